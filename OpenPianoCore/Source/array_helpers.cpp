@@ -22,28 +22,39 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 
 void normalize(float* array, int size)
 {
+    // Scales the array so that its absolute peak is 1 (a silent array is left as it is)
     float max = 0.0;
     for (int n = 0; n < size; n++)
     {
-        if(array[n] > max)
+        if(fabsf(array[n]) > max)
         {
-            max = array[n];
+            max = fabsf(array[n]);
         }
     }
+    if(max == 0.0f)
+    {
+        return;
+    }
+    float gain = 1.0f/max;
     for (int n = 0; n < size; n++)
     {
-        array[n] /= max;
+        array[n] *= gain;
     }
 }
 
 double* hanning(uint32_t length)
 {
     double* output = (double*)malloc(sizeof (double) * length);
+    fill_hanning(output, length);
+    return output;
+}
+
+void fill_hanning(double* output, uint32_t length)
+{
     for (uint32_t i = 0; i < length; i++)
     {
         output[i] = 0.5 * (1 - cos(2*M_PI*i/(length-1)));
     }
-    return output;
 }
 
 double** zeros2D(uint32_t rows, uint32_t columns)
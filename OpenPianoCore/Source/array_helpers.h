@@ -42,6 +42,7 @@ extern "C" {
 double* zeros1D(uint32_t size);
 double** zeros2D(uint32_t rows, uint32_t columns);
 double* hanning(uint32_t length);
+void fill_hanning(double* output, uint32_t length);
 double mean(double **array, uint32_t dim, uint32_t idx, uint32_t start, uint32_t stop);
 double mean_abs(double** array, uint32_t dim, uint32_t idx, uint32_t start, uint32_t stop);
 void print1D(double* array, int size);
@@ -0,0 +1,123 @@
+/*
+OpenPiano: an open source piano engine based on physical modeling
+Copyright (C) 2021-2022 Michele Perrone
+Github: https://github.com/michele-perrone/OpenPiano
+Author e-mail: perrone(dot)michele(at)outlook(dot)com
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Affero General Public License as published
+by the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Affero General Public License for more details.
+
+You should have received a copy of the GNU Affero General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef ATTACK_CACHE_H
+#define ATTACK_CACHE_H
+
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+
+/* ********************************************************************** *
+ * Cache of string states right after the hammer contact.                 *
+ * For a set of velocity buckets, the contact of the hammer with a string *
+ * at rest is simulated once. The cache stores the state of the string    *
+ * and the hammer at the end of the simulation, together with the sound   *
+ * produced in the meantime. Hitting a silent string can then skip the    *
+ * simulation of the contact: the string plays back the cached sound,     *
+ * interpolated between the two closest buckets, and then continues from  *
+ * the interpolated state.                                                *
+ * ********************************************************************** */
+
+struct AttackCache
+{
+    uint32_t n_buckets;
+    double* velocities; // Hammer velocities of the buckets [m/s], in ascending order
+    uint32_t length; // Length of the simulated attack [samples]
+    uint32_t n_nodes; // Spatial samples of the string (len_x_axis+2)
+
+    // For each bucket:
+    double* y; // String displacement, n_nodes*4 values. Time level 0 is the most recent one.
+    double* eta; // Hammer displacement, 4 values
+    double* Fh; // Hammer force, 4 values
+    float* sound; // Sound produced by the string during the attack, "length" values
+
+    float* playback; // Sound of the last interpolated attack, played back by the string
+    bool owns_arrays; // false -> y, eta, Fh and sound belong to someone else (see "compiled_model.h")
+
+    AttackCache(const double* velocities, uint32_t n_buckets, uint32_t length, uint32_t n_nodes)
+    {
+        this->n_buckets = n_buckets;
+        this->length = length;
+        this->n_nodes = n_nodes;
+        this->velocities = (double*)malloc(n_buckets*sizeof(double));
+        memcpy(this->velocities, velocities, n_buckets*sizeof(double));
+
+        y = (double*)calloc((size_t)n_buckets*n_nodes*4, sizeof(double));
+        eta = (double*)calloc(n_buckets*4, sizeof(double));
+        Fh = (double*)calloc(n_buckets*4, sizeof(double));
+        sound = (float*)calloc((size_t)n_buckets*length, sizeof(float));
+        playback = (float*)calloc(length > 0 ? length : 1, sizeof(float));
+        owns_arrays = true;
+    }
+    AttackCache(const double* velocities, uint32_t n_buckets, uint32_t length, uint32_t n_nodes,
+                const double* y, const double* eta, const double* Fh, const float* sound)
+    {
+        // The cache is read from arrays that outlive it, and that are never written
+        this->n_buckets = n_buckets;
+        this->length = length;
+        this->n_nodes = n_nodes;
+        this->velocities = (double*)malloc(n_buckets*sizeof(double));
+        memcpy(this->velocities, velocities, n_buckets*sizeof(double));
+
+        this->y = (double*)y;
+        this->eta = (double*)eta;
+        this->Fh = (double*)Fh;
+        this->sound = (float*)sound;
+        playback = (float*)calloc(length > 0 ? length : 1, sizeof(float));
+        owns_arrays = false;
+    }
+    ~AttackCache()
+    {
+        free(velocities);
+        if(owns_arrays)
+        {
+            free(y);
+            free(eta);
+            free(Fh);
+            free(sound);
+        }
+        free(playback);
+    }
+    bool covers(double velocity) const
+    {
+        return n_buckets > 0 && velocity >= velocities[0] && velocity <= velocities[n_buckets-1];
+    }
+    void find_buckets(double velocity, uint32_t& lower, double& weight) const
+    {
+        // "weight" is the weight of bucket "lower+1"
+        lower = 0;
+        while(lower+2 < n_buckets && velocity > velocities[lower+1])
+            lower++;
+        if(n_buckets < 2)
+        {
+            weight = 0.0;
+            return;
+        }
+        weight = (velocity-velocities[lower])/(velocities[lower+1]-velocities[lower]);
+    }
+};
+
+// The cache is filled by PianoStringT::build_attack_cache()
+
+// Crossfade from the cached sound to the simulation when the damper or a new hit
+// cuts an attack short [samples]
+const uint32_t ATTACK_DAMPER_FADE = 32;
+
+#endif // ATTACK_CACHE_H
@@ -0,0 +1,332 @@
+/*
+OpenPiano: an open source piano engine based on physical modeling
+Copyright (C) 2021-2022 Michele Perrone
+Github: https://github.com/michele-perrone/OpenPiano
+Author e-mail: perrone(dot)michele(at)outlook(dot)com
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Affero General Public License as published
+by the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Affero General Public License for more details.
+
+You should have received a copy of the GNU Affero General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef COMPILED_MODEL_H
+#define COMPILED_MODEL_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include "mapped_file.h"
+#include "string_hammer.h"
+#include "attack_cache.h"
+#include "piano_description.h"
+
+/* ********************************************************************** *
+ * Compiled model: a file with everything the piano derives from its      *
+ * description at a given sample rate, produced by "openpiano-compile".   *
+ * For each string it holds the grid size, the pickup range, the hammer   *
+ * window, the kernel coefficients and the attack cache. The file is      *
+ * mapped in memory and used as it is: the attack caches point inside the *
+ * mapping, so loading it takes no parsing and no simulation.             *
+ * The header carries a hash of everything the model was derived from     *
+ * (see PianoModel::compiled_hash()). The derived data of each string is  *
+ * also compared with the string that was just built, so a file produced  *
+ * by a different version of the engine is rejected, not misused.         *
+ * ********************************************************************** */
+
+const uint32_t COMPILED_MODEL_MAGIC = 0x4D43504F; // "OPCM"
+const uint32_t COMPILED_MODEL_VERSION = 1;
+const uint64_t COMPILED_MODEL_ALIGNMENT = 64; // Every array starts on its own cache line
+
+// Names of the string models chosen at compile time (see "string_hammer.h")
+#define OPENPIANO_STRINGIFY_(x) #x
+#define OPENPIANO_STRINGIFY(x) OPENPIANO_STRINGIFY_(x)
+const char* const STRING_MODEL_NAME = OPENPIANO_STRINGIFY(OPENPIANO_STRING_BOUNDARY) "/" OPENPIANO_STRINGIFY(OPENPIANO_HAMMER_MODEL);
+
+inline uint64_t fnv1a(uint64_t hash, const void* data, size_t size)
+{
+    // FNV-1a, 64 bits. Start from FNV1A_SEED.
+    const uint8_t* bytes = (const uint8_t*)data;
+    for(size_t i = 0; i < size; i++)
+    {
+        hash ^= bytes[i];
+        hash *= 0x100000001B3ULL;
+    }
+    return hash;
+}
+const uint64_t FNV1A_SEED = 0xCBF29CE484222325ULL;
+
+struct CompiledModelHeader
+{
+    uint32_t magic;
+    uint32_t version;
+    uint64_t params_hash; // Hash of the parameters and of the sample rate
+    uint64_t file_size; // [bytes]
+    int32_t sample_rate;
+    uint32_t n_strings;
+    uint32_t n_buckets; // Velocity buckets of the attack caches
+    uint32_t reserved;
+    uint64_t velocities_offset; // n_buckets doubles
+    uint64_t strings_offset; // n_strings CompiledString
+};
+
+struct CompiledString
+{
+    // Grid and ranges
+    uint32_t len_x_axis;
+    uint32_t left_boundary;
+    uint32_t right_boundary;
+    uint32_t Xs_contact;
+    uint32_t damper_left;
+    uint32_t damper_right;
+    uint32_t Xs_bridge;
+    uint32_t attack_length; // Length of the cached attack [samples]
+
+    // Kernel coefficients
+    double a1;
+    double a2;
+    double a3;
+    double a4;
+    double a5;
+    double force_scale;
+    double K;
+    double p;
+    double d1;
+    double d2;
+    double dF;
+    double Mh;
+    double damper_sigma;
+
+    // Arrays
+    uint64_t hammer_mask_offset; // len_x_axis doubles: the hammer window placed on the string
+    uint64_t y_offset; // Attack cache (see AttackCache), n_buckets*(len_x_axis+2)*4 doubles
+    uint64_t eta_offset; // n_buckets*4 doubles
+    uint64_t Fh_offset; // n_buckets*4 doubles
+    uint64_t sound_offset; // n_buckets*attack_length floats
+};
+
+inline void compile_string(const PianoString& string, CompiledString& compiled)
+{
+    // Copies what the string derived from its parameters (the offsets are filled by the writer)
+    memset(&compiled, 0, sizeof(CompiledString));
+    compiled.len_x_axis = string.len_x_axis;
+    compiled.left_boundary = string.left_boundary;
+    compiled.right_boundary = string.right_boundary;
+    compiled.Xs_contact = string.Xs_contact;
+    compiled.damper_left = string.damper_left;
+    compiled.damper_right = string.damper_right;
+    compiled.Xs_bridge = string.Xs_bridge;
+    compiled.a1 = string.a1;
+    compiled.a2 = string.a2;
+    compiled.a3 = string.a3;
+    compiled.a4 = string.a4;
+    compiled.a5 = string.a5;
+    compiled.force_scale = string.force_scale;
+    compiled.K = string.K;
+    compiled.p = string.p;
+    compiled.d1 = string.d1;
+    compiled.d2 = string.d2;
+    compiled.dF = string.dF;
+    compiled.Mh = string.Mh;
+    compiled.damper_sigma = string.damper_sigma;
+}
+
+inline bool write_compiled_model(const char* path, uint64_t params_hash, int sample_rate,
+                                 PianoString* const* strings, uint32_t n_strings)
+{
+    // Every string must have an attack cache, with the same buckets.
+    // Returns false if they don't, or if the file can't be written.
+    if(n_strings == 0)
+        return false;
+    AttackCache* first = strings[0]->attack_cache.load(std::memory_order_acquire);
+    if(first == nullptr)
+        return false;
+    uint32_t n_buckets = first->n_buckets;
+    for(uint32_t i = 0; i < n_strings; i++)
+    {
+        AttackCache* cache = strings[i]->attack_cache.load(std::memory_order_acquire);
+        if(cache == nullptr || cache->n_buckets != n_buckets ||
+           memcmp(cache->velocities, first->velocities, n_buckets*sizeof(double)) != 0)
+            return false;
+    }
+
+    // Lay out the file
+    auto align = [](uint64_t offset) { return (offset + COMPILED_MODEL_ALIGNMENT-1) & ~(COMPILED_MODEL_ALIGNMENT-1); };
+    CompiledModelHeader header;
+    memset(&header, 0, sizeof(header));
+    header.magic = COMPILED_MODEL_MAGIC;
+    header.version = COMPILED_MODEL_VERSION;
+    header.params_hash = params_hash;
+    header.sample_rate = sample_rate;
+    header.n_strings = n_strings;
+    header.n_buckets = n_buckets;
+    header.velocities_offset = align(sizeof(CompiledModelHeader));
+    header.strings_offset = align(header.velocities_offset + n_buckets*sizeof(double));
+    uint64_t offset = align(header.strings_offset + n_strings*sizeof(CompiledString));
+
+    CompiledString* compiled = (CompiledString*)malloc(n_strings*sizeof(CompiledString));
+    for(uint32_t i = 0; i < n_strings; i++)
+    {
+        AttackCache* cache = strings[i]->attack_cache.load(std::memory_order_acquire);
+        compile_string(*strings[i], compiled[i]);
+        compiled[i].attack_length = cache->length;
+        compiled[i].hammer_mask_offset = offset;
+        offset = align(offset + strings[i]->len_x_axis*sizeof(double));
+        compiled[i].y_offset = offset;
+        offset = align(offset + (uint64_t)n_buckets*cache->n_nodes*4*sizeof(double));
+        compiled[i].eta_offset = offset;
+        offset = align(offset + n_buckets*4*sizeof(double));
+        compiled[i].Fh_offset = offset;
+        offset = align(offset + n_buckets*4*sizeof(double));
+        compiled[i].sound_offset = offset;
+        offset = align(offset + (uint64_t)n_buckets*cache->length*sizeof(float));
+    }
+    header.file_size = offset;
+
+    // Write it in one go: the gaps between the arrays are zeroed
+    uint8_t* data = (uint8_t*)calloc(header.file_size, 1);
+    memcpy(data, &header, sizeof(header));
+    memcpy(data+header.velocities_offset, first->velocities, n_buckets*sizeof(double));
+    memcpy(data+header.strings_offset, compiled, n_strings*sizeof(CompiledString));
+    for(uint32_t i = 0; i < n_strings; i++)
+    {
+        AttackCache* cache = strings[i]->attack_cache.load(std::memory_order_acquire);
+        memcpy(data+compiled[i].hammer_mask_offset, strings[i]->hammer_mask, strings[i]->len_x_axis*sizeof(double));
+        memcpy(data+compiled[i].y_offset, cache->y, (size_t)n_buckets*cache->n_nodes*4*sizeof(double));
+        memcpy(data+compiled[i].eta_offset, cache->eta, n_buckets*4*sizeof(double));
+        memcpy(data+compiled[i].Fh_offset, cache->Fh, n_buckets*4*sizeof(double));
+        memcpy(data+compiled[i].sound_offset, cache->sound, (size_t)n_buckets*cache->length*sizeof(float));
+    }
+    free(compiled);
+
+    bool ok = false;
+    FILE* file = fopen(path, "wb");
+    if(file != nullptr)
+    {
+        ok = fwrite(data, 1, header.file_size, file) == header.file_size;
+        ok = (fclose(file) == 0) && ok;
+    }
+    free(data);
+    return ok;
+}
+
+struct CompiledModel
+{
+    MappedFile file; // The whole file, mapped read-only
+    uint8_t* data; // Start of the mapping (nullptr if not open)
+    size_t size;
+    const CompiledModelHeader* header;
+    const double* velocities;
+    const CompiledString* strings;
+
+    CompiledModel()
+    {
+        data = nullptr;
+        size = 0;
+        header = nullptr;
+        velocities = nullptr;
+        strings = nullptr;
+    }
+    ~CompiledModel()
+    {
+        close();
+    }
+    bool open(const char* path)
+    {
+        // Maps the file and checks that its layout is consistent.
+        // Whether it fits a model is checked by matches().
+        close();
+        if(!file.open(path))
+            return false;
+        data = file.data;
+        size = file.size;
+        if(!check_layout())
+        {
+            close();
+            return false;
+        }
+        return true;
+    }
+    void close()
+    {
+        file.close();
+        data = nullptr;
+        size = 0;
+        header = nullptr;
+        velocities = nullptr;
+        strings = nullptr;
+    }
+    bool check_layout()
+    {
+        // Every array must lie inside the file
+        if(size < sizeof(CompiledModelHeader))
+            return false;
+        header = (const CompiledModelHeader*)data;
+        if(header->magic != COMPILED_MODEL_MAGIC || header->version != COMPILED_MODEL_VERSION
+                || header->file_size != size || header->n_strings == 0 || header->n_strings > (uint32_t)MAX_STRINGS
+                || header->n_buckets == 0)
+            return false;
+        if(!fits(header->velocities_offset, header->n_buckets*sizeof(double))
+                || !fits(header->strings_offset, (uint64_t)header->n_strings*sizeof(CompiledString)))
+            return false;
+        velocities = (const double*)(data+header->velocities_offset);
+        strings = (const CompiledString*)(data+header->strings_offset);
+        uint64_t n_buckets = header->n_buckets;
+        for(uint32_t i = 0; i < header->n_strings; i++)
+        {
+            const CompiledString& s = strings[i];
+            if(!fits(s.hammer_mask_offset, (uint64_t)s.len_x_axis*sizeof(double))
+                    || !fits(s.y_offset, n_buckets*(s.len_x_axis+2)*4*sizeof(double))
+                    || !fits(s.eta_offset, n_buckets*4*sizeof(double))
+                    || !fits(s.Fh_offset, n_buckets*4*sizeof(double))
+                    || !fits(s.sound_offset, n_buckets*s.attack_length*sizeof(float)))
+                return false;
+        }
+        return true;
+    }
+    bool fits(uint64_t offset, uint64_t length) const
+    {
+        return offset % COMPILED_MODEL_ALIGNMENT == 0 && offset <= size && length <= size-offset;
+    }
+    bool matches(uint64_t params_hash, int sample_rate, PianoString* const* strings, uint32_t n_strings) const
+    {
+        // Whether the file was compiled for these strings, by this version of the engine
+        if(data == nullptr || header->params_hash != params_hash || header->sample_rate != sample_rate
+                || header->n_strings != n_strings)
+            return false;
+        for(uint32_t i = 0; i < n_strings; i++)
+        {
+            CompiledString expected;
+            compile_string(*strings[i], expected);
+            expected.attack_length = this->strings[i].attack_length;
+            expected.hammer_mask_offset = this->strings[i].hammer_mask_offset;
+            expected.y_offset = this->strings[i].y_offset;
+            expected.eta_offset = this->strings[i].eta_offset;
+            expected.Fh_offset = this->strings[i].Fh_offset;
+            expected.sound_offset = this->strings[i].sound_offset;
+            if(memcmp(&expected, &this->strings[i], sizeof(CompiledString)) != 0
+                    || memcmp(data+expected.hammer_mask_offset, strings[i]->hammer_mask,
+                              strings[i]->len_x_axis*sizeof(double)) != 0)
+                return false;
+        }
+        return true;
+    }
+    AttackCache* attack_cache(uint32_t idx_string) const
+    {
+        // The cache points inside the mapping, which must outlive it
+        const CompiledString& s = strings[idx_string];
+        return new AttackCache(velocities, header->n_buckets, s.attack_length, s.len_x_axis+2,
+                               (const double*)(data+s.y_offset), (const double*)(data+s.eta_offset),
+                               (const double*)(data+s.Fh_offset), (const float*)(data+s.sound_offset));
+    }
+};
+
+#endif // COMPILED_MODEL_H
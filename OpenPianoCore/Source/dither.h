@@ -0,0 +1,83 @@
+/*
+OpenPiano: an open source piano engine based on physical modeling
+Copyright (C) 2021-2022 Michele Perrone
+Github: https://github.com/michele-perrone/OpenPiano
+Author e-mail: perrone(dot)michele(at)outlook(dot)com
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Affero General Public License as published
+by the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Affero General Public License for more details.
+
+You should have received a copy of the GNU Affero General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef DITHER_H
+#define DITHER_H
+
+#include <inttypes.h>
+#include <math.h>
+
+/* ********************************************************************** *
+ * Float to integer PCM conversion with TPDF (triangular) dither: the     *
+ * difference of two uniform random numbers, 1 LSB wide each, is added   *
+ * before rounding, so the quantization error doesn't depend on the       *
+ * signal. The random numbers come from LANES independent xorshift        *
+ * generators, one per sample of a group: the inner loop has no           *
+ * dependency between its iterations, and the compiler vectorizes it.     *
+ * ********************************************************************** */
+
+struct TpdfDither
+{
+    static const int LANES = 8;
+    uint32_t state[LANES]; // Never 0
+
+    TpdfDither(uint32_t seed = 1)
+    {
+        for(int l = 0; l < LANES; l++)
+        {
+            state[l] = (seed + l)*2654435761u; // Spread the seeds over the whole range
+            if(state[l] == 0)
+                state[l] = 0x9E3779B9u;
+        }
+    }
+    void quantize(const float* input, uint32_t n, float gain, uint32_t bits_per_sample, bool dither, int32_t* output)
+    {
+        // Converts input*gain (full scale: [-1, 1]) to signed integers of "bits_per_sample" bits,
+        // with saturation. Without dither, the samples are just rounded.
+        const float scale = (float)((1u << (bits_per_sample-1)) - 1)*gain;
+        const float lowest = -(float)(1u << (bits_per_sample-1));
+        const float highest = (float)((1u << (bits_per_sample-1)) - 1);
+        const float noise_scale = dither ? 1.0f/65536.0f : 0.0f; // [LSB] per unit of the 16-bit halves
+        uint32_t i = 0;
+        for(; i+LANES <= n; i += LANES)
+        {
+            for(int l = 0; l < LANES; l++)
+                output[i+l] = quantize_sample(input[i+l], l, scale, lowest, highest, noise_scale);
+        }
+        for(int l = 0; i < n; i++, l++)
+            output[i] = quantize_sample(input[i], l, scale, lowest, highest, noise_scale);
+    }
+
+private:
+    inline int32_t quantize_sample(float x, int lane, float scale, float lowest, float highest, float noise_scale)
+    {
+        uint32_t s = state[lane];
+        s ^= s << 13;
+        s ^= s >> 17;
+        s ^= s << 5;
+        state[lane] = s;
+        // The two halves of the random word are the two uniform numbers: their difference is triangular in (-1, 1)
+        float noise = ((float)(s & 0xFFFF) - (float)(s >> 16))*noise_scale;
+        float y = x*scale + noise;
+        y = y < lowest ? lowest : (y > highest ? highest : y);
+        return (int32_t)floorf(y + 0.5f);
+    }
+};
+
+#endif // DITHER_H
@@ -22,9 +22,14 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 //#include "dr_wav.h"
 //#include "array_helpers.h"
 #include "piano.h"
+#include "midi_player.h"
+#include "workload.h"
+#include "wav_stream.h"
 
-int main()
+int main(int argc, char** argv)
 {
+    // Usage: OpenPianoCore [output.wav]
+
     // Temporal sampling parameters
     int Fs = 48000; // Sampling frequency [Hz]
     int samples_per_block = 256;
@@ -33,11 +38,28 @@ int main()
     // Initialize the piano
     Piano piano(Fs, samples_per_block, n_threads);
 
-    // Output sound init
-    uint32_t duration = 300; // Duration of the synthesized signal [s]
+    // Every test plays the same synthetic performance, from silence (see "workload.h")
+    uint32_t duration = 30; // Duration of the synthesized signal [s]
+    MidiFile workload;
+    WorkloadOptions workload_options;
+    workload_options.duration = duration;
+    workload_options.n_keys = piano.n_strings;
+    WorkloadGenerator(workload_options).generate("mixed", workload);
+    std::vector<uint8_t> silence(piano.get_state_size());
+    piano.save_state(silence.data(), silence.size());
+
+    // Output sound init. Only one block is kept in memory: the blocks of the first test
+    // are streamed to the file given on the command line, if any (see "wav_stream.h").
     int duration_samples = duration*Fs;
     int n_blocks = floorf(duration_samples/samples_per_block);
-    float* sound = (float*)malloc(duration_samples*sizeof (float));
+    float* sound = (float*)malloc(samples_per_block*sizeof (float));
+    WavStream output;
+    if(argc > 1 && !output.open(argv[1], Fs))
+    {
+        fprintf(stderr, "Can't write \"%s\"\n", argv[1]);
+        free(sound);
+        return 1;
+    }
 
 
 
@@ -45,10 +67,15 @@ int main()
 
     auto test_start = std::chrono::steady_clock::now();
 
-    piano.strings[C2]->hit(2.5);
+    MidiPlayer player(&piano);
     for(uint64_t n = 0; n < n_blocks; n++)
     {
-        piano.get_next_block_multithreaded(&sound[n*samples_per_block], samples_per_block, 1);
+        player.play_quantum(workload, n*samples_per_block, samples_per_block);
+        piano.get_next_block_multithreaded(sound, samples_per_block, 1);
+        if(output.is_open)
+        {
+            output.write(sound, samples_per_block);
+        }
     }
     while(piano.n_running_threads != 0) {}
     auto test_end = std::chrono::steady_clock::now();
@@ -65,10 +92,12 @@ int main()
 
     test_start = std::chrono::steady_clock::now();
 
-    piano.strings[C2]->hit(2.5);
+    piano.load_state(silence.data(), silence.size());
+    player = MidiPlayer(&piano);
     for(uint64_t n = 0; n < n_blocks; n++)
     {
-        piano.get_next_block(&sound[n*samples_per_block], samples_per_block, 1);
+        player.play_quantum(workload, n*samples_per_block, samples_per_block);
+        piano.get_next_block(sound, samples_per_block, 1);
     }
 
     test_end = std::chrono::steady_clock::now();
@@ -84,10 +113,15 @@ int main()
 
     test_start = std::chrono::steady_clock::now();
 
-    piano.strings[C2]->hit(2.5);
+    piano.load_state(silence.data(), silence.size());
+    player = MidiPlayer(&piano);
     for(uint64_t n = 0; n < duration_samples; n++)
     {
-        sound[n] = piano.get_next_sample(1);
+        if(n%samples_per_block == 0)
+        {
+            player.play_quantum(workload, n, samples_per_block);
+        }
+        sound[n%samples_per_block] = piano.get_next_sample(1);
     }
 
     test_end = std::chrono::steady_clock::now();
@@ -111,9 +145,8 @@ int main()
 
 
 
-    // Save the sound to file
-    //char filename[] = "C2_doublehit.wav";
-    //String::save_to_wav(filename, sound, duration_samples, true, false);
+    // Finish writing the file, if any
+    output.close();
 
     free(sound);
 
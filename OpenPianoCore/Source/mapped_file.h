@@ -0,0 +1,128 @@
+/*
+OpenPiano: an open source piano engine based on physical modeling
+Copyright (C) 2021-2022 Michele Perrone
+Github: https://github.com/michele-perrone/OpenPiano
+Author e-mail: perrone(dot)michele(at)outlook(dot)com
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Affero General Public License as published
+by the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Affero General Public License for more details.
+
+You should have received a copy of the GNU Affero General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef MAPPED_FILE_H
+#define MAPPED_FILE_H
+
+#include <stdlib.h>
+#include <inttypes.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+/* ********************************************************************** *
+ * A whole file mapped in memory, read-only or writable. The pages are    *
+ * loaded by the OS when they're touched, so even a file larger than the  *
+ * memory can be processed in one pass. Writes go straight to the file.   *
+ * ********************************************************************** */
+
+struct MappedFile
+{
+    uint8_t* data; // nullptr if not open
+    size_t size; // [bytes]
+#ifdef _WIN32
+    HANDLE file_handle;
+    HANDLE mapping_handle;
+#endif
+
+    MappedFile()
+    {
+        data = nullptr;
+        size = 0;
+#ifdef _WIN32
+        file_handle = INVALID_HANDLE_VALUE;
+        mapping_handle = nullptr;
+#endif
+    }
+    ~MappedFile()
+    {
+        close();
+    }
+    bool open(const char* path, bool writable = false)
+    {
+        // Returns false if the file can't be mapped (an empty file can't)
+        close();
+#ifdef _WIN32
+        file_handle = CreateFileA(path, writable ? GENERIC_READ|GENERIC_WRITE : GENERIC_READ, FILE_SHARE_READ,
+                                  nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+        if(file_handle == INVALID_HANDLE_VALUE)
+            return false;
+        LARGE_INTEGER file_size;
+        if(!GetFileSizeEx(file_handle, &file_size) || file_size.QuadPart == 0)
+        {
+            close();
+            return false;
+        }
+        mapping_handle = CreateFileMappingA(file_handle, nullptr, writable ? PAGE_READWRITE : PAGE_READONLY, 0, 0, nullptr);
+        if(mapping_handle == nullptr)
+        {
+            close();
+            return false;
+        }
+        data = (uint8_t*)MapViewOfFile(mapping_handle, writable ? FILE_MAP_WRITE : FILE_MAP_READ, 0, 0, 0);
+        size = (size_t)file_size.QuadPart;
+#else
+        int fd = ::open(path, writable ? O_RDWR : O_RDONLY);
+        if(fd < 0)
+            return false;
+        struct stat st;
+        if(fstat(fd, &st) != 0 || st.st_size == 0)
+        {
+            ::close(fd);
+            return false;
+        }
+        void* mapping = mmap(nullptr, st.st_size, writable ? PROT_READ|PROT_WRITE : PROT_READ,
+                             writable ? MAP_SHARED : MAP_PRIVATE, fd, 0);
+        ::close(fd); // The mapping stays valid
+        data = mapping == MAP_FAILED ? nullptr : (uint8_t*)mapping;
+        size = st.st_size;
+#endif
+        if(data == nullptr)
+        {
+            close();
+            return false;
+        }
+        return true;
+    }
+    void close()
+    {
+#ifdef _WIN32
+        if(data != nullptr)
+            UnmapViewOfFile(data);
+        if(mapping_handle != nullptr)
+            CloseHandle(mapping_handle);
+        if(file_handle != INVALID_HANDLE_VALUE)
+            CloseHandle(file_handle);
+        mapping_handle = nullptr;
+        file_handle = INVALID_HANDLE_VALUE;
+#else
+        if(data != nullptr)
+            munmap(data, size);
+#endif
+        data = nullptr;
+        size = 0;
+    }
+};
+
+#endif // MAPPED_FILE_H
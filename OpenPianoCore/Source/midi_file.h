@@ -0,0 +1,352 @@
+/*
+OpenPiano: an open source piano engine based on physical modeling
+Copyright (C) 2021-2022 Michele Perrone
+Github: https://github.com/michele-perrone/OpenPiano
+Author e-mail: perrone(dot)michele(at)outlook(dot)com
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Affero General Public License as published
+by the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Affero General Public License for more details.
+
+You should have received a copy of the GNU Affero General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef MIDI_FILE_H
+#define MIDI_FILE_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <math.h>
+#include <vector>
+#include <algorithm>
+
+/* ********************************************************************** *
+ * Standard MIDI File reader (formats 0, 1 and 2).                        *
+ * The channel messages of all the tracks are merged into one list,       *
+ * sorted by time, and their time is converted to seconds with the tempo  *
+ * map (or with the SMPTE time division). The tracks of a format 2 file   *
+ * are independent sequences: only the first one is read. Meta events    *
+ * other than tempo changes, system exclusive, system common and          *
+ * real-time messages are skipped.                                        *
+ * save() writes the events back as a format 0 file, at 120 BPM.          *
+ * ********************************************************************** */
+
+struct MidiEvent
+{
+    double time; // [s]
+    uint8_t status; // Channel message: type in the upper nibble, channel in the lower one
+    uint8_t data1;
+    uint8_t data2;
+
+    bool is_note_on() const { return (status & 0xF0) == 0x90 && data2 > 0; }
+    bool is_note_off() const { return (status & 0xF0) == 0x80 || ((status & 0xF0) == 0x90 && data2 == 0); }
+    bool is_controller(uint8_t controller) const { return (status & 0xF0) == 0xB0 && data1 == controller; }
+};
+
+struct MidiFile
+{
+    std::vector<MidiEvent> events; // Channel messages of all the tracks, sorted by time
+    double duration; // Time of the last event of any kind [s]
+
+    MidiFile()
+    {
+        duration = 0.0;
+    }
+    bool load(const char* path)
+    {
+        // Returns false if the file can't be read or isn't a Standard MIDI File
+        FILE* file = fopen(path, "rb");
+        if(file == nullptr)
+            return false;
+        std::vector<uint8_t> data;
+        uint8_t chunk[65536];
+        size_t n_read;
+        while((n_read = fread(chunk, 1, sizeof(chunk), file)) > 0)
+            data.insert(data.end(), chunk, chunk+n_read);
+        fclose(file);
+        return parse(data.data(), data.size());
+    }
+    bool parse(const uint8_t* data, size_t size)
+    {
+        events.clear();
+        duration = 0.0;
+        if(size < 14 || memcmp(data, "MThd", 4) != 0 || read_u32(data+4) < 6)
+            return false;
+        uint16_t format = read_u16(data+8);
+        uint16_t n_tracks = read_u16(data+10);
+        uint16_t division = read_u16(data+12);
+        if(division == 0)
+            return false;
+
+        // The events are first collected with their time in ticks
+        std::vector<TickEvent> tick_events;
+        std::vector<TempoChange> tempo_map;
+        uint64_t last_tick = 0;
+        size_t pos = 8 + read_u32(data+4);
+        uint32_t sequence = 0; // Keeps the order of the events with the same tick
+        for(uint16_t track = 0; track < n_tracks && pos+8 <= size; track++)
+        {
+            uint32_t length = read_u32(data+pos+4);
+            bool is_track = memcmp(data+pos, "MTrk", 4) == 0;
+            pos += 8;
+            if(length > size-pos)
+                return false;
+            if(is_track && !parse_track(data+pos, length, tick_events, tempo_map, last_tick, sequence))
+                return false;
+            pos += length; // Unknown chunks are skipped
+            if(is_track && format == 2)
+                break; // The other sequences aren't played at the same time as this one
+        }
+
+        // Convert the ticks to seconds
+        std::stable_sort(tick_events.begin(), tick_events.end(),
+                         [](const TickEvent& a, const TickEvent& b) { return a.tick < b.tick || (a.tick == b.tick && a.sequence < b.sequence); });
+        std::stable_sort(tempo_map.begin(), tempo_map.end(),
+                         [](const TempoChange& a, const TempoChange& b) { return a.tick < b.tick; });
+        TickClock clock(division, tempo_map);
+        events.reserve(tick_events.size());
+        for(const TickEvent& e : tick_events)
+        {
+            MidiEvent event;
+            event.time = clock.seconds(e.tick);
+            event.status = e.status;
+            event.data1 = e.data1;
+            event.data2 = e.data2;
+            events.push_back(event);
+        }
+        duration = clock.seconds(last_tick);
+        return true;
+    }
+    bool save(const char* path, uint16_t division = 960) const
+    {
+        // One track at the default tempo (no tempo event): a quarter note lasts 0.5 s.
+        // The times are rounded to the nearest of "division" ticks per quarter note.
+        // Returns false if the file can't be written.
+        if(division == 0 || division >= 0x8000)
+            return false;
+        std::vector<uint8_t> track;
+        uint64_t previous = 0;
+        for(const MidiEvent& event : events)
+        {
+            uint64_t tick = std::max(previous, (uint64_t)llround(std::max(event.time, 0.0)*2.0*division));
+            if(!write_varlen(track, tick-previous))
+                return false;
+            previous = tick;
+            uint8_t type = event.status & 0xF0;
+            track.push_back(event.status);
+            track.push_back(event.data1 & 0x7F);
+            if(type != 0xC0 && type != 0xD0)
+                track.push_back(event.data2 & 0x7F);
+        }
+        uint64_t end = std::max(previous, (uint64_t)llround(std::max(duration, 0.0)*2.0*division));
+        if(!write_varlen(track, end-previous))
+            return false;
+        track.push_back(0xFF); // End of track
+        track.push_back(0x2F);
+        track.push_back(0x00);
+
+        uint8_t header[22] = {'M', 'T', 'h', 'd', 0, 0, 0, 6, 0, 0, 0, 1,
+                              (uint8_t)(division >> 8), (uint8_t)division, 'M', 'T', 'r', 'k'};
+        for(int b = 0; b < 4; b++)
+            header[18+b] = (uint8_t)(track.size() >> (24-8*b));
+        FILE* file = fopen(path, "wb");
+        if(file == nullptr)
+            return false;
+        bool ok = fwrite(header, 1, sizeof(header), file) == sizeof(header) &&
+                  fwrite(track.data(), 1, track.size(), file) == track.size();
+        return fclose(file) == 0 && ok;
+    }
+
+private:
+    struct TickEvent
+    {
+        uint64_t tick;
+        uint32_t sequence;
+        uint8_t status;
+        uint8_t data1;
+        uint8_t data2;
+    };
+    struct TempoChange
+    {
+        uint64_t tick;
+        uint32_t us_per_quarter; // [microseconds per quarter note]
+    };
+    struct TickClock
+    {
+        // Walks the tempo map. The ticks must be requested in ascending order.
+        uint16_t division;
+        const std::vector<TempoChange>& tempo_map;
+        size_t next_change;
+        uint64_t origin_tick; // Tick of the last tempo change
+        double origin_seconds;
+        double seconds_per_tick;
+
+        TickClock(uint16_t division, const std::vector<TempoChange>& tempo_map) : tempo_map(tempo_map)
+        {
+            this->division = division;
+            next_change = 0;
+            origin_tick = 0;
+            origin_seconds = 0.0;
+            if(division & 0x8000) // SMPTE: frames per second and ticks per frame, no tempo
+            {
+                int fps = -(int8_t)(division >> 8);
+                int ticks_per_frame = division & 0xFF;
+                seconds_per_tick = 1.0/((fps == 29 ? 29.97 : fps)*(ticks_per_frame > 0 ? ticks_per_frame : 1));
+            }
+            else // Ticks per quarter note, 120 BPM until the first tempo change
+                seconds_per_tick = 0.5/division;
+        }
+        double seconds(uint64_t tick)
+        {
+            if(!(division & 0x8000))
+            {
+                while(next_change < tempo_map.size() && tempo_map[next_change].tick <= tick)
+                {
+                    const TempoChange& change = tempo_map[next_change++];
+                    origin_seconds += (change.tick-origin_tick)*seconds_per_tick;
+                    origin_tick = change.tick;
+                    seconds_per_tick = change.us_per_quarter*1e-6/division;
+                }
+            }
+            return origin_seconds + (tick-origin_tick)*seconds_per_tick;
+        }
+    };
+
+    static uint32_t read_u32(const uint8_t* p)
+    {
+        return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+    }
+    static uint16_t read_u16(const uint8_t* p)
+    {
+        return (uint16_t)((p[0] << 8) | p[1]);
+    }
+    static bool read_varlen(const uint8_t* data, size_t size, size_t& pos, uint32_t& value)
+    {
+        // Variable-length quantity: at most 4 bytes, 7 bits each
+        value = 0;
+        for(int k = 0; k < 4; k++)
+        {
+            if(pos >= size)
+                return false;
+            uint8_t byte = data[pos++];
+            value = (value << 7) | (byte & 0x7F);
+            if(!(byte & 0x80))
+                return true;
+        }
+        return false;
+    }
+    static bool write_varlen(std::vector<uint8_t>& data, uint64_t value)
+    {
+        // At most 4 bytes: longer delta times can't be written
+        if(value > 0x0FFFFFFF)
+            return false;
+        uint8_t bytes[4];
+        int n = 0;
+        do
+        {
+            bytes[n++] = value & 0x7F;
+            value >>= 7;
+        } while(value > 0);
+        while(n > 0)
+        {
+            n--;
+            data.push_back(bytes[n] | (n > 0 ? 0x80 : 0));
+        }
+        return true;
+    }
+    static bool parse_track(const uint8_t* data, size_t size, std::vector<TickEvent>& tick_events,
+                            std::vector<TempoChange>& tempo_map, uint64_t& last_tick, uint32_t& sequence)
+    {
+        size_t pos = 0;
+        uint64_t tick = 0;
+        uint8_t running_status = 0;
+        while(pos < size)
+        {
+            uint32_t delta;
+            if(!read_varlen(data, size, pos, delta) || pos >= size)
+                return false;
+            tick += delta;
+            last_tick = std::max(last_tick, tick);
+
+            uint8_t status = data[pos];
+            if(status == 0xFF) // Meta event
+            {
+                uint32_t length;
+                pos++;
+                if(pos >= size)
+                    return false;
+                uint8_t type = data[pos++];
+                if(!read_varlen(data, size, pos, length) || length > size-pos)
+                    return false;
+                if(type == 0x51 && length == 3) // Set tempo
+                {
+                    TempoChange change;
+                    change.tick = tick;
+                    change.us_per_quarter = ((uint32_t)data[pos] << 16) | ((uint32_t)data[pos+1] << 8) | data[pos+2];
+                    if(change.us_per_quarter > 0)
+                        tempo_map.push_back(change);
+                }
+                pos += length;
+                if(type == 0x2F) // End of track
+                    return true;
+                continue;
+            }
+            if(status >= 0xF8) // Real-time message: no data, and the running status stays
+            {
+                pos++;
+                continue;
+            }
+            if(status == 0xF0 || status == 0xF7) // System exclusive
+            {
+                uint32_t length;
+                pos++;
+                if(!read_varlen(data, size, pos, length) || length > size-pos)
+                    return false;
+                pos += length;
+                running_status = 0;
+                continue;
+            }
+            if(status >= 0xF1) // System common message: its data is skipped, and it cancels the running status
+            {
+                int n_data = (status == 0xF2) ? 2 : (status == 0xF1 || status == 0xF3) ? 1 : 0;
+                pos += 1+n_data;
+                if(pos > size)
+                    return false;
+                running_status = 0;
+                continue;
+            }
+
+            // Channel message, possibly with running status
+            if(status & 0x80)
+            {
+                running_status = status;
+                pos++;
+            }
+            else if(running_status == 0)
+                return false;
+            uint8_t type = running_status & 0xF0;
+            int n_data = (type == 0xC0 || type == 0xD0) ? 1 : 2;
+            if(pos+n_data > size)
+                return false;
+            TickEvent event;
+            event.tick = tick;
+            event.sequence = sequence++;
+            event.status = running_status;
+            event.data1 = data[pos] & 0x7F;
+            event.data2 = n_data == 2 ? data[pos+1] & 0x7F : 0;
+            tick_events.push_back(event);
+            pos += n_data;
+        }
+        return true; // Missing "end of track": tolerated
+    }
+};
+
+#endif // MIDI_FILE_H
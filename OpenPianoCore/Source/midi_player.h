@@ -0,0 +1,102 @@
+/*
+OpenPiano: an open source piano engine based on physical modeling
+Copyright (C) 2021-2022 Michele Perrone
+Github: https://github.com/michele-perrone/OpenPiano
+Author e-mail: perrone(dot)michele(at)outlook(dot)com
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Affero General Public License as published
+by the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Affero General Public License for more details.
+
+You should have received a copy of the GNU Affero General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef MIDI_PLAYER_H
+#define MIDI_PLAYER_H
+
+#include <inttypes.h>
+#include <math.h>
+#include "piano.h"
+#include "midi_file.h"
+
+/* ********************************************************************** *
+ * Plays the events of a MIDI file (or of a workload, see "workload.h")   *
+ * on a piano, one render quantum at a time, each event at its sample.    *
+ * The notes and the sustain pedal (CC64) are turned into note events     *
+ * the same way the plugin does.                                          *
+ * ********************************************************************** */
+
+struct MidiPlayer
+{
+    Piano* piano;
+    bool key_down[MAX_STRINGS];
+    double pedal_position; // 0 -> pedal released, 1 -> pedal fully pressed
+    size_t next_event; // First event of the file not yet played (see play_quantum())
+
+    MidiPlayer(Piano* piano)
+    {
+        this->piano = piano;
+        for(int i = 0; i < MAX_STRINGS; i++)
+            key_down[i] = false;
+        pedal_position = 0.0;
+        next_event = 0;
+    }
+    void play_quantum(const MidiFile& midi, uint64_t quantum_start, uint32_t quantum)
+    {
+        // Schedules the events of [quantum_start, quantum_start+quantum) [samples], before the quantum
+        // is computed. An event that doesn't fit in a quantum is played at the beginning of the next one.
+        while(next_event < midi.events.size())
+        {
+            uint64_t sample = (uint64_t)llround(midi.events[next_event].time*piano->sample_rate);
+            if(sample >= quantum_start+quantum)
+                break;
+            uint32_t offset = sample > quantum_start ? (uint32_t)(sample-quantum_start) : 0;
+            if(!play(midi.events[next_event], offset))
+                break;
+            next_event++;
+        }
+    }
+    bool play(const MidiEvent& event, uint32_t offset)
+    {
+        // Returns false, without playing the event, if there's no room left
+        // for its note events in this quantum
+        uint32_t n_free = MAX_NOTE_EVENTS - piano->n_note_events;
+        int note = event.data1 - MIDI_NOTE_OFFSET;
+        bool on_keyboard = note >= 0 && note < (int)piano->n_strings;
+        if(event.is_controller(64))
+        {
+            if(n_free < piano->n_strings)
+                return false;
+            pedal_position = event.data2/127.0;
+            for(uint32_t i = 0; i < piano->n_strings; i++)
+            {
+                // The dampers of the keys held down stay lifted
+                if(!key_down[i])
+                    piano->schedule_note_event(offset, i, NOTE_EVENT_DAMPER, 1.0-pedal_position);
+            }
+        }
+        else if(event.is_note_on() && on_keyboard)
+        {
+            if(n_free < 1)
+                return false;
+            key_down[note] = true;
+            piano->schedule_note_event(offset, note, NOTE_EVENT_HIT, event.data2/30.0);
+        }
+        else if(event.is_note_off() && on_keyboard)
+        {
+            if(n_free < 1)
+                return false;
+            key_down[note] = false;
+            piano->schedule_note_event(offset, note, NOTE_EVENT_DAMPER, 1.0-pedal_position);
+        }
+        return true;
+    }
+};
+
+#endif // MIDI_PLAYER_H
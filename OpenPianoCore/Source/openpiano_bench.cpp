@@ -0,0 +1,900 @@
+/*
+OpenPiano: an open source piano engine based on physical modeling
+Copyright (C) 2021-2022 Michele Perrone
+Github: https://github.com/michele-perrone/OpenPiano
+Author e-mail: perrone(dot)michele(at)outlook(dot)com
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Affero General Public License as published
+by the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Affero General Public License for more details.
+
+You should have received a copy of the GNU Affero General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <chrono>
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <type_traits>
+#include "piano.h"
+#include "perf_counters.h"
+#include "midi_player.h"
+#include "workload.h"
+
+// openpiano-bench: measures the cost of one sample of each string, for each string kernel
+// (boundary and hammer models, see "string_hammer.h"), while the hammer is in contact with
+// the string and while the string vibrates freely. The results are written as JSON.
+// With --capacity, it measures instead how many notes the whole piano can sustain in real time,
+// for each number of threads and block size (see run_capacity()), or how a synthetic performance
+// is rendered (--workload, see "workload.h"): the same seed replays the same events in any build.
+// With --calibrate, it measures this machine again for Piano::calibrate() and caches the result.
+// With --perf, the hardware counters of each measurement are reported too (see "perf_counters.h").
+
+static void print_usage()
+{
+    fprintf(stderr, "Usage: openpiano-bench [options]\n"
+                    "  --rate <Hz>             Sample rate (default: 48000)\n"
+                    "  --samples <n>           Samples of free vibration per run (default: 2048)\n"
+                    "  --runs <n>              Timed runs per measurement (default: 11)\n"
+                    "  --warmup <n>            Untimed runs before them (default: 2)\n"
+                    "  --velocity <m/s>        Hammer velocity (default: 3)\n"
+                    "  --description <file>    Per-note parameters, CSV (default: all the keys, A0 to C8)\n"
+                    "  --output <file>         JSON output (default: standard output)\n"
+                    "  --perf                  Read the performance counters (Linux)\n"
+                    "  --perf-raw <list>       Also read these raw CPU events, e.g. 0x1c7 (at most 4)\n"
+                    "\n"
+                    "Usage: openpiano-bench --capacity [options]\n"
+                    "  --polyphony <list>      Notes played, e.g. 1,8,32 (default: 1,2,4,8,16,32,64,88)\n"
+                    "  --threads <list>        Worker threads (default: powers of two up to the cores)\n"
+                    "  --blocks <list>         Block sizes [samples] (default: 64,128,256,512)\n"
+                    "  --duration <s>          Audio rendered for each point (default: 2)\n"
+                    "  --max-miss <fraction>   Missed deadlines tolerated by the capacity table (default: 0)\n"
+                    "  --workload <list>       Play these workloads instead, e.g. mixed,pedal (see \"workload.h\"):\n"
+                    "                          melody, chords, repeated, glissando, pedal or mixed\n"
+                    "  --seed <n>              Seed of the workloads (default: 1)\n"
+                    "  --static-partition      Keep the predicted string partition (see Piano::rebalance())\n"
+                    "  --rate, --warmup, --velocity, --description, --output and --perf as above.\n"
+                    "  The capacity table goes to the standard output, the JSON only to --output.\n"
+                    "\n"
+                    "Usage: openpiano-bench --calibrate [options]\n"
+                    "  Measures the calibration of this machine again and caches it (see \"piano_calibration.h\").\n"
+                    "  --rate and --description as above (default description: the built-in piano).\n"
+                    "  --output <file>         Instead of the cache (default: $OPENPIANO_CALIBRATION or the user cache)\n");
+}
+
+struct BenchOptions
+{
+    int sample_rate;
+    uint32_t samples;
+    uint32_t runs;
+    uint32_t warmup;
+    double velocity;
+    PianoDescription description;
+
+    // Capacity mode
+    std::vector<uint32_t> polyphony;
+    std::vector<uint32_t> threads;
+    std::vector<uint32_t> blocks;
+    double duration; // [s]
+    double max_miss;
+    std::vector<std::string> workloads; // Played instead of the polyphony patterns (see "workload.h")
+    uint64_t seed;
+    bool rebalancing; // false -> the strings stay with the threads of the predicted partition
+
+    // Performance counters
+    bool perf;
+    std::vector<uint64_t> perf_raw;
+
+    BenchOptions() : description(MAX_STRINGS)
+    {
+        sample_rate = 48000;
+        samples = 2048;
+        runs = 11;
+        warmup = 2;
+        velocity = 3.0;
+        polyphony = {1, 2, 4, 8, 16, 32, 64, 88};
+        uint32_t n_cores = std::max(1u, std::thread::hardware_concurrency());
+        for(uint32_t n = 1; n < n_cores; n *= 2)
+            threads.push_back(n);
+        threads.push_back(n_cores);
+        blocks = {64, 128, 256, 512};
+        duration = 2.0;
+        max_miss = 0.0;
+        seed = 1;
+        rebalancing = true;
+        perf = false;
+    }
+    bool open_counters(PerfCounters& counters, bool inherit) const
+    {
+        for(uint64_t config : perf_raw)
+            counters.add_raw(config);
+        return counters.open(inherit);
+    }
+};
+
+struct PerfSample
+{
+    // Counters summed over the timed runs of a measurement
+    bool measured;
+    bool available[N_PERF_COUNTERS+MAX_RAW_PERF_COUNTERS];
+    uint64_t values[N_PERF_COUNTERS+MAX_RAW_PERF_COUNTERS];
+    uint32_t n_counters;
+    uint64_t samples; // Samples computed while counting
+
+    PerfSample()
+    {
+        measured = false;
+        n_counters = 0;
+        samples = 0;
+        for(uint32_t c = 0; c < N_PERF_COUNTERS+MAX_RAW_PERF_COUNTERS; c++)
+        {
+            available[c] = false;
+            values[c] = 0;
+        }
+    }
+    void add(const PerfCounters& counters, uint64_t n_samples)
+    {
+        measured = true;
+        n_counters = counters.n_counters();
+        for(uint32_t c = 0; c < n_counters; c++)
+        {
+            available[c] = counters.available(c);
+            values[c] += counters.values[c];
+        }
+        samples += n_samples;
+    }
+};
+
+struct BenchResult
+{
+    uint32_t note; // Index of the string (0 -> A0)
+    uint32_t nodes; // Spatial samples of the string
+    const char* kernel;
+    bool is_default_kernel; // The one the piano is compiled with
+    const char* phase; // "contact" or "free"
+    uint32_t samples; // Samples per run
+    std::vector<double> ns_per_sample; // One value per run, sorted
+    double flops_per_sample; // Counted from the code, see kernel_work()
+    double bytes_per_sample;
+    PerfSample perf;
+};
+
+struct MixResult
+{
+    // Piano::mix_buffers() of the worker buffers
+    uint32_t inputs;
+    uint32_t block;
+    std::vector<double> ns_per_sample; // One value per run, sorted
+    PerfSample perf;
+};
+
+static volatile double sink; // Keeps the compiler from dropping the samples
+
+static double percentile(const std::vector<double>& sorted, double p)
+{
+    // Linear interpolation between the closest ranks
+    double rank = p*(sorted.size()-1);
+    size_t low = (size_t)rank;
+    size_t high = std::min(low+1, sorted.size()-1);
+    return sorted[low] + (rank-low)*(sorted[high]-sorted[low]);
+}
+
+static std::string note_name(uint32_t note)
+{
+    static const char* names[12] = {"C", "C#", "D", "D#", "E", "F", "F#", "G", "G#", "A", "A#", "B"};
+    uint32_t midi = note + MIDI_NOTE_OFFSET;
+    return std::string(names[midi%12]) + std::to_string((int)midi/12-1);
+}
+
+template <typename String>
+static double time_samples(String& string, uint32_t n, PerfCounters* counters, PerfSample* perf)
+{
+    // [ns per sample]. The counters, if any, are added to "perf".
+    double sum = 0.0;
+    if(counters != nullptr)
+        counters->start();
+    auto start = std::chrono::steady_clock::now();
+    for(uint32_t i = 0; i < n; i++)
+        sum += string.get_next_sample();
+    auto end = std::chrono::steady_clock::now();
+    if(counters != nullptr)
+    {
+        counters->stop();
+        counters->read_values();
+        perf->add(*counters, n);
+    }
+    sink = sum;
+    return std::chrono::duration<double, std::nano>(end-start).count()/n;
+}
+
+template <typename String>
+static void kernel_work(const String& s, double& flops, double& bytes)
+{
+    // Work of one get_next_sample(), counted from the code. Flops: 16 for each node of the
+    // FD scheme (see compute_displacement()), 3 for each node under the damper, and the mean
+    // of the pickup. Bytes: the data touched at least once (row pointers, the 4 time levels
+    // of each node and the hammer window), whether it comes from the cache or from memory.
+    uint32_t fd_nodes = s.len_x_axis-5;
+    flops = 16.0*fd_nodes + 3.0*(s.damper_right-s.damper_left) + (s.right_boundary-s.left_boundary+2);
+    bytes = (double)(s.len_x_axis+2)*(sizeof(double*)+4*sizeof(double)) + (double)fd_nodes*sizeof(double);
+}
+
+template <typename String>
+static uint32_t contact_length(String& string, double velocity)
+{
+    // Samples from the hit until the hammer leaves the string
+    uint32_t max_length = (uint32_t)(0.02*string.Fs);
+    string.reset();
+    string.hit(velocity);
+    uint32_t n = 0;
+    bool touched = false;
+    while(n < max_length)
+    {
+        sink = string.get_next_sample();
+        n++;
+        bool in_contact = string.Fh[string.n_0] > 0.0;
+        touched = touched || in_contact;
+        if(touched && !in_contact)
+            break;
+    }
+    return n;
+}
+
+template <typename Boundary, typename HammerModel>
+static void bench_kernel(const char* kernel, bool is_default_kernel, const BenchOptions& options,
+                         PerfCounters* counters, std::vector<BenchResult>& results)
+{
+    typedef PianoStringT<Boundary, HammerModel> String;
+    for(uint32_t i = 0; i < options.description.n_strings; i++)
+    {
+        // Same construction as PianoModel, outside of any arena
+        const NoteParams& n = options.description.notes[i];
+        Hammer hammer(options.sample_rate, n.Mh, n.p, n.bH, n.K, n.a, n.g_meters);
+        String string(options.sample_rate, n.f0, n.L, n.rho, n.S, n.E, n.b1, n.b2, &hammer);
+        if(!string.is_playable())
+            continue; // Its sound pickup doesn't fit on it
+
+        BenchResult result;
+        result.note = i;
+        result.nodes = string.len_x_axis;
+        result.kernel = kernel;
+        result.is_default_kernel = is_default_kernel;
+        kernel_work(string, result.flops_per_sample, result.bytes_per_sample);
+
+        // Contact: each run hits the string at rest and lasts until the hammer leaves it
+        result.phase = "contact";
+        result.samples = contact_length(string, options.velocity);
+        for(uint32_t r = 0; r < options.warmup+options.runs; r++)
+        {
+            string.reset();
+            string.hit(options.velocity);
+            bool timed = r >= options.warmup;
+            double ns = time_samples(string, result.samples, timed ? counters : nullptr, &result.perf);
+            if(timed)
+                result.ns_per_sample.push_back(ns);
+        }
+        std::sort(result.ns_per_sample.begin(), result.ns_per_sample.end());
+        results.push_back(result);
+
+        // Free vibration: the runs follow each other after the contact, with the damper lifted
+        result.phase = "free";
+        result.samples = options.samples;
+        result.ns_per_sample.clear();
+        result.perf = PerfSample();
+        contact_length(string, options.velocity); // Hits the string and leaves it right after the contact
+        for(uint32_t r = 0; r < options.warmup+options.runs; r++)
+        {
+            bool timed = r >= options.warmup;
+            double ns = time_samples(string, result.samples, timed ? counters : nullptr, &result.perf);
+            if(timed)
+                result.ns_per_sample.push_back(ns);
+        }
+        std::sort(result.ns_per_sample.begin(), result.ns_per_sample.end());
+        results.push_back(result);
+    }
+}
+
+static void bench_mix(const BenchOptions& options, PerfCounters* counters, std::vector<MixResult>& results)
+{
+    // The mix of the worker buffers, done by the audio thread after each quantum
+    const uint32_t block = 256;
+    const uint32_t n_repeats = 64; // Blocks per run
+    for(uint32_t inputs : {1u, 2u, 4u, 8u, 16u})
+    {
+        MixResult result;
+        result.inputs = inputs;
+        result.block = block;
+        float** buffers = (float**)malloc(inputs*sizeof(float*));
+        for(uint32_t b = 0; b < inputs; b++)
+        {
+            buffers[b] = (float*)malloc(block*sizeof(float));
+            for(uint32_t i = 0; i < block; i++)
+                buffers[b][i] = 1e-3f*(float)((i*7+b*13)%101);
+        }
+        float* output = (float*)malloc(block*sizeof(float));
+        for(uint32_t r = 0; r < options.warmup+options.runs; r++)
+        {
+            bool timed = r >= options.warmup;
+            if(timed && counters != nullptr)
+                counters->start();
+            auto start = std::chrono::steady_clock::now();
+            for(uint32_t k = 0; k < n_repeats; k++)
+            {
+                Piano::mix_buffers(output, buffers, inputs, block, 1.0f);
+                sink = output[k%block];
+            }
+            auto end = std::chrono::steady_clock::now();
+            if(!timed)
+                continue;
+            if(counters != nullptr)
+            {
+                counters->stop();
+                counters->read_values();
+                result.perf.add(*counters, (uint64_t)n_repeats*block);
+            }
+            result.ns_per_sample.push_back(std::chrono::duration<double, std::nano>(end-start).count()/(n_repeats*block));
+        }
+        std::sort(result.ns_per_sample.begin(), result.ns_per_sample.end());
+        results.push_back(result);
+        for(uint32_t b = 0; b < inputs; b++)
+            free(buffers[b]);
+        free(buffers);
+        free(output);
+    }
+}
+
+static void write_perf(FILE* file, const PerfSample& perf, const BenchOptions& options, double flops, double bytes)
+{
+    // ", \"perf\": {...}": the counters that could be read, and the metrics derived from them.
+    // Nothing if the counters weren't requested.
+    if(!perf.measured)
+        return;
+    const uint64_t* v = perf.values;
+    const bool* a = perf.available;
+    double samples = (double)perf.samples;
+    fprintf(file, ", \"perf\": {\"samples\": %llu", (unsigned long long)perf.samples);
+    for(uint32_t c = 0; c < perf.n_counters; c++)
+    {
+        if(!a[c])
+            continue;
+        if(c < N_PERF_COUNTERS)
+            fprintf(file, ", \"%s\": %llu", PERF_COUNTER_NAMES[c], (unsigned long long)v[c]);
+        else
+            fprintf(file, ", \"raw_0x%llx\": %llu", (unsigned long long)options.perf_raw[c-N_PERF_COUNTERS],
+                    (unsigned long long)v[c]);
+    }
+    if(a[PERF_CYCLES] && a[PERF_INSTRUCTIONS] && v[PERF_CYCLES] > 0)
+        fprintf(file, ", \"ipc\": %.3f", (double)v[PERF_INSTRUCTIONS]/v[PERF_CYCLES]);
+    if(a[PERF_INSTRUCTIONS])
+        fprintf(file, ", \"instructions_per_sample\": %.2f", v[PERF_INSTRUCTIONS]/samples);
+    if(a[PERF_CYCLES])
+        fprintf(file, ", \"cycles_per_sample\": %.2f", v[PERF_CYCLES]/samples);
+    if(a[PERF_BRANCHES] && a[PERF_BRANCH_MISSES] && v[PERF_BRANCHES] > 0)
+        fprintf(file, ", \"branch_miss_rate\": %.5f", (double)v[PERF_BRANCH_MISSES]/v[PERF_BRANCHES]);
+    if(a[PERF_L1D_READS] && a[PERF_L1D_READ_MISSES] && v[PERF_L1D_READS] > 0)
+        fprintf(file, ", \"l1d_miss_rate\": %.5f", (double)v[PERF_L1D_READ_MISSES]/v[PERF_L1D_READS]);
+    if(a[PERF_LLC_READS] && a[PERF_LLC_READ_MISSES] && v[PERF_LLC_READS] > 0)
+        fprintf(file, ", \"llc_miss_rate\": %.5f", (double)v[PERF_LLC_READ_MISSES]/v[PERF_LLC_READS]);
+    if(a[PERF_LLC_READ_MISSES]) // One cache line from memory for each miss
+        fprintf(file, ", \"memory_bytes_per_sample\": %.2f", 64.0*v[PERF_LLC_READ_MISSES]/samples);
+    if(a[PERF_CYCLES] && flops > 0)
+        fprintf(file, ", \"flops_per_cycle\": %.3f", flops*samples/v[PERF_CYCLES]);
+    if(a[PERF_CYCLES] && bytes > 0)
+        fprintf(file, ", \"bytes_per_cycle\": %.3f", bytes*samples/v[PERF_CYCLES]);
+    fprintf(file, "}");
+}
+
+static void write_perf_status(FILE* file, const BenchOptions& options, const PerfCounters& counters)
+{
+    // Which counters could be read, and why the others couldn't
+    if(!options.perf)
+        return;
+    fprintf(file, "  \"perf\": {\"counters\": [");
+    bool first = true;
+    for(uint32_t c = 0; c < counters.n_counters(); c++)
+    {
+        if(!counters.available(c))
+            continue;
+        if(c < N_PERF_COUNTERS)
+            fprintf(file, "%s\"%s\"", first ? "" : ", ", PERF_COUNTER_NAMES[c]);
+        else
+            fprintf(file, "%s\"raw_0x%llx\"", first ? "" : ", ", (unsigned long long)options.perf_raw[c-N_PERF_COUNTERS]);
+        first = false;
+    }
+    fprintf(file, "], \"error\": \"%s\"},\n", counters.error != 0 ? strerror(counters.error) : "");
+}
+
+static void write_json(FILE* file, const BenchOptions& options, const PerfCounters& counters,
+                       const std::vector<BenchResult>& results, const std::vector<MixResult>& mix_results)
+{
+    fprintf(file, "{\n");
+    fprintf(file, "  \"benchmark\": \"openpiano-bench\",\n");
+#ifdef __VERSION__
+    fprintf(file, "  \"compiler\": \"%s\",\n", __VERSION__);
+#endif
+#ifdef __OPTIMIZE__
+    fprintf(file, "  \"optimized\": true,\n");
+#else
+    fprintf(file, "  \"optimized\": false,\n");
+#endif
+    fprintf(file, "  \"default_kernel\": \"%s\",\n", STRING_MODEL_NAME);
+    fprintf(file, "  \"precision\": \"double\",\n");
+    fprintf(file, "  \"sample_rate\": %d,\n", options.sample_rate);
+    fprintf(file, "  \"runs\": %u,\n", options.runs);
+    fprintf(file, "  \"warmup\": %u,\n", options.warmup);
+    fprintf(file, "  \"velocity\": %g,\n", options.velocity);
+    write_perf_status(file, options, counters);
+    fprintf(file, "  \"results\": [\n");
+    for(size_t k = 0; k < results.size(); k++)
+    {
+        const BenchResult& r = results[k];
+        double median = percentile(r.ns_per_sample, 0.5);
+        fprintf(file, "    {\"note\": \"%s\", \"index\": %u, \"nodes\": %u, \"kernel\": \"%s\", \"default\": %s, "
+                      "\"phase\": \"%s\", \"samples\": %u, \"ns_per_sample\": {\"min\": %.3f, \"p10\": %.3f, "
+                      "\"median\": %.3f, \"p90\": %.3f, \"max\": %.3f}, \"ns_per_node_sample\": %.4f, "
+                      "\"flops_per_sample\": %.0f, \"bytes_per_sample\": %.0f",
+                note_name(r.note).c_str(), r.note, r.nodes, r.kernel, r.is_default_kernel ? "true" : "false",
+                r.phase, r.samples, r.ns_per_sample.front(), percentile(r.ns_per_sample, 0.1), median,
+                percentile(r.ns_per_sample, 0.9), r.ns_per_sample.back(), median/r.nodes,
+                r.flops_per_sample, r.bytes_per_sample);
+        write_perf(file, r.perf, options, r.flops_per_sample, r.bytes_per_sample);
+        fprintf(file, "}%s\n", k+1 < results.size() ? "," : "");
+    }
+    fprintf(file, "  ],\n");
+    fprintf(file, "  \"mix\": [\n");
+    for(size_t k = 0; k < mix_results.size(); k++)
+    {
+        const MixResult& r = mix_results[k];
+        double flops = 2.0*r.inputs; // One multiply and one add for each input
+        double bytes = sizeof(float)*(r.inputs+1.0);
+        fprintf(file, "    {\"inputs\": %u, \"block\": %u, \"ns_per_sample\": {\"min\": %.3f, \"median\": %.3f, "
+                      "\"max\": %.3f}, \"flops_per_sample\": %.0f, \"bytes_per_sample\": %.0f",
+                r.inputs, r.block, r.ns_per_sample.front(), percentile(r.ns_per_sample, 0.5), r.ns_per_sample.back(),
+                flops, bytes);
+        write_perf(file, r.perf, options, flops, bytes);
+        fprintf(file, "}%s\n", k+1 < mix_results.size() ? "," : "");
+    }
+    fprintf(file, "  ]\n");
+    fprintf(file, "}\n");
+}
+
+/* ********************************************************************** *
+ * Capacity: the piano plays "polyphony" notes, spread over the keyboard, *
+ * for each number of threads and block size. The notes are hit again    *
+ * every PATTERN_PERIOD, all together (chord) or one after the other      *
+ * (arpeggio). With the pedal down the strings keep ringing; with the     *
+ * pedal up each key is released halfway through the period. Each block   *
+ * is timed on its own and compared with its deadline, the time it lasts. *
+ * ********************************************************************** */
+
+const double PATTERN_PERIOD = 1.0; // [s]
+
+struct CapacityPoint
+{
+    const char* pattern; // "chord" or "arpeggio", or the name of the workload
+    bool is_workload; // The pedal and the notes are the workload's (see "workload.h")
+    bool pedal_down;
+    uint32_t polyphony; // Notes played, or the most strings ringing at once in a workload
+    uint32_t threads;
+    uint32_t block; // [samples]
+    double real_time_factor; // Audio rendered per second of computation
+    double p50; // Block latency [us]
+    double p99;
+    double p999;
+    double deadline; // Duration of a block [us]
+    double miss_fraction; // Blocks that took longer than their deadline
+    uint64_t rebalances; // Moves of the strings between the threads
+    PerfSample perf; // All the threads, idle ones included, over the timed blocks
+};
+
+static void play_pattern(Piano& piano, const std::vector<uint32_t>& notes, bool arpeggio, bool pedal_down,
+                         double velocity, uint64_t block_start, uint32_t block)
+{
+    // Schedules the events of the pattern that fall inside this block
+    uint64_t period = (uint64_t)(PATTERN_PERIOD*piano.sample_rate);
+    for(size_t k = 0; k < notes.size(); k++)
+    {
+        uint64_t hit = arpeggio ? k*period/notes.size() : 0;
+        uint64_t release = hit + period/2;
+        for(uint64_t t = block_start - block_start%period; t < block_start+block; t += period)
+        {
+            if(t+hit >= block_start && t+hit < block_start+block)
+                piano.schedule_note_event((uint32_t)(t+hit-block_start), notes[k], NOTE_EVENT_HIT, velocity);
+            if(!pedal_down && t+release >= block_start && t+release < block_start+block)
+                piano.schedule_note_event((uint32_t)(t+release-block_start), notes[k], NOTE_EVENT_DAMPER, 1.0);
+        }
+    }
+}
+
+static CapacityPoint measure_capacity(const BenchOptions& options, const char* pattern, bool pedal_down,
+                                      uint32_t polyphony, uint32_t threads, uint32_t block,
+                                      const MidiFile* workload = nullptr)
+{
+    // A new piano for each point: every measurement starts from silence.
+    // The counters are opened first, so they follow the worker threads too.
+    PerfCounters counters;
+    if(options.perf)
+        options.open_counters(counters, true);
+    Piano piano(options.sample_rate, block, threads, nullptr, options.description);
+    piano.rebalancing = options.rebalancing;
+    polyphony = std::min(polyphony, piano.n_strings);
+    std::vector<uint32_t> notes;
+    for(uint32_t k = 0; k < polyphony; k++)
+        notes.push_back(polyphony > 1 ? (uint32_t)llround(k*(piano.n_strings-1.0)/(polyphony-1)) : piano.n_strings/2);
+    if(pedal_down && workload == nullptr)
+    {
+        for(uint32_t i = 0; i < piano.n_strings; i++)
+            piano.schedule_note_event(0, i, NOTE_EVENT_DAMPER, 0.0);
+    }
+    MidiPlayer player(&piano);
+
+    float* buffer = (float*)malloc(block*sizeof(float));
+    uint64_t n_blocks = (uint64_t)ceil(options.duration*options.sample_rate/block);
+    std::vector<double> latencies; // [us]
+    double total = 0.0; // [s]
+    for(uint64_t b = 0; b < options.warmup+n_blocks; b++)
+    {
+        if(workload != nullptr)
+            player.play_quantum(*workload, b*block, block);
+        else
+            play_pattern(piano, notes, strcmp(pattern, "arpeggio") == 0, pedal_down, options.velocity, b*block, block);
+        if(options.perf && b == options.warmup)
+            counters.start();
+        auto start = std::chrono::steady_clock::now();
+        piano.get_next_block_multithreaded(buffer, block, 1.0f);
+        auto end = std::chrono::steady_clock::now();
+        if(b < options.warmup)
+            continue;
+        double elapsed = std::chrono::duration<double>(end-start).count();
+        latencies.push_back(elapsed*1e6);
+        total += elapsed;
+    }
+    free(buffer);
+
+    CapacityPoint point;
+    if(options.perf)
+    {
+        counters.stop();
+        counters.read_values();
+        point.perf.add(counters, n_blocks*block);
+    }
+    point.pattern = pattern;
+    point.is_workload = workload != nullptr;
+    point.pedal_down = pedal_down;
+    point.polyphony = workload != nullptr ? piano.stats().peak_active_strings : polyphony;
+    point.threads = piano.N_THREADS;
+    point.block = block;
+    point.rebalances = piano.stats().rebalances;
+    point.deadline = 1e6*block/options.sample_rate;
+    point.real_time_factor = (double)n_blocks*block/options.sample_rate/total;
+    uint64_t n_missed = 0;
+    for(double latency : latencies)
+        n_missed += latency > point.deadline;
+    point.miss_fraction = (double)n_missed/latencies.size();
+    std::sort(latencies.begin(), latencies.end());
+    point.p50 = percentile(latencies, 0.5);
+    point.p99 = percentile(latencies, 0.99);
+    point.p999 = percentile(latencies, 0.999);
+    return point;
+}
+
+static int write_capacity(const BenchOptions& options, const char* output, const std::vector<CapacityPoint>& points)
+{
+    if(output == nullptr)
+        return 0;
+    FILE* file = fopen(output, "w");
+    if(file == nullptr)
+    {
+        fprintf(stderr, "Can't write \"%s\"\n", output);
+        return 1;
+    }
+    fprintf(file, "{\n");
+    fprintf(file, "  \"benchmark\": \"openpiano-bench --capacity\",\n");
+    fprintf(file, "  \"kernel\": \"%s\",\n", STRING_MODEL_NAME);
+    fprintf(file, "  \"sample_rate\": %d,\n", options.sample_rate);
+    fprintf(file, "  \"duration\": %g,\n", options.duration);
+    if(!options.workloads.empty())
+        fprintf(file, "  \"seed\": %llu,\n", (unsigned long long)options.seed);
+    fprintf(file, "  \"hardware_threads\": %u,\n", std::thread::hardware_concurrency());
+    fprintf(file, "  \"rebalancing\": %s,\n", options.rebalancing ? "true" : "false");
+    if(options.perf)
+    {
+        PerfCounters counters; // Only to report which counters are available
+        options.open_counters(counters, true);
+        write_perf_status(file, options, counters);
+    }
+    fprintf(file, "  \"points\": [\n");
+    for(size_t k = 0; k < points.size(); k++)
+    {
+        const CapacityPoint& p = points[k];
+        fprintf(file, "    {\"pattern\": \"%s\", \"pedal\": \"%s\", \"threads\": %u, \"block\": %u, \"polyphony\": %u, "
+                      "\"real_time_factor\": %.3f, \"latency_us\": {\"p50\": %.2f, \"p99\": %.2f, \"p999\": %.2f}, "
+                      "\"deadline_us\": %.2f, \"miss_fraction\": %.5f, \"rebalances\": %llu",
+                p.pattern, p.is_workload ? "workload" : (p.pedal_down ? "down" : "up"), p.threads, p.block, p.polyphony, p.real_time_factor,
+                p.p50, p.p99, p.p999, p.deadline, p.miss_fraction, (unsigned long long)p.rebalances);
+        // Per output sample: the waits of the audio thread and of the idle workers are counted too
+        write_perf(file, p.perf, options, 0.0, 0.0);
+        fprintf(file, "}%s\n", k+1 < points.size() ? "," : "");
+    }
+    fprintf(file, "  ]\n");
+    fprintf(file, "}\n");
+    fclose(file);
+    return 0;
+}
+
+static void print_point(const CapacityPoint& p)
+{
+    printf("%-9s %-5s %7u %5u %9u %8.2f %10.1f %10.1f %10.1f %7.2f%%\n", p.pattern,
+           p.is_workload ? "-" : (p.pedal_down ? "down" : "up"), p.threads, p.block, p.polyphony,
+           p.real_time_factor, p.p50, p.p99, p.p999, 100.0*p.miss_fraction);
+    fflush(stdout);
+}
+
+static int run_capacity(const BenchOptions& options, const char* output)
+{
+    static const char* patterns[2] = {"chord", "arpeggio"};
+    std::vector<CapacityPoint> points;
+    printf("%-9s %-5s %7s %5s %9s %8s %10s %10s %10s %8s\n",
+           "pattern", "pedal", "threads", "block", "polyphony", "rtf", "p50 [us]", "p99 [us]", "p999 [us]", "missed");
+
+    // The workloads, generated once: each point replays the same events.
+    // Their polyphony is the most strings ringing at once, and there's no capacity table.
+    std::vector<MidiFile> workloads(options.workloads.size());
+    for(size_t w = 0; w < options.workloads.size(); w++)
+    {
+        WorkloadOptions workload_options;
+        workload_options.seed = options.seed;
+        workload_options.duration = options.duration;
+        workload_options.n_keys = options.description.n_strings;
+        WorkloadGenerator(workload_options).generate(options.workloads[w].c_str(), workloads[w]);
+        for(uint32_t threads : options.threads)
+        for(uint32_t block : options.blocks)
+        {
+            CapacityPoint p = measure_capacity(options, options.workloads[w].c_str(), false, 0, threads, block, &workloads[w]);
+            points.push_back(p);
+            print_point(p);
+        }
+    }
+    if(!workloads.empty())
+        return write_capacity(options, output, points);
+
+    for(const char* pattern : patterns)
+    for(int pedal = 1; pedal >= 0; pedal--)
+    for(uint32_t threads : options.threads)
+    for(uint32_t block : options.blocks)
+    {
+        uint32_t previous = 0;
+        for(uint32_t polyphony : options.polyphony)
+        {
+            CapacityPoint p = measure_capacity(options, pattern, pedal == 1, polyphony, threads, block);
+            if(p.polyphony == previous)
+                continue; // Clipped to the strings of the piano
+            previous = p.polyphony;
+            points.push_back(p);
+            print_point(p);
+        }
+    }
+
+    // Capacity table: the most notes sustained without missing more deadlines than tolerated
+    printf("\nCapacity (notes sustained with at most %.2f%% missed deadlines):\n", 100.0*options.max_miss);
+    printf("%-9s %-5s %7s", "pattern", "pedal", "threads");
+    for(uint32_t block : options.blocks)
+        printf(" %7u", block);
+    printf("\n");
+    for(const char* pattern : patterns)
+    for(int pedal = 1; pedal >= 0; pedal--)
+    for(uint32_t threads : options.threads)
+    {
+        printf("%-9s %-5s %7u", pattern, pedal == 1 ? "down" : "up", std::min(threads, MAX_THREADS));
+        for(uint32_t block : options.blocks)
+        {
+            uint32_t capacity = 0;
+            for(const CapacityPoint& p : points)
+            {
+                if(strcmp(p.pattern, pattern) == 0 && p.pedal_down == (pedal == 1) && p.threads == std::min(threads, MAX_THREADS) &&
+                   p.block == block && p.miss_fraction <= options.max_miss)
+                    capacity = std::max(capacity, p.polyphony);
+            }
+            printf(" %7u", capacity);
+        }
+        printf("\n");
+    }
+    return write_capacity(options, output, points);
+}
+
+static int run_calibration(const BenchOptions& options, const char* output)
+{
+    // A pinned calibration is the choice of an operator: it's shown, not replaced
+    std::string path = output != nullptr ? output : PianoCalibration::default_path();
+    PianoCalibration calibration;
+    bool loaded = calibration.load(path);
+    if(calibration.pinned)
+    {
+        if(!loaded)
+        {
+            fprintf(stderr, "%s is pinned, but doesn't choose the threads and the quantum\n", path.c_str());
+            return 1;
+        }
+        printf("%s is pinned, it's left as it is:\n", path.c_str());
+        calibration.print(stdout);
+        return 0;
+    }
+    auto start = std::chrono::steady_clock::now();
+    calibration = Piano::calibrate(options.sample_rate, options.description);
+    auto end = std::chrono::steady_clock::now();
+    printf("Calibrated in %lld ms: ", (long long)std::chrono::duration_cast<std::chrono::milliseconds>(end-start).count());
+    calibration.print(stdout);
+    if(!calibration.save(path))
+    {
+        fprintf(stderr, "Can't write \"%s\"\n", path.c_str());
+        return 1;
+    }
+    printf("Saved to %s\n", path.c_str());
+    return 0;
+}
+
+static bool parse_list(const char* text, std::vector<uint32_t>& values)
+{
+    // Comma-separated positive integers
+    values.clear();
+    while(*text != '\0')
+    {
+        char* end;
+        long value = strtol(text, &end, 10);
+        if(end == text || value <= 0 || (*end != ',' && *end != '\0'))
+            return false;
+        values.push_back((uint32_t)value);
+        text = *end == ',' ? end+1 : end;
+    }
+    return !values.empty();
+}
+
+static bool parse_hex_list(const char* text, std::vector<uint64_t>& values)
+{
+    // Comma-separated raw events, in hexadecimal
+    values.clear();
+    while(*text != '\0')
+    {
+        char* end;
+        unsigned long long value = strtoull(text, &end, 16);
+        if(end == text || (*end != ',' && *end != '\0'))
+            return false;
+        values.push_back((uint64_t)value);
+        text = *end == ',' ? end+1 : end;
+    }
+    return !values.empty() && values.size() <= MAX_RAW_PERF_COUNTERS;
+}
+
+static bool parse_workloads(const char* text, std::vector<std::string>& values)
+{
+    // Comma-separated names of workload patterns
+    values.clear();
+    std::string list = text;
+    for(size_t start = 0; start <= list.size();)
+    {
+        size_t end = std::min(list.find(',', start), list.size());
+        values.push_back(list.substr(start, end-start));
+        if(!WorkloadGenerator::is_pattern(values.back().c_str()))
+            return false;
+        start = end+1;
+    }
+    return !values.empty();
+}
+
+int main(int argc, char** argv)
+{
+    BenchOptions options;
+    const char* output = nullptr;
+    bool capacity = false;
+    bool calibrate = false;
+    bool has_description = false;
+    bool lists_ok = true;
+    for(int i = 1; i < argc; i++)
+    {
+        bool has_value = i+1 < argc;
+        if(strcmp(argv[i], "--capacity") == 0)
+            capacity = true;
+        else if(strcmp(argv[i], "--calibrate") == 0)
+            calibrate = true;
+        else if(strcmp(argv[i], "--polyphony") == 0 && has_value)
+            lists_ok = parse_list(argv[++i], options.polyphony) && lists_ok;
+        else if(strcmp(argv[i], "--threads") == 0 && has_value)
+            lists_ok = parse_list(argv[++i], options.threads) && lists_ok;
+        else if(strcmp(argv[i], "--blocks") == 0 && has_value)
+            lists_ok = parse_list(argv[++i], options.blocks) && lists_ok;
+        else if(strcmp(argv[i], "--duration") == 0 && has_value)
+            options.duration = atof(argv[++i]);
+        else if(strcmp(argv[i], "--max-miss") == 0 && has_value)
+            options.max_miss = atof(argv[++i]);
+        else if(strcmp(argv[i], "--workload") == 0 && has_value)
+            lists_ok = parse_workloads(argv[++i], options.workloads) && lists_ok;
+        else if(strcmp(argv[i], "--seed") == 0 && has_value)
+            options.seed = strtoull(argv[++i], nullptr, 10);
+        else if(strcmp(argv[i], "--static-partition") == 0)
+            options.rebalancing = false;
+        else if(strcmp(argv[i], "--rate") == 0 && has_value)
+            options.sample_rate = atoi(argv[++i]);
+        else if(strcmp(argv[i], "--samples") == 0 && has_value)
+            options.samples = atoi(argv[++i]);
+        else if(strcmp(argv[i], "--runs") == 0 && has_value)
+            options.runs = atoi(argv[++i]);
+        else if(strcmp(argv[i], "--warmup") == 0 && has_value)
+            options.warmup = atoi(argv[++i]);
+        else if(strcmp(argv[i], "--velocity") == 0 && has_value)
+            options.velocity = atof(argv[++i]);
+        else if(strcmp(argv[i], "--output") == 0 && has_value)
+            output = argv[++i];
+        else if(strcmp(argv[i], "--perf") == 0)
+            options.perf = true;
+        else if(strcmp(argv[i], "--perf-raw") == 0 && has_value)
+        {
+            options.perf = true;
+            lists_ok = parse_hex_list(argv[++i], options.perf_raw) && lists_ok;
+        }
+        else if(strcmp(argv[i], "--description") == 0 && has_value)
+        {
+            if(!options.description.load_csv(argv[++i]))
+            {
+                fprintf(stderr, "Can't load the description \"%s\"\n", argv[i]);
+                return 1;
+            }
+            has_description = true;
+        }
+        else
+        {
+            print_usage();
+            return 1;
+        }
+    }
+    if(options.sample_rate <= 0 || options.samples == 0 || options.runs == 0 || options.velocity <= 0 ||
+       !lists_ok || options.duration <= 0 || options.max_miss < 0)
+    {
+        print_usage();
+        return 1;
+    }
+    if(calibrate)
+    {
+        // Calibrated for the piano that gets played, not for the whole keyboard
+        if(!has_description)
+            options.description = PianoDescription();
+        return run_calibration(options, output);
+    }
+    if(capacity)
+        return run_capacity(options, output);
+
+    // The counters of this thread, reset for each timed run
+    PerfCounters counters;
+    if(options.perf && !options.open_counters(counters, false))
+        fprintf(stderr, "No performance counter available: %s\n", strerror(counters.error));
+    PerfCounters* used_counters = options.perf ? &counters : nullptr;
+
+    // Every combination of the string models, whichever the piano is compiled with
+    std::vector<BenchResult> results;
+    bench_kernel<PerfectReflection, ChaigneHammer>("PerfectReflection/ChaigneHammer",
+        std::is_same<PianoString, PianoStringT<PerfectReflection, ChaigneHammer>>::value, options, used_counters, results);
+    bench_kernel<PerfectReflection, FeltHammer>("PerfectReflection/FeltHammer",
+        std::is_same<PianoString, PianoStringT<PerfectReflection, FeltHammer>>::value, options, used_counters, results);
+    bench_kernel<ImpedanceBoundary, ChaigneHammer>("ImpedanceBoundary/ChaigneHammer",
+        std::is_same<PianoString, PianoStringT<ImpedanceBoundary, ChaigneHammer>>::value, options, used_counters, results);
+    bench_kernel<ImpedanceBoundary, FeltHammer>("ImpedanceBoundary/FeltHammer",
+        std::is_same<PianoString, PianoStringT<ImpedanceBoundary, FeltHammer>>::value, options, used_counters, results);
+
+    FILE* file = output != nullptr ? fopen(output, "w") : stdout;
+    if(file == nullptr)
+    {
+        fprintf(stderr, "Can't write \"%s\"\n", output);
+        return 1;
+    }
+    std::vector<MixResult> mix_results;
+    bench_mix(options, used_counters, mix_results);
+    write_json(file, options, counters, results, mix_results);
+    if(file != stdout)
+        fclose(file);
+    return 0;
+}
@@ -0,0 +1,91 @@
+/*
+OpenPiano: an open source piano engine based on physical modeling
+Copyright (C) 2021-2022 Michele Perrone
+Github: https://github.com/michele-perrone/OpenPiano
+Author e-mail: perrone(dot)michele(at)outlook(dot)com
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Affero General Public License as published
+by the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Affero General Public License for more details.
+
+You should have received a copy of the GNU Affero General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <chrono>
+#include "piano.h"
+
+// openpiano-compile: writes the compiled model of a piano (see "compiled_model.h"),
+// which Piano::load_compiled_model() maps instead of simulating the attack caches.
+
+static void print_usage()
+{
+    fprintf(stderr, "Usage: openpiano-compile <output> [options]\n"
+                    "  --rate <Hz>             Sample rate (default: 48000)\n"
+                    "  --description <file>    Per-note parameters, CSV (default: built-in piano)\n"
+                    "  --hardness <factor>     Voicing: hammer hardness (default: 1)\n"
+                    "  --damping <factor>      Voicing: string damping (default: 1)\n");
+}
+
+int main(int argc, char** argv)
+{
+    if(argc < 2 || argv[1][0] == '-')
+    {
+        print_usage();
+        return 1;
+    }
+    const char* output = argv[1];
+    int sample_rate = 48000;
+    PianoDescription description;
+    PianoVoicing voicing;
+    for(int i = 2; i < argc; i++)
+    {
+        bool has_value = i+1 < argc;
+        if(strcmp(argv[i], "--rate") == 0 && has_value)
+            sample_rate = atoi(argv[++i]);
+        else if(strcmp(argv[i], "--description") == 0 && has_value)
+        {
+            if(!description.load_csv(argv[++i]))
+            {
+                fprintf(stderr, "Can't load the description \"%s\"\n", argv[i]);
+                return 1;
+            }
+        }
+        else if(strcmp(argv[i], "--hardness") == 0 && has_value)
+            voicing.hammer_hardness = atof(argv[++i]);
+        else if(strcmp(argv[i], "--damping") == 0 && has_value)
+            voicing.damping = atof(argv[++i]);
+        else
+        {
+            print_usage();
+            return 1;
+        }
+    }
+    if(sample_rate <= 0 || voicing.hammer_hardness <= 0 || voicing.damping <= 0)
+    {
+        print_usage();
+        return 1;
+    }
+
+    auto start = std::chrono::steady_clock::now();
+
+    // The render quantum and the threads don't matter: only the strings are compiled
+    Piano piano(sample_rate, 256, 1, nullptr, description);
+    piano.set_voicing(voicing);
+    piano.build_attack_cache(DEFAULT_ATTACK_VELOCITIES, N_DEFAULT_ATTACK_VELOCITIES, false);
+    if(!piano.save_compiled_model(output))
+    {
+        fprintf(stderr, "Can't write \"%s\"\n", output);
+        return 1;
+    }
+
+    auto end = std::chrono::steady_clock::now();
+    printf("%s: %u strings at %d Hz, compiled in %lld ms\n", output, piano.n_strings, sample_rate,
+           (long long)std::chrono::duration_cast<std::chrono::milliseconds>(end-start).count());
+    return 0;
+}
@@ -0,0 +1,255 @@
+/*
+OpenPiano: an open source piano engine based on physical modeling
+Copyright (C) 2021-2022 Michele Perrone
+Github: https://github.com/michele-perrone/OpenPiano
+Author e-mail: perrone(dot)michele(at)outlook(dot)com
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Affero General Public License as published
+by the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Affero General Public License for more details.
+
+You should have received a copy of the GNU Affero General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <chrono>
+#include <string>
+#include "piano.h"
+#include "midi_file.h"
+#include "midi_player.h"
+#include "workload.h"
+#include "wav_stream.h"
+
+// openpiano-render: renders a Standard MIDI File to a WAV file, faster than real time.
+// The notes, the note-offs and the sustain pedal (CC64) are played at their exact sample.
+// With --workload, a synthetic performance is rendered instead (see "workload.h").
+
+static void print_usage()
+{
+    fprintf(stderr, "Usage: openpiano-render <input.mid> <output.wav> [options]\n"
+                    "       openpiano-render --workload <pattern> <output.wav> [options]\n"
+                    "  --rate <Hz>             Sample rate (default: 48000)\n"
+                    "  --quantum <samples>     Render quantum (default: 1024)\n"
+                    "  --threads <n>           Worker threads (default: all the cores, or the calibrated ones)\n"
+                    "  --calibrate             Threads and string partition of the cached calibration of this\n"
+                    "                          machine, measured first if needed (see \"piano_calibration.h\")\n"
+                    "  --gain <factor>         Output gain (default: 150, like the plugin)\n"
+                    "  --tail <s>              Rendered after the last event (default: 3)\n"
+                    "  --description <file>    Per-note parameters, CSV (default: built-in piano)\n"
+                    "  --compiled <file>       Compiled model (see openpiano-compile)\n"
+                    "  --container <type>      wav, rf64 or w64 (default: wav, or rf64 above 4 GiB)\n"
+                    "  --normalize <dBFS>      Scale the output to this absolute peak (e.g. -1)\n"
+                    "  --bits <n>              16 or 24-bit PCM, or 32-bit float (default: 32)\n"
+                    "  --no-dither             Round the integer samples without dither\n"
+                    "  --trace <file>          Chrome trace JSON of the render threads\n"
+                    "  --static-partition      Keep the predicted string partition (see Piano::rebalance())\n"
+                    "  --seed <n>              Workload: seed of the generator (default: 1)\n"
+                    "  --duration <s>          Workload: length of the performance (default: 30)\n"
+                    "  Workload patterns: melody, chords, repeated, glissando, pedal, mixed (see \"workload.h\")\n");
+}
+
+int main(int argc, char** argv)
+{
+    // The input is a MIDI file, or a workload pattern after --workload
+    const char* workload = argc >= 4 && strcmp(argv[1], "--workload") == 0 ? argv[2] : nullptr;
+    int first_option = workload != nullptr ? 4 : 3;
+    if(argc < first_option || (workload == nullptr && argv[1][0] == '-') || argv[first_option-1][0] == '-')
+    {
+        print_usage();
+        return 1;
+    }
+    const char* input = argv[1];
+    const char* output = argv[first_option-1];
+    WorkloadOptions workload_options;
+    int sample_rate = 48000;
+    uint32_t quantum = 1024; // Latency doesn't matter: long quanta wake the threads up less often
+    uint32_t n_threads = std::thread::hardware_concurrency();
+    bool has_threads = false;
+    bool calibrate = false;
+    float gain = 150.0f;
+    double tail = 3.0;
+    const char* compiled = nullptr;
+    const char* container = nullptr;
+    bool normalize_output = false;
+    double peak_dbfs = 0.0;
+    uint32_t bits_per_sample = 32;
+    bool dither = true;
+    const char* trace = nullptr;
+    bool rebalancing = true;
+    PianoDescription description;
+    for(int i = first_option; i < argc; i++)
+    {
+        bool has_value = i+1 < argc;
+        if(strcmp(argv[i], "--rate") == 0 && has_value)
+            sample_rate = atoi(argv[++i]);
+        else if(strcmp(argv[i], "--quantum") == 0 && has_value)
+            quantum = atoi(argv[++i]);
+        else if(strcmp(argv[i], "--threads") == 0 && has_value)
+        {
+            n_threads = atoi(argv[++i]);
+            has_threads = true;
+        }
+        else if(strcmp(argv[i], "--calibrate") == 0)
+            calibrate = true;
+        else if(strcmp(argv[i], "--gain") == 0 && has_value)
+            gain = atof(argv[++i]);
+        else if(strcmp(argv[i], "--tail") == 0 && has_value)
+            tail = atof(argv[++i]);
+        else if(strcmp(argv[i], "--compiled") == 0 && has_value)
+            compiled = argv[++i];
+        else if(strcmp(argv[i], "--container") == 0 && has_value)
+            container = argv[++i];
+        else if(strcmp(argv[i], "--normalize") == 0 && has_value)
+        {
+            normalize_output = true;
+            peak_dbfs = atof(argv[++i]);
+        }
+        else if(strcmp(argv[i], "--bits") == 0 && has_value)
+            bits_per_sample = atoi(argv[++i]);
+        else if(strcmp(argv[i], "--no-dither") == 0)
+            dither = false;
+        else if(strcmp(argv[i], "--trace") == 0 && has_value)
+            trace = argv[++i];
+        else if(strcmp(argv[i], "--static-partition") == 0)
+            rebalancing = false;
+        else if(strcmp(argv[i], "--seed") == 0 && has_value && workload != nullptr)
+            workload_options.seed = strtoull(argv[++i], nullptr, 10);
+        else if(strcmp(argv[i], "--duration") == 0 && has_value && workload != nullptr)
+            workload_options.duration = atof(argv[++i]);
+        else if(strcmp(argv[i], "--description") == 0 && has_value)
+        {
+            if(!description.load_csv(argv[++i]))
+            {
+                fprintf(stderr, "Can't load the description \"%s\"\n", argv[i]);
+                return 1;
+            }
+        }
+        else
+        {
+            print_usage();
+            return 1;
+        }
+    }
+    if(sample_rate <= 0 || quantum == 0 || tail < 0 || peak_dbfs > 0 ||
+       (bits_per_sample != 16 && bits_per_sample != 24 && bits_per_sample != 32))
+    {
+        print_usage();
+        return 1;
+    }
+
+    MidiFile midi;
+    if(workload != nullptr)
+    {
+        // The keys of the piano that gets rendered
+        workload_options.n_keys = description.n_strings;
+        if(!WorkloadGenerator(workload_options).generate(workload, midi))
+        {
+            fprintf(stderr, "Unknown workload \"%s\"\n", workload);
+            return 1;
+        }
+    }
+    else if(!midi.load(input))
+    {
+        fprintf(stderr, "Can't read the MIDI file \"%s\"\n", input);
+        return 1;
+    }
+
+    auto start = std::chrono::steady_clock::now();
+
+    // The quantum isn't taken from the calibration: offline, a long one only saves time.
+    // Threads given on the command line win over the calibrated ones.
+    PianoCalibration calibration;
+    if(calibrate)
+    {
+        calibration = Piano::load_or_calibrate(sample_rate, description);
+        if(!has_threads)
+            n_threads = calibration.n_threads;
+        printf("Calibration: ");
+        if(calibration.valid)
+            calibration.print(stdout);
+        else
+            printf("none, the defaults apply\n");
+    }
+    Piano piano(sample_rate, quantum, n_threads, nullptr, description, calibration);
+    piano.rebalancing = rebalancing;
+    if(compiled != nullptr && !piano.load_compiled_model(compiled))
+        fprintf(stderr, "The compiled model \"%s\" doesn't fit, the attacks will be simulated\n", compiled);
+
+    // The blocks are written by a background thread while the next ones are rendered.
+    // Integer output is rendered to an intermediate float file first, and converted at the end.
+    std::string float_path = bits_per_sample == 32 ? output : std::string(output) + ".float.tmp";
+    uint64_t n_samples = (uint64_t)ceil((midi.duration+tail)*sample_rate);
+    drwav_container wav_container = WavStream::container_for(n_samples, 1, sizeof(float)*8);
+    if(container != nullptr)
+    {
+        if(strcmp(container, "wav") == 0)
+            wav_container = drwav_container_riff;
+        else if(strcmp(container, "rf64") == 0)
+            wav_container = drwav_container_rf64;
+        else if(strcmp(container, "w64") == 0)
+            wav_container = drwav_container_w64;
+        else
+        {
+            print_usage();
+            return 1;
+        }
+    }
+    WavStream wav;
+    if(!wav.open(float_path.c_str(), sample_rate, 1, wav_container))
+    {
+        fprintf(stderr, "Can't write \"%s\"\n", output);
+        return 1;
+    }
+
+    // Render one quantum at a time. The events of each quantum are scheduled at their sample.
+    if(trace != nullptr)
+        piano.start_trace();
+    MidiPlayer player(&piano);
+    float* block = (float*)malloc(quantum*sizeof(float));
+    uint64_t n_queued = 0;
+    for(uint64_t block_start = 0; block_start < n_samples; block_start += quantum)
+    {
+        player.play_quantum(midi, block_start, quantum);
+        piano.get_next_block_multithreaded(block, quantum, gain);
+        uint64_t n_frames = std::min((uint64_t)quantum, n_samples-block_start);
+        n_queued += wav.write(block, (uint32_t)n_frames);
+    }
+    bool written = wav.close() && n_queued == n_samples;
+    free(block);
+    if(trace != nullptr && !piano.save_trace(trace))
+        fprintf(stderr, "Can't write \"%s\"\n", trace);
+
+    // Second pass: normalization and conversion, over the mapped file
+    float output_gain = 1.0f;
+    if(normalize_output && wav.peak > 0.0f)
+        output_gain = (float)(pow(10.0, peak_dbfs/20.0)/wav.peak);
+    if(written && (output_gain != 1.0f || bits_per_sample != 32))
+        written = WavStream::finalize(float_path.c_str(), output, output_gain, bits_per_sample, dither);
+    if(bits_per_sample != 32)
+        remove(float_path.c_str());
+
+    auto end = std::chrono::steady_clock::now();
+    double elapsed = std::chrono::duration<double>(end-start).count();
+    double rendered = (double)wav.frames_written/sample_rate;
+    printf("%s: %.1f s of audio in %.1f s (%.1fx real time), %u threads, quantum %u\n",
+           output, rendered, elapsed, rendered/elapsed, piano.N_THREADS, quantum);
+    PianoStats stats = piano.stats();
+    printf("Quanta: p50 %.2f ms, p99 %.2f ms, max %.2f ms; peak of %u active strings, %llu note events\n",
+           stats.block_ns.percentile(0.5)*1e-6, stats.block_ns.percentile(0.99)*1e-6, stats.block_ns.max()*1e-6,
+           stats.peak_active_strings, (unsigned long long)stats.events_applied);
+    for(uint32_t t = 0; t < stats.n_threads; t++)
+        printf("Thread %u: busy %.0f%% of the quanta\n", t, 100.0*stats.worker_utilization(t));
+    if(stats.n_threads > 1)
+        printf("Strings moved between the threads %llu times%s\n", (unsigned long long)stats.rebalances,
+               rebalancing ? "" : " (static partition)");
+    printf("Peak %.2f dBFS, written as %u-bit %s\n", 20.0*log10(std::max(wav.peak*output_gain, 1e-10f)),
+           bits_per_sample, bits_per_sample == 32 ? "float" : (dither ? "PCM with dither" : "PCM"));
+    if(!written)
+        fprintf(stderr, "Can't write \"%s\"\n", output);
+    return written ? 0 : 1;
+}
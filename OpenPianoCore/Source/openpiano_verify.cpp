@@ -0,0 +1,892 @@
+/*
+OpenPiano: an open source piano engine based on physical modeling
+Copyright (C) 2021-2022 Michele Perrone
+Github: https://github.com/michele-perrone/OpenPiano
+Author e-mail: perrone(dot)michele(at)outlook(dot)com
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Affero General Public License as published
+by the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Affero General Public License for more details.
+
+You should have received a copy of the GNU Affero General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <vector>
+#include <string>
+#include <complex>
+#include <algorithm>
+#include "piano.h"
+
+// openpiano-verify: plays a fixed set of scenarios (single hits across the keyboard at several
+// velocities, repeated strikes, damping and half-damping, chords) through a plain scalar
+// transcription of the string model (see ReferenceString), and through every optimized path
+// that should sound the same: the string kernels of each boundary and hammer model, and the
+// piano rendered sample by sample, with its threads, with the attack caches and from a compiled
+// model. Each output is compared with the reference (see compare()), and the program exits
+// with a nonzero status if any of them drifts further than its tolerance.
+
+static void print_usage()
+{
+    fprintf(stderr, "Usage: openpiano-verify [options]\n"
+                    "  --rate <Hz>             Sample rate (default: 48000)\n"
+                    "  --quantum <samples>     Render quantum (default: 256)\n"
+                    "  --threads <list>        Worker threads of the multithreaded runs (default: 1,2,4)\n"
+                    "  --description <file>    Per-note parameters, CSV (default: built-in piano)\n"
+                    "  --scenario <prefix>     Only the scenarios whose name starts with this\n"
+                    "  --verbose               Print every comparison, not only the failures\n");
+}
+
+/* ********************************************************************** *
+ * Reference string: the finite difference scheme of PianoStringT written *
+ * out as plainly as possible. One array per time level, every node in    *
+ * the same loop, the boundary and hammer models chosen with a branch, no *
+ * silence detection and no attack cache. The coefficients are taken from *
+ * "params", a string of the piano that is never played: the physics is   *
+ * not under test, only the way the kernel computes it.                   *
+ * ********************************************************************** */
+
+struct ReferenceString
+{
+    PianoString* params;
+    bool impedance_boundary; // ImpedanceBoundary instead of PerfectReflection
+    bool felt_hammer; // FeltHammer instead of ChaigneHammer
+    std::vector<double> levels[4];
+    double* y[4]; // y[0] -> latest time instant, y[3] -> three instants before
+    double eta[4]; // Hammer displacement, same order
+    double Fh[4]; // Hammer force, same order
+
+    ReferenceString(PianoString* params, bool impedance_boundary, bool felt_hammer)
+    {
+        this->params = params;
+        this->impedance_boundary = impedance_boundary;
+        this->felt_hammer = felt_hammer;
+        for(int l = 0; l < 4; l++)
+        {
+            levels[l].assign(params->len_x_axis+2, 0.0);
+            y[l] = levels[l].data();
+            eta[l] = 0.0;
+            Fh[l] = 0.0;
+        }
+    }
+    void shift(int direction)
+    {
+        // direction > 0: a new time instant is about to become the latest one (it takes the oldest array).
+        // direction < 0: the latest time instant is discarded, see hit().
+        if(direction > 0)
+        {
+            std::rotate(y, y+3, y+4);
+            std::rotate(eta, eta+3, eta+4);
+            std::rotate(Fh, Fh+3, Fh+4);
+        }
+        else
+        {
+            std::rotate(y, y+1, y+4);
+            std::rotate(eta, eta+1, eta+4);
+            std::rotate(Fh, Fh+1, Fh+4);
+        }
+    }
+    void hit(double velocity)
+    {
+        // Like PianoStringT::hit(): the latest time instant is computed again, with the hammer
+        params->damper_target = 0.0;
+        params->damper_position = 0.0;
+        params->compute_damper_coefficients();
+        shift(-1);
+        eta[0] = velocity*params->Ts;
+        eta[1] = eta[2] = eta[3] = 0.0;
+        Fh[0] = contact_force(eta[0], y[0][params->Xs_contact]);
+    }
+    void set_damper(double engagement)
+    {
+        params->set_damper(engagement);
+    }
+    void update_damper(uint32_t block_length)
+    {
+        params->update_damper(block_length);
+    }
+    double contact_force(double hammer, double string) const
+    {
+        if(hammer < string) // (Chaigne, Eq. 21)
+            return 0.0;
+        return params->K*powf(hammer-string, params->p); // (Chaigne, Eq. 20)
+    }
+    double get_next_sample()
+    {
+        const PianoString& s = *params;
+        shift(1);
+        double* next = y[0];
+        const double* now = y[1];
+        const double* before = y[2];
+        const double* earlier = y[3];
+
+        // String (Chaigne, Eq. 10), and the dashpot under the damper felt
+        double hammer_force = s.force_scale*Fh[1];
+        for(uint32_t i = 2; i < s.len_x_axis-3; i++)
+        {
+            double value = s.a1*now[i] + s.a2*before[i]
+                    + s.a3*(now[i+1] + now[i-1])
+                    + s.a4*(now[i+2] + now[i-2])
+                    + s.a5*(before[i+1] + before[i-1] + earlier[i])
+                    + (hammer_force*s.hammer_mask[i])/s.Ms;
+            if(i >= s.damper_left && i < s.damper_right)
+                value = s.damper_g*value + s.damper_s*before[i];
+            next[i] = value;
+        }
+
+        // Boundaries
+        if(impedance_boundary)
+        {
+            uint32_t end = s.Xs_bridge;
+            next[1] = s.b_L1*now[1] + s.b_L2*now[2] + s.b_L3*now[3] + s.b_L4*before[1] + s.b_LF*Fh[1]*s.hammer_mask[1];
+            next[0] = 2*next[1] - next[2];
+            next[end] = s.b_R1*now[end] + s.b_R2*now[end-1] + s.b_R3*now[end-2] + s.b_R4*before[end]
+                    + s.b_RF*Fh[1]*s.hammer_mask[end];
+            next[end+1] = 2*next[end] - next[end-1];
+        }
+        else
+        {
+            next[0] = -next[2];
+            next[s.len_x_axis+1] = -next[s.len_x_axis-1];
+        }
+
+        // Hammer
+        if(felt_hammer)
+            eta[0] = s.d1*eta[1] + s.d2*eta[2] + s.dF*Fh[1];
+        else
+            eta[0] = s.d1*eta[1] + s.d2*eta[2] - (s.Ts*s.Ts*Fh[1])/s.Mh;
+        Fh[0] = contact_force(eta[0], next[s.Xs_contact]);
+
+        // Sound pickup
+        double sum = 0.0;
+        for(uint32_t i = s.left_boundary; i < s.right_boundary; i++)
+            sum += next[i];
+        return sum/(s.right_boundary-s.left_boundary);
+    }
+};
+
+/* ********************************************************************** *
+ * Scenarios. The events are applied like the piano applies its note      *
+ * events: the dampers move once per render quantum, and an event takes   *
+ * effect at its sample.                                                  *
+ * ********************************************************************** */
+
+struct ScoreEvent
+{
+    double time; // [s]
+    uint32_t note; // From A0
+    NoteEventType type;
+    double value; // Velocity [m/s] or damper engagement
+};
+
+struct Scenario
+{
+    std::string name;
+    double duration; // [s]
+    std::vector<ScoreEvent> events; // Sorted by time
+
+    uint32_t highest_note() const
+    {
+        uint32_t highest = 0;
+        for(const ScoreEvent& e : events)
+            highest = std::max(highest, e.note);
+        return highest;
+    }
+    double release_time() const
+    {
+        // When the last string that rings is fully damped: from then on the sound can only
+        // die away. Negative if a string rings until the end.
+        std::vector<bool> ringing(MAX_STRINGS, false);
+        std::vector<bool> struck(MAX_STRINGS, false);
+        double release = -1.0;
+        for(const ScoreEvent& e : events)
+        {
+            if(e.type == NOTE_EVENT_HIT)
+                struck[e.note] = true;
+            bool damped = e.type == NOTE_EVENT_DAMPER && e.value >= 1.0;
+            if(damped && ringing[e.note])
+                release = std::max(release, e.time);
+            ringing[e.note] = struck[e.note] && !damped;
+        }
+        for(uint32_t note = 0; note < MAX_STRINGS; note++)
+        {
+            if(ringing[note])
+                return -1.0;
+        }
+        return release;
+    }
+    bool interpolates_attacks(const double* velocities, uint32_t n_buckets) const
+    {
+        // Whether a string at rest is hit between two velocity buckets: with the attack
+        // caches, its attack is interpolated rather than simulated
+        std::vector<bool> struck(MAX_STRINGS, false);
+        for(const ScoreEvent& e : events)
+        {
+            if(e.type != NOTE_EVENT_HIT || struck[e.note])
+                continue;
+            struck[e.note] = true;
+            if(std::find(velocities, velocities+n_buckets, e.value) == velocities+n_buckets)
+                return true;
+        }
+        return false;
+    }
+};
+
+static std::string note_name(uint32_t note)
+{
+    static const char* names[12] = {"C", "C#", "D", "D#", "E", "F", "F#", "G", "G#", "A", "A#", "B"};
+    uint32_t midi = note + MIDI_NOTE_OFFSET;
+    return std::string(names[midi%12]) + std::to_string((int)midi/12-1);
+}
+
+static std::vector<Scenario> canonical_scenarios(uint32_t n_strings)
+{
+    std::vector<Scenario> scenarios;
+
+    // Single hits across the keyboard: soft, between two default attack cache buckets (1.5)
+    // and near the top of the range (4)
+    const double velocities[] = {0.5, 1.5, 4.0};
+    const uint32_t notes[] = {0, n_strings/4, n_strings/2, 3*n_strings/4, n_strings-1};
+    for(uint32_t note : notes)
+    for(double velocity : velocities)
+    {
+        Scenario s;
+        char name[64];
+        snprintf(name, sizeof(name), "hit-%s-v%g", note_name(note).c_str(), velocity);
+        s.name = name;
+        s.duration = 0.5;
+        s.events.push_back({0.0, note, NOTE_EVENT_HIT, velocity});
+        scenarios.push_back(s);
+    }
+
+    // The same key struck again while it still rings, softer and louder
+    Scenario repeated;
+    repeated.name = "repeated-" + note_name(n_strings/2);
+    repeated.duration = 0.6;
+    const double repeated_velocities[] = {1.0, 3.0, 0.5, 2.0};
+    for(uint32_t k = 0; k < 4; k++)
+        repeated.events.push_back({0.12*k, n_strings/2, NOTE_EVENT_HIT, repeated_velocities[k]});
+    scenarios.push_back(repeated);
+
+    // Key released, pedal pressed again while the damper is falling, half pedal, release
+    Scenario damping;
+    damping.name = "damp-undamp-" + note_name(n_strings/3);
+    damping.duration = 0.6;
+    damping.events.push_back({0.0, n_strings/3, NOTE_EVENT_HIT, 2.0});
+    damping.events.push_back({0.15, n_strings/3, NOTE_EVENT_DAMPER, 1.0});
+    damping.events.push_back({0.155, n_strings/3, NOTE_EVENT_DAMPER, 0.0});
+    damping.events.push_back({0.3, n_strings/3, NOTE_EVENT_DAMPER, 0.5});
+    damping.events.push_back({0.45, n_strings/3, NOTE_EVENT_DAMPER, 1.0});
+    scenarios.push_back(damping);
+
+    // Chords: a triad with its octave, struck together and released together,
+    // then an arpeggio held over it
+    Scenario chord;
+    chord.name = "chord";
+    chord.duration = 0.6;
+    uint32_t root = n_strings/4;
+    const uint32_t intervals[] = {0, 4, 7, 12};
+    for(uint32_t interval : intervals)
+        chord.events.push_back({0.0, root+interval, NOTE_EVENT_HIT, 2.0});
+    for(uint32_t interval : intervals)
+        chord.events.push_back({0.25, root+interval, NOTE_EVENT_DAMPER, 1.0});
+    for(uint32_t k = 0; k < 4; k++)
+        chord.events.push_back({0.3+0.03*k, root+12+intervals[k], NOTE_EVENT_HIT, 1.0+0.5*k});
+    scenarios.push_back(chord);
+
+    // A bass note held for seconds and released: a scheme that is unstable at the ends of
+    // the string only shows it after a while (see check_stability())
+    Scenario sustained;
+    sustained.name = "sustain-" + note_name(0);
+    sustained.duration = 4.0;
+    sustained.events.push_back({0.0, 0, NOTE_EVENT_HIT, 2.0});
+    sustained.events.push_back({3.0, 0, NOTE_EVENT_DAMPER, 1.0});
+    scenarios.push_back(sustained);
+
+    // Only the notes the piano can play
+    std::vector<Scenario> playable;
+    for(const Scenario& s : scenarios)
+    {
+        if(s.highest_note() < n_strings)
+            playable.push_back(s);
+    }
+    return playable;
+}
+
+template <typename Voice>
+static std::vector<double> play_voices(std::vector<Voice*>& voices, const Scenario& scenario,
+                                       int sample_rate, uint32_t quantum)
+{
+    // Sum of the voices, one per note (nullptr for the notes that aren't played)
+    uint64_t n_samples = (uint64_t)ceil(scenario.duration*sample_rate);
+    std::vector<double> output(n_samples, 0.0);
+    size_t next_event = 0;
+    for(uint64_t t = 0; t < n_samples; t++)
+    {
+        uint32_t offset = (uint32_t)(t%quantum);
+        if(offset == 0)
+        {
+            for(Voice* v : voices)
+            {
+                if(v != nullptr)
+                    v->update_damper(quantum);
+            }
+        }
+        while(next_event < scenario.events.size() &&
+              (uint64_t)llround(scenario.events[next_event].time*sample_rate) <= t)
+        {
+            const ScoreEvent& e = scenario.events[next_event++];
+            Voice* v = voices[e.note];
+            if(e.type == NOTE_EVENT_HIT)
+                v->hit(e.value);
+            else
+            {
+                v->set_damper(e.value);
+                v->update_damper(quantum-offset);
+            }
+        }
+        double sample = 0.0;
+        for(Voice* v : voices)
+        {
+            if(v != nullptr)
+                sample += v->get_next_sample();
+        }
+        output[t] = sample;
+    }
+    return output;
+}
+
+/* ********************************************************************** *
+ * Comparison of an output with the reference:                            *
+ * - the largest absolute error, relative to the peak of the reference;   *
+ * - the level of each partial (the peaks of the spectrum of the          *
+ *   reference that are not too far below the strongest one), in dB;      *
+ * - the decay rate of the envelope after its peak, relative.             *
+ * ********************************************************************** */
+
+struct Tolerance
+{
+    double max_error; // Relative to the peak
+    double partial_db;
+    double partial_range; // Only the partials within this range of the strongest one are compared [dB]
+    double decay; // Relative
+};
+
+struct Comparison
+{
+    double max_error;
+    double partial_db; // Largest difference over the partials
+    double partial_hz; // Where it is
+    double decay;
+    bool passed;
+};
+
+const double PI = 3.14159265358979323846;
+
+static void fft(std::vector<std::complex<double>>& x)
+{
+    // In place, radix 2. The length must be a power of two.
+    size_t n = x.size();
+    for(size_t i = 1, j = 0; i < n; i++)
+    {
+        size_t bit = n >> 1;
+        for(; j & bit; bit >>= 1)
+            j ^= bit;
+        j ^= bit;
+        if(i < j)
+            std::swap(x[i], x[j]);
+    }
+    for(size_t len = 2; len <= n; len <<= 1)
+    {
+        std::complex<double> w_len = std::polar(1.0, -2.0*PI/len);
+        for(size_t i = 0; i < n; i += len)
+        {
+            std::complex<double> w = 1.0;
+            for(size_t k = 0; k < len/2; k++)
+            {
+                std::complex<double> u = x[i+k];
+                std::complex<double> v = x[i+k+len/2]*w;
+                x[i+k] = u+v;
+                x[i+k+len/2] = u-v;
+                w *= w_len;
+            }
+        }
+    }
+}
+
+static std::vector<double> spectrum_db(const std::vector<double>& signal)
+{
+    // Magnitude of the Hann-windowed signal, zero-padded to a power of two [dB]
+    size_t n = 1;
+    while(n < signal.size())
+        n <<= 1;
+    std::vector<std::complex<double>> x(n, 0.0);
+    for(size_t i = 0; i < signal.size(); i++)
+        x[i] = signal[i]*0.5*(1.0-cos(2.0*PI*i/(signal.size()-1)));
+    fft(x);
+    std::vector<double> db(n/2);
+    for(size_t k = 0; k < n/2; k++)
+        db[k] = 20.0*log10(std::abs(x[k])+1e-300);
+    return db;
+}
+
+static double decay_rate(const std::vector<double>& signal, int sample_rate)
+{
+    // Slope of the RMS envelope (10 ms frames) after its peak, by least squares [dB/s].
+    // The frames more than 60 dB below the peak are left out.
+    uint32_t frame = sample_rate/100;
+    std::vector<double> envelope;
+    for(size_t start = 0; start+frame <= signal.size(); start += frame)
+    {
+        double sum = 0.0;
+        for(size_t i = start; i < start+frame; i++)
+            sum += signal[i]*signal[i];
+        envelope.push_back(10.0*log10(sum/frame+1e-300));
+    }
+    if(envelope.empty())
+        return 0.0;
+    size_t peak = std::max_element(envelope.begin(), envelope.end())-envelope.begin();
+    double sx = 0, sy = 0, sxx = 0, sxy = 0;
+    uint32_t n = 0;
+    for(size_t k = peak; k < envelope.size() && envelope[k] > envelope[peak]-60.0; k++, n++)
+    {
+        double t = (double)k*frame/sample_rate;
+        sx += t;
+        sy += envelope[k];
+        sxx += t*t;
+        sxy += t*envelope[k];
+    }
+    if(n < 2)
+        return 0.0;
+    return (n*sxy-sx*sy)/(n*sxx-sx*sx);
+}
+
+static Comparison compare(const std::vector<double>& reference, const std::vector<double>& output,
+                          int sample_rate, const Tolerance& tolerance)
+{
+    Comparison c;
+    double peak = 0.0, error = 0.0;
+    for(size_t i = 0; i < reference.size(); i++)
+    {
+        peak = std::max(peak, fabs(reference[i]));
+        error = std::max(error, fabs(reference[i]-output[i]));
+    }
+    c.max_error = peak > 0.0 ? error/peak : error;
+
+    // The partials are the local maxima of the spectrum of the reference
+    std::vector<double> ref_db = spectrum_db(reference);
+    std::vector<double> out_db = spectrum_db(output);
+    double strongest = *std::max_element(ref_db.begin(), ref_db.end());
+    double bin_hz = (double)sample_rate/(2*ref_db.size());
+    c.partial_db = 0.0;
+    c.partial_hz = 0.0;
+    const size_t half_width = 3; // [bins]
+    for(size_t k = half_width; k+half_width < ref_db.size(); k++)
+    {
+        if(ref_db[k] < strongest-tolerance.partial_range)
+            continue;
+        bool is_peak = true;
+        for(size_t j = k-half_width; j <= k+half_width && is_peak; j++)
+            is_peak = j == k || ref_db[j] < ref_db[k];
+        if(is_peak && fabs(out_db[k]-ref_db[k]) > c.partial_db)
+        {
+            c.partial_db = fabs(out_db[k]-ref_db[k]);
+            c.partial_hz = k*bin_hz;
+        }
+    }
+
+    // A nearly steady envelope is compared on an absolute scale of 1 dB/s
+    double ref_rate = decay_rate(reference, sample_rate);
+    double out_rate = decay_rate(output, sample_rate);
+    c.decay = fabs(out_rate-ref_rate)/std::max(fabs(ref_rate), 1.0);
+
+    c.passed = c.max_error <= tolerance.max_error && c.partial_db <= tolerance.partial_db && c.decay <= tolerance.decay;
+    return c;
+}
+
+/* ********************************************************************** *
+ * Checks of an output on its own, which don't trust the reference (a     *
+ * reference that transcribes a wrong scheme agrees with it):             *
+ * - the sound stays bounded: once the last hammer has left, it never     *
+ *   gets louder than the attack;                                         *
+ * - after the final release, the envelope decays.                        *
+ * ********************************************************************** */
+
+struct Stability
+{
+    double growth; // Peak after the last attack over the peak until then
+    double release_db; // Level at the end, relative to the level just before the release [dB]
+    bool passed;
+};
+
+const double ATTACK_DURATION = 0.1; // [s]
+const double LEVEL_WINDOW = 0.05; // [s]
+const double MAX_RELEASE_DB = -40.0;
+
+static double ac_level_db(const std::vector<double>& signal, size_t start, size_t length)
+{
+    // RMS level around the mean of the window [dB]. A string can keep a static offset
+    // once it's damped (the bridge of ImpedanceBoundary has no stiffness and creeps back
+    // for seconds): the pickup reports it as a DC level, which isn't sound.
+    double mean = 0.0, sum = 0.0;
+    for(size_t i = start; i < start+length; i++)
+        mean += signal[i];
+    mean /= length;
+    for(size_t i = start; i < start+length; i++)
+        sum += (signal[i]-mean)*(signal[i]-mean);
+    return 10.0*log10(sum/length+1e-300);
+}
+
+static Stability check_stability(const std::vector<double>& output, const Scenario& scenario, int sample_rate)
+{
+    Stability s;
+    double last_hit = 0.0;
+    for(const ScoreEvent& e : scenario.events)
+    {
+        if(e.type == NOTE_EVENT_HIT)
+            last_hit = e.time;
+    }
+    size_t attack_end = std::min(output.size(), (size_t)((last_hit+ATTACK_DURATION)*sample_rate));
+    double attack_peak = 0.0, later_peak = 0.0;
+    bool finite = true;
+    for(size_t i = 0; i < output.size(); i++)
+    {
+        finite = finite && std::isfinite(output[i]);
+        double& peak = i < attack_end ? attack_peak : later_peak;
+        peak = std::max(peak, fabs(output[i]));
+    }
+    s.growth = attack_peak > 0.0 ? later_peak/attack_peak : later_peak;
+    s.release_db = 0.0;
+    double release = scenario.release_time();
+    size_t window = (size_t)(LEVEL_WINDOW*sample_rate);
+    if(release >= 0.0 && (size_t)(release*sample_rate) >= window && output.size() >= window)
+    {
+        size_t before = (size_t)(release*sample_rate)-window;
+        s.release_db = ac_level_db(output, output.size()-window, window) - ac_level_db(output, before, window);
+    }
+    s.passed = finite && s.growth <= 1.0 && (release < 0.0 || s.release_db <= MAX_RELEASE_DB);
+    return s;
+}
+
+/* ********************************************************************** *
+ * Variants under test                                                    *
+ * ********************************************************************** */
+
+struct VerifyOptions
+{
+    int sample_rate;
+    uint32_t quantum;
+    std::vector<uint32_t> threads;
+    PianoDescription description;
+    const char* only; // Scenario prefix (nullptr -> all)
+    bool verbose;
+
+    VerifyOptions()
+    {
+        sample_rate = 48000;
+        quantum = 256;
+        threads = {1, 2, 4};
+        only = nullptr;
+        verbose = false;
+    }
+};
+
+struct VerifyReport
+{
+    uint32_t n_compared;
+    uint32_t n_failed;
+
+    VerifyReport()
+    {
+        n_compared = 0;
+        n_failed = 0;
+    }
+    void add(const std::string& variant, const Scenario& scenario, const Comparison& c, bool verbose)
+    {
+        n_compared++;
+        n_failed += !c.passed;
+        if(c.passed && !verbose)
+            return;
+        printf("%-4s %-36s %-22s %10.3g %8.4f dB @ %7.1f Hz %10.3g\n", c.passed ? "ok" : "FAIL", variant.c_str(),
+               scenario.name.c_str(), c.max_error, c.partial_db, c.partial_hz, c.decay);
+        fflush(stdout);
+    }
+    void add(const std::string& variant, const Scenario& scenario, const Stability& s, bool verbose)
+    {
+        n_compared++;
+        n_failed += !s.passed;
+        if(s.passed && !verbose)
+            return;
+        if(scenario.release_time() < 0.0)
+            printf("%-4s %-36s %-22s growth %.3g\n", s.passed ? "ok" : "FAIL", variant.c_str(), scenario.name.c_str(), s.growth);
+        else
+            printf("%-4s %-36s %-22s growth %.3g, %.1f dB after the release\n", s.passed ? "ok" : "FAIL", variant.c_str(),
+                   scenario.name.c_str(), s.growth, s.release_db);
+        fflush(stdout);
+    }
+};
+
+// The reference and the kernels compute the same operations in the same order: only the silence
+// detection of the kernel (which zeroes a string below 1 micrometer) can tell them apart.
+const Tolerance KERNEL_TOLERANCE = {1e-6, 0.01, 60.0, 1e-3};
+// The piano sums the strings in float, in a different order for each number of threads
+const Tolerance ENGINE_TOLERANCE = {1e-5, 0.01, 60.0, 1e-3};
+// Between two velocity buckets, the attack caches interpolate the state of the string. The weak
+// partials can be far off, so only the main ones are compared. The worst case today is at the
+// top of the keyboard, C5 at 1.5 m/s with the default buckets: 15% and 2.3 dB.
+const Tolerance INTERPOLATED_ATTACK_TOLERANCE = {0.2, 3.0, 30.0, 0.01};
+
+template <typename Boundary, typename HammerModel>
+static void verify_kernel(const char* kernel, const std::vector<Scenario>& scenarios, Piano& params,
+                          const VerifyOptions& options, VerifyReport& report)
+{
+    // PianoStringT<Boundary, HammerModel> against the reference with the same models
+    typedef PianoStringT<Boundary, HammerModel> String;
+    bool impedance = std::is_same<Boundary, ImpedanceBoundary>::value;
+    bool felt = std::is_same<HammerModel, FeltHammer>::value;
+    for(const Scenario& scenario : scenarios)
+    {
+        std::vector<Hammer*> hammers(params.n_strings, nullptr);
+        std::vector<String*> strings(params.n_strings, nullptr);
+        std::vector<ReferenceString*> references(params.n_strings, nullptr);
+        for(const ScoreEvent& e : scenario.events)
+        {
+            if(strings[e.note] != nullptr)
+                continue;
+            // Same construction as PianoModel, outside of any arena
+            const NoteParams& n = options.description.notes[e.note];
+            hammers[e.note] = new Hammer(options.sample_rate, n.Mh, n.p, n.bH, n.K, n.a, n.g_meters);
+            strings[e.note] = new String(options.sample_rate, n.f0, n.L, n.rho, n.S, n.E, n.b1, n.b2, hammers[e.note]);
+            params.strings[e.note]->reset();
+            references[e.note] = new ReferenceString(params.strings[e.note], impedance, felt);
+        }
+        std::vector<double> reference = play_voices(references, scenario, options.sample_rate, options.quantum);
+        std::vector<double> output = play_voices(strings, scenario, options.sample_rate, options.quantum);
+        report.add(std::string("kernel ") + kernel, scenario,
+                   compare(reference, output, options.sample_rate, KERNEL_TOLERANCE), options.verbose);
+        report.add(std::string("kernel ") + kernel, scenario,
+                   check_stability(output, scenario, options.sample_rate), options.verbose);
+        for(uint32_t i = 0; i < params.n_strings; i++)
+        {
+            delete references[i];
+            delete strings[i];
+            delete hammers[i];
+        }
+    }
+}
+
+static std::vector<double> play_piano(Piano& piano, const Scenario& scenario, bool multithreaded)
+{
+    // The whole piano, from the silence, one render quantum at a time
+    uint32_t quantum = piano.samples_per_block;
+    uint64_t n_samples = (uint64_t)ceil(scenario.duration*piano.sample_rate);
+    uint64_t n_blocks = (n_samples+quantum-1)/quantum;
+    std::vector<float> block(quantum);
+    std::vector<double> output;
+    size_t next_event = 0;
+    for(uint64_t b = 0; b < n_blocks; b++)
+    {
+        uint64_t block_start = b*quantum;
+        while(next_event < scenario.events.size())
+        {
+            const ScoreEvent& e = scenario.events[next_event];
+            uint64_t sample = (uint64_t)llround(e.time*piano.sample_rate);
+            if(sample >= block_start+quantum)
+                break;
+            piano.schedule_note_event((uint32_t)(sample-block_start), e.note, e.type, e.value);
+            next_event++;
+        }
+        if(multithreaded)
+            piano.get_next_block_multithreaded(block.data(), quantum, 1.0f);
+        else
+            piano.get_next_block(block.data(), quantum, 1.0f);
+        for(uint32_t i = 0; i < quantum && output.size() < n_samples; i++)
+            output.push_back(block[i]);
+    }
+    return output;
+}
+
+static void verify_engine(const std::string& variant, Piano& piano, bool multithreaded, bool interpolating,
+                          const std::vector<Scenario>& scenarios, const std::vector<std::vector<double>>& references,
+                          const VerifyOptions& options, VerifyReport& report)
+{
+    // Each scenario starts from the snapshot of the silent piano
+    std::vector<uint8_t> silence(piano.get_state_size());
+    piano.save_state(silence.data(), silence.size());
+    for(size_t k = 0; k < scenarios.size(); k++)
+    {
+        piano.load_state(silence.data(), silence.size());
+        std::vector<double> output = play_piano(piano, scenarios[k], multithreaded);
+        bool interpolated = interpolating && scenarios[k].interpolates_attacks(piano.attack_cache_velocities.data(),
+                                                                               piano.attack_cache_velocities.size());
+        const Tolerance& tolerance = interpolated ? INTERPOLATED_ATTACK_TOLERANCE : ENGINE_TOLERANCE;
+        report.add(variant, scenarios[k], compare(references[k], output, options.sample_rate, tolerance), options.verbose);
+    }
+}
+
+static std::vector<double> attack_buckets(const std::vector<Scenario>& scenarios)
+{
+    // The default buckets and every velocity the scenarios strike, in increasing order.
+    // No attack is interpolated: a cached attack sounds the same as the simulation it replaces.
+    std::vector<double> velocities(DEFAULT_ATTACK_VELOCITIES, DEFAULT_ATTACK_VELOCITIES+N_DEFAULT_ATTACK_VELOCITIES);
+    for(const Scenario& s : scenarios)
+    {
+        for(const ScoreEvent& e : s.events)
+        {
+            if(e.type == NOTE_EVENT_HIT)
+                velocities.push_back(e.value);
+        }
+    }
+    std::sort(velocities.begin(), velocities.end());
+    velocities.erase(std::unique(velocities.begin(), velocities.end()), velocities.end());
+    return velocities;
+}
+
+static bool parse_list(const char* text, std::vector<uint32_t>& values)
+{
+    // Comma-separated positive integers
+    values.clear();
+    while(*text != '\0')
+    {
+        char* end;
+        long value = strtol(text, &end, 10);
+        if(end == text || value <= 0 || (*end != ',' && *end != '\0'))
+            return false;
+        values.push_back((uint32_t)value);
+        text = *end == ',' ? end+1 : end;
+    }
+    return !values.empty();
+}
+
+int main(int argc, char** argv)
+{
+    VerifyOptions options;
+    bool lists_ok = true;
+    for(int i = 1; i < argc; i++)
+    {
+        bool has_value = i+1 < argc;
+        if(strcmp(argv[i], "--rate") == 0 && has_value)
+            options.sample_rate = atoi(argv[++i]);
+        else if(strcmp(argv[i], "--quantum") == 0 && has_value)
+            options.quantum = atoi(argv[++i]);
+        else if(strcmp(argv[i], "--threads") == 0 && has_value)
+            lists_ok = parse_list(argv[++i], options.threads) && lists_ok;
+        else if(strcmp(argv[i], "--scenario") == 0 && has_value)
+            options.only = argv[++i];
+        else if(strcmp(argv[i], "--verbose") == 0)
+            options.verbose = true;
+        else if(strcmp(argv[i], "--description") == 0 && has_value)
+        {
+            if(!options.description.load_csv(argv[++i]))
+            {
+                fprintf(stderr, "Can't load the description \"%s\"\n", argv[i]);
+                return 1;
+            }
+        }
+        else
+        {
+            print_usage();
+            return 1;
+        }
+    }
+    if(options.sample_rate <= 0 || options.quantum == 0 || !lists_ok)
+    {
+        print_usage();
+        return 1;
+    }
+
+    // The single-threaded piano plays the reference strings: its own strings are only
+    // read for their coefficients, and it has only the strings that are playable
+    Piano params(options.sample_rate, options.quantum, 1, nullptr, options.description);
+    std::vector<Scenario> scenarios;
+    for(const Scenario& s : canonical_scenarios(params.n_strings))
+    {
+        if(options.only == nullptr || s.name.compare(0, strlen(options.only), options.only) == 0)
+            scenarios.push_back(s);
+    }
+    if(scenarios.empty())
+    {
+        fprintf(stderr, "No scenario to play\n");
+        return 1;
+    }
+    printf("%-4s %-36s %-22s %10s %24s %10s\n", "", "variant", "scenario", "max error", "partials", "decay");
+
+    // 1. Every string kernel against the reference with the same models
+    VerifyReport report;
+    verify_kernel<PerfectReflection, ChaigneHammer>("PerfectReflection/ChaigneHammer", scenarios, params, options, report);
+    verify_kernel<PerfectReflection, FeltHammer>("PerfectReflection/FeltHammer", scenarios, params, options, report);
+    verify_kernel<ImpedanceBoundary, ChaigneHammer>("ImpedanceBoundary/ChaigneHammer", scenarios, params, options, report);
+    verify_kernel<ImpedanceBoundary, FeltHammer>("ImpedanceBoundary/FeltHammer", scenarios, params, options, report);
+
+    // 2. The piano against the reference with the models it's compiled with
+    bool impedance = std::is_same<PianoString, PianoStringT<ImpedanceBoundary, FeltHammer>>::value ||
+                     std::is_same<PianoString, PianoStringT<ImpedanceBoundary, ChaigneHammer>>::value;
+    bool felt = std::is_same<PianoString, PianoStringT<PerfectReflection, FeltHammer>>::value ||
+                std::is_same<PianoString, PianoStringT<ImpedanceBoundary, FeltHammer>>::value;
+    std::vector<std::vector<double>> references;
+    for(const Scenario& scenario : scenarios)
+    {
+        std::vector<ReferenceString*> voices(params.n_strings, nullptr);
+        for(const ScoreEvent& e : scenario.events)
+        {
+            if(voices[e.note] == nullptr)
+            {
+                params.strings[e.note]->reset();
+                voices[e.note] = new ReferenceString(params.strings[e.note], impedance, felt);
+            }
+        }
+        references.push_back(play_voices(voices, scenario, options.sample_rate, options.quantum));
+        for(ReferenceString* v : voices)
+            delete v;
+    }
+    std::string model = std::string(" (") + STRING_MODEL_NAME + ")";
+    {
+        Piano piano(options.sample_rate, options.quantum, 1, nullptr, options.description);
+        verify_engine("piano per sample" + model, piano, false, false, scenarios, references, options, report);
+    }
+    for(uint32_t threads : options.threads)
+    {
+        Piano piano(options.sample_rate, options.quantum, threads, nullptr, options.description);
+        verify_engine("piano " + std::to_string(piano.N_THREADS) + " threads" + model, piano, true, false,
+                      scenarios, references, options, report);
+    }
+
+    // 3. The attack caches, simulated and then compiled, with a bucket at each velocity played.
+    //    Then with the default buckets, which interpolate the attacks in between.
+    const char* compiled_path = "openpiano-verify.model.tmp";
+    std::vector<double> buckets = attack_buckets(scenarios);
+    {
+        Piano piano(options.sample_rate, options.quantum, options.threads.back(), nullptr, options.description);
+        piano.build_attack_cache(buckets.data(), buckets.size(), false);
+        verify_engine("piano attack cache" + model, piano, true, false, scenarios, references, options, report);
+        if(!piano.save_compiled_model(compiled_path))
+        {
+            fprintf(stderr, "Can't write \"%s\"\n", compiled_path);
+            return 1;
+        }
+    }
+    {
+        Piano piano(options.sample_rate, options.quantum, options.threads.back(), nullptr, options.description);
+        bool loaded = piano.load_compiled_model(compiled_path);
+        remove(compiled_path);
+        if(!loaded)
+        {
+            fprintf(stderr, "The compiled model doesn't fit the piano that wrote it\n");
+            return 1;
+        }
+        verify_engine("piano compiled model" + model, piano, true, false, scenarios, references, options, report);
+    }
+    {
+        Piano piano(options.sample_rate, options.quantum, options.threads.back(), nullptr, options.description);
+        piano.build_attack_cache(DEFAULT_ATTACK_VELOCITIES, N_DEFAULT_ATTACK_VELOCITIES, false);
+        verify_engine("piano default attack buckets" + model, piano, true, true, scenarios, references, options, report);
+    }
+
+    printf("%u comparisons, %u failed\n", report.n_compared, report.n_failed);
+    return report.n_failed == 0 ? 0 : 1;
+}
@@ -0,0 +1,99 @@
+/*
+OpenPiano: an open source piano engine based on physical modeling
+Copyright (C) 2021-2022 Michele Perrone
+Github: https://github.com/michele-perrone/OpenPiano
+Author e-mail: perrone(dot)michele(at)outlook(dot)com
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Affero General Public License as published
+by the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Affero General Public License for more details.
+
+You should have received a copy of the GNU Affero General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <algorithm>
+#include "workload.h"
+
+// openpiano-workload: writes a synthetic performance (see "workload.h") as a Standard MIDI File.
+// The same options always give the same file, so it can be replayed by any build of the engine,
+// or by openpiano-render and openpiano-bench, which can also generate it on their own.
+
+static void print_usage()
+{
+    fprintf(stderr, "Usage: openpiano-workload <output.mid> [options]\n"
+                    "  --pattern <name>        melody, chords, repeated, glissando, pedal or mixed (default: mixed)\n"
+                    "  --seed <n>              Seed of the generator (default: 1)\n"
+                    "  --duration <s>          Length of the performance (default: 30)\n"
+                    "  --keys <n>              Keys played, from A0 up (default: 52, the built-in piano)\n"
+                    "  --velocity <mean>       Mean MIDI velocity (default: 80)\n"
+                    "  --spread <sd>           Standard deviation of the MIDI velocity (default: 20)\n");
+}
+
+int main(int argc, char** argv)
+{
+    if(argc < 2 || argv[1][0] == '-')
+    {
+        print_usage();
+        return 1;
+    }
+    const char* output = argv[1];
+    const char* pattern = "mixed";
+    WorkloadOptions options;
+    for(int i = 2; i < argc; i++)
+    {
+        bool has_value = i+1 < argc;
+        if(strcmp(argv[i], "--pattern") == 0 && has_value)
+            pattern = argv[++i];
+        else if(strcmp(argv[i], "--seed") == 0 && has_value)
+            options.seed = strtoull(argv[++i], nullptr, 10);
+        else if(strcmp(argv[i], "--duration") == 0 && has_value)
+            options.duration = atof(argv[++i]);
+        else if(strcmp(argv[i], "--keys") == 0 && has_value)
+            options.n_keys = atoi(argv[++i]);
+        else if(strcmp(argv[i], "--velocity") == 0 && has_value)
+            options.velocity_mean = atof(argv[++i]);
+        else if(strcmp(argv[i], "--spread") == 0 && has_value)
+            options.velocity_spread = atof(argv[++i]);
+        else
+        {
+            print_usage();
+            return 1;
+        }
+    }
+    if(!WorkloadGenerator::is_pattern(pattern) || options.duration <= 0 || options.n_keys == 0 ||
+       options.n_keys > (uint32_t)MAX_STRINGS || options.velocity_spread < 0)
+    {
+        print_usage();
+        return 1;
+    }
+
+    MidiFile midi;
+    WorkloadGenerator(options).generate(pattern, midi);
+    if(!midi.save(output, WORKLOAD_DIVISION))
+    {
+        fprintf(stderr, "Can't write \"%s\"\n", output);
+        return 1;
+    }
+
+    // Summary of the load: the notes, and the most keys held down at once
+    uint32_t n_notes = 0, held = 0, most_held = 0;
+    for(const MidiEvent& event : midi.events)
+    {
+        if(event.is_note_on())
+        {
+            n_notes++;
+            most_held = std::max(most_held, ++held);
+        }
+        else if(event.is_note_off())
+            held--;
+    }
+    printf("%s: %s, seed %llu, %.1f s, %u notes (%.1f per second), at most %u keys down at once\n",
+           output, pattern, (unsigned long long)options.seed, midi.duration, n_notes, n_notes/midi.duration, most_held);
+    return 0;
+}
@@ -0,0 +1,235 @@
+/*
+OpenPiano: an open source piano engine based on physical modeling
+Copyright (C) 2021-2022 Michele Perrone
+Github: https://github.com/michele-perrone/OpenPiano
+Author e-mail: perrone(dot)michele(at)outlook(dot)com
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Affero General Public License as published
+by the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Affero General Public License for more details.
+
+You should have received a copy of the GNU Affero General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef PERF_COUNTERS_H
+#define PERF_COUNTERS_H
+
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+#include <errno.h>
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+/* ********************************************************************** *
+ * Hardware and software performance counters of the calling thread      *
+ * (Linux perf_event_open()), for the benchmarks. Each counter is opened *
+ * on its own, so an event that the CPU, the hypervisor or the           *
+ * permissions (kernel.perf_event_paranoid) don't allow is just marked   *
+ * unavailable, and the others still count. On other systems no counter *
+ * is available. With "inherit", the threads created after open() are    *
+ * counted too, and start(), stop() and read_values() cover them.        *
+ * ********************************************************************** */
+
+enum PerfCounter
+{
+    PERF_CYCLES,
+    PERF_INSTRUCTIONS,
+    PERF_BRANCHES,
+    PERF_BRANCH_MISSES,
+    PERF_L1D_READS,
+    PERF_L1D_READ_MISSES,
+    PERF_LLC_READS,
+    PERF_LLC_READ_MISSES,
+    PERF_TASK_CLOCK, // [ns]
+    PERF_CONTEXT_SWITCHES,
+    PERF_PAGE_FAULTS,
+    N_PERF_COUNTERS
+};
+
+const char* const PERF_COUNTER_NAMES[N_PERF_COUNTERS] = {
+    "cycles", "instructions", "branches", "branch_misses", "l1d_reads", "l1d_read_misses",
+    "llc_reads", "llc_read_misses", "task_clock_ns", "context_switches", "page_faults"
+};
+
+const uint32_t MAX_RAW_PERF_COUNTERS = 4; // Model-specific events, e.g. vector instructions retired
+
+struct PerfCounters
+{
+    int fds[N_PERF_COUNTERS+MAX_RAW_PERF_COUNTERS]; // -1 -> unavailable
+    uint64_t raw_configs[MAX_RAW_PERF_COUNTERS];
+    uint32_t n_raw;
+    uint64_t values[N_PERF_COUNTERS+MAX_RAW_PERF_COUNTERS]; // See read_values()
+    int error; // errno of the first counter that couldn't be opened (0 if none)
+
+    PerfCounters()
+    {
+        for(uint32_t c = 0; c < N_PERF_COUNTERS+MAX_RAW_PERF_COUNTERS; c++)
+        {
+            fds[c] = -1;
+            values[c] = 0;
+        }
+        n_raw = 0;
+        error = 0;
+    }
+    ~PerfCounters()
+    {
+        close();
+    }
+    bool add_raw(uint64_t config)
+    {
+        // Raw event of the CPU (PERF_TYPE_RAW), added before open()
+        if(n_raw >= MAX_RAW_PERF_COUNTERS)
+            return false;
+        raw_configs[n_raw++] = config;
+        return true;
+    }
+    bool open(bool inherit = false)
+    {
+        // Returns true if at least one counter is available
+        close();
+        bool any = false;
+        for(uint32_t c = 0; c < N_PERF_COUNTERS+n_raw; c++)
+        {
+            fds[c] = open_counter(c, inherit);
+            if(fds[c] < 0 && error == 0)
+                error = errno;
+            any = any || fds[c] >= 0;
+        }
+        return any;
+    }
+    void close()
+    {
+        for(uint32_t c = 0; c < N_PERF_COUNTERS+MAX_RAW_PERF_COUNTERS; c++)
+        {
+#ifdef __linux__
+            if(fds[c] >= 0)
+                ::close(fds[c]);
+#endif
+            fds[c] = -1;
+        }
+    }
+    bool available(uint32_t counter) const
+    {
+        return fds[counter] >= 0;
+    }
+    uint32_t n_counters() const
+    {
+        return N_PERF_COUNTERS+n_raw;
+    }
+    void start()
+    {
+#ifdef __linux__
+        for(uint32_t c = 0; c < n_counters(); c++)
+        {
+            if(fds[c] < 0)
+                continue;
+            ioctl(fds[c], PERF_EVENT_IOC_RESET, 0);
+            ioctl(fds[c], PERF_EVENT_IOC_ENABLE, 0);
+        }
+#endif
+    }
+    void stop()
+    {
+#ifdef __linux__
+        for(uint32_t c = 0; c < n_counters(); c++)
+        {
+            if(fds[c] >= 0)
+                ioctl(fds[c], PERF_EVENT_IOC_DISABLE, 0);
+        }
+#endif
+    }
+    void read_values()
+    {
+        // Counts between start() and stop()
+        for(uint32_t c = 0; c < n_counters(); c++)
+        {
+            values[c] = 0;
+#ifdef __linux__
+            if(fds[c] < 0)
+                continue;
+            // When there are more events than hardware counters, the kernel multiplexes them:
+            // the count is extrapolated to the whole time the counter was enabled
+            uint64_t data[3]; // Value, time enabled, time running
+            if(read(fds[c], data, sizeof(data)) != (ssize_t)sizeof(data) || data[2] == 0)
+                continue;
+            values[c] = data[2] < data[1] ? (uint64_t)((double)data[0]*data[1]/data[2]) : data[0];
+#endif
+        }
+    }
+
+private:
+    int open_counter(uint32_t counter, bool inherit)
+    {
+#ifdef __linux__
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.disabled = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        attr.inherit = inherit ? 1 : 0;
+        attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+        const uint64_t l1d_read = PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8);
+        const uint64_t llc_read = PERF_COUNT_HW_CACHE_LL | (PERF_COUNT_HW_CACHE_OP_READ << 8);
+        attr.type = PERF_TYPE_HARDWARE;
+        switch(counter)
+        {
+        case PERF_CYCLES: attr.config = PERF_COUNT_HW_CPU_CYCLES; break;
+        case PERF_INSTRUCTIONS: attr.config = PERF_COUNT_HW_INSTRUCTIONS; break;
+        case PERF_BRANCHES: attr.config = PERF_COUNT_HW_BRANCH_INSTRUCTIONS; break;
+        case PERF_BRANCH_MISSES: attr.config = PERF_COUNT_HW_BRANCH_MISSES; break;
+        case PERF_L1D_READS:
+            attr.type = PERF_TYPE_HW_CACHE;
+            attr.config = l1d_read | (PERF_COUNT_HW_CACHE_RESULT_ACCESS << 16);
+            break;
+        case PERF_L1D_READ_MISSES:
+            attr.type = PERF_TYPE_HW_CACHE;
+            attr.config = l1d_read | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+            break;
+        case PERF_LLC_READS:
+            attr.type = PERF_TYPE_HW_CACHE;
+            attr.config = llc_read | (PERF_COUNT_HW_CACHE_RESULT_ACCESS << 16);
+            break;
+        case PERF_LLC_READ_MISSES:
+            attr.type = PERF_TYPE_HW_CACHE;
+            attr.config = llc_read | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+            break;
+        case PERF_TASK_CLOCK:
+            attr.type = PERF_TYPE_SOFTWARE;
+            attr.config = PERF_COUNT_SW_TASK_CLOCK;
+            break;
+        case PERF_CONTEXT_SWITCHES:
+            attr.type = PERF_TYPE_SOFTWARE;
+            attr.config = PERF_COUNT_SW_CONTEXT_SWITCHES;
+            break;
+        case PERF_PAGE_FAULTS:
+            attr.type = PERF_TYPE_SOFTWARE;
+            attr.config = PERF_COUNT_SW_PAGE_FAULTS;
+            break;
+        default:
+            attr.type = PERF_TYPE_RAW;
+            attr.config = raw_configs[counter-N_PERF_COUNTERS];
+            break;
+        }
+        return (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0); // This thread, any CPU
+#else
+        (void)counter;
+        (void)inherit;
+        errno = ENOSYS;
+        return -1;
+#endif
+    }
+};
+
+#endif // PERF_COUNTERS_H
@@ -21,10 +21,20 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 #define PIANO_H
 
 #include "string_hammer.h"
+#include "sympathetic.h"
+#include "piano_arena.h"
+#include "render_fifo.h"
+#include "piano_description.h"
+#include "compiled_model.h"
+#include "piano_stats.h"
+#include "piano_trace.h"
+#include "piano_calibration.h"
+#include "rt_check.h"
 #include <thread>
 #include <vector>
 #include <atomic>
 #include <mutex>
+#include <condition_variable>
 #include <iostream>
 
 /* ***************************************************** *
@@ -46,20 +56,367 @@ enum NoteIndices
 };
 
 const int FIRST_NOTE = A0;
-const int LAST_NOTE = C5;
-const int N_STRINGS = LAST_NOTE-FIRST_NOTE+1;
-const int MIDI_NOTE_OFFSET = 21;
+const int LAST_NOTE = C5; // Last note of the default piano (see DEFAULT_N_STRINGS)
+static_assert(LAST_NOTE-FIRST_NOTE+1 == DEFAULT_N_STRINGS, "LAST_NOTE must match the default piano description");
 const int N_WHITE_KEYS = 31; // 52 for the entire piano range
 
+// Hammer velocities [m/s] of the attack cache buckets.
+// They cover the range used by the plugin (MIDI velocity/30).
+const double DEFAULT_ATTACK_VELOCITIES[] = {0.25, 0.5, 1.0, 2.0, 3.0, 4.25};
+const uint32_t N_DEFAULT_ATTACK_VELOCITIES = sizeof(DEFAULT_ATTACK_VELOCITIES)/sizeof(double);
+
+// Duration of the fade-out of the notes that can't be carried over to a new model [s]
+const double FADE_TIME = 0.02;
+
+// Runtime rebalancing of the strings between the threads (see Piano::rebalance())
+const double REBALANCE_SMOOTHING = 0.25; // Weight of the last quantum in the measured cost of a string
+const double REBALANCE_THRESHOLD = 0.2; // Slowest thread above the average by this fraction: imbalance
+const uint32_t REBALANCE_PATIENCE = 4; // Consecutive imbalanced quanta before the strings move
+const uint32_t REBALANCE_COOLDOWN = 16; // Quanta between two moves, at least
+const double REBALANCE_MIN_GAIN = 0.1; // The slowest thread must get this much faster, or nothing moves
+
+/* ********************************************************************* *
+ * Voicing of the piano: physical parameters that a preset can change    *
+ * on top of the hand-tuned values of each note.                         *
+ * ********************************************************************* */
+
+struct PianoVoicing
+{
+    double hammer_hardness; // Multiplies the stiffness K of the hammer felt
+    double damping; // Multiplies the loss parameters b1 and b2 of the strings
+
+    PianoVoicing(double hammer_hardness = 1.0, double damping = 1.0)
+    {
+        this->hammer_hardness = hammer_hardness;
+        this->damping = damping;
+    }
+    bool operator==(const PianoVoicing& other) const
+    {
+        return hammer_hardness == other.hammer_hardness && damping == other.damping;
+    }
+};
+
+/* ********************************************************************* *
+ * Note events at a given sample of the next render quantum (see        *
+ * Piano::schedule_note_event()). The threads split the computation of  *
+ * each string at its events, so the events are sample-accurate even    *
+ * with long quanta.                                                    *
+ * ********************************************************************* */
+
+enum NoteEventType
+{
+    NOTE_EVENT_HIT, // "value" is the hammer velocity [m/s]
+    NOTE_EVENT_DAMPER // "value" is the damper engagement (see PianoStringT::set_damper())
+};
+
+struct NoteEvent
+{
+    uint32_t offset; // Sample of the quantum at which the event happens
+    uint32_t note; // Index of the string
+    NoteEventType type;
+    double value;
+};
+
+const uint32_t MAX_NOTE_EVENTS = 1024; // Per render quantum
+
+/* ********************************************************************* *
+ * The piano model: hammers, strings, audio buffers and coupling stage   *
+ * for one sample rate and block size, all inside one arena. The piano   *
+ * owns two models: while one is played, the other one can be rebuilt   *
+ * with a new configuration (see Piano::reconfigure()).                  *
+ * ********************************************************************* */
+
+struct PianoModel
+{
+    Hammer* hammers[MAX_STRINGS];
+    PianoString* strings[MAX_STRINGS];
+    uint32_t n_strings; // Strings of the description that can be played at this sample rate
+    float** buffers; // One audio buffer for each thread, with length "samples_per_block"
+    SympatheticCoupling* coupling; // Bridge coupling between the strings (nullptr if disabled)
+    float* quantum_buffer; // Mix of the last render quantum, with length "samples_per_block"
+    RenderFifo output_fifo; // Samples of the last quantum not yet consumed by the host
+
+    int sample_rate;
+    uint32_t samples_per_block; // Render quantum [samples]
+    uint32_t n_buffers;
+    PianoVoicing voicing;
+    PianoDescription description; // Parameters of the strings and of the hammers
+    uint32_t* note_ranges; // Strings computed by each thread: [first, end) of thread 0, then thread 1...
+    double string_overhead; // Fixed cost of a string in the partition, in spatial samples (see partition_strings())
+    double* string_cost; // Smoothed measured cost of each string per quantum [ticks] (see Piano::rebalance())
+
+    PianoArena* arena; // Memory of the hammers, the strings and the audio buffers
+    bool owns_arena; // false -> the arena was given by the caller, and it outlives the model
+    bool model_in_arena; // false while the model is being measured (the objects are on the heap)
+    bool restored; // The strings were loaded from a snapshot: nothing is carried over (see Piano::restore_state())
+
+    PianoModel(PianoArena* arena = nullptr)
+    {
+        for(int i = 0; i < MAX_STRINGS; i++)
+        {
+            hammers[i] = nullptr;
+            strings[i] = nullptr;
+        }
+        n_strings = 0;
+        note_ranges = nullptr;
+        string_overhead = 0.0;
+        string_cost = nullptr;
+        buffers = nullptr;
+        coupling = nullptr;
+        quantum_buffer = nullptr;
+        sample_rate = 0;
+        samples_per_block = 0;
+        n_buffers = 0;
+        owns_arena = (arena == nullptr);
+        this->arena = owns_arena ? new PianoArena() : arena;
+        model_in_arena = false;
+        restored = false;
+    }
+    ~PianoModel()
+    {
+        destroy();
+        if(owns_arena)
+        {
+            delete arena;
+        }
+    }
+    void build(int sample_rate, uint32_t samples_per_block, uint32_t n_buffers,
+               const PianoVoicing& voicing = PianoVoicing(),
+               const PianoDescription& description = PianoDescription(), double string_overhead = 0.0)
+    {
+        // Whatever was built before is destroyed, but its memory is reused
+        destroy();
+        this->sample_rate = sample_rate;
+        this->samples_per_block = samples_per_block;
+        this->n_buffers = n_buffers;
+        this->string_overhead = string_overhead;
+        this->voicing = voicing;
+        this->description = description;
+        this->n_strings = description.n_strings;
+        this->restored = false;
+
+        // First pass: the model is created on the heap only to measure how much memory its arrays need.
+        // Second pass: the model is created again inside the arena, whose region is now large enough.
+        arena->begin_measure();
+        model_in_arena = false;
+        init_hammers();
+        init_strings();
+        limit_to_playable_strings();
+        init_note_ranges();
+        init_buffers();
+        uint32_t n_playable = n_strings;
+        destroy();
+        this->n_strings = n_playable;
+
+        arena->begin_build();
+        model_in_arena = true;
+        init_hammers();
+        init_strings();
+        init_note_ranges();
+        init_buffers();
+    }
+    void destroy()
+    {
+        disable_coupling();
+        for(int i = 0; i < MAX_STRINGS; i++)
+        {
+            if(strings[i] == nullptr)
+                continue;
+            if(model_in_arena)
+            {
+                strings[i]->~PianoString();
+                hammers[i]->~Hammer();
+            }
+            else
+            {
+                delete strings[i];
+                delete hammers[i];
+            }
+            strings[i] = nullptr;
+            hammers[i] = nullptr;
+        }
+        n_strings = 0;
+        note_ranges = nullptr;
+        string_cost = nullptr;
+        buffers = nullptr;
+        quantum_buffer = nullptr;
+        output_fifo.init(nullptr, 0);
+    }
+    void enable_coupling(uint32_t coupling_period, double coupling_gain, double wake_threshold)
+    {
+        disable_coupling();
+        coupling = new SympatheticCoupling(strings, n_strings, samples_per_block,
+                                           coupling_period, coupling_gain, wake_threshold);
+    }
+    void disable_coupling()
+    {
+        if(coupling != nullptr)
+        {
+            coupling->detach(strings);
+            delete coupling;
+            coupling = nullptr;
+        }
+    }
+    template <typename T, typename... Args>
+    T* create(Args... args)
+    {
+        // Placement inside the arena, or on the heap while measuring
+        void* memory = arena->allocate(sizeof(T));
+        if(memory == nullptr)
+            return new T(args...);
+        return new (memory) T(args...);
+    }
+    Hammer* create_hammer(double Mh, double p, double bH, double K, double a, double g_meters)
+    {
+        return create<Hammer>(sample_rate, Mh, p, bH, K*voicing.hammer_hardness, a, g_meters);
+    }
+    PianoString* create_string(double f0, double L, double rho, double S, double E,
+                               double b1, double b2, Hammer* hammer)
+    {
+        return create<PianoString>(sample_rate, f0, L, rho, S, E,
+                                   b1*voicing.damping, b2*voicing.damping, hammer, arena);
+    }
+    void init_buffers()
+    {
+        // Allocate the buffers. Each one starts on its own cache line,
+        // so the threads never write to the same line.
+        // The arena is zeroed, which prevents from drilling people's ears
+        // when they change the buffer size in the plugin!
+        buffers = arena->allocate_array<float*>(n_buffers);
+        for(uint32_t idx_thread = 0; idx_thread < n_buffers; idx_thread++)
+        {
+            float* buffer = arena->allocate_array<float>(this->samples_per_block);
+            if(buffers != nullptr)
+                buffers[idx_thread] = buffer;
+        }
+
+        // The quantum is mixed here and queued for the host
+        quantum_buffer = arena->allocate_array<float>(this->samples_per_block);
+        uint32_t fifo_capacity = RenderFifo::capacity_for(this->samples_per_block);
+        float* fifo_data = arena->allocate_array<float>(fifo_capacity);
+        if(fifo_data != nullptr)
+            output_fifo.init(fifo_data, fifo_capacity);
+    }
+    void init_hammers()
+    {
+        for(uint32_t i = 0; i < n_strings; i++)
+        {
+            const NoteParams& n = description.notes[i];
+            hammers[i] = create_hammer(n.Mh, n.p, n.bH, n.K, n.a, n.g_meters);
+        }
+    }
+    void init_strings()
+    {
+        for(uint32_t i = 0; i < n_strings; i++)
+        {
+            const NoteParams& n = description.notes[i];
+            strings[i] = create_string(n.f0, n.L, n.rho, n.S, n.E, n.b1, n.b2, hammers[i]);
+        }
+    }
+    uint64_t compiled_hash(const double* velocities, uint32_t n_buckets) const
+    {
+        // Everything a compiled model of these strings is derived from (see "compiled_model.h")
+        uint64_t hash = fnv1a(FNV1A_SEED, &COMPILED_MODEL_VERSION, sizeof(COMPILED_MODEL_VERSION));
+        hash = fnv1a(hash, STRING_MODEL_NAME, strlen(STRING_MODEL_NAME));
+        hash = fnv1a(hash, &sample_rate, sizeof(sample_rate));
+        hash = fnv1a(hash, &description.n_strings, sizeof(description.n_strings));
+        hash = fnv1a(hash, description.notes, description.n_strings*sizeof(NoteParams));
+        hash = fnv1a(hash, &voicing.hammer_hardness, sizeof(double));
+        hash = fnv1a(hash, &voicing.damping, sizeof(double));
+        return fnv1a(hash, velocities, n_buckets*sizeof(double));
+    }
+    void limit_to_playable_strings()
+    {
+        // The piano stops at the first string that can't be simulated at this sample rate
+        // (see PianoStringT::is_playable()), so the notes are still contiguous from A0.
+        // The other strings are created only while measuring, and destroy() deletes them.
+        for(uint32_t i = 0; i < n_strings; i++)
+        {
+            if(!strings[i]->is_playable())
+            {
+                n_strings = i;
+                break;
+            }
+        }
+    }
+    void init_note_ranges()
+    {
+        // The ranges start from the predicted cost of the strings: once the piano plays,
+        // they follow the measured one (see Piano::rebalance())
+        note_ranges = arena->allocate_array<uint32_t>(n_buffers*2);
+        string_cost = arena->allocate_array<double>(n_strings);
+        if(note_ranges == nullptr)
+            return;
+        double costs[MAX_STRINGS];
+        predict_costs(strings, n_strings, string_overhead, costs);
+        partition_strings(costs, n_strings, n_buffers, note_ranges);
+    }
+    static void predict_costs(PianoString* const* strings, uint32_t n_strings, double string_overhead, double* costs)
+    {
+        // The cost of a string is proportional to its spatial samples, plus a fixed cost
+        // measured by the calibration (see "piano_calibration.h")
+        for(uint32_t i = 0; i < n_strings; i++)
+            costs[i] = strings[i]->len_x_axis + string_overhead;
+    }
+    static void partition_strings(const double* costs, uint32_t n_strings, uint32_t n_ranges, uint32_t* ranges)
+    {
+        // Each thread gets a contiguous range of strings with about the same cost,
+        // rather than the same number of strings. The costs can be in any unit.
+        // Ranges are [first, end): a thread can get no strings at all.
+        double total_cost = 0.0;
+        for(uint32_t i = 0; i < n_strings; i++)
+            total_cost += costs[i];
+
+        double cost = 0.0;
+        uint32_t note = 0;
+        for(uint32_t idx_thread = 0; idx_thread < n_ranges; idx_thread++)
+        {
+            ranges[idx_thread*2] = note;
+            double target = total_cost*(idx_thread+1)/n_ranges;
+            while(note < n_strings && (cost + costs[note]/2 < target || idx_thread == n_ranges-1))
+            {
+                cost += costs[note];
+                note++;
+            }
+            ranges[idx_thread*2+1] = note;
+        }
+    }
+};
+
+// Snapshot requested by Piano::capture_state() from the audio thread
+enum SnapshotStatus
+{
+    SNAPSHOT_IDLE,
+    SNAPSHOT_REQUESTED, // The audio thread takes it at the next quantum
+    SNAPSHOT_TAKING,
+    SNAPSHOT_DONE,
+    SNAPSHOT_TOO_SMALL // The buffer can't hold the state, see Piano::snapshot_size
+};
+
+struct RetiredAttackCache
+{
+    AttackCache* cache; // Replaced by another cache (see Piano::retire_attack_cache())
+    uint64_t free_after; // Value of Piano::quanta_rendered from which no string can play it back
+};
+
+struct RetiredTrace
+{
+    PianoTrace* trace; // Replaced by another trace (see Piano::start_trace())
+    uint64_t free_after; // Value of Piano::quanta_rendered from which no thread records to it
+};
+
 struct Piano
 {
-    Hammer* hammers[N_STRINGS];
-    PianoString* strings[N_STRINGS];
+    // Hammers and strings of the model being played
+    Hammer** hammers;
+    PianoString** strings;
+    uint32_t n_strings; // Starting from A0 (see PianoModel::n_strings)
 
     int sample_rate;
-    uint32_t samples_per_block;
+    uint32_t samples_per_block; // Render quantum: the threads always compute blocks of this length
 
     uint32_t N_THREADS; // How many threads should we start
+    PianoCalibration calibration; // Given to the constructor (see calibrate()), not valid if none
     std::thread** threads; // Array that stores the pointers to the active threads
     float** buffers; // Array of audio buffers, one for each thread, with length "samples_per_block"
     std::atomic<bool>* thr_running; // Array that contains one flag for each thread.
@@ -68,39 +425,163 @@ struct Piano
     std::atomic<bool>* thr_waiting_for_block; // Array that contains one flag for each thread.
                                               // Used to keep threads running in an empty "while" loop
                                               // until next audio block is requested
+    std::atomic<int> n_alive_threads; // How many threads haven't left their loop yet
     std::atomic<int> n_running_threads; // How many threads are computing an audio block right now.
                                         // n_running_threads == 0 -> all threads are doing nothing
                                         // n_running_threads == N_THREADS -> all threads are working
     std::atomic<uint32_t> sleep_duration; // How often threads should wake up to check if the
                                           // next audio block has been requested
-    uint32_t* thr_note_range; // For each thread store the note range to compute (first and last note)
+    uint32_t* thr_note_range; // For each thread store the note range to compute (see PianoModel::note_ranges)
+    double* string_cost; // Measured cost of each string, written by the worker that owns it (see rebalance())
+    std::atomic<bool> rebalancing; // false -> the note ranges stay the predicted ones
+    uint32_t n_imbalanced_blocks; // Consecutive quanta above REBALANCE_THRESHOLD
+    uint32_t blocks_since_rebalance;
+
+    SympatheticCoupling* coupling; // Bridge coupling between the strings (nullptr if disabled)
+    float* quantum_buffer; // Mix of the last render quantum (see process())
+    RenderFifo* output_fifo; // Samples of the last quantum not yet consumed by the host
+    uint32_t samples_since_block; // Used by get_next_sample() to run the per-block stages once per block
+    NoteEvent* note_events; // Events of the next quantum, sorted by offset (see schedule_note_event())
+    uint32_t n_note_events;
+    uint32_t next_note_event; // First event not yet applied by get_next_sample()
+    PianoLoad load; // Timing of the render quanta and of the workers (see stats())
+    PianoTrace* trace; // Trace of the quantum being computed (nullptr if not tracing), see start_trace()
+    std::atomic<PianoTrace*> requested_trace; // Picked up by the audio thread at the next quantum
+    PianoTrace* last_trace; // Last trace started, written by save_trace() (nullptr if none)
+    std::vector<RetiredTrace> retired_traces; // Replaced traces, which might still be recorded to
+    std::mutex trace_mutex;
 
-    Piano(int sample_rate, uint32_t samples_per_block, uint32_t n_threads)
+    std::thread* attack_cache_builder; // Background thread that fills the attack caches (nullptr if none)
+    std::atomic<bool> attack_cache_abort; // Tells the background thread to give up
+    std::vector<RetiredAttackCache> retired_attack_caches; // Replaced caches, which might still be played back
+    std::atomic<uint64_t> quanta_rendered; // Quanta computed by the audio thread (see reclaim_attack_caches())
+
+    // Snapshot taken by the audio thread for capture_state()
+    std::atomic<int> snapshot_status; // See SnapshotStatus
+    uint8_t* snapshot_data; // Buffer of the caller, with "snapshot_capacity" bytes
+    size_t snapshot_capacity;
+    size_t snapshot_size; // Size of the state, written by the audio thread
+    std::mutex snapshot_mutex; // One capture_state() at a time
+
+    std::vector<double> attack_cache_velocities; // Buckets of the attack caches (empty if there are none)
+    std::vector<CompiledModel*> compiled_models; // Mapped by load_compiled_model(), they outlive the caches
+
+    // Models (see PianoModel). The model being played can only be changed by the audio thread,
+    // between two blocks: reconfigure() rebuilds the spare model and leaves it in "pending_model",
+    // the audio thread swaps it in and gives the old one back as "spare_model".
+    // If some notes of the old model can't be carried over, the old model first fades out
+    // as "fading_model", and it's given back only at the end of the fade.
+    PianoModel* models[2];
+    std::atomic<PianoModel*> active_model;
+    std::atomic<PianoModel*> pending_model;
+    std::atomic<PianoModel*> spare_model;
+    std::atomic<PianoModel*> fading_model;
+    uint32_t fade_pos; // Samples of the fade already computed
+    uint32_t fade_length; // [samples]
+    std::mutex reconfigure_mutex; // Only one reconfiguration at a time
+    int configured_sample_rate; // Configuration requested by the last reconfigure()
+    uint32_t configured_block;
+    PianoVoicing configured_voicing;
+    PianoDescription configured_description;
+
+    // Background thread that builds the models requested by set_voicing_async()
+    std::thread* model_builder; // nullptr until the first request
+    std::mutex builder_mutex;
+    std::condition_variable builder_cv;
+    bool voicing_requested;
+    bool builder_stop;
+    PianoVoicing requested_voicing;
+
+    // Sympathetic resonance settings, applied to every model that gets built
+    bool coupling_enabled;
+    uint32_t coupling_period;
+    double coupling_gain;
+    double wake_threshold;
+
+    Piano(int sample_rate, uint32_t samples_per_block, uint32_t n_threads, PianoArena* arena = nullptr,
+          const PianoDescription& description = PianoDescription(),
+          const PianoCalibration& calibration = PianoCalibration())
     {
+        // The calibration only weighs the strings of the partition: the threads and the quantum
+        // are the ones given, which the caller usually takes from the calibration too
+        this->calibration = calibration;
         this->sample_rate = sample_rate;
         this->samples_per_block = samples_per_block;
-        if (n_threads > 8) // More than 8 threads doesn't make much sense right now
-            this->N_THREADS = 8;
+        if (n_threads > MAX_THREADS) // More threads than strings would have nothing to compute
+            this->N_THREADS = MAX_THREADS;
         else if (n_threads < 1) // Could happen if "std::thread::hardware_concurrency" returns 0
             this->N_THREADS = 1;
         else
             this->N_THREADS = n_threads;
         this->n_running_threads = 0;
-
-        // Initialize the audio buffers
-        init_buffers();
+        this->n_alive_threads = this->N_THREADS;
+        this->rebalancing = true;
+        this->n_imbalanced_blocks = 0;
+        this->blocks_since_rebalance = 0;
+        this->coupling = nullptr;
+        this->samples_since_block = 0;
+        this->attack_cache_builder = nullptr;
+        this->attack_cache_abort = false;
+        this->quanta_rendered = 0;
+        this->snapshot_status = SNAPSHOT_IDLE;
+        this->snapshot_data = nullptr;
+        this->snapshot_capacity = 0;
+        this->snapshot_size = 0;
+        this->coupling_enabled = false;
+        this->pending_model = nullptr;
+        this->fading_model = nullptr;
+        this->fade_pos = 0;
+        this->fade_length = 0;
+        this->model_builder = nullptr;
+        this->voicing_requested = false;
+        this->builder_stop = false;
+        this->note_events = (NoteEvent*)malloc(sizeof(NoteEvent)*MAX_NOTE_EVENTS);
+        this->n_note_events = 0;
+        this->next_note_event = 0;
+        this->load.init(N_THREADS);
+        this->trace = nullptr;
+        this->requested_trace = nullptr;
+        this->last_trace = nullptr;
 
         // Initialize the threads
         init_threads();
 
-        // Initialize the hammers with their physical parameters
-        init_hammers();
-
-        // Initialize the strings with its physical parameters
-        init_strings();
+        // Initialize the hammers, the strings and the audio buffers inside the arena.
+        // The second model is built only if the piano gets reconfigured.
+        models[0] = new PianoModel(arena);
+        models[1] = new PianoModel();
+        models[0]->build(sample_rate, this->samples_per_block, N_THREADS, PianoVoicing(), description,
+                         calibration.string_overhead);
+        install_model(models[0]);
+        spare_model = models[1];
+        configured_sample_rate = sample_rate;
+        configured_block = this->samples_per_block;
+        configured_description = description;
     }
     ~Piano()
     {
+        // Stop building the models and the attack caches
+        if(model_builder != nullptr)
+        {
+            {
+                std::lock_guard<std::mutex> lock(builder_mutex);
+                builder_stop = true;
+            }
+            builder_cv.notify_one();
+            model_builder->join();
+            delete model_builder;
+        }
+        wait_for_attack_cache(true);
+        for(RetiredAttackCache& retired : retired_attack_caches)
+        {
+            delete retired.cache;
+        }
+        delete last_trace;
+        for(RetiredTrace& retired : retired_traces)
+        {
+            delete retired.trace;
+        }
+
         // Delete the threads
         for(uint32_t i = 0; i < N_THREADS; i++)
         {
@@ -122,34 +603,446 @@ struct Piano
             delete threads[i];
         }
         free(threads);
-        free(thr_note_range);
+
+        // A thread that wasn't scheduled in the meantime hasn't seen its flag yet:
+        // the flags can be freed only once every thread has left its loop
+        while(n_alive_threads > 0)
+        {
+            std::this_thread::sleep_for(std::chrono::microseconds(sleep_duration));
+        }
 
         // Delete the flag arrays
         free(thr_waiting_for_block);
         free(thr_running);
+        free(note_events);
+
+        // Delete the hammers, the strings, the audio buffers and the coupling stages
+        delete models[0];
+        delete models[1];
 
-        // Delete the hammers and strings
-        for(int i = 0; i < N_STRINGS; i++)
+        // The attack caches are gone, the compiled models can be unmapped
+        for(CompiledModel* compiled : compiled_models)
         {
-            delete hammers[i];
-            delete strings[i];
+            delete compiled;
         }
+    }
 
-        // Free the audio buffers
-        for(uint32_t i = 0; i < N_THREADS; i++)
+    /* ******************************************************************* *
+     * Reconfiguration.                                                    *
+     * reconfigure(), set_voicing() and set_description() can be called   *
+     * from any thread except the audio one. They rebuild the model that  *
+     * isn't being played, reusing its memory, and the audio thread swaps *
+     * it in at the beginning of the next block. The threads are never    *
+     * restarted. When the sample rate and the quantum don't change, the  *
+     * strings that are ringing carry on in the new model; the others     *
+     * fade out with the old model.                                       *
+     * ******************************************************************* */
+
+    void reconfigure(int sample_rate, uint32_t render_quantum)
+    {
+        std::lock_guard<std::mutex> lock(reconfigure_mutex);
+        rebuild(sample_rate, render_quantum, configured_voicing, configured_description);
+    }
+    void set_voicing(const PianoVoicing& voicing)
+    {
+        std::lock_guard<std::mutex> lock(reconfigure_mutex);
+        rebuild(configured_sample_rate, configured_block, voicing, configured_description);
+    }
+    void set_description(const PianoDescription& description)
+    {
+        // Plays another instrument: the parameters of the notes, and how many there are, can change
+        std::lock_guard<std::mutex> lock(reconfigure_mutex);
+        rebuild(configured_sample_rate, configured_block, configured_voicing, description);
+    }
+    bool load_description(const char* path)
+    {
+        // See PianoDescription::load_csv() for the format.
+        // Returns false (and keeps the current instrument) if the file can't be loaded.
+        PianoDescription* description = new PianoDescription();
+        bool loaded = description->load_csv(path);
+        if(loaded)
+            set_description(*description);
+        delete description;
+        return loaded;
+    }
+    void set_voicing_async(const PianoVoicing& voicing)
+    {
+        // Returns immediately, the model is built by a background thread.
+        // If several requests arrive while a model is being built, only the last one is built next.
+        std::lock_guard<std::mutex> lock(builder_mutex);
+        requested_voicing = voicing;
+        voicing_requested = true;
+        if(model_builder == nullptr)
+            model_builder = new std::thread([this]() { builder_loop(); });
+        builder_cv.notify_one();
+    }
+    void builder_loop()
+    {
+        std::unique_lock<std::mutex> lock(builder_mutex);
+        while(true)
+        {
+            builder_cv.wait(lock, [this]() { return voicing_requested || builder_stop; });
+            if(builder_stop)
+                return;
+            PianoVoicing voicing = requested_voicing;
+            voicing_requested = false;
+            lock.unlock();
+            set_voicing(voicing);
+            lock.lock();
+        }
+    }
+    void rebuild(int sample_rate, uint32_t render_quantum, const PianoVoicing& voicing,
+                 const PianoDescription& description)
+    {
+        // Must be called with "reconfigure_mutex" locked
+        if(sample_rate == configured_sample_rate && render_quantum == configured_block &&
+           voicing == configured_voicing && description == configured_description)
+            return; // Nothing to do
+        configured_sample_rate = sample_rate;
+        configured_block = render_quantum;
+        configured_voicing = voicing;
+        configured_description = description;
+
+        PianoModel* model = take_spare_model();
+
+        // The attack caches are being built for the old model
+        wait_for_attack_cache(true);
+
+        model->build(sample_rate, render_quantum, N_THREADS, voicing, description, calibration.string_overhead);
+        if(coupling_enabled)
+        {
+            model->enable_coupling(coupling_period, coupling_gain, wake_threshold);
+        }
+        pending_model.store(model, std::memory_order_release);
+
+        if(!attack_cache_velocities.empty())
+        {
+            build_attack_cache_for(model, attack_cache_velocities.data(), attack_cache_velocities.size(), true);
+        }
+    }
+    PianoModel* take_spare_model()
+    {
+        // Must be called with "reconfigure_mutex" locked.
+        // Take back the model that the audio thread hasn't swapped in yet, if any.
+        // Otherwise, rebuild the spare model. If neither is there, the audio thread
+        // is swapping the models right now, and it will give the spare one back shortly,
+        // or the old model is fading out: taking it cuts the fade short.
+        PianoModel* model = pending_model.exchange(nullptr, std::memory_order_acq_rel);
+        while(model == nullptr)
+        {
+            model = spare_model.exchange(nullptr, std::memory_order_acq_rel);
+            if(model == nullptr)
+                model = fading_model.exchange(nullptr, std::memory_order_acq_rel);
+            if(model == nullptr)
+                std::this_thread::yield();
+        }
+        return model;
+    }
+    bool apply_pending_model(bool allow_fade = true)
+    {
+        // Called by the audio thread between two blocks.
+        // If the sample rate and the render quantum don't change, the strings that are ringing
+        // carry on in the new model, together with the samples waiting in the output FIFO.
+        // The strings that can't be carried over fade out with the old model (if "allow_fade"),
+        // otherwise they're cut. A model restored from a snapshot carries nothing over.
+        PianoModel* model = pending_model.exchange(nullptr, std::memory_order_acq_rel);
+        if(model == nullptr)
+            return false;
+        PianoModel* old = active_model.load(std::memory_order_relaxed);
+
+        bool fade = false;
+        if(old->sample_rate == model->sample_rate && old->samples_per_block == model->samples_per_block)
+        {
+            for(uint32_t i = 0; i < old->n_strings; i++)
+            {
+                if(!old->strings[i]->is_active)
+                    continue;
+                if(i < model->n_strings && !model->restored && model->strings[i]->carry_over_from(*old->strings[i]))
+                    old->strings[i]->is_active = false; // Now it rings in the new model only
+                else
+                    fade = true;
+            }
+
+            // At most one quantum is waiting, so it fits in the quantum buffer of the new model
+            uint32_t n_waiting = old->output_fifo.pop(model->quantum_buffer, model->samples_per_block, 1.0f);
+            model->output_fifo.push(model->quantum_buffer, n_waiting);
+        }
+
+        install_model(model);
+        if(fade && allow_fade)
+        {
+            fade_pos = 0;
+            fade_length = (uint32_t)(FADE_TIME*old->sample_rate);
+            fading_model.store(old, std::memory_order_release);
+        }
+        else
+        {
+            spare_model.store(old, std::memory_order_release);
+        }
+        return true;
+    }
+    void install_model(PianoModel* model)
+    {
+        select_model(model);
+        samples_since_block = 0;
+        active_model.store(model, std::memory_order_release);
+    }
+    void select_model(PianoModel* model)
+    {
+        // The threads compute the strings of the selected model
+        hammers = model->hammers;
+        strings = model->strings;
+        n_strings = model->n_strings;
+        thr_note_range = model->note_ranges;
+        string_cost = model->string_cost;
+        buffers = model->buffers;
+        coupling = model->coupling;
+        quantum_buffer = model->quantum_buffer;
+        output_fifo = &model->output_fifo;
+        sample_rate = model->sample_rate;
+        samples_per_block = model->samples_per_block;
+    }
+    bool schedule_note_event(uint32_t offset, uint32_t note, NoteEventType type, double value)
+    {
+        // Called by the audio thread between two quanta: the event happens "offset" samples
+        // into the next quantum that is computed (by render_quantum() or get_next_sample()).
+        // Returns false if the offset is outside of the quantum, or if there are too many events.
+        if(offset >= samples_per_block || n_note_events >= MAX_NOTE_EVENTS)
+            return false;
+
+        // Keep the events sorted by offset. The events at the same offset stay in order.
+        uint32_t pos = n_note_events;
+        while(pos > 0 && note_events[pos-1].offset > offset)
+        {
+            note_events[pos] = note_events[pos-1];
+            pos--;
+        }
+        note_events[pos].offset = offset;
+        note_events[pos].note = note;
+        note_events[pos].type = type;
+        note_events[pos].value = value;
+        n_note_events++;
+        return true;
+    }
+    void apply_note_event(const NoteEvent& event)
+    {
+        if(event.note >= n_strings)
+            return;
+        PianoString* string = strings[event.note];
+        if(event.type == NOTE_EVENT_HIT)
+        {
+            string->hit(event.value);
+        }
+        else
+        {
+            // The damper starts moving now, rather than at the beginning of the next quantum
+            string->set_damper(event.value);
+            if(event.offset < samples_per_block)
+                string->update_damper(samples_per_block-event.offset);
+        }
+    }
+    void process(float* buffer, uint32_t length, float gain)
+    {
+        // Computes "length" samples, whatever the render quantum.
+        // The threads compute whole quanta: what the host doesn't consume now
+        // is kept in the output FIFO and returned by the next call.
+        // When the host block is not a multiple of the quantum, the notes played
+        // in the meantime are heard with some delay, see get_latency().
+        RtScope rt_scope;
+
+        // Swap in the new configuration, if any.
+        // The samples left in the FIFO of the old model are lost.
+        apply_pending_model();
+
+        while(length > 0)
+        {
+            uint32_t n_popped = output_fifo->pop(buffer, length, gain);
+            buffer += n_popped;
+            length -= n_popped;
+            if(length > 0)
+            {
+                render_quantum(quantum_buffer, samples_per_block, 1.0f);
+                output_fifo->push(quantum_buffer, samples_per_block);
+            }
+        }
+    }
+    uint32_t get_latency(uint32_t host_block = 0) const
+    {
+        // Worst-case delay [samples] between a note played before process() and its sound.
+        // For a host block of constant length, the FIFO holds a multiple of gcd(host_block, quantum)
+        // samples, and at most quantum-gcd. Pass 0 if the host block length changes from call to call.
+        // The quantum is the one requested by the last reconfigure(), even if it's not swapped in yet.
+        uint32_t quantum = configured_block;
+        uint32_t a = host_block, b = quantum;
+        if(a == 0)
+            return quantum-1;
+        while(b != 0)
+        {
+            uint32_t t = a%b;
+            a = b;
+            b = t;
+        }
+        return quantum-a;
+    }
+    PianoStats stats() const
+    {
+        // Snapshot of the load, from any thread, without locking (see "piano_stats.h").
+        // Only the quanta of the multithreaded path are recorded, not get_next_sample().
+        PianoStats snapshot;
+        snapshot.read(load);
+        return snapshot;
+    }
+    void start_trace(uint32_t capacity = DEFAULT_TRACE_CAPACITY)
+    {
+        // Records the render threads from the next quantum on, "capacity" events per thread.
+        // A trace that was already running is stopped. The buffers of a replaced trace are
+        // reused, or freed, once the threads can't record to it anymore (see reclaim_traces()).
+        std::lock_guard<std::mutex> lock(trace_mutex);
+        PianoTrace* new_trace = reclaim_traces(capacity);
+        if(new_trace == nullptr)
+            new_trace = new PianoTrace(N_THREADS, capacity);
+        requested_trace.store(new_trace, std::memory_order_release);
+        if(last_trace != nullptr)
         {
-            free(buffers[i]);
+            // The quantum being computed can still record to it, and the audio thread records
+            // the quantum itself after counting it: two quanta later, nothing does
+            RetiredTrace retired;
+            retired.trace = last_trace;
+            retired.free_after = quanta_rendered.load(std::memory_order_acquire) + 2;
+            retired_traces.push_back(retired);
         }
-        free(buffers);
+        last_trace = new_trace;
+    }
+    PianoTrace* reclaim_traces(uint32_t capacity)
+    {
+        // Frees the retired traces that no thread records to anymore, but keeps one that has
+        // "capacity" events per thread for the new trace, and returns it (nullptr if none).
+        // While no quantum is computed the retired traces wait, as the audio thread might still
+        // be in the middle of one. Called with "trace_mutex" held.
+        uint64_t now = quanta_rendered.load(std::memory_order_acquire);
+        PianoTrace* reused = nullptr;
+        size_t kept = 0;
+        for(size_t k = 0; k < retired_traces.size(); k++)
+        {
+            PianoTrace* t = retired_traces[k].trace;
+            if(retired_traces[k].free_after > now)
+                retired_traces[kept++] = retired_traces[k];
+            else if(reused == nullptr && t->capacity() == capacity && t->n_workers == N_THREADS)
+                reused = t;
+            else
+                delete t;
+        }
+        retired_traces.resize(kept);
+        if(reused != nullptr)
+            reused->reset();
+        return reused;
+    }
+    void stop_trace()
+    {
+        requested_trace.store(nullptr, std::memory_order_release);
+    }
+    bool save_trace(const char* path)
+    {
+        // Writes the last trace started as Chrome trace JSON, even if it's still running
+        std::lock_guard<std::mutex> lock(trace_mutex);
+        if(last_trace == nullptr)
+            return false;
+        return last_trace->write_json(path);
+    }
+    void set_render_quantum(uint32_t quantum)
+    {
+        // A longer quantum is cheaper (fewer thread wake-ups), a shorter one plays the notes sooner
+        std::lock_guard<std::mutex> lock(reconfigure_mutex);
+        rebuild(configured_sample_rate, quantum, configured_voicing, configured_description);
     }
     void get_next_block_multithreaded(float* buffer, int samples_per_block, float gain)
+    {
+        RtScope rt_scope;
+
+        // Swap in the new configuration, if any
+        apply_pending_model();
+        render_quantum(buffer, samples_per_block, gain);
+    }
+    void render_quantum(float* buffer, int samples_per_block, float gain)
+    {
+        // Computes the quantum and records its load (see stats()).
+        // A trace started or stopped in the meantime applies from this quantum on.
+        trace = requested_trace.load(std::memory_order_acquire);
+        serve_state_request();
+        uint64_t start = PianoLoad::now_ns();
+        uint32_t n_events = n_note_events;
+        render_models(buffer, samples_per_block, gain);
+        quanta_rendered.store(quanta_rendered.load(std::memory_order_relaxed)+1, std::memory_order_release);
+        uint64_t end = PianoLoad::now_ns();
+        uint32_t n_active = 0;
+        for(uint32_t i = 0; i < n_strings; i++)
+        {
+            n_active += strings[i]->is_active;
+        }
+        // While a model fades out the workers compute two blocks: they count as one quantum
+        load.record_workers();
+        uint64_t deadline = (uint64_t)samples_per_block*1000000000/sample_rate;
+        load.record_block(end-start, deadline, n_events, n_active);
+        if(trace != nullptr)
+        {
+            trace->record(trace->audio_buffer(), TRACE_QUANTUM, (uint32_t)deadline, start, end);
+        }
+    }
+    void render_models(float* buffer, int samples_per_block, float gain)
+    {
+        // The old model is held by the audio thread while it's being computed,
+        // so that rebuild() can't take it in the meantime
+        PianoModel* fading = fading_model.exchange(nullptr, std::memory_order_acq_rel);
+        if(fading == nullptr)
+        {
+            compute_block(buffer, samples_per_block, gain);
+            n_note_events = 0;
+
+            // The workers are waiting: the strings can change hands before the next quantum.
+            // Not during a fade, when the workers' time is shared by two partitions.
+            rebalance();
+            return;
+        }
+
+        // Compute both models with the same threads, and fade out the old one linearly.
+        // The note events are meant for the active model only.
+        PianoModel* active = active_model.load(std::memory_order_relaxed);
+        uint32_t n_events = n_note_events;
+        n_note_events = 0;
+        select_model(fading);
+        compute_block(fading->quantum_buffer, samples_per_block, 1.0f);
+        select_model(active);
+        n_note_events = n_events;
+        compute_block(buffer, samples_per_block, gain);
+        n_note_events = 0;
+
+        int n_computed = std::min(samples_per_block, (int)fading->samples_per_block);
+        for(int i = 0; i < n_computed; i++)
+        {
+            float w = 1.0f - (float)(fade_pos+i)/fade_length;
+            if(w <= 0.0f)
+                break;
+            buffer[i] += gain*w*fading->quantum_buffer[i];
+        }
+        fade_pos += n_computed;
+
+        if(fade_pos >= fade_length)
+            spare_model.store(fading, std::memory_order_release);
+        else
+            fading_model.store(fading, std::memory_order_release);
+    }
+    void compute_block(float* buffer, int samples_per_block, float gain)
     {
         // TODO: Each time this function is called, we have to check if "n_running_threads" not zero.
         //  If not, it means that this function got called before it had time to finish computing the previous block.
         //  In that case, the threads have to be immediately notified to stop computing the previous block
         //  and to start with the new one.
 
-        // Activate the threads
+        // Activate the threads. The counter is set before the threads are released:
+        // if each thread incremented it on its own, we could see it at 0 before
+        // the slowest thread even started, and mix a block that isn't finished.
+        uint64_t released = trace != nullptr ? PianoLoad::now_ns() : 0;
+        n_running_threads = N_THREADS;
         for(uint32_t idx_thread = 0; idx_thread < N_THREADS; idx_thread++)
         {
             thr_waiting_for_block[idx_thread] = false;
@@ -160,27 +1053,618 @@ struct Piano
         // so we have to check every once in a while whether they're finished.
         while(true)
         {
-            // Each thread increments the "n_running_threads" counter once it begins computing its block,
-            // and decrements it once it's finished. When the counter is 0, then all threads are finished.
+            // Each thread decrements the "n_running_threads" counter once it has finished its block.
+            // When the counter is 0, then all threads are finished.
             if (n_running_threads == 0)
             {
                 break;
             }
             //std::this_thread::sleep_for(std::chrono::microseconds(sleep_duration));
         }
+        uint64_t finished = trace != nullptr ? PianoLoad::now_ns() : 0;
 
         // Each thread has its own buffer. At this point, all threads have written
         // its computed audio block into it.
         // Now we have to mix (sum) these blocks into the output buffer.
-        for(int i = 0; i < samples_per_block; i++)
+        // The threads never compute more than "this->samples_per_block" samples,
+        // so a longer block (e.g. requested before a reconfiguration) is padded with zeros.
+        int n_computed = std::min(samples_per_block, (int)this->samples_per_block);
+        mix_buffers(buffer, buffers, N_THREADS, n_computed, gain);
+        for(int i = n_computed; i < samples_per_block; i++)
         {
             buffer[i] = 0;
-            for(uint32_t idx_thread = 0; idx_thread < N_THREADS; idx_thread++)
+        }
+
+        // Exchange the bridge forces between the strings
+        if(coupling != nullptr)
+        {
+            coupling->exchange(strings, this->samples_per_block);
+        }
+
+        if(trace != nullptr)
+        {
+            trace->record(trace->audio_buffer(), TRACE_WAIT, 0, released, finished);
+            trace->record(trace->audio_buffer(), TRACE_MIX, 0, finished, PianoLoad::now_ns());
+        }
+    }
+    void rebalance()
+    {
+        // Called by the audio thread between two quanta, once per quantum of the active model alone
+        // (see render_models()). The slowest worker sets the length of the quantum, so the note
+        // ranges are moved to even out the measured cost of the workers. Only an imbalance that
+        // lasts for REBALANCE_PATIENCE quanta is corrected, at most once every REBALANCE_COOLDOWN
+        // quanta, and only if the new ranges are clearly better: a note that is played and
+        // released doesn't move the strings back and forth.
+        blocks_since_rebalance++;
+        if(N_THREADS < 2 || !rebalancing.load(std::memory_order_relaxed))
+            return;
+        double total = 0.0;
+        double slowest = 0.0;
+        for(uint32_t idx_thread = 0; idx_thread < N_THREADS; idx_thread++)
+        {
+            double cost = range_cost(thr_note_range[idx_thread*2], thr_note_range[idx_thread*2+1]);
+            total += cost;
+            slowest = std::max(slowest, cost);
+        }
+        if(total <= 0.0 || slowest < (1.0+REBALANCE_THRESHOLD)*total/N_THREADS)
+        {
+            n_imbalanced_blocks = 0;
+            return;
+        }
+        n_imbalanced_blocks++;
+        if(n_imbalanced_blocks < REBALANCE_PATIENCE || blocks_since_rebalance < REBALANCE_COOLDOWN)
+            return;
+
+        uint32_t ranges[MAX_THREADS*2];
+        PianoModel::partition_strings(string_cost, n_strings, N_THREADS, ranges);
+        double new_slowest = 0.0;
+        for(uint32_t idx_thread = 0; idx_thread < N_THREADS; idx_thread++)
+            new_slowest = std::max(new_slowest, range_cost(ranges[idx_thread*2], ranges[idx_thread*2+1]));
+        if(new_slowest > (1.0-REBALANCE_MIN_GAIN)*slowest)
+            return; // A string costs more than its share: moving the others wouldn't help
+
+        // The workers read their range when they're released
+        memcpy(thr_note_range, ranges, sizeof(uint32_t)*N_THREADS*2);
+        n_imbalanced_blocks = 0;
+        blocks_since_rebalance = 0;
+        load.record_rebalance();
+    }
+    double range_cost(uint32_t first, uint32_t end) const
+    {
+        double cost = 0.0;
+        for(uint32_t i = first; i < end; i++)
+            cost += string_cost[i];
+        return cost;
+    }
+    static void mix_buffers(float* output, float* const* inputs, uint32_t n_inputs, int length, float gain)
+    {
+        // Sum of the worker buffers, scaled by "gain"
+        for(int i = 0; i < length; i++)
+        {
+            output[i] = 0;
+            for(uint32_t idx_thread = 0; idx_thread < n_inputs; idx_thread++)
+            {
+                output[i] += gain*(inputs[idx_thread][i]);
+            }
+        }
+    }
+    void build_attack_cache(const double* velocities = DEFAULT_ATTACK_VELOCITIES,
+                            uint32_t n_buckets = N_DEFAULT_ATTACK_VELOCITIES,
+                            bool background = true)
+    {
+        // Precompute the hammer contact of every string for each velocity bucket.
+        // In the background, each string starts using its cache as soon as it's ready.
+        // The caches are rebuilt whenever the piano is reconfigured.
+        std::lock_guard<std::mutex> lock(reconfigure_mutex);
+        attack_cache_velocities.assign(velocities, velocities+n_buckets);
+        PianoModel* model = pending_model.load(std::memory_order_acquire);
+        if(model == nullptr)
+            model = active_model.load(std::memory_order_acquire);
+        build_attack_cache_for(model, velocities, n_buckets, background);
+    }
+    void build_attack_cache_for(PianoModel* model, const double* velocities, uint32_t n_buckets, bool background)
+    {
+        wait_for_attack_cache(true);
+        reclaim_attack_caches();
+        if(attach_compiled_model(model, velocities, n_buckets))
+            return; // Nothing to simulate
+        std::vector<double> buckets(velocities, velocities+n_buckets);
+        auto build = [this, model, buckets]()
+        {
+            for(uint32_t i = 0; i < model->n_strings && !attack_cache_abort; i++)
+            {
+                PianoString* string = model->strings[i];
+                AttackCache* cache = string->build_attack_cache(buckets.data(), buckets.size());
+                retire_attack_cache(string->attack_cache.exchange(cache, std::memory_order_acq_rel));
+            }
+        };
+        if(background)
+            attack_cache_builder = new std::thread(build);
+        else
+            build();
+    }
+    void retire_attack_cache(AttackCache* cache)
+    {
+        // A string whose cache is replaced can still be playing back its last attack, or a worker
+        // can have loaded the old cache just before the exchange: it's freed later, see reclaim_attack_caches()
+        if(cache == nullptr)
+            return;
+        RetiredAttackCache retired;
+        retired.cache = cache;
+        retired.free_after = quanta_rendered.load(std::memory_order_acquire) + cache->length + 2;
+        retired_attack_caches.push_back(retired);
+    }
+    void reclaim_attack_caches()
+    {
+        // Frees the retired caches that no string can play back anymore. A hit that loaded the old
+        // cache finishes within the quantum being computed, and its playback within "length" samples
+        // of the string's model: as a quantum holds at least one sample, "length"+2 quanta later,
+        // the cache is unused, whatever the quanta of the active and the fading models.
+        // Only called when the builder thread isn't running, which is the only other writer.
+        uint64_t now = quanta_rendered.load(std::memory_order_acquire);
+        size_t n_kept = 0;
+        for(RetiredAttackCache& retired : retired_attack_caches)
+        {
+            if(now >= retired.free_after)
+                delete retired.cache;
+            else
+                retired_attack_caches[n_kept++] = retired;
+        }
+        retired_attack_caches.resize(n_kept);
+    }
+    bool attach_compiled_model(PianoModel* model, const double* velocities, uint32_t n_buckets)
+    {
+        // Gives the strings the attack caches of a compiled model that fits them, if any was loaded
+        uint64_t hash = model->compiled_hash(velocities, n_buckets);
+        for(CompiledModel* compiled : compiled_models)
+        {
+            if(!compiled->matches(hash, model->sample_rate, model->strings, model->n_strings))
+                continue;
+            for(uint32_t i = 0; i < model->n_strings; i++)
+            {
+                retire_attack_cache(model->strings[i]->attack_cache.exchange(compiled->attack_cache(i), std::memory_order_acq_rel));
+            }
+            return true;
+        }
+        return false;
+    }
+    bool load_compiled_model(const char* path)
+    {
+        // Maps a file written by save_compiled_model() (see "openpiano-compile").
+        // If it fits the current configuration, the strings take their attack caches from it
+        // right away. Either way it stays mapped, and it's used again whenever the piano is
+        // reconfigured to a configuration it fits. Returns false if the file is invalid,
+        // or if it doesn't fit the current configuration.
+        std::lock_guard<std::mutex> lock(reconfigure_mutex);
+        CompiledModel* compiled = new CompiledModel();
+        if(!compiled->open(path))
+        {
+            delete compiled;
+            return false;
+        }
+        compiled_models.push_back(compiled);
+
+        PianoModel* model = pending_model.load(std::memory_order_acquire);
+        if(model == nullptr)
+            model = active_model.load(std::memory_order_acquire);
+        const double* velocities = compiled->velocities;
+        uint32_t n_buckets = compiled->header->n_buckets;
+        if(!compiled->matches(model->compiled_hash(velocities, n_buckets), model->sample_rate,
+                              model->strings, model->n_strings))
+            return false;
+
+        // The caches are rebuilt with the same buckets after a reconfiguration
+        wait_for_attack_cache(true);
+        reclaim_attack_caches();
+        attack_cache_velocities.assign(velocities, velocities+n_buckets);
+        return attach_compiled_model(model, velocities, n_buckets);
+    }
+    bool save_compiled_model(const char* path)
+    {
+        // Writes the derived data and the attack caches of the current configuration.
+        // The attack caches must have been built (see build_attack_cache()).
+        std::lock_guard<std::mutex> lock(reconfigure_mutex);
+        wait_for_attack_cache();
+        if(attack_cache_velocities.empty())
+            return false;
+        PianoModel* model = pending_model.load(std::memory_order_acquire);
+        if(model == nullptr)
+            model = active_model.load(std::memory_order_acquire);
+        uint64_t hash = model->compiled_hash(attack_cache_velocities.data(), attack_cache_velocities.size());
+        return write_compiled_model(path, hash, model->sample_rate, model->strings, model->n_strings);
+    }
+    void wait_for_attack_cache(bool abort = false)
+    {
+        if(attack_cache_builder != nullptr)
+        {
+            attack_cache_abort = abort;
+            attack_cache_builder->join();
+            delete attack_cache_builder;
+            attack_cache_builder = nullptr;
+            attack_cache_abort = false;
+        }
+    }
+    void enable_sympathetic_resonance(uint32_t coupling_period = 16, double coupling_gain = 2e-3, double wake_threshold = 1e-8)
+    {
+        // Must be called between two audio blocks.
+        // coupling_period: resolution of the exchanged bridge force [samples], 1 is the finest, longer periods
+        //                  are cheaper. The force is exchanged once per quantum, and heard one quantum late.
+        // coupling_gain: fraction of the bridge force of a string that reaches a perfectly consonant string
+        // wake_threshold: mean squared force [N^2] that a dormant string must receive to be woken up
+        std::lock_guard<std::mutex> lock(reconfigure_mutex);
+        this->coupling_enabled = true;
+        this->coupling_period = coupling_period;
+        this->coupling_gain = coupling_gain;
+        this->wake_threshold = wake_threshold;
+        PianoModel* model = active_model.load(std::memory_order_acquire);
+        model->enable_coupling(coupling_period, coupling_gain, wake_threshold);
+        coupling = model->coupling;
+        samples_since_block = 0;
+        PianoModel* pending = pending_model.load(std::memory_order_acquire);
+        if(pending != nullptr)
+            pending->enable_coupling(coupling_period, coupling_gain, wake_threshold);
+    }
+    void disable_sympathetic_resonance()
+    {
+        // Must be called between two audio blocks
+        std::lock_guard<std::mutex> lock(reconfigure_mutex);
+        coupling_enabled = false;
+        active_model.load(std::memory_order_acquire)->disable_coupling();
+        coupling = nullptr;
+        PianoModel* pending = pending_model.load(std::memory_order_acquire);
+        if(pending != nullptr)
+            pending->disable_coupling();
+    }
+
+    /* ************************************************************** *
+     * Snapshots of the whole engine.                                 *
+     * A snapshot contains everything that changes while the piano is *
+     * played, so that a session or an offline render can resume     *
+     * exactly where it was. save_state() and load_state() must be    *
+     * called by the audio thread between two quanta, or while the    *
+     * piano isn't playing; load_state() doesn't allocate anything.   *
+     * While the piano plays, the other threads use capture_state(),  *
+     * which the audio thread serves between two quanta, and          *
+     * restore_state(), which loads the snapshot into the spare model *
+     * and lets the audio thread swap it in.                          *
+     * ************************************************************** */
+
+    static const uint32_t STATE_MAGIC = 0x5453504F; // "OPST"
+    static const uint32_t STATE_VERSION = 1;
+    static const size_t STATE_HEADER_SIZE = 5*sizeof(uint32_t) + sizeof(uint64_t);
+
+    size_t get_state_size() const
+    {
+        size_t size = STATE_HEADER_SIZE;
+        for(uint32_t i = 0; i < n_strings; i++)
+        {
+            size += strings[i]->state_size();
+        }
+        return size;
+    }
+    bool save_state(void* dest, size_t size) const
+    {
+        // "dest" must hold at least get_state_size() bytes
+        size_t state_size = get_state_size();
+        if(size < state_size)
+            return false;
+
+        uint32_t header[5] = {STATE_MAGIC, STATE_VERSION, (uint32_t)sample_rate, n_strings, samples_since_block};
+        uint64_t body_size = state_size-STATE_HEADER_SIZE;
+        uint8_t* p = write_state((uint8_t*)dest, header, 5);
+        p = write_state(p, &body_size, 1);
+        for(uint32_t i = 0; i < n_strings; i++)
+        {
+            p = strings[i]->save_state(p);
+        }
+        return true;
+    }
+    bool load_state(const void* src, size_t size)
+    {
+        // Returns false, leaving the piano untouched, if the snapshot
+        // is corrupted or was taken with a different configuration.
+        // A pending reconfiguration is applied first, so that the state isn't lost with the old model.
+        apply_pending_model(false);
+        uint32_t position;
+        if(!load_strings_state(strings, n_strings, sample_rate, src, size, position))
+            return false;
+        samples_since_block = position < samples_per_block ? position : 0;
+        return true;
+    }
+    static bool load_strings_state(PianoString** strings, uint32_t n_strings, int sample_rate,
+                                   const void* src, size_t size, uint32_t& position)
+    {
+        // "position" is the sample of the block at which the snapshot was taken (see get_next_sample())
+        const uint8_t* p = (const uint8_t*)src;
+        const uint8_t* end = p+size;
+        uint32_t header[5];
+        uint64_t body_size;
+        if(size < STATE_HEADER_SIZE)
+            return false;
+        p = read_state(p, header, 5);
+        p = read_state(p, &body_size, 1);
+        if(header[0] != STATE_MAGIC || header[1] != STATE_VERSION || header[2] != (uint32_t)sample_rate
+                || header[3] != n_strings || body_size != size-STATE_HEADER_SIZE)
+            return false;
+
+        // Validate every string before touching any of them
+        const uint8_t* q = p;
+        for(uint32_t i = 0; i < n_strings && q != nullptr; i++)
+        {
+            q = strings[i]->check_state(q, end);
+        }
+        if(q != end)
+            return false;
+
+        for(uint32_t i = 0; i < n_strings; i++)
+        {
+            p = strings[i]->load_state(p, end);
+        }
+        position = header[4];
+        return true;
+    }
+    bool capture_state(std::vector<uint8_t>& state, uint32_t timeout_ms = 1000)
+    {
+        // From any thread but the audio one, while the piano plays: the audio thread copies its state
+        // into "state" between two quanta (see serve_state_request()), so it never waits for the caller.
+        // Returns false if the audio thread didn't get to it within "timeout_ms", e.g. because the host
+        // isn't processing: the caller can then use save_state(), keeping the audio thread away.
+        std::lock_guard<std::mutex> lock(snapshot_mutex);
+        auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout_ms);
+        size_t capacity = snapshot_size;
+        while(true)
+        {
+            // The size changes with the cached attacks being played back: some room is left
+            state.resize(capacity + capacity/4 + STATE_HEADER_SIZE);
+            snapshot_data = state.data();
+            snapshot_capacity = state.size();
+            snapshot_status.store(SNAPSHOT_REQUESTED, std::memory_order_release);
+
+            int status;
+            while((status = snapshot_status.load(std::memory_order_acquire)) == SNAPSHOT_REQUESTED ||
+                  status == SNAPSHOT_TAKING)
+            {
+                if(status == SNAPSHOT_REQUESTED && std::chrono::steady_clock::now() > deadline)
+                {
+                    // Withdrawn, unless the audio thread has just started taking it
+                    int expected = SNAPSHOT_REQUESTED;
+                    if(snapshot_status.compare_exchange_strong(expected, SNAPSHOT_IDLE, std::memory_order_acq_rel))
+                        return false;
+                }
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            }
+            snapshot_status.store(SNAPSHOT_IDLE, std::memory_order_relaxed);
+            if(status == SNAPSHOT_DONE)
+            {
+                state.resize(snapshot_size);
+                return true;
+            }
+            capacity = snapshot_size; // Too small: try again with the size the audio thread found
+        }
+    }
+    void serve_state_request()
+    {
+        // Called by the audio thread between two quanta. Copying the state doesn't allocate.
+        int expected = SNAPSHOT_REQUESTED;
+        if(!snapshot_status.compare_exchange_strong(expected, SNAPSHOT_TAKING, std::memory_order_acq_rel))
+            return;
+        snapshot_size = get_state_size();
+        bool saved = save_state(snapshot_data, snapshot_capacity);
+        snapshot_status.store(saved ? SNAPSHOT_DONE : SNAPSHOT_TOO_SMALL, std::memory_order_release);
+    }
+    bool restore_state(const void* src, size_t size)
+    {
+        // From any thread but the audio one, while the piano plays. The spare model is rebuilt with
+        // the current configuration and takes the snapshot, then the audio thread swaps it in like
+        // a reconfiguration (see apply_pending_model()): the strings ringing in the old model fade out.
+        // Returns false if the snapshot doesn't fit the configuration: the strings go on ringing.
+        // The cached attack being played back by a string is lost, its caches are built afterwards.
+        std::lock_guard<std::mutex> lock(reconfigure_mutex);
+        PianoModel* model = take_spare_model();
+        wait_for_attack_cache(true);
+        model->build(configured_sample_rate, configured_block, N_THREADS, configured_voicing, configured_description,
+                     calibration.string_overhead);
+        if(coupling_enabled)
+        {
+            model->enable_coupling(coupling_period, coupling_gain, wake_threshold);
+        }
+        uint32_t position;
+        model->restored = load_strings_state(model->strings, model->n_strings, model->sample_rate, src, size, position);
+        pending_model.store(model, std::memory_order_release);
+
+        if(!attack_cache_velocities.empty())
+        {
+            build_attack_cache_for(model, attack_cache_velocities.data(), attack_cache_velocities.size(), true);
+        }
+        return model->restored;
+    }
+    bool save_state_to_file(const char* path) const
+    {
+        // Checkpoint for offline renders
+        size_t size = get_state_size();
+        uint8_t* data = (uint8_t*)malloc(size);
+        bool ok = save_state(data, size);
+        FILE* file = fopen(path, "wb");
+        if(file == nullptr)
+            ok = false;
+        else
+        {
+            ok = ok && fwrite(data, 1, size, file) == size;
+            ok = (fclose(file) == 0) && ok;
+        }
+        free(data);
+        return ok;
+    }
+    bool load_state_from_file(const char* path)
+    {
+        FILE* file = fopen(path, "rb");
+        if(file == nullptr)
+            return false;
+        fseek(file, 0, SEEK_END);
+        long size = ftell(file);
+        fseek(file, 0, SEEK_SET);
+        bool ok = false;
+        if(size > 0)
+        {
+            uint8_t* data = (uint8_t*)malloc(size);
+            ok = fread(data, 1, size, file) == (size_t)size && load_state(data, size);
+            free(data);
+        }
+        fclose(file);
+        return ok;
+    }
+
+    /* ******************************************************************* *
+     * Calibration (see "piano_calibration.h").                           *
+     * calibrate() times the string kernel on short and long strings of   *
+     * this piano, and a quantum without anything to compute for each     *
+     * number of threads, which is the cost of waking the threads up and  *
+     * waiting for them. From these it predicts the quantum with every    *
+     * string ringing, and picks the shortest render quantum that stays   *
+     * within CALIBRATION_LOAD_TARGET of its deadline, with the fewest    *
+     * threads that are about as fast as the fastest count.               *
+     * ******************************************************************* */
+
+    static PianoCalibration calibrate(int sample_rate, const PianoDescription& description = PianoDescription())
+    {
+        // Takes a few hundred milliseconds at most, and keeps the cores busy in the meantime:
+        // call it before the piano starts playing, from any thread except the audio one
+        PianoCalibration result;
+        result.valid = true;
+        result.sample_rate = sample_rate;
+        result.description_hash = PianoCalibration::hash_description(description);
+
+        // 1. The string kernel: a few strings, from the shortest to the longest, hit and left
+        //    ringing. The cost of a sample is fitted as string_ns + node_ns*nodes.
+        const uint32_t N_PROBES = 8;
+        const uint32_t PROBE_SAMPLES = 1024;
+        const uint32_t PROBE_RUNS = 5;
+        PianoModel model;
+        model.build(sample_rate, 64, 1, PianoVoicing(), description);
+        double sum_x = 0.0, sum_y = 0.0, sum_xx = 0.0, sum_xy = 0.0;
+        uint32_t n_probes = 0;
+        for(uint32_t k = 0; k < N_PROBES && model.n_strings > 0; k++)
+        {
+            PianoString* string = model.strings[(uint64_t)k*(model.n_strings-1)/(N_PROBES-1)];
+            string->hit(2.0);
+            for(uint32_t i = 0; i < PROBE_SAMPLES; i++)
+                string->get_next_sample(); // Mostly the hammer contact, and a warm cache
+            double best = HUGE_VAL; // [ns per sample]
+            for(uint32_t r = 0; r < PROBE_RUNS; r++)
+            {
+                uint64_t start = PianoLoad::now_ns();
+                for(uint32_t i = 0; i < PROBE_SAMPLES; i++)
+                    string->get_next_sample();
+                best = std::min(best, (double)(PianoLoad::now_ns()-start)/PROBE_SAMPLES);
+            }
+            double x = string->len_x_axis;
+            sum_x += x;
+            sum_y += best;
+            sum_xx += x*x;
+            sum_xy += x*best;
+            n_probes++;
+        }
+        double denominator = n_probes*sum_xx - sum_x*sum_x;
+        result.node_ns = denominator > 0.0 ? (n_probes*sum_xy - sum_x*sum_y)/denominator : 0.0;
+        result.string_ns = n_probes > 0 ? (sum_y - result.node_ns*sum_x)/n_probes : 0.0;
+        if(result.node_ns <= 0.0 || result.string_ns < 0.0)
+        {
+            // Too noisy to tell the two apart: all the cost goes to the spatial samples
+            result.node_ns = sum_x > 0.0 ? sum_y/sum_x : 0.0;
+            result.string_ns = 0.0;
+        }
+        result.string_overhead = result.node_ns > 0.0 ? result.string_ns/result.node_ns : 0.0;
+
+        // 2. The wake-up of the threads: quanta of a silent piano, for each number of threads
+        uint32_t hardware = std::max(1u, std::min(std::thread::hardware_concurrency(), MAX_THREADS));
+        std::vector<uint32_t> candidates;
+        for(uint32_t n = 1; n < hardware; n *= 2)
+            candidates.push_back(n);
+        candidates.push_back(hardware);
+        std::vector<double> wakeup_ns;
+        const uint32_t WAKEUP_WARMUP = 8;
+        const uint32_t WAKEUP_BLOCKS = 64;
+        const uint32_t WAKEUP_QUANTUM = 64; // The wake-up hardly depends on the quantum
+        float block[WAKEUP_QUANTUM];
+        for(uint32_t n : candidates)
+        {
+            Piano piano(sample_rate, WAKEUP_QUANTUM, n, nullptr, description);
+            std::vector<uint64_t> times;
+            for(uint32_t b = 0; b < WAKEUP_WARMUP+WAKEUP_BLOCKS; b++)
+            {
+                uint64_t start = PianoLoad::now_ns();
+                piano.get_next_block_multithreaded(block, WAKEUP_QUANTUM, 1.0f);
+                if(b >= WAKEUP_WARMUP)
+                    times.push_back(PianoLoad::now_ns()-start);
+            }
+            std::sort(times.begin(), times.end());
+            wakeup_ns.push_back((double)times[times.size()/2]);
+        }
+
+        // 3. The choice. The partition is the one the piano will use, so its slowest thread is known.
+        uint32_t ranges[MAX_THREADS*2];
+        double costs[MAX_STRINGS];
+        PianoModel::predict_costs(model.strings, model.n_strings, result.string_overhead, costs);
+        for(uint32_t q = 0; q < N_CALIBRATION_QUANTA; q++)
+        {
+            uint32_t quantum = CALIBRATION_QUANTA[q];
+            double deadline = 1e9*quantum/sample_rate; // [ns]
+            std::vector<double> predicted; // [ns] for each candidate
+            double fastest = HUGE_VAL;
+            for(size_t c = 0; c < candidates.size(); c++)
             {
-                buffer[i] += gain*(buffers[idx_thread][i]);
+                PianoModel::partition_strings(costs, model.n_strings, candidates[c], ranges);
+                double slowest = 0.0; // [ns per sample]
+                for(uint32_t t = 0; t < candidates[c]; t++)
+                {
+                    double cost = 0.0;
+                    for(uint32_t i = ranges[t*2]; i < ranges[t*2+1]; i++)
+                        cost += result.string_ns + result.node_ns*model.strings[i]->len_x_axis;
+                    slowest = std::max(slowest, cost);
+                }
+                predicted.push_back(wakeup_ns[c] + quantum*slowest);
+                fastest = std::min(fastest, predicted.back());
             }
+            // A thread more must save at least 5% to be worth a core
+            size_t chosen = 0;
+            while(predicted[chosen] > 1.05*fastest)
+                chosen++;
+            result.n_threads = candidates[chosen];
+            result.render_quantum = quantum;
+            result.wakeup_ns = wakeup_ns[chosen];
+            result.quantum_load = predicted[chosen]/deadline;
+            if(result.quantum_load <= CALIBRATION_LOAD_TARGET)
+                break; // Otherwise the longest quantum is kept, the best that can be done
+        }
+        return result;
+    }
+    static PianoCalibration load_or_calibrate(int sample_rate, const PianoDescription& description = PianoDescription(),
+                                              const std::string& path = PianoCalibration::default_path())
+    {
+        // The calibration cached in "path" if it was measured on this machine for this piano,
+        // or if it's pinned. Otherwise a new one, which replaces it.
+        // None (not valid) if the calibration is disabled (see PianoCalibration::disabled()),
+        // or if the pinned file doesn't choose the threads and the quantum: a pinned file is
+        // the choice of an operator, it's never replaced.
+        PianoCalibration calibration;
+        if(PianoCalibration::disabled())
+            return calibration;
+        bool loaded = calibration.load(path);
+        if(calibration.pinned)
+        {
+            if(loaded)
+                return calibration;
+            fprintf(stderr, "The pinned calibration \"%s\" doesn't choose the threads and the quantum, "
+                            "it's ignored\n", path.c_str());
+            return PianoCalibration();
         }
+        if(loaded && calibration.matches(sample_rate, description))
+            return calibration;
+        calibration = calibrate(sample_rate, description);
+        calibration.save(path); // Measured again next time if it can't be written
+        return calibration;
     }
+
     void init_threads()
     {
         // Allocate and initialize the arrays of flags (one for each thread)
@@ -199,33 +1683,10 @@ struct Piano
             thr_waiting_for_block[idx_thread] = true;
         }
 
-        // Range notes for each thread
-        // TODO: to be more fair when assigning a group of notes to each thread, we could take into account that strings
-        //  with lower fundamental frequencies require more computational power (they have more spatial samples)
-        //  in order to distribute the computational load more evenly.
-        thr_note_range = (uint32_t*)malloc(sizeof(uint32_t)*N_THREADS*2); // thr_note_range[0] -> first note of thread 0
-                                                                          // thr_note_range[1] -> last note of thread 0
-                                                                          // thr_note_range[2] -> first note of thread 1
-                                                                          // thr_note_range[3] -> last note of thread 2
-                                                                          // ... and so on
-        uint32_t n_notes_per_thread = floor(N_STRINGS/N_THREADS); // If N_THREADS is not divisible by N_STRINGS, the
-                                                                  // remainder will go to the last thread
-        for(uint32_t idx_thread = 0; idx_thread < N_THREADS; idx_thread++)
-        {
-            uint32_t start_note = idx_thread * n_notes_per_thread; // Start note for the current thread
-            uint32_t end_note = start_note + n_notes_per_thread-1; // End note for the current thread
-
-            thr_note_range[idx_thread*2] = start_note;
-
-            if(idx_thread == (N_THREADS-1)) // Check if we have reached the last thread, because...
-                thr_note_range[idx_thread*2+1] = LAST_NOTE; // ... the last thread gets the remainder
-            else
-                thr_note_range[idx_thread*2+1] = end_note;
-
-            //std::cout << "idx_thread: " << idx_thread << std::endl;
-            //std::cout << "start_note: " << thr_note_range[idx_thread*2] << std::endl;
-            //std::cout << "end_note: " << thr_note_range[idx_thread*2+1] << std::endl << std::endl;
-        }
+        // The note range of each thread depends on the model (see PianoModel::init_note_ranges()),
+        // it's set by select_model()
+        thr_note_range = nullptr;
+        string_cost = nullptr;
 
         // Create "n_threads" threads and pause them
         sleep_duration = 20; // (microsecs) TODO: it should be proportional to (samples_per_block/sampling_rate) seconds
@@ -243,24 +1704,81 @@ struct Piano
                     // If the thread isn't paused
                     if(thr_waiting_for_block[idx_thread].load() == false)
                     {
-                        // Signal that the block is about to be computed
-                        n_running_threads++;
+                        RtScope rt_scope; // Only while computing: the idle branch sleeps
+                        uint64_t busy_start = PianoLoad::now_ns();
+                        PianoTrace* block_trace = trace; // Set by the audio thread before releasing this one
 
-                        // Compute the block
+                        // Move the dampers
+                        for(uint32_t j = thr_note_range[idx_thread*2]; j < thr_note_range[idx_thread*2+1]; j++)
+                        {
+                            strings[j]->update_damper(samples_per_block);
+                        }
+
+                        // Compute the block one string at a time: the string stays in the cache
+                        // for the whole block, and the strings are visited in the same order
+                        // in which they are laid out in the arena
+                        float* block = buffers[idx_thread];
                         for(size_t i = 0; i < samples_per_block; i++)
                         {
-                            buffers[idx_thread][i] = 0.0f;
-                            for(uint32_t j = thr_note_range[idx_thread*2]; j <= thr_note_range[idx_thread*2+1]; j++)
+                            block[i] = 0.0f;
+                        }
+                        uint64_t string_ticks = PianoLoad::now_ticks(); // The end of a string is the start of the next one
+                        for(uint32_t j = thr_note_range[idx_thread*2]; j < thr_note_range[idx_thread*2+1]; j++)
+                        {
+                            // The computation of the string is split at its note events
+                            PianoString* string = strings[j];
+                            uint64_t string_start = block_trace != nullptr ? PianoLoad::now_ns() : 0;
+                            uint32_t i = 0;
+                            for(uint32_t e = 0; e < n_note_events; e++)
+                            {
+                                if(note_events[e].note != j)
+                                    continue;
+                                for(uint32_t end = std::min(note_events[e].offset, samples_per_block); i < end; i++)
+                                {
+                                    block[i] += string->get_next_sample();
+                                }
+                                if(block_trace != nullptr)
+                                {
+                                    uint64_t event_start = PianoLoad::now_ns();
+                                    apply_note_event(note_events[e]);
+                                    block_trace->record(idx_thread, note_events[e].type == NOTE_EVENT_HIT ? TRACE_HIT : TRACE_DAMPER,
+                                                        j, event_start, PianoLoad::now_ns());
+                                }
+                                else
+                                {
+                                    apply_note_event(note_events[e]);
+                                }
+                            }
+                            for(; i < samples_per_block; i++)
+                            {
+                                block[i] += string->get_next_sample();
+                            }
+
+                            // Only this thread owns the string until the next rebalance()
+                            uint64_t end_ticks = PianoLoad::now_ticks();
+                            string_cost[j] += REBALANCE_SMOOTHING*((double)(end_ticks-string_ticks) - string_cost[j]);
+                            string_ticks = end_ticks;
+
+                            // The silent strings cost next to nothing and would only clutter the trace
+                            if(block_trace != nullptr && string->is_active)
                             {
-                                buffers[idx_thread][i] += strings[j]->get_next_sample();
+                                block_trace->record(idx_thread, TRACE_STRING, j, string_start, PianoLoad::now_ns());
                             }
                         }
 
-                        // Signal that the block has been computed
-                        n_running_threads--;
+                        uint64_t busy_end = PianoLoad::now_ns();
+                        load.add_worker_time(idx_thread, busy_end-busy_start);
+                        if(block_trace != nullptr)
+                        {
+                            block_trace->record(idx_thread, TRACE_WORKER_BLOCK,
+                                                thr_note_range[idx_thread*2+1]-thr_note_range[idx_thread*2], busy_start, busy_end);
+                        }
 
-                        // Go to sleep
+                        // Go to sleep, then signal that the block has been computed.
+                        // In the opposite order, the next block could be requested in between,
+                        // and this thread would pause without computing it.
                         thr_waiting_for_block[idx_thread] = true;
+                        n_running_threads--;
                     }
                     // If the thread is paused, sleep for "sleep_duration" microseconds
                     else
@@ -268,6 +1786,7 @@ struct Piano
                         std::this_thread::sleep_for(std::chrono::microseconds(sleep_duration));
                     }
                 }
+                n_alive_threads--;
             });
         }
 
@@ -277,235 +1796,54 @@ struct Piano
             threads[idx_thread]->detach();
         }
     }
-    void init_buffers()
+    float get_next_sample(float gain)
     {
-        // Allocate the buffers
-        buffers = (float**)malloc(N_THREADS * sizeof(float*));
-        for(uint32_t idx_thread = 0; idx_thread < N_THREADS; idx_thread++)
+        // Move the dampers once per block
+        if(samples_since_block == 0)
         {
-            buffers[idx_thread] = (float*)malloc(this->samples_per_block * sizeof(float));
+            apply_pending_model(false);
+            serve_state_request();
+
+            for(uint32_t i = 0; i < n_strings; i++)
+            {
+                strings[i]->update_damper(samples_per_block);
+            }
+        }
+
+        // Note events scheduled at this sample
+        while(next_note_event < n_note_events && note_events[next_note_event].offset <= samples_since_block)
+        {
+            apply_note_event(note_events[next_note_event++]);
         }
 
-        // Initialize the buffers to zeros.
-        // This prevents from drilling people's ears when they change the buffer size in the plugin!
-        for (uint32_t idx_thread = 0; idx_thread < N_THREADS; idx_thread++)
-            for (uint32_t i = 0; i < samples_per_block; i++)
-                buffers[idx_thread][i] = 0;
-    }
-    float get_next_sample(float gain)
-    {
         float sample = 0;
-        for(int i = 0; i < N_STRINGS; i++)
+        for(uint32_t i = 0; i < n_strings; i++)
         {
             sample += strings[i]->get_next_sample();
         }
+
+        // Exchange the bridge forces between the strings once per block
+        if(++samples_since_block >= samples_per_block)
+        {
+            if(coupling != nullptr)
+            {
+                coupling->exchange(strings, samples_since_block);
+            }
+            samples_since_block = 0;
+            n_note_events = 0;
+            next_note_event = 0;
+            quanta_rendered.store(quanta_rendered.load(std::memory_order_relaxed)+1, std::memory_order_release);
+        }
         return gain*sample;
     }
     void get_next_block(float* buffer, size_t length, float gain)
     {
+        RtScope rt_scope;
         for(size_t i = 0; i < length; i++)
         {
             buffer[i] = this->get_next_sample(gain);
         }
     }
-    void init_hammers()
-    {
-        hammers[A0] = new Hammer(sample_rate, 4.9e-03, 2.3, 1e-04, 4e08, 0.12, 0.05);
-        hammers[A0s] = new Hammer(sample_rate, 4.9e-03, 2.3, 1e-04, 4e08, 0.12, 0.05);
-        hammers[B0] = new Hammer(sample_rate, 4.9e-03, 2.3, 1e-04, 4e08, 0.12, 0.05);
-
-        hammers[C1] = new Hammer(sample_rate, 4.9e-03, 2.3, 1e-04, 4e08, 0.12, 0.05);
-        hammers[C1s] = new Hammer(sample_rate, 4.9e-03, 2.3, 1e-04, 4e08, 0.12, 0.05);
-        hammers[D1] = new Hammer(sample_rate, 4.9e-03, 2.3, 1e-04, 4e08, 0.12, 0.05);
-        hammers[D1s] = new Hammer(sample_rate, 4.9e-03, 2.3, 1e-04, 4e08, 0.12, 0.05);
-        hammers[E1] = new Hammer(sample_rate, 4.9e-03, 2.3, 1e-04, 4e08, 0.12, 0.05);
-        hammers[F1] = new Hammer(sample_rate, 4.9e-03, 2.3, 1e-04, 4e08, 0.12, 0.05);
-        hammers[F1s] = new Hammer(sample_rate, 4.9e-03, 2.3, 1e-04, 4e08, 0.12, 0.05);
-        hammers[G1] = new Hammer(sample_rate, 4.9e-03, 2.3, 1e-04, 4e08, 0.12, 0.05);
-        hammers[G1s] = new Hammer(sample_rate, 4.9e-03, 2.3, 1e-04, 4e08, 0.12, 0.05);
-        hammers[A1] = new Hammer(sample_rate, 4.9e-03, 2.3, 1e-04, 4e08, 0.12, 0.05);
-        hammers[A1s] = new Hammer(sample_rate, 4.9e-03, 2.3, 1e-04, 4e08, 0.12, 0.05);
-        hammers[B1] = new Hammer(sample_rate, 4.9e-03, 2.3, 1e-04, 4e08, 0.12, 0.05);
-
-        hammers[C2] = new Hammer(sample_rate, 4.9e-03, 2.3, 1e-04, 4e08, 0.12, 0.05);
-        hammers[C2s] = new Hammer(sample_rate, 4.9e-03, 2.3, 1e-04, 4e08, 0.12, 0.05);
-        hammers[D2] = new Hammer(sample_rate, 4.9e-03, 2.3, 1e-04, 4e08, 0.12, 0.05);
-        hammers[D2s] = new Hammer(sample_rate, 4.9e-03, 2.3, 1e-04, 4e08, 0.12, 0.05);
-        hammers[E2] = new Hammer(sample_rate, 4.9e-03, 2.3, 1e-04, 4e08, 0.12, 0.05);
-        hammers[F2] = new Hammer(sample_rate, 4.9e-03, 2.3, 1e-04, 4e08, 0.12, 0.05);
-        hammers[F2s] = new Hammer(sample_rate, 4.9e-03, 2.3, 1e-04, 4e08, 0.12, 0.05);
-        hammers[G2] = new Hammer(sample_rate, 4.9e-03, 2.3, 1e-04, 4e08, 0.12, 0.05);
-        hammers[G2s] = new Hammer(sample_rate, 4.9e-03, 2.3, 1e-04, 4e08, 0.12, 0.05);
-        hammers[A2] = new Hammer(sample_rate, 4.9e-03, 2.3, 1e-04, 4e08, 0.12, 0.05);
-        hammers[A2s] = new Hammer(sample_rate, 4.9e-03, 2.3, 1e-04, 4e08, 0.12, 0.05);
-        hammers[B2] = new Hammer(sample_rate, 4.9e-03, 2.3, 1e-04, 4e08, 0.12, 0.05);
-
-        hammers[C3] = new Hammer(sample_rate, 4.9e-03, 2.3, 1e-04, 4e08, 0.12, 0.05);
-        hammers[C3s] = new Hammer(sample_rate, 4.9e-03, 2.3, 1e-04, 4e08, 0.12, 0.05);
-        hammers[D3] = new Hammer(sample_rate, 4.9e-03, 2.3, 1e-04, 4e08, 0.12, 0.05);
-        hammers[D3s] = new Hammer(sample_rate, 4.9e-03, 2.3, 1e-04, 4e08, 0.12, 0.05);
-        hammers[E3] = new Hammer(sample_rate, 4.9e-03, 2.3, 1e-04, 4e08, 0.12, 0.05);
-        hammers[F3] = new Hammer(sample_rate, 4.9e-03, 2.3, 1e-04, 4e08, 0.12, 0.05);
-        hammers[F3s] = new Hammer(sample_rate, 4.9e-03, 2.3, 1e-04, 4e08, 0.12, 0.05);
-        hammers[G3] = new Hammer(sample_rate, 4.9e-03, 2.3, 1e-04, 4e08, 0.12, 0.05);
-        hammers[G3s] = new Hammer(sample_rate, 4.9e-03, 2.3, 1e-04, 4e08, 0.12, 0.05);
-        hammers[A3] = new Hammer(sample_rate, 4.9e-03, 2.3, 1e-04, 4e08, 0.12, 0.05);
-        hammers[A3s] = new Hammer(sample_rate, 4.9e-03, 2.3, 1e-04, 4e08, 0.12, 0.05);
-        hammers[B3] = new Hammer(sample_rate, 4.9e-03, 2.3, 1e-04, 4e08, 0.12, 0.05);
-
-        hammers[C4] = new Hammer(sample_rate, 4.9e-03, 2.3, 1e-04, 4e08, 0.12, 0.05);
-        hammers[C4s] = new Hammer(sample_rate, 4.9e-03, 2.3, 1e-04, 4e08, 0.12, 0.05);
-        hammers[D4] = new Hammer(sample_rate, 4.9e-03, 2.3, 1e-04, 4e08, 0.12, 0.05);
-        hammers[D4s] = new Hammer(sample_rate, 4.9e-03, 2.3, 1e-04, 4e08, 0.12, 0.05);
-        hammers[E4] = new Hammer(sample_rate, 4.9e-03, 2.3, 1e-04, 4e08, 0.12, 0.05);
-        hammers[F4] = new Hammer(sample_rate, 4.9e-03, 2.3, 1e-04, 4e08, 0.12, 0.05);
-        hammers[F4s] = new Hammer(sample_rate, 4.9e-03, 2.3, 1e-04, 4e08, 0.12, 0.05);
-        hammers[G4] = new Hammer(sample_rate, 4.9e-03, 2.3, 1e-04, 4e08, 0.12, 0.05);
-        hammers[G4s] = new Hammer(sample_rate, 4.9e-03, 2.3, 1e-04, 4e08, 0.12, 0.05);
-        hammers[A4] = new Hammer(sample_rate, 4.9e-03, 2.3, 1e-04, 4e08, 0.12, 0.05);
-        hammers[A4s] = new Hammer(sample_rate, 4.9e-03, 2.3, 1e-04, 4e08, 0.12, 0.05);
-        hammers[B4] = new Hammer(sample_rate, 4.9e-03, 2.3, 1e-04, 4e08, 0.12, 0.05);
-
-        hammers[C5] = new Hammer(sample_rate, 4.9e-03, 2.3, 1e-04, 4e08, 0.12, 0.05);
-        /*hammers[C5s] = new Hammer(sample_rate, 4.9e-03, 2.3, 1e-04, 4e08, 0.12, 0.05);
-        hammers[D5] = new Hammer(sample_rate, 4.9e-03, 2.3, 1e-04, 4e08, 0.12, 0.05);
-        hammers[D5s] = new Hammer(sample_rate, 4.9e-03, 2.3, 1e-04, 4e08, 0.12, 0.05);
-        hammers[E5] = new Hammer(sample_rate, 4.9e-03, 2.3, 1e-04, 4e08, 0.12, 0.05);
-        hammers[F5] = new Hammer(sample_rate, 4.9e-03, 2.3, 1e-04, 4e08, 0.12, 0.05);
-        hammers[F5s] = new Hammer(sample_rate, 4.9e-03, 2.3, 1e-04, 4e08, 0.12, 0.05);
-        hammers[G5] = new Hammer(sample_rate, 4.9e-03, 2.3, 1e-04, 4e08, 0.12, 0.05);
-        hammers[G5s] = new Hammer(sample_rate, 4.9e-03, 2.3, 1e-04, 4e08, 0.12, 0.05);
-        hammers[A5] = new Hammer(sample_rate, 4.9e-03, 2.3, 1e-04, 4e08, 0.12, 0.05);
-        hammers[A5s] = new Hammer(sample_rate, 4.9e-03, 2.3, 1e-04, 4e08, 0.12, 0.05);
-        hammers[B5] = new Hammer(sample_rate, 4.9e-03, 2.3, 1e-04, 4e08, 0.12, 0.05);
-
-        hammers[C6] = new Hammer(sample_rate, 4.9e-03, 2.3, 1e-04, 4e08, 0.12, 0.05);
-        hammers[C6s] = new Hammer(sample_rate, 4.9e-03, 2.3, 1e-04, 4e08, 0.12, 0.05);
-        hammers[D6] = new Hammer(sample_rate, 4.9e-03, 2.3, 1e-04, 4e08, 0.12, 0.05);
-        hammers[D6s] = new Hammer(sample_rate, 4.9e-03, 2.3, 1e-04, 4e08, 0.12, 0.05);
-        hammers[E6] = new Hammer(sample_rate, 4.9e-03, 2.3, 1e-04, 4e08, 0.12, 0.05);
-        hammers[F6] = new Hammer(sample_rate, 4.9e-03, 2.3, 1e-04, 4e08, 0.12, 0.05);
-        hammers[F6s] = new Hammer(sample_rate, 4.9e-03, 2.3, 1e-04, 4e08, 0.12, 0.05);
-        hammers[G6] = new Hammer(sample_rate, 4.9e-03, 2.3, 1e-04, 4e08, 0.12, 0.05);
-        hammers[G6s] = new Hammer(sample_rate, 4.9e-03, 2.3, 1e-04, 4e08, 0.12, 0.05);
-        hammers[A6] = new Hammer(sample_rate, 4.9e-03, 2.3, 1e-04, 4e08, 0.12, 0.05);
-        hammers[A6s] = new Hammer(sample_rate, 4.9e-03, 2.3, 1e-04, 4e08, 0.12, 0.05);
-        hammers[B6] = new Hammer(sample_rate, 4.9e-03, 2.3, 1e-04, 4e08, 0.12, 0.05);
-
-        hammers[C7] = new Hammer(sample_rate, 4.9e-03, 2.3, 1e-04, 4e08, 0.12, 0.05);
-        hammers[C7s] = new Hammer(sample_rate, 4.9e-03, 2.3, 1e-04, 4e08, 0.12, 0.05);
-        hammers[D7] = new Hammer(sample_rate, 4.9e-03, 2.3, 1e-04, 4e08, 0.12, 0.05);
-        hammers[D7s] = new Hammer(sample_rate, 4.9e-03, 2.3, 1e-04, 4e08, 0.12, 0.05);
-        hammers[E7] = new Hammer(sample_rate, 4.9e-03, 2.3, 1e-04, 4e08, 0.12, 0.05);
-        hammers[F7] = new Hammer(sample_rate, 4.9e-03, 2.3, 1e-04, 4e08, 0.12, 0.05);
-        hammers[F7s] = new Hammer(sample_rate, 4.9e-03, 2.3, 1e-04, 4e08, 0.12, 0.05);
-        hammers[G7] = new Hammer(sample_rate, 4.9e-03, 2.3, 1e-04, 4e08, 0.12, 0.05);
-        hammers[G7s] = new Hammer(sample_rate, 4.9e-03, 2.3, 1e-04, 4e08, 0.12, 0.05);
-        hammers[A7] = new Hammer(sample_rate, 4.9e-03, 2.3, 1e-04, 4e08, 0.12, 0.05);
-        hammers[A7s] = new Hammer(sample_rate, 4.9e-03, 2.3, 1e-04, 4e08, 0.12, 0.05);
-        hammers[B7] = new Hammer(sample_rate, 4.9e-03, 2.3, 1e-04, 4e08, 0.12, 0.05);
-
-        hammers[C8] = new Hammer(sample_rate, 4.9e-03, 2.3, 1e-04, 4e08, 0.12, 0.05);*/
-    }
-    void init_strings()
-    {
-        strings[A0] = new PianoString(sample_rate, 27.5, 1.92, 0.0182, 0.001, 9e7, 0.003, 6.25e-9, hammers[A0]);
-        strings[A0s] = new PianoString(sample_rate, 29.14, 1.92, 0.0182, 0.001, 9e7, 0.003, 6.25e-9, hammers[A0s]);
-        strings[B0] = new PianoString(sample_rate, 30.87, 1.92, 0.0182, 0.001, 9e7, 0.003, 6.25e-9, hammers[B0]);
-
-        strings[C1] = new PianoString(sample_rate, 32.7, 1.92, 0.0182, 0.001, 9e7, 0.003, 6.25e-9, hammers[C1]);
-        strings[C1s] = new PianoString(sample_rate, 34.65, 1.92, 0.0182, 0.001, 9e7, 0.003, 6.25e-9, hammers[C1s]);
-        strings[D1] = new PianoString(sample_rate, 36.71, 1.92, 0.0182, 0.001, 9e7, 0.003, 6.25e-9, hammers[D1]);
-        strings[D1s] = new PianoString(sample_rate, 38.89, 1.92, 0.0182, 0.001, 9e7, 0.003, 6.25e-9, hammers[D1s]);
-        strings[E1] = new PianoString(sample_rate, 41.20, 1.92, 0.0182, 0.001, 9e7, 0.003, 6.25e-9, hammers[E1]);
-        strings[F1] = new PianoString(sample_rate, 43.65, 1.92, 0.0182, 0.001, 9e7, 0.003, 6.25e-9, hammers[F1]);
-        strings[F1s] = new PianoString(sample_rate, 46.25, 1.92, 0.0182, 0.001, 9e7, 0.003, 6.25e-9, hammers[F1s]);
-        strings[G1] = new PianoString(sample_rate, 49.00, 1.92, 0.0182, 0.001, 9e7, 0.003, 6.25e-9, hammers[G1]);
-        strings[G1s] = new PianoString(sample_rate, 51.91, 1.92, 0.0182, 0.001, 9e7, 0.003, 6.25e-9, hammers[G1s]);
-        strings[A1] = new PianoString(sample_rate, 55.00, 1.92, 0.0182, 0.001, 9e7, 0.003, 6.25e-9, hammers[A1]);
-        strings[A1s] = new PianoString(sample_rate, 58.27, 1.92, 0.0182, 0.001, 9e7, 0.003, 6.25e-9, hammers[A1s]);
-        strings[B1] = new PianoString(sample_rate, 61.74, 1.92, 0.0182, 0.001, 9e7, 0.003, 6.25e-9, hammers[B1]);
-
-        strings[C2] = new PianoString(sample_rate, 65.41, 1.92, 0.0182, 0.001, 9e7, 0.003, 6.25e-9, hammers[C2]);
-        strings[C2s] = new PianoString(sample_rate, 69.30, 1.92, 0.0182, 0.001, 9e7, 0.003, 6.25e-9, hammers[C2s]);
-        strings[D2] = new PianoString(sample_rate, 73.42, 1.92, 0.0182, 0.001, 9e7, 0.003, 6.25e-9, hammers[D2]);
-        strings[D2s] = new PianoString(sample_rate, 77.78, 1.92, 0.0182, 0.001, 9e7, 0.003, 6.25e-9, hammers[D2s]);
-        strings[E2] = new PianoString(sample_rate, 82.41, 1.92, 0.0182, 0.001, 9e7, 0.003, 6.25e-9, hammers[E2]);
-        strings[F2] = new PianoString(sample_rate, 87.31, 1.92, 0.0182, 0.001, 9e7, 0.003, 6.25e-9, hammers[F2]);
-        strings[F2s] = new PianoString(sample_rate, 92.50, 1.92, 0.0182, 0.001, 9e7, 0.003, 6.25e-9, hammers[F2s]);
-        strings[G2] = new PianoString(sample_rate, 98.00, 1.92, 0.0182, 0.001, 9e7, 0.003, 6.25e-9, hammers[G2]);
-        strings[G2s] = new PianoString(sample_rate, 103.83, 1.92, 0.0182, 0.001, 9e7, 0.003, 6.25e-9, hammers[G2s]);
-        strings[A2] = new PianoString(sample_rate, 110.00, 1.92, 0.0182, 0.001, 9e7, 0.003, 6.25e-9, hammers[A2]);
-        strings[A2s] = new PianoString(sample_rate, 116.54, 1.92, 0.0182, 0.001, 9e7, 0.003, 6.25e-9, hammers[A2s]);
-        strings[B2] = new PianoString(sample_rate, 123.47, 1.92, 0.0182, 0.001, 9e7, 0.003, 6.25e-9, hammers[B2]);
-
-        strings[C3] = new PianoString(sample_rate, 130.81, 0.96, 0.0182, 0.001, 9e7, 0.003, 6.25e-9, hammers[C3]);
-        strings[C3s] = new PianoString(sample_rate, 138.59, 0.96, 0.0182, 0.001, 9e7, 0.003, 6.25e-9, hammers[C3s]);
-        strings[D3] = new PianoString(sample_rate, 146.83, 0.96, 0.0182, 0.001, 9e7, 0.003, 6.25e-9, hammers[D3]);
-        strings[D3s] = new PianoString(sample_rate, 155.56, 0.96, 0.0182, 0.001, 9e7, 0.003, 6.25e-9, hammers[D3s]);
-        strings[E3] = new PianoString(sample_rate, 164.81, 0.96, 0.0182, 0.001, 9e7, 0.003, 6.25e-9, hammers[E3]);
-        strings[F3] = new PianoString(sample_rate, 174.61, 0.96, 0.0182, 0.001, 9e7, 0.003, 6.25e-9, hammers[F3]);
-        strings[F3s] = new PianoString(sample_rate, 185.00, 0.96, 0.0182, 0.001, 9e7, 0.003, 6.25e-9, hammers[F3s]);
-        strings[G3] = new PianoString(sample_rate, 196, 0.96, 0.0182, 0.001, 9e7, 0.003, 6.25e-9, hammers[G3]);
-        strings[G3s] = new PianoString(sample_rate, 207.65, 0.96, 0.0182, 0.001, 9e7, 0.003, 6.25e-9, hammers[G3s]);
-        strings[A3] = new PianoString(sample_rate, 220, 0.96, 0.0182, 0.001, 9e7, 0.003, 6.25e-9, hammers[A3]);
-        strings[A3s] = new PianoString(sample_rate, 233.08, 0.96, 0.0182, 0.001, 9e7, 0.003, 6.25e-9, hammers[A3s]);
-        strings[B3] = new PianoString(sample_rate, 246.94, 0.96, 0.0182, 0.001, 9e7, 0.003, 6.25e-9, hammers[B3]);
-
-        strings[C4] = new PianoString(sample_rate, 261.63, 0.96, 0.0182, 0.001, 9e7, 0.003, 6.25e-9, hammers[C4]);
-        strings[C4s] = new PianoString(sample_rate, 277.18, 0.96, 0.0182, 0.001, 9e7, 0.003, 6.25e-9, hammers[C4s]);
-        strings[D4] = new PianoString(sample_rate, 293.66, 0.96, 0.0182, 0.001, 9e7, 0.003, 6.25e-9, hammers[D4]);
-        strings[D4s] = new PianoString(sample_rate, 311.13, 0.96, 0.0182, 0.001, 9e7, 0.003, 6.25e-9, hammers[D4s]);
-        strings[E4] = new PianoString(sample_rate, 329.63, 0.96, 0.0182, 0.001, 9e7, 0.003, 6.25e-9, hammers[E4]);
-        strings[F4] = new PianoString(sample_rate, 349.23, 0.96, 0.0182, 0.001, 9e7, 0.003, 6.25e-9, hammers[F4]);
-        strings[F4s] = new PianoString(sample_rate, 369.99, 0.96, 0.0182, 0.001, 9e7, 0.003, 6.25e-9, hammers[F4s]);
-        strings[G4] = new PianoString(sample_rate, 392.00, 0.96, 0.0182, 0.001, 9e7, 0.003, 6.25e-9, hammers[G4]);
-        strings[G4s] = new PianoString(sample_rate, 415.30, 0.96, 0.0182, 0.001, 9e7, 0.003, 6.25e-9, hammers[G4s]);
-        strings[A4] = new PianoString(sample_rate, 440.00, 0.96, 0.0182, 0.001, 9e7, 0.003, 6.25e-9, hammers[A4]);
-        strings[A4s] = new PianoString(sample_rate, 466.16, 0.96, 0.0182, 0.001, 9e7, 0.003, 6.25e-9, hammers[A4s]);
-        strings[B4] = new PianoString(sample_rate, 493.88, 0.96, 0.0182, 0.001, 9e7, 0.003, 6.25e-9, hammers[B4]);
-
-        strings[C5] = new PianoString(sample_rate, 523.25, 0.96, 0.0182, 0.0008, 9e7, 0.003, 6.25e-9, hammers[C5]);
-        /*strings[C5s] = new PianoString(sample_rate, 554.37, 0.96, 0.0182, 0.0008, 9e7, 0.003, 6.25e-9, hammers[C5s]);
-        strings[D5] = new PianoString(sample_rate, 587.33, 0.96, 0.0182, 0.0008, 9e7, 0.003, 6.25e-9, hammers[D5]);
-        strings[D5s] = new PianoString(sample_rate, 622.25, 0.96, 0.0182, 0.0008, 9e7, 0.003, 6.25e-9, hammers[D5s]);
-        strings[E5] = new PianoString(sample_rate, 659.26, 0.96, 0.0182, 0.0008, 9e7, 0.003, 6.25e-9, hammers[E5]);
-        strings[F5] = new PianoString(sample_rate, 698.46, 0.96, 0.0182, 0.0008, 9e7, 0.003, 6.25e-9, hammers[F5]);
-        strings[F5s] = new PianoString(sample_rate, 739.99, 0.96, 0.0182, 0.0008, 9e7, 0.003, 6.25e-9, hammers[F5s]);
-        strings[G5] = new PianoString(sample_rate, 783.99, 0.96, 0.0182, 0.0008, 9e7, 0.003, 6.25e-9, hammers[G5]);
-        strings[G5s] = new PianoString(sample_rate, 830.61, 0.96, 0.0182, 0.0008, 9e7, 0.003, 6.25e-9, hammers[G5s]);
-        strings[A5] = new PianoString(sample_rate, 880.00, 0.96, 0.0182, 0.0008, 9e7, 0.003, 6.25e-9, hammers[A5]);
-        strings[A5s] = new PianoString(sample_rate, 932.33, 0.96, 0.0182, 0.0008, 9e7, 0.003, 6.25e-9, hammers[A5s]);
-        strings[B5] = new PianoString(sample_rate, 987.77, 0.96, 0.0182, 0.0008, 9e7, 0.003, 6.25e-9, hammers[B5]);
-
-        strings[C6] = new PianoString(sample_rate, 1046.50, 0.96, 0.0182, 0.0005, 9e7, 0.003, 6.25e-9, hammers[C6]);
-        strings[C6s] = new PianoString(sample_rate, 1108.73, 0.96, 0.0182, 0.0005, 9e7, 0.003, 6.25e-9, hammers[C6s]);
-        strings[D6] = new PianoString(sample_rate, 1174.66, 0.96, 0.0182, 0.0005, 9e7, 0.003, 6.25e-9, hammers[D6]);
-        strings[D6s] = new PianoString(sample_rate, 1244.51, 0.96, 0.0182, 0.0005, 9e7, 0.003, 6.25e-9, hammers[D6s]);
-        strings[E6] = new PianoString(sample_rate, 1318.51, 0.96, 0.0182, 0.0005, 9e7, 0.003, 6.25e-9, hammers[E6]);
-        strings[F6] = new PianoString(sample_rate, 1396.91, 0.96, 0.0182, 0.0005, 9e7, 0.003, 6.25e-9, hammers[F6]);
-        strings[F6s] = new PianoString(sample_rate, 1479.98, 0.96, 0.0182, 0.0005, 9e7, 0.003, 6.25e-9, hammers[F6s]);
-        strings[G6] = new PianoString(sample_rate, 1567.98, 0.96, 0.0182, 0.0005, 9e7, 0.003, 6.25e-9, hammers[G6]);
-        strings[G6s] = new PianoString(sample_rate, 1661.22, 0.96, 0.0182, 0.0005, 9e7, 0.003, 6.25e-9, hammers[G6s]);
-        strings[A6] = new PianoString(sample_rate, 1760.00, 0.96, 0.0182, 0.0005, 9e7, 0.003, 6.25e-9, hammers[A6]);
-        strings[A6s] = new PianoString(sample_rate, 1864.66, 0.96, 0.0182, 0.0005, 9e7, 0.003, 6.25e-9, hammers[A6s]);
-        strings[B6] = new PianoString(sample_rate, 1975.53, 0.96, 0.0182, 0.0005, 9e7, 0.003, 6.25e-9, hammers[B6]);
-
-        strings[C7] = new PianoString(sample_rate, 2093.00, 0.96, 0.0182, 0.0005, 9e7, 0.003, 6.25e-9, hammers[C7]);
-        strings[C7s] = new PianoString(sample_rate, 2217.46, 0.96, 0.0182, 0.0005, 9e7, 0.003, 6.25e-9, hammers[C7s]);
-        strings[D7] = new PianoString(sample_rate, 2349.32, 0.96, 0.0182, 0.0005, 9e7, 0.003, 6.25e-9, hammers[D7]);
-        strings[D7s] = new PianoString(sample_rate, 2489.02, 0.96, 0.0182, 0.0005, 9e7, 0.003, 6.25e-9, hammers[D7s]);
-        strings[E7] = new PianoString(sample_rate, 2637.02, 0.96, 0.0182, 0.0005, 9e7, 0.003, 6.25e-9, hammers[E7]);
-        strings[F7] = new PianoString(sample_rate, 2793.83, 0.96, 0.0182, 0.0005, 9e7, 0.003, 6.25e-9, hammers[F7]);
-        strings[F7s] = new PianoString(sample_rate, 2959.96, 0.96, 0.0182, 0.0005, 9e7, 0.003, 6.25e-9, hammers[F7s]);
-        strings[G7] = new PianoString(sample_rate, 3135.96, 0.96, 0.0182, 0.0005, 9e7, 0.003, 6.25e-9, hammers[G7]);
-        strings[G7s] = new PianoString(sample_rate, 3322.44, 0.96, 0.0182, 0.0005, 9e7, 0.003, 6.25e-9, hammers[G7s]);
-        strings[A7] = new PianoString(sample_rate, 3520.00, 0.96, 0.0182, 0.0005, 9e7, 0.003, 6.25e-9, hammers[A7]);
-        strings[A7s] = new PianoString(sample_rate, 3729.31, 0.96, 0.0182, 0.0005, 9e7, 0.003, 6.25e-9, hammers[A7s]);
-        strings[B7] = new PianoString(sample_rate, 3951.07, 0.96, 0.0182, 0.0005, 9e7, 0.003, 6.25e-9, hammers[B7]);
-
-        strings[C8] = new PianoString(sample_rate, 4186.01, 0.96, 0.0182, 0.0005, 9e7, 0.003, 6.25e-9, hammers[C8]);*/
-    }
 };
 
 #endif // PIANO_H
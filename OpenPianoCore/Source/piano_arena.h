@@ -0,0 +1,96 @@
+/*
+OpenPiano: an open source piano engine based on physical modeling
+Copyright (C) 2021-2022 Michele Perrone
+Github: https://github.com/michele-perrone/OpenPiano
+Author e-mail: perrone(dot)michele(at)outlook(dot)com
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Affero General Public License as published
+by the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Affero General Public License for more details.
+
+You should have received a copy of the GNU Affero General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef PIANO_ARENA_H
+#define PIANO_ARENA_H
+
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+
+/* ******************************************************************** *
+ * One contiguous memory region for the whole piano model.              *
+ * The model is created twice: the first time the arena only measures   *
+ * how much memory is requested (allocate() returns nullptr), then it   *
+ * allocates a single region and hands out consecutive, cache-line      *
+ * aligned blocks of it. Since the strings are created in the order in  *
+ * which the worker threads compute them, each worker walks its memory  *
+ * linearly. The region is kept when the model is destroyed, and it is  *
+ * reused by the next model as long as it is large enough.              *
+ * ******************************************************************** */
+
+struct PianoArena
+{
+    static const size_t ALIGNMENT = 64; // Size of a cache line [bytes]
+
+    uint8_t* memory; // Region returned by malloc()
+    uint8_t* data; // First aligned byte of the region
+    size_t capacity; // Usable size of the region [bytes]
+    size_t used; // Bytes handed out (or measured) so far
+    bool measuring; // true -> allocate() only counts the requested bytes
+
+    PianoArena()
+    {
+        memory = nullptr;
+        data = nullptr;
+        capacity = 0;
+        used = 0;
+        measuring = false;
+    }
+    ~PianoArena()
+    {
+        free(memory);
+    }
+    void begin_measure()
+    {
+        measuring = true;
+        used = 0;
+    }
+    void begin_build()
+    {
+        // Grow the region only if the measured model doesn't fit in it
+        size_t required = used;
+        if(required > capacity)
+        {
+            free(memory);
+            memory = (uint8_t*)malloc(required+ALIGNMENT);
+            data = (uint8_t*)(((uintptr_t)memory + ALIGNMENT-1) & ~(uintptr_t)(ALIGNMENT-1));
+            capacity = required;
+        }
+        memset(data, 0, required);
+        measuring = false;
+        used = 0;
+    }
+    void* allocate(size_t size)
+    {
+        size_t offset = (used + ALIGNMENT-1) & ~(ALIGNMENT-1);
+        if(!measuring && offset+size > capacity) // The model changed between the two passes
+            return nullptr;
+        used = offset+size;
+        return measuring ? nullptr : data+offset;
+    }
+    template <typename T>
+    T* allocate_array(size_t count)
+    {
+        // The region is zeroed by begin_build()
+        return (T*)allocate(count*sizeof(T));
+    }
+};
+
+#endif // PIANO_ARENA_H
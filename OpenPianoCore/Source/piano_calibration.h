@@ -0,0 +1,236 @@
+/*
+OpenPiano: an open source piano engine based on physical modeling
+Copyright (C) 2021-2022 Michele Perrone
+Github: https://github.com/michele-perrone/OpenPiano
+Author e-mail: perrone(dot)michele(at)outlook(dot)com
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Affero General Public License as published
+by the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Affero General Public License for more details.
+
+You should have received a copy of the GNU Affero General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef PIANO_CALIBRATION_H
+#define PIANO_CALIBRATION_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <string>
+#include <thread>
+#include <algorithm>
+#include "compiled_model.h"
+#include "piano_description.h"
+#ifdef _WIN32
+#include <direct.h>
+#else
+#include <sys/stat.h>
+#endif
+
+/* ********************************************************************** *
+ * Calibration of the piano on this machine (see Piano::calibrate()).     *
+ * It holds what was measured, the cost of the string kernel on short     *
+ * and long strings and the cost of waking the worker threads up, and     *
+ * what was chosen from it: the worker threads, the render quantum, and   *
+ * the weight of each string in the partition of the strings among the   *
+ * threads (see PianoModel::partition_strings()).                         *
+ * It's cached in a text file, one "key value" per line, and measured     *
+ * again when the machine, the string model or the piano change. An       *
+ * operator can edit the file: with "pinned 1" its choices are used as    *
+ * they are, and the file is never measured again nor replaced. With      *
+ * $OPENPIANO_CALIBRATION set to "off", nothing is measured or read: the  *
+ * defaults of the caller apply (see Piano::load_or_calibrate()).         *
+ * ********************************************************************** */
+
+const uint32_t CALIBRATION_VERSION = 1;
+
+// Render quanta considered by the calibration [samples]
+const uint32_t CALIBRATION_QUANTA[] = {32, 64, 128, 256, 512, 1024};
+const uint32_t N_CALIBRATION_QUANTA = sizeof(CALIBRATION_QUANTA)/sizeof(uint32_t);
+
+// The chosen quantum must compute every string of the piano within this fraction of its duration
+const double CALIBRATION_LOAD_TARGET = 0.7;
+
+struct PianoCalibration
+{
+    bool valid; // false -> not calibrated, the defaults of the caller apply
+    bool pinned; // Chosen by an operator: used whatever the machine and the piano
+
+    // Where it was measured
+    uint32_t version;
+    char kernel[64]; // String model (see STRING_MODEL_NAME)
+    uint32_t hardware_threads; // std::thread::hardware_concurrency()
+    int sample_rate; // [Hz]
+    uint64_t description_hash; // Strings of the piano (see hash_description())
+
+    // Measurements
+    double string_ns; // Cost of a ringing string for each sample, whatever its length [ns]
+    double node_ns; // Cost of each spatial sample of a string for each sample [ns]
+    double wakeup_ns; // Cost of a quantum without anything to compute, with the chosen threads [ns]
+    double quantum_load; // Predicted duration of a quantum with every string ringing, over its deadline
+
+    // Choices
+    uint32_t n_threads;
+    uint32_t render_quantum; // [samples]
+    double string_overhead; // Fixed cost of a string in the partition, in spatial samples
+
+    PianoCalibration()
+    {
+        valid = false;
+        pinned = false;
+        version = CALIBRATION_VERSION;
+        snprintf(kernel, sizeof(kernel), "%s", STRING_MODEL_NAME);
+        hardware_threads = std::thread::hardware_concurrency();
+        sample_rate = 0;
+        description_hash = 0;
+        string_ns = 0.0;
+        node_ns = 0.0;
+        wakeup_ns = 0.0;
+        quantum_load = 0.0;
+        n_threads = std::max(1u, hardware_threads);
+        render_quantum = 0;
+        string_overhead = 0.0;
+    }
+    static uint64_t hash_description(const PianoDescription& description)
+    {
+        uint64_t hash = fnv1a(FNV1A_SEED, &description.n_strings, sizeof(description.n_strings));
+        return fnv1a(hash, description.notes, description.n_strings*sizeof(NoteParams));
+    }
+    bool matches(int sample_rate, const PianoDescription& description) const
+    {
+        // A pinned calibration matches anything
+        if(!valid)
+            return false;
+        return pinned || (version == CALIBRATION_VERSION && strcmp(kernel, STRING_MODEL_NAME) == 0 &&
+                          hardware_threads == std::thread::hardware_concurrency() &&
+                          this->sample_rate == sample_rate && description_hash == hash_description(description));
+    }
+    void print(FILE* file) const
+    {
+        // The measurements are left out of a pinned file written by hand
+        fprintf(file, "%u threads, quantum %u, string overhead %.1f spatial samples%s\n",
+                n_threads, render_quantum, string_overhead, pinned ? " (pinned)" : "");
+        if(node_ns > 0.0)
+            fprintf(file, "  String kernel %s: %.2f ns + %.3f ns per spatial sample, wake-up %.1f us,\n"
+                          "  %.0f%% of the quantum with every string ringing\n",
+                    kernel, string_ns, node_ns, wakeup_ns*1e-3, 100.0*quantum_load);
+    }
+    static bool disabled()
+    {
+        // $OPENPIANO_CALIBRATION is "off"
+        const char* path = getenv("OPENPIANO_CALIBRATION");
+        return path != nullptr && strcmp(path, "off") == 0;
+    }
+    static std::string default_path()
+    {
+        // $OPENPIANO_CALIBRATION if it's set, otherwise the cache directory of the user
+        const char* path = getenv("OPENPIANO_CALIBRATION");
+        if(path != nullptr && path[0] != '\0')
+            return path;
+#ifdef _WIN32
+        const char* base = getenv("LOCALAPPDATA");
+        return base != nullptr ? std::string(base) + "\\OpenPiano\\calibration.txt" : "openpiano-calibration.txt";
+#else
+        const char* xdg = getenv("XDG_CACHE_HOME");
+        const char* home = getenv("HOME");
+        if(xdg != nullptr && xdg[0] != '\0')
+            return std::string(xdg) + "/openpiano/calibration.txt";
+        return home != nullptr ? std::string(home) + "/.cache/openpiano/calibration.txt" : "openpiano-calibration.txt";
+#endif
+    }
+    bool load(const std::string& path)
+    {
+        // Unknown keys are skipped. Returns false (and "valid" stays false)
+        // if the file can't be read or doesn't choose the threads and the quantum.
+        // "pinned" is read either way.
+        *this = PianoCalibration();
+        FILE* file = fopen(path.c_str(), "r");
+        if(file == nullptr)
+            return false;
+        char line[256];
+        bool has_threads = false, has_quantum = false;
+        while(fgets(line, sizeof(line), file) != nullptr)
+        {
+            char key[64], value[128];
+            if(line[0] == '#' || sscanf(line, "%63s %127s", key, value) != 2)
+                continue;
+            if(strcmp(key, "pinned") == 0)
+                pinned = atoi(value) != 0;
+            else if(strcmp(key, "version") == 0)
+                version = (uint32_t)strtoul(value, nullptr, 10);
+            else if(strcmp(key, "kernel") == 0)
+            {
+                // A name that doesn't fit isn't one of ours: the calibration is stale
+                size_t length = strlen(value);
+                kernel[0] = '\0';
+                if(length < sizeof(kernel))
+                    memcpy(kernel, value, length+1);
+            }
+            else if(strcmp(key, "hardware_threads") == 0)
+                hardware_threads = (uint32_t)strtoul(value, nullptr, 10);
+            else if(strcmp(key, "sample_rate") == 0)
+                sample_rate = atoi(value);
+            else if(strcmp(key, "description_hash") == 0)
+                description_hash = strtoull(value, nullptr, 16);
+            else if(strcmp(key, "string_ns") == 0)
+                string_ns = atof(value);
+            else if(strcmp(key, "node_ns") == 0)
+                node_ns = atof(value);
+            else if(strcmp(key, "wakeup_ns") == 0)
+                wakeup_ns = atof(value);
+            else if(strcmp(key, "quantum_load") == 0)
+                quantum_load = atof(value);
+            else if(strcmp(key, "threads") == 0)
+                has_threads = (n_threads = (uint32_t)strtoul(value, nullptr, 10)) > 0;
+            else if(strcmp(key, "quantum") == 0)
+                has_quantum = (render_quantum = (uint32_t)strtoul(value, nullptr, 10)) > 0;
+            else if(strcmp(key, "string_overhead") == 0)
+                string_overhead = std::max(0.0, atof(value));
+        }
+        fclose(file);
+        valid = has_threads && has_quantum;
+        return valid;
+    }
+    bool save(const std::string& path) const
+    {
+        // The directory is created if it's missing (one level only)
+        size_t slash = path.find_last_of("/\\");
+        if(slash != std::string::npos && slash > 0)
+        {
+#ifdef _WIN32
+            _mkdir(path.substr(0, slash).c_str());
+#else
+            mkdir(path.substr(0, slash).c_str(), 0755);
+#endif
+        }
+        FILE* file = fopen(path.c_str(), "w");
+        if(file == nullptr)
+            return false;
+        fprintf(file, "# OpenPiano calibration (see \"piano_calibration.h\").\n"
+                      "# Set \"pinned\" to 1 to keep the choices below, whatever the machine.\n");
+        fprintf(file, "pinned %d\n", pinned ? 1 : 0);
+        fprintf(file, "version %u\n", version);
+        fprintf(file, "kernel %s\n", kernel);
+        fprintf(file, "hardware_threads %u\n", hardware_threads);
+        fprintf(file, "sample_rate %d\n", sample_rate);
+        fprintf(file, "description_hash %016llx\n", (unsigned long long)description_hash);
+        fprintf(file, "string_ns %.4f\n", string_ns);
+        fprintf(file, "node_ns %.4f\n", node_ns);
+        fprintf(file, "wakeup_ns %.0f\n", wakeup_ns);
+        fprintf(file, "quantum_load %.3f\n", quantum_load);
+        fprintf(file, "threads %u\n", n_threads);
+        fprintf(file, "quantum %u\n", render_quantum);
+        fprintf(file, "string_overhead %.1f\n", string_overhead);
+        return fclose(file) == 0;
+    }
+};
+
+#endif // PIANO_CALIBRATION_H
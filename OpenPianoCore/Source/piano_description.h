@@ -0,0 +1,259 @@
+/*
+OpenPiano: an open source piano engine based on physical modeling
+Copyright (C) 2021-2022 Michele Perrone
+Github: https://github.com/michele-perrone/OpenPiano
+Author e-mail: perrone(dot)michele(at)outlook(dot)com
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Affero General Public License as published
+by the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Affero General Public License for more details.
+
+You should have received a copy of the GNU Affero General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef PIANO_DESCRIPTION_H
+#define PIANO_DESCRIPTION_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+
+/* ********************************************************************** *
+ * Description of a piano model: the physical parameters of the string    *
+ * and of the hammer of each note, starting from A0. The piano builds its *
+ * strings, sizes its memory and splits the work among its threads from  *
+ * this table, so a different instrument can be loaded from a CSV file    *
+ * (see load_csv()) without recompiling.                                  *
+ * ********************************************************************** */
+
+const int MAX_STRINGS = 88; // A0 ... C8
+
+struct NoteParams
+{
+    // String
+    double f0; // Fund. frequency [Hz]
+    double L; // Total length [m]
+    double rho; // Linear density [kg/m]
+    double S; // Cross-sectional area of the string [m^2]
+    double E; // Young's modulus [N/m^2]
+    double b1; // First damping coefficient
+    double b2; // Second damping coefficient
+
+    // Hammer
+    double Mh; // Total mass [kg]
+    double p; // Stiffness nonlinear exponent
+    double bH; // FD parameter
+    double K; // Stiffness [N/m]
+    double a; // Contact point, normalized in the range (0,1]
+    double g_meters; // Hammer length [m]
+};
+
+// Parameters of the default piano, one row for each key of the keyboard
+constexpr NoteParams DEFAULT_NOTE_PARAMS[MAX_STRINGS] =
+{
+    //  f0,    L,   rho,     S,   E,    b1,      b2,      Mh,   p,    bH,    K,    a, g_meters
+    {27.5, 1.92, 0.0182, 0.001, 9e7, 0.003, 6.25e-9, 4.9e-03, 2.3, 1e-04, 4e08, 0.12, 0.05}, // A0
+    {29.14, 1.92, 0.0182, 0.001, 9e7, 0.003, 6.25e-9, 4.9e-03, 2.3, 1e-04, 4e08, 0.12, 0.05}, // A0#
+    {30.87, 1.92, 0.0182, 0.001, 9e7, 0.003, 6.25e-9, 4.9e-03, 2.3, 1e-04, 4e08, 0.12, 0.05}, // B0
+
+    {32.7, 1.92, 0.0182, 0.001, 9e7, 0.003, 6.25e-9, 4.9e-03, 2.3, 1e-04, 4e08, 0.12, 0.05}, // C1
+    {34.65, 1.92, 0.0182, 0.001, 9e7, 0.003, 6.25e-9, 4.9e-03, 2.3, 1e-04, 4e08, 0.12, 0.05}, // C1#
+    {36.71, 1.92, 0.0182, 0.001, 9e7, 0.003, 6.25e-9, 4.9e-03, 2.3, 1e-04, 4e08, 0.12, 0.05}, // D1
+    {38.89, 1.92, 0.0182, 0.001, 9e7, 0.003, 6.25e-9, 4.9e-03, 2.3, 1e-04, 4e08, 0.12, 0.05}, // D1#
+    {41.20, 1.92, 0.0182, 0.001, 9e7, 0.003, 6.25e-9, 4.9e-03, 2.3, 1e-04, 4e08, 0.12, 0.05}, // E1
+    {43.65, 1.92, 0.0182, 0.001, 9e7, 0.003, 6.25e-9, 4.9e-03, 2.3, 1e-04, 4e08, 0.12, 0.05}, // F1
+    {46.25, 1.92, 0.0182, 0.001, 9e7, 0.003, 6.25e-9, 4.9e-03, 2.3, 1e-04, 4e08, 0.12, 0.05}, // F1#
+    {49.00, 1.92, 0.0182, 0.001, 9e7, 0.003, 6.25e-9, 4.9e-03, 2.3, 1e-04, 4e08, 0.12, 0.05}, // G1
+    {51.91, 1.92, 0.0182, 0.001, 9e7, 0.003, 6.25e-9, 4.9e-03, 2.3, 1e-04, 4e08, 0.12, 0.05}, // G1#
+    {55.00, 1.92, 0.0182, 0.001, 9e7, 0.003, 6.25e-9, 4.9e-03, 2.3, 1e-04, 4e08, 0.12, 0.05}, // A1
+    {58.27, 1.92, 0.0182, 0.001, 9e7, 0.003, 6.25e-9, 4.9e-03, 2.3, 1e-04, 4e08, 0.12, 0.05}, // A1#
+    {61.74, 1.92, 0.0182, 0.001, 9e7, 0.003, 6.25e-9, 4.9e-03, 2.3, 1e-04, 4e08, 0.12, 0.05}, // B1
+
+    {65.41, 1.92, 0.0182, 0.001, 9e7, 0.003, 6.25e-9, 4.9e-03, 2.3, 1e-04, 4e08, 0.12, 0.05}, // C2
+    {69.30, 1.92, 0.0182, 0.001, 9e7, 0.003, 6.25e-9, 4.9e-03, 2.3, 1e-04, 4e08, 0.12, 0.05}, // C2#
+    {73.42, 1.92, 0.0182, 0.001, 9e7, 0.003, 6.25e-9, 4.9e-03, 2.3, 1e-04, 4e08, 0.12, 0.05}, // D2
+    {77.78, 1.92, 0.0182, 0.001, 9e7, 0.003, 6.25e-9, 4.9e-03, 2.3, 1e-04, 4e08, 0.12, 0.05}, // D2#
+    {82.41, 1.92, 0.0182, 0.001, 9e7, 0.003, 6.25e-9, 4.9e-03, 2.3, 1e-04, 4e08, 0.12, 0.05}, // E2
+    {87.31, 1.92, 0.0182, 0.001, 9e7, 0.003, 6.25e-9, 4.9e-03, 2.3, 1e-04, 4e08, 0.12, 0.05}, // F2
+    {92.50, 1.92, 0.0182, 0.001, 9e7, 0.003, 6.25e-9, 4.9e-03, 2.3, 1e-04, 4e08, 0.12, 0.05}, // F2#
+    {98.00, 1.92, 0.0182, 0.001, 9e7, 0.003, 6.25e-9, 4.9e-03, 2.3, 1e-04, 4e08, 0.12, 0.05}, // G2
+    {103.83, 1.92, 0.0182, 0.001, 9e7, 0.003, 6.25e-9, 4.9e-03, 2.3, 1e-04, 4e08, 0.12, 0.05}, // G2#
+    {110.00, 1.92, 0.0182, 0.001, 9e7, 0.003, 6.25e-9, 4.9e-03, 2.3, 1e-04, 4e08, 0.12, 0.05}, // A2
+    {116.54, 1.92, 0.0182, 0.001, 9e7, 0.003, 6.25e-9, 4.9e-03, 2.3, 1e-04, 4e08, 0.12, 0.05}, // A2#
+    {123.47, 1.92, 0.0182, 0.001, 9e7, 0.003, 6.25e-9, 4.9e-03, 2.3, 1e-04, 4e08, 0.12, 0.05}, // B2
+
+    {130.81, 0.96, 0.0182, 0.001, 9e7, 0.003, 6.25e-9, 4.9e-03, 2.3, 1e-04, 4e08, 0.12, 0.05}, // C3
+    {138.59, 0.96, 0.0182, 0.001, 9e7, 0.003, 6.25e-9, 4.9e-03, 2.3, 1e-04, 4e08, 0.12, 0.05}, // C3#
+    {146.83, 0.96, 0.0182, 0.001, 9e7, 0.003, 6.25e-9, 4.9e-03, 2.3, 1e-04, 4e08, 0.12, 0.05}, // D3
+    {155.56, 0.96, 0.0182, 0.001, 9e7, 0.003, 6.25e-9, 4.9e-03, 2.3, 1e-04, 4e08, 0.12, 0.05}, // D3#
+    {164.81, 0.96, 0.0182, 0.001, 9e7, 0.003, 6.25e-9, 4.9e-03, 2.3, 1e-04, 4e08, 0.12, 0.05}, // E3
+    {174.61, 0.96, 0.0182, 0.001, 9e7, 0.003, 6.25e-9, 4.9e-03, 2.3, 1e-04, 4e08, 0.12, 0.05}, // F3
+    {185.00, 0.96, 0.0182, 0.001, 9e7, 0.003, 6.25e-9, 4.9e-03, 2.3, 1e-04, 4e08, 0.12, 0.05}, // F3#
+    {196, 0.96, 0.0182, 0.001, 9e7, 0.003, 6.25e-9, 4.9e-03, 2.3, 1e-04, 4e08, 0.12, 0.05}, // G3
+    {207.65, 0.96, 0.0182, 0.001, 9e7, 0.003, 6.25e-9, 4.9e-03, 2.3, 1e-04, 4e08, 0.12, 0.05}, // G3#
+    {220, 0.96, 0.0182, 0.001, 9e7, 0.003, 6.25e-9, 4.9e-03, 2.3, 1e-04, 4e08, 0.12, 0.05}, // A3
+    {233.08, 0.96, 0.0182, 0.001, 9e7, 0.003, 6.25e-9, 4.9e-03, 2.3, 1e-04, 4e08, 0.12, 0.05}, // A3#
+    {246.94, 0.96, 0.0182, 0.001, 9e7, 0.003, 6.25e-9, 4.9e-03, 2.3, 1e-04, 4e08, 0.12, 0.05}, // B3
+
+    {261.63, 0.96, 0.0182, 0.001, 9e7, 0.003, 6.25e-9, 4.9e-03, 2.3, 1e-04, 4e08, 0.12, 0.05}, // C4
+    {277.18, 0.96, 0.0182, 0.001, 9e7, 0.003, 6.25e-9, 4.9e-03, 2.3, 1e-04, 4e08, 0.12, 0.05}, // C4#
+    {293.66, 0.96, 0.0182, 0.001, 9e7, 0.003, 6.25e-9, 4.9e-03, 2.3, 1e-04, 4e08, 0.12, 0.05}, // D4
+    {311.13, 0.96, 0.0182, 0.001, 9e7, 0.003, 6.25e-9, 4.9e-03, 2.3, 1e-04, 4e08, 0.12, 0.05}, // D4#
+    {329.63, 0.96, 0.0182, 0.001, 9e7, 0.003, 6.25e-9, 4.9e-03, 2.3, 1e-04, 4e08, 0.12, 0.05}, // E4
+    {349.23, 0.96, 0.0182, 0.001, 9e7, 0.003, 6.25e-9, 4.9e-03, 2.3, 1e-04, 4e08, 0.12, 0.05}, // F4
+    {369.99, 0.96, 0.0182, 0.001, 9e7, 0.003, 6.25e-9, 4.9e-03, 2.3, 1e-04, 4e08, 0.12, 0.05}, // F4#
+    {392.00, 0.96, 0.0182, 0.001, 9e7, 0.003, 6.25e-9, 4.9e-03, 2.3, 1e-04, 4e08, 0.12, 0.05}, // G4
+    {415.30, 0.96, 0.0182, 0.001, 9e7, 0.003, 6.25e-9, 4.9e-03, 2.3, 1e-04, 4e08, 0.12, 0.05}, // G4#
+    {440.00, 0.96, 0.0182, 0.001, 9e7, 0.003, 6.25e-9, 4.9e-03, 2.3, 1e-04, 4e08, 0.12, 0.05}, // A4
+    {466.16, 0.96, 0.0182, 0.001, 9e7, 0.003, 6.25e-9, 4.9e-03, 2.3, 1e-04, 4e08, 0.12, 0.05}, // A4#
+    {493.88, 0.96, 0.0182, 0.001, 9e7, 0.003, 6.25e-9, 4.9e-03, 2.3, 1e-04, 4e08, 0.12, 0.05}, // B4
+
+    {523.25, 0.96, 0.0182, 0.0008, 9e7, 0.003, 6.25e-9, 4.9e-03, 2.3, 1e-04, 4e08, 0.12, 0.05}, // C5
+    {554.37, 0.96, 0.0182, 0.0008, 9e7, 0.003, 6.25e-9, 4.9e-03, 2.3, 1e-04, 4e08, 0.12, 0.05}, // C5#
+    {587.33, 0.96, 0.0182, 0.0008, 9e7, 0.003, 6.25e-9, 4.9e-03, 2.3, 1e-04, 4e08, 0.12, 0.05}, // D5
+    {622.25, 0.96, 0.0182, 0.0008, 9e7, 0.003, 6.25e-9, 4.9e-03, 2.3, 1e-04, 4e08, 0.12, 0.05}, // D5#
+    {659.26, 0.96, 0.0182, 0.0008, 9e7, 0.003, 6.25e-9, 4.9e-03, 2.3, 1e-04, 4e08, 0.12, 0.05}, // E5
+    {698.46, 0.96, 0.0182, 0.0008, 9e7, 0.003, 6.25e-9, 4.9e-03, 2.3, 1e-04, 4e08, 0.12, 0.05}, // F5
+    {739.99, 0.96, 0.0182, 0.0008, 9e7, 0.003, 6.25e-9, 4.9e-03, 2.3, 1e-04, 4e08, 0.12, 0.05}, // F5#
+    {783.99, 0.96, 0.0182, 0.0008, 9e7, 0.003, 6.25e-9, 4.9e-03, 2.3, 1e-04, 4e08, 0.12, 0.05}, // G5
+    {830.61, 0.96, 0.0182, 0.0008, 9e7, 0.003, 6.25e-9, 4.9e-03, 2.3, 1e-04, 4e08, 0.12, 0.05}, // G5#
+    {880.00, 0.96, 0.0182, 0.0008, 9e7, 0.003, 6.25e-9, 4.9e-03, 2.3, 1e-04, 4e08, 0.12, 0.05}, // A5
+    {932.33, 0.96, 0.0182, 0.0008, 9e7, 0.003, 6.25e-9, 4.9e-03, 2.3, 1e-04, 4e08, 0.12, 0.05}, // A5#
+    {987.77, 0.96, 0.0182, 0.0008, 9e7, 0.003, 6.25e-9, 4.9e-03, 2.3, 1e-04, 4e08, 0.12, 0.05}, // B5
+
+    {1046.50, 0.96, 0.0182, 0.0005, 9e7, 0.003, 6.25e-9, 4.9e-03, 2.3, 1e-04, 4e08, 0.12, 0.05}, // C6
+    {1108.73, 0.96, 0.0182, 0.0005, 9e7, 0.003, 6.25e-9, 4.9e-03, 2.3, 1e-04, 4e08, 0.12, 0.05}, // C6#
+    {1174.66, 0.96, 0.0182, 0.0005, 9e7, 0.003, 6.25e-9, 4.9e-03, 2.3, 1e-04, 4e08, 0.12, 0.05}, // D6
+    {1244.51, 0.96, 0.0182, 0.0005, 9e7, 0.003, 6.25e-9, 4.9e-03, 2.3, 1e-04, 4e08, 0.12, 0.05}, // D6#
+    {1318.51, 0.96, 0.0182, 0.0005, 9e7, 0.003, 6.25e-9, 4.9e-03, 2.3, 1e-04, 4e08, 0.12, 0.05}, // E6
+    {1396.91, 0.96, 0.0182, 0.0005, 9e7, 0.003, 6.25e-9, 4.9e-03, 2.3, 1e-04, 4e08, 0.12, 0.05}, // F6
+    {1479.98, 0.96, 0.0182, 0.0005, 9e7, 0.003, 6.25e-9, 4.9e-03, 2.3, 1e-04, 4e08, 0.12, 0.05}, // F6#
+    {1567.98, 0.96, 0.0182, 0.0005, 9e7, 0.003, 6.25e-9, 4.9e-03, 2.3, 1e-04, 4e08, 0.12, 0.05}, // G6
+    {1661.22, 0.96, 0.0182, 0.0005, 9e7, 0.003, 6.25e-9, 4.9e-03, 2.3, 1e-04, 4e08, 0.12, 0.05}, // G6#
+    {1760.00, 0.96, 0.0182, 0.0005, 9e7, 0.003, 6.25e-9, 4.9e-03, 2.3, 1e-04, 4e08, 0.12, 0.05}, // A6
+    {1864.66, 0.96, 0.0182, 0.0005, 9e7, 0.003, 6.25e-9, 4.9e-03, 2.3, 1e-04, 4e08, 0.12, 0.05}, // A6#
+    {1975.53, 0.96, 0.0182, 0.0005, 9e7, 0.003, 6.25e-9, 4.9e-03, 2.3, 1e-04, 4e08, 0.12, 0.05}, // B6
+
+    {2093.00, 0.96, 0.0182, 0.0005, 9e7, 0.003, 6.25e-9, 4.9e-03, 2.3, 1e-04, 4e08, 0.12, 0.05}, // C7
+    {2217.46, 0.96, 0.0182, 0.0005, 9e7, 0.003, 6.25e-9, 4.9e-03, 2.3, 1e-04, 4e08, 0.12, 0.05}, // C7#
+    {2349.32, 0.96, 0.0182, 0.0005, 9e7, 0.003, 6.25e-9, 4.9e-03, 2.3, 1e-04, 4e08, 0.12, 0.05}, // D7
+    {2489.02, 0.96, 0.0182, 0.0005, 9e7, 0.003, 6.25e-9, 4.9e-03, 2.3, 1e-04, 4e08, 0.12, 0.05}, // D7#
+    {2637.02, 0.96, 0.0182, 0.0005, 9e7, 0.003, 6.25e-9, 4.9e-03, 2.3, 1e-04, 4e08, 0.12, 0.05}, // E7
+    {2793.83, 0.96, 0.0182, 0.0005, 9e7, 0.003, 6.25e-9, 4.9e-03, 2.3, 1e-04, 4e08, 0.12, 0.05}, // F7
+    {2959.96, 0.96, 0.0182, 0.0005, 9e7, 0.003, 6.25e-9, 4.9e-03, 2.3, 1e-04, 4e08, 0.12, 0.05}, // F7#
+    {3135.96, 0.96, 0.0182, 0.0005, 9e7, 0.003, 6.25e-9, 4.9e-03, 2.3, 1e-04, 4e08, 0.12, 0.05}, // G7
+    {3322.44, 0.96, 0.0182, 0.0005, 9e7, 0.003, 6.25e-9, 4.9e-03, 2.3, 1e-04, 4e08, 0.12, 0.05}, // G7#
+    {3520.00, 0.96, 0.0182, 0.0005, 9e7, 0.003, 6.25e-9, 4.9e-03, 2.3, 1e-04, 4e08, 0.12, 0.05}, // A7
+    {3729.31, 0.96, 0.0182, 0.0005, 9e7, 0.003, 6.25e-9, 4.9e-03, 2.3, 1e-04, 4e08, 0.12, 0.05}, // A7#
+    {3951.07, 0.96, 0.0182, 0.0005, 9e7, 0.003, 6.25e-9, 4.9e-03, 2.3, 1e-04, 4e08, 0.12, 0.05}, // B7
+
+    {4186.01, 0.96, 0.0182, 0.0005, 9e7, 0.003, 6.25e-9, 4.9e-03, 2.3, 1e-04, 4e08, 0.12, 0.05}, // C8
+};
+
+// Computing all the strings is still too expensive: by default, the piano stops at C5
+const int DEFAULT_N_STRINGS = 52;
+const int MIDI_NOTE_OFFSET = 21; // MIDI note of A0, the first string
+
+// Column names of the CSV files, in this order
+const char* const NOTE_PARAMS_COLUMNS = "note,f0,L,rho,S,E,b1,b2,Mh,p,bH,K,a,g_meters";
+const int N_NOTE_PARAMS = 13;
+
+struct PianoDescription
+{
+    uint32_t n_strings; // The strings are the first "n_strings" keys, starting from A0
+    NoteParams notes[MAX_STRINGS];
+
+    PianoDescription(uint32_t n_strings = DEFAULT_N_STRINGS)
+    {
+        this->n_strings = n_strings > (uint32_t)MAX_STRINGS ? MAX_STRINGS : n_strings;
+        memcpy(notes, DEFAULT_NOTE_PARAMS, sizeof(notes));
+    }
+    bool operator==(const PianoDescription& other) const
+    {
+        return n_strings == other.n_strings && memcmp(notes, other.notes, n_strings*sizeof(NoteParams)) == 0;
+    }
+    bool load_csv(const char* path)
+    {
+        // One line for each note, in ascending order starting from A0. The first column
+        // is the MIDI note number (21 for A0), followed by the parameters in the order
+        // of NOTE_PARAMS_COLUMNS. Empty lines, lines starting with '#' and a header line
+        // starting with "note" are skipped. Returns false (leaving the description
+        // untouched) if the file can't be read or a line is malformed.
+        FILE* file = fopen(path, "r");
+        if(file == nullptr)
+            return false;
+
+        NoteParams* loaded = (NoteParams*)malloc(sizeof(notes));
+        uint32_t n_loaded = 0;
+        bool valid = true;
+        char line[1024];
+        while(valid && fgets(line, sizeof(line), file) != nullptr)
+        {
+            char* c = line;
+            while(*c == ' ' || *c == '\t')
+                c++;
+            if(*c == '\0' || *c == '\n' || *c == '\r' || *c == '#' || strncmp(c, "note", 4) == 0)
+                continue;
+
+            double values[N_NOTE_PARAMS+1];
+            for(int k = 0; k < N_NOTE_PARAMS+1 && valid; k++)
+            {
+                char* end;
+                values[k] = strtod(c, &end);
+                valid = (end != c);
+                c = end;
+                while(*c == ' ' || *c == '\t')
+                    c++;
+                if(k < N_NOTE_PARAMS)
+                {
+                    valid = valid && (*c == ',');
+                    c++;
+                }
+            }
+            // The notes must be contiguous, starting from A0 (MIDI note 21)
+            valid = valid && n_loaded < (uint32_t)MAX_STRINGS && (int)values[0] == 21+(int)n_loaded;
+            if(valid)
+            {
+                memcpy(&loaded[n_loaded], &values[1], sizeof(NoteParams));
+                valid = loaded[n_loaded].f0 > 0 && loaded[n_loaded].L > 0 && loaded[n_loaded].rho > 0
+                        && loaded[n_loaded].S > 0 && loaded[n_loaded].Mh > 0
+                        && loaded[n_loaded].a > 0 && loaded[n_loaded].a <= 1;
+                n_loaded++;
+            }
+        }
+        fclose(file);
+
+        if(valid && n_loaded > 0)
+        {
+            memcpy(notes, loaded, n_loaded*sizeof(NoteParams));
+            n_strings = n_loaded;
+        }
+        free(loaded);
+        return valid && n_loaded > 0;
+    }
+    bool save_csv(const char* path) const
+    {
+        // Writes the description in the format read by load_csv(),
+        // e.g. to start a new instrument from the default piano
+        FILE* file = fopen(path, "w");
+        if(file == nullptr)
+            return false;
+        fprintf(file, "%s\n", NOTE_PARAMS_COLUMNS);
+        for(uint32_t i = 0; i < n_strings; i++)
+        {
+            const NoteParams& n = notes[i];
+            fprintf(file, "%u,%.17g,%.17g,%.17g,%.17g,%.17g,%.17g,%.17g,%.17g,%.17g,%.17g,%.17g,%.17g,%.17g\n",
+                    21+i, n.f0, n.L, n.rho, n.S, n.E, n.b1, n.b2, n.Mh, n.p, n.bH, n.K, n.a, n.g_meters);
+        }
+        return fclose(file) == 0;
+    }
+};
+
+#endif // PIANO_DESCRIPTION_H
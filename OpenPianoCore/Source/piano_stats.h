@@ -0,0 +1,317 @@
+/*
+OpenPiano: an open source piano engine based on physical modeling
+Copyright (C) 2021-2022 Michele Perrone
+Github: https://github.com/michele-perrone/OpenPiano
+Author e-mail: perrone(dot)michele(at)outlook(dot)com
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Affero General Public License as published
+by the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Affero General Public License for more details.
+
+You should have received a copy of the GNU Affero General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef PIANO_STATS_H
+#define PIANO_STATS_H
+
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <atomic>
+#include <chrono>
+#include "piano_description.h"
+#ifdef _MSC_VER
+#include <intrin.h>
+#elif defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+// Upper limit of the worker threads: each one computes a range of whole strings
+const uint32_t MAX_THREADS = MAX_STRINGS;
+
+/* ********************************************************************** *
+ * Load instrumentation of the piano (see Piano::stats()).                *
+ * Each value has a single writer, the audio thread (the workers' time    *
+ * is recorded once per quantum, see record_workers()), and it            *
+ * is a relaxed atomic: recording never waits, and any thread can read    *
+ * the values at any time. A snapshot isn't taken atomically as a whole:  *
+ * a block recorded in the meantime can appear in some of its fields      *
+ * and not in others. The counters only grow: the load over a period of   *
+ * time is the difference of two snapshots (see PianoStats::since()).     *
+ * ********************************************************************** */
+
+struct LoadHistogram
+{
+    // Log-linear buckets: SUB_BUCKETS linear buckets for each power of two,
+    // so any value is known within 1/SUB_BUCKETS of itself.
+    // The values below SUB_BUCKETS have a bucket each.
+    static const uint32_t SUB_BITS = 4;
+    static const uint32_t SUB_BUCKETS = 1 << SUB_BITS;
+    static const uint32_t N_BUCKETS = (64-SUB_BITS+1)*SUB_BUCKETS; // Covers the whole uint64_t range
+
+    std::atomic<uint64_t> counts[N_BUCKETS];
+
+    LoadHistogram()
+    {
+        for(uint32_t b = 0; b < N_BUCKETS; b++)
+            counts[b].store(0, std::memory_order_relaxed);
+    }
+    void record(uint64_t value)
+    {
+        std::atomic<uint64_t>& count = counts[bucket_of(value)];
+        count.store(count.load(std::memory_order_relaxed)+1, std::memory_order_relaxed); // Single writer
+    }
+    static uint32_t bucket_of(uint64_t value)
+    {
+        if(value < SUB_BUCKETS)
+            return (uint32_t)value;
+        uint32_t msb = most_significant_bit(value);
+        uint32_t shift = msb-SUB_BITS;
+        return (shift+1)*SUB_BUCKETS + (uint32_t)((value >> shift) & (SUB_BUCKETS-1));
+    }
+    static uint64_t lower_bound(uint32_t bucket)
+    {
+        // Smallest value of the bucket
+        if(bucket < SUB_BUCKETS)
+            return bucket;
+        uint32_t shift = bucket/SUB_BUCKETS-1;
+        return (uint64_t)(SUB_BUCKETS + bucket%SUB_BUCKETS) << shift;
+    }
+    static uint32_t most_significant_bit(uint64_t value)
+    {
+#ifdef _MSC_VER
+        unsigned long index;
+        _BitScanReverse64(&index, value);
+        return (uint32_t)index;
+#else
+        return 63 - (uint32_t)__builtin_clzll(value);
+#endif
+    }
+};
+
+struct HistogramSnapshot
+{
+    uint64_t counts[LoadHistogram::N_BUCKETS];
+    uint64_t total; // Values recorded
+
+    void read(const LoadHistogram& histogram)
+    {
+        total = 0;
+        for(uint32_t b = 0; b < LoadHistogram::N_BUCKETS; b++)
+        {
+            counts[b] = histogram.counts[b].load(std::memory_order_relaxed);
+            total += counts[b];
+        }
+    }
+    double percentile(double p) const
+    {
+        // Middle of the bucket that holds the requested rank (0 if nothing was recorded)
+        if(total == 0)
+            return 0.0;
+        uint64_t rank = (uint64_t)(p*(total-1));
+        uint64_t seen = 0;
+        for(uint32_t b = 0; b < LoadHistogram::N_BUCKETS; b++)
+        {
+            seen += counts[b];
+            if(seen > rank)
+            {
+                double low = (double)LoadHistogram::lower_bound(b);
+                double high = b+1 < LoadHistogram::N_BUCKETS ? (double)LoadHistogram::lower_bound(b+1) : low;
+                return 0.5*(low+high);
+            }
+        }
+        return 0.0;
+    }
+    double max() const
+    {
+        // Upper end of the highest bucket used
+        for(uint32_t b = LoadHistogram::N_BUCKETS; b > 0; b--)
+        {
+            if(counts[b-1] > 0)
+                return b < LoadHistogram::N_BUCKETS ? (double)LoadHistogram::lower_bound(b) : (double)UINT64_MAX;
+        }
+        return 0.0;
+    }
+};
+
+struct alignas(64) WorkerLoad
+{
+    // One cache line per worker, so that the workers never write to the same line
+    std::atomic<uint64_t> busy_ns; // Time spent computing strings
+    std::atomic<uint64_t> blocks; // Blocks computed
+    uint64_t quantum_busy_ns; // Time spent in the current quantum, written by the worker alone
+};
+
+struct PianoLoad
+{
+    LoadHistogram block_ns; // Wall time of each render quantum [ns]
+    std::atomic<uint64_t> blocks; // Render quanta computed
+    std::atomic<uint64_t> block_ns_total; // Their wall time [ns]
+    std::atomic<uint64_t> audio_ns_total; // Duration of the audio they hold [ns]
+    std::atomic<uint64_t> events_applied; // Note events (see Piano::schedule_note_event())
+    std::atomic<uint32_t> active_strings; // Strings vibrating at the end of the last quantum
+    std::atomic<uint32_t> peak_active_strings;
+    std::atomic<uint64_t> rebalances; // Moves of the strings between the workers (see Piano::rebalance())
+    WorkerLoad* workers;
+    uint32_t n_workers;
+
+    PianoLoad()
+    {
+        workers = nullptr;
+        n_workers = 0;
+        blocks = 0;
+        block_ns_total = 0;
+        audio_ns_total = 0;
+        events_applied = 0;
+        active_strings = 0;
+        peak_active_strings = 0;
+        rebalances = 0;
+    }
+    ~PianoLoad()
+    {
+        delete[] workers;
+    }
+    void init(uint32_t n_workers)
+    {
+        delete[] workers;
+        workers = new WorkerLoad[n_workers];
+        for(uint32_t w = 0; w < n_workers; w++)
+        {
+            workers[w].busy_ns = 0;
+            workers[w].blocks = 0;
+            workers[w].quantum_busy_ns = 0;
+        }
+        this->n_workers = n_workers;
+    }
+    static uint64_t now_ns()
+    {
+        // Steady clock, about 20 ns per call on current systems
+        return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(
+                    std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+    static uint64_t now_ticks()
+    {
+        // Cycle counter, a few ns per call without a system call. Its frequency isn't known:
+        // use it only to compare costs measured on the same machine. The steady clock elsewhere.
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+        return __rdtsc();
+#elif defined(__aarch64__) && !defined(_MSC_VER)
+        uint64_t ticks;
+        asm volatile("mrs %0, cntvct_el0" : "=r"(ticks));
+        return ticks;
+#else
+        return now_ns();
+#endif
+    }
+    static void add(std::atomic<uint64_t>& counter, uint64_t value)
+    {
+        // Single writer: a plain load and store, without a locked instruction
+        counter.store(counter.load(std::memory_order_relaxed)+value, std::memory_order_relaxed);
+    }
+    void add_worker_time(uint32_t idx_thread, uint64_t busy_ns)
+    {
+        // Called by each worker after its share of a block. A quantum can hold two blocks,
+        // while a model fades out (see Piano::render_models()).
+        workers[idx_thread].quantum_busy_ns += busy_ns;
+    }
+    void record_workers()
+    {
+        // Called by the audio thread after each render quantum, when the workers are waiting
+        for(uint32_t w = 0; w < n_workers; w++)
+        {
+            add(workers[w].busy_ns, workers[w].quantum_busy_ns);
+            add(workers[w].blocks, 1);
+            workers[w].quantum_busy_ns = 0;
+        }
+    }
+    void record_block(uint64_t wall_ns, uint64_t audio_ns, uint32_t n_events, uint32_t n_active)
+    {
+        // Called by the audio thread after each render quantum
+        block_ns.record(wall_ns);
+        add(blocks, 1);
+        add(block_ns_total, wall_ns);
+        add(audio_ns_total, audio_ns);
+        add(events_applied, n_events);
+        active_strings.store(n_active, std::memory_order_relaxed);
+        if(n_active > peak_active_strings.load(std::memory_order_relaxed))
+            peak_active_strings.store(n_active, std::memory_order_relaxed);
+    }
+    void record_rebalance()
+    {
+        // Called by the audio thread when the strings change hands
+        add(rebalances, 1);
+    }
+};
+
+struct PianoStats
+{
+    uint64_t blocks; // Render quanta computed
+    uint64_t block_ns_total; // Wall time spent computing them [ns]
+    uint64_t audio_ns_total; // Duration of the audio they hold [ns]
+    HistogramSnapshot block_ns; // Wall time of each quantum [ns]
+    uint64_t events_applied;
+    uint32_t active_strings; // At the end of the last quantum
+    uint32_t peak_active_strings; // Since the piano was created
+    uint64_t rebalances; // Moves of the strings between the workers
+    uint32_t n_threads;
+    uint64_t worker_busy_ns[MAX_THREADS]; // Time each worker spent computing its strings
+    uint64_t worker_idle_ns[MAX_THREADS]; // Time each worker waited for the others during the quanta
+
+    void read(const PianoLoad& load)
+    {
+        blocks = load.blocks.load(std::memory_order_relaxed);
+        block_ns_total = load.block_ns_total.load(std::memory_order_relaxed);
+        audio_ns_total = load.audio_ns_total.load(std::memory_order_relaxed);
+        block_ns.read(load.block_ns);
+        events_applied = load.events_applied.load(std::memory_order_relaxed);
+        active_strings = load.active_strings.load(std::memory_order_relaxed);
+        peak_active_strings = load.peak_active_strings.load(std::memory_order_relaxed);
+        rebalances = load.rebalances.load(std::memory_order_relaxed);
+        n_threads = load.n_workers;
+        for(uint32_t w = 0; w < n_threads; w++)
+        {
+            worker_busy_ns[w] = load.workers[w].busy_ns.load(std::memory_order_relaxed);
+            worker_idle_ns[w] = block_ns_total > worker_busy_ns[w] ? block_ns_total-worker_busy_ns[w] : 0;
+        }
+    }
+    PianoStats since(const PianoStats& earlier) const
+    {
+        // Load between two snapshots. The active strings are the ones of the later snapshot.
+        PianoStats difference = *this;
+        difference.blocks -= earlier.blocks;
+        difference.block_ns_total -= earlier.block_ns_total;
+        difference.audio_ns_total -= earlier.audio_ns_total;
+        difference.events_applied -= earlier.events_applied;
+        difference.rebalances -= earlier.rebalances;
+        difference.block_ns.total = 0;
+        for(uint32_t b = 0; b < LoadHistogram::N_BUCKETS; b++)
+        {
+            difference.block_ns.counts[b] -= earlier.block_ns.counts[b];
+            difference.block_ns.total += difference.block_ns.counts[b];
+        }
+        for(uint32_t w = 0; w < n_threads && w < earlier.n_threads; w++)
+        {
+            difference.worker_busy_ns[w] -= earlier.worker_busy_ns[w];
+            difference.worker_idle_ns[w] -= earlier.worker_idle_ns[w];
+        }
+        return difference;
+    }
+    double load() const
+    {
+        // Wall time over audio time: above 1, the piano can't keep up in real time
+        return audio_ns_total > 0 ? (double)block_ns_total/audio_ns_total : 0.0;
+    }
+    double worker_utilization(uint32_t idx_thread) const
+    {
+        // Fraction of the quanta during which the worker was computing
+        return block_ns_total > 0 ? (double)worker_busy_ns[idx_thread]/block_ns_total : 0.0;
+    }
+};
+
+#endif // PIANO_STATS_H
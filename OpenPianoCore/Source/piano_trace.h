@@ -0,0 +1,196 @@
+/*
+OpenPiano: an open source piano engine based on physical modeling
+Copyright (C) 2021-2022 Michele Perrone
+Github: https://github.com/michele-perrone/OpenPiano
+Author e-mail: perrone(dot)michele(at)outlook(dot)com
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Affero General Public License as published
+by the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Affero General Public License for more details.
+
+You should have received a copy of the GNU Affero General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef PIANO_TRACE_H
+#define PIANO_TRACE_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <inttypes.h>
+#include <atomic>
+#include "piano_stats.h"
+
+/* ********************************************************************** *
+ * Trace of the render threads (see Piano::start_trace()), written as     *
+ * Chrome trace JSON: it opens in chrome://tracing or in Perfetto. Each  *
+ * thread appends its events to its own buffer, so recording needs no    *
+ * lock. A buffer that is full drops the following events.                *
+ * ********************************************************************** */
+
+enum TraceEventType
+{
+    TRACE_QUANTUM, // Audio thread: one render quantum. "arg" is its deadline [ns].
+    TRACE_WAIT, // Audio thread: from the release of the workers until the last one is done
+    TRACE_MIX, // Audio thread: mix of the worker buffers and bridge coupling
+    TRACE_WORKER_BLOCK, // Worker: its share of the quantum. "arg" is the number of strings.
+    TRACE_STRING, // Worker: one string that is vibrating. "arg" is the index of the string.
+    TRACE_HIT, // Worker: a hammer hit (see Piano::apply_note_event()). "arg" is the index of the string.
+    TRACE_DAMPER // Worker: a damper movement. "arg" is the index of the string.
+};
+
+struct TraceEvent
+{
+    uint64_t begin; // [ns], see PianoLoad::now_ns()
+    uint64_t end;
+    uint32_t type; // TraceEventType
+    uint32_t arg;
+};
+
+struct TraceBuffer
+{
+    TraceEvent* events;
+    uint32_t capacity;
+    std::atomic<uint32_t> count; // Events written so far (a reader sees only complete events)
+    std::atomic<uint32_t> dropped; // Events that didn't fit
+};
+
+const uint32_t DEFAULT_TRACE_CAPACITY = 1 << 20; // Events per thread, 24 MiB
+
+struct PianoTrace
+{
+    TraceBuffer* buffers; // One for each worker, then one for the audio thread
+    uint32_t n_workers;
+    uint64_t origin; // Start of the trace [ns]
+
+    PianoTrace(uint32_t n_workers, uint32_t capacity = DEFAULT_TRACE_CAPACITY)
+    {
+        this->n_workers = n_workers;
+        buffers = new TraceBuffer[n_workers+1];
+        for(uint32_t b = 0; b <= n_workers; b++)
+        {
+            buffers[b].events = (TraceEvent*)malloc(sizeof(TraceEvent)*capacity);
+            buffers[b].capacity = capacity;
+            buffers[b].count = 0;
+            buffers[b].dropped = 0;
+        }
+        origin = PianoLoad::now_ns();
+    }
+    ~PianoTrace()
+    {
+        for(uint32_t b = 0; b <= n_workers; b++)
+            free(buffers[b].events);
+        delete[] buffers;
+    }
+    void reset()
+    {
+        // Starts the trace over, keeping the buffers. No thread may be recording.
+        for(uint32_t b = 0; b <= n_workers; b++)
+        {
+            buffers[b].count = 0;
+            buffers[b].dropped = 0;
+        }
+        origin = PianoLoad::now_ns();
+    }
+    uint32_t capacity() const
+    {
+        return buffers[0].capacity;
+    }
+    uint32_t audio_buffer() const
+    {
+        return n_workers;
+    }
+    void record(uint32_t buffer, TraceEventType type, uint32_t arg, uint64_t begin, uint64_t end)
+    {
+        // Only the thread that owns the buffer writes to it
+        TraceBuffer& b = buffers[buffer];
+        uint32_t n = b.count.load(std::memory_order_relaxed);
+        if(n >= b.capacity)
+        {
+            b.dropped.store(b.dropped.load(std::memory_order_relaxed)+1, std::memory_order_relaxed);
+            return;
+        }
+        b.events[n].begin = begin;
+        b.events[n].end = end;
+        b.events[n].type = type;
+        b.events[n].arg = arg;
+        b.count.store(n+1, std::memory_order_release);
+    }
+    bool write_json(const char* path) const
+    {
+        // Complete events ("ph": "X") with microsecond timestamps, one track per thread.
+        // The trace can be written while it's still being recorded.
+        FILE* file = fopen(path, "w");
+        if(file == nullptr)
+            return false;
+        fprintf(file, "{\"displayTimeUnit\": \"ns\", \"traceEvents\": [\n");
+        for(uint32_t b = 0; b <= n_workers; b++)
+        {
+            if(b == audio_buffer())
+                fprintf(file, "%s{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": %u, \"args\": {\"name\": \"audio\"}}",
+                        b == 0 ? "" : ",\n", b);
+            else
+                fprintf(file, "%s{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": %u, \"args\": {\"name\": \"worker %u\"}}",
+                        b == 0 ? "" : ",\n", b, b);
+            fprintf(file, ",\n{\"name\": \"thread_sort_index\", \"ph\": \"M\", \"pid\": 1, \"tid\": %u, \"args\": {\"sort_index\": %u}}",
+                    b, b == audio_buffer() ? 0 : b+1);
+        }
+        uint32_t dropped = 0;
+        for(uint32_t b = 0; b <= n_workers; b++)
+        {
+            uint32_t n = buffers[b].count.load(std::memory_order_acquire);
+            for(uint32_t k = 0; k < n; k++)
+                write_event(file, buffers[b].events[k], b);
+            dropped += buffers[b].dropped.load(std::memory_order_relaxed);
+        }
+        fprintf(file, "\n], \"otherData\": {\"dropped_events\": %u}}\n", dropped);
+        return fclose(file) == 0;
+    }
+
+private:
+    void write_event(FILE* file, const TraceEvent& e, uint32_t tid) const
+    {
+        double ts = (e.begin-origin)*1e-3; // [us]
+        double dur = (e.end-e.begin)*1e-3;
+        switch(e.type)
+        {
+        case TRACE_QUANTUM:
+        {
+            // Late quanta get their own category, so they can be searched for
+            bool late = e.end-e.begin > e.arg;
+            fprintf(file, ",\n{\"name\": \"%s\", \"cat\": \"%s\", \"ph\": \"X\", \"ts\": %.3f, \"dur\": %.3f, \"pid\": 1, \"tid\": %u, "
+                          "\"args\": {\"deadline_us\": %.3f}}", late ? "quantum (late)" : "quantum",
+                    late ? "late" : "quantum", ts, dur, tid, e.arg*1e-3);
+            break;
+        }
+        case TRACE_WAIT:
+            fprintf(file, ",\n{\"name\": \"wait for workers\", \"cat\": \"audio\", \"ph\": \"X\", \"ts\": %.3f, \"dur\": %.3f, "
+                          "\"pid\": 1, \"tid\": %u}", ts, dur, tid);
+            break;
+        case TRACE_MIX:
+            fprintf(file, ",\n{\"name\": \"mix\", \"cat\": \"audio\", \"ph\": \"X\", \"ts\": %.3f, \"dur\": %.3f, "
+                          "\"pid\": 1, \"tid\": %u}", ts, dur, tid);
+            break;
+        case TRACE_WORKER_BLOCK:
+            fprintf(file, ",\n{\"name\": \"block\", \"cat\": \"worker\", \"ph\": \"X\", \"ts\": %.3f, \"dur\": %.3f, "
+                          "\"pid\": 1, \"tid\": %u, \"args\": {\"strings\": %u}}", ts, dur, tid, e.arg);
+            break;
+        case TRACE_STRING:
+            fprintf(file, ",\n{\"name\": \"string %u\", \"cat\": \"string\", \"ph\": \"X\", \"ts\": %.3f, \"dur\": %.3f, "
+                          "\"pid\": 1, \"tid\": %u, \"args\": {\"midi_note\": %u}}", e.arg, ts, dur, tid, e.arg+MIDI_NOTE_OFFSET);
+            break;
+        case TRACE_HIT:
+        case TRACE_DAMPER:
+            fprintf(file, ",\n{\"name\": \"%s %u\", \"cat\": \"event\", \"ph\": \"X\", \"ts\": %.3f, \"dur\": %.3f, "
+                          "\"pid\": 1, \"tid\": %u}", e.type == TRACE_HIT ? "hit" : "damper", e.arg, ts, dur, tid);
+            break;
+        }
+    }
+};
+
+#endif // PIANO_TRACE_H
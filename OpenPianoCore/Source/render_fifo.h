@@ -0,0 +1,98 @@
+/*
+OpenPiano: an open source piano engine based on physical modeling
+Copyright (C) 2021-2022 Michele Perrone
+Github: https://github.com/michele-perrone/OpenPiano
+Author e-mail: perrone(dot)michele(at)outlook(dot)com
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Affero General Public License as published
+by the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Affero General Public License for more details.
+
+You should have received a copy of the GNU Affero General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef RENDER_FIFO_H
+#define RENDER_FIFO_H
+
+#include <atomic>
+#include <inttypes.h>
+
+/* ******************************************************************** *
+ * Lock-free FIFO between the internal render quantum and the host.     *
+ * The piano always computes audio in blocks of the same length (the    *
+ * "render quantum"), while the host can ask for any number of samples. *
+ * The samples of a quantum that the host hasn't consumed yet wait in   *
+ * this FIFO. There is one producer and one consumer: each index is     *
+ * only written by one side, so no lock is needed.                      *
+ * The memory is given by the owner (usually the arena of the model).   *
+ * ******************************************************************** */
+
+struct RenderFifo
+{
+    float* data;
+    uint32_t capacity; // Power of two
+    uint32_t mask; // capacity-1
+    std::atomic<uint32_t> write_idx; // Only written by the producer
+    std::atomic<uint32_t> read_idx; // Only written by the consumer
+
+    RenderFifo()
+    {
+        data = nullptr;
+        capacity = 0;
+        mask = 0;
+        write_idx = 0;
+        read_idx = 0;
+    }
+    static uint32_t capacity_for(uint32_t quantum)
+    {
+        // Before a new quantum is pushed, at most quantum-1 samples are still waiting
+        uint32_t capacity = 1;
+        while(capacity < 2*quantum)
+            capacity <<= 1;
+        return capacity;
+    }
+    void init(float* data, uint32_t capacity)
+    {
+        this->data = data;
+        this->capacity = capacity;
+        this->mask = capacity-1;
+        write_idx = 0;
+        read_idx = 0;
+    }
+    uint32_t available() const
+    {
+        // The indices are free-running, their difference is correct even after they wrap around
+        return write_idx.load(std::memory_order_acquire) - read_idx.load(std::memory_order_acquire);
+    }
+    uint32_t push(const float* input, uint32_t length)
+    {
+        uint32_t w = write_idx.load(std::memory_order_relaxed);
+        uint32_t r = read_idx.load(std::memory_order_acquire);
+        uint32_t free_space = capacity - (w-r);
+        if(length > free_space)
+            length = free_space;
+        for(uint32_t i = 0; i < length; i++)
+            data[(w+i)&mask] = input[i];
+        write_idx.store(w+length, std::memory_order_release);
+        return length;
+    }
+    uint32_t pop(float* output, uint32_t length, float gain)
+    {
+        uint32_t r = read_idx.load(std::memory_order_relaxed);
+        uint32_t w = write_idx.load(std::memory_order_acquire);
+        if(length > w-r)
+            length = w-r;
+        for(uint32_t i = 0; i < length; i++)
+            output[i] = gain*data[(r+i)&mask];
+        read_idx.store(r+length, std::memory_order_release);
+        return length;
+    }
+};
+
+#endif // RENDER_FIFO_H
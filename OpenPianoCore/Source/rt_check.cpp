@@ -0,0 +1,378 @@
+/*
+OpenPiano: an open source piano engine based on physical modeling
+Copyright (C) 2021-2022 Michele Perrone
+Github: https://github.com/michele-perrone/OpenPiano
+Author e-mail: perrone(dot)michele(at)outlook(dot)com
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Affero General Public License as published
+by the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Affero General Public License for more details.
+
+You should have received a copy of the GNU Affero General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifdef OPENPIANO_RT_CHECK
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <atomic>
+#include <new>
+#include "rt_check.h"
+#if defined(__linux__) && defined(__GLIBC__)
+#define RT_CHECK_INTERPOSE_LIBC // The C library calls are interposed too, not only operator new and delete
+#include <dlfcn.h>
+#include <execinfo.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#endif
+
+// See "rt_check.h"
+
+enum RtViolation
+{
+    RT_ALLOCATION,
+    RT_LOCK,
+    RT_SLEEP,
+    RT_IO,
+    N_RT_VIOLATIONS
+};
+
+static const char* const RT_VIOLATION_NAMES[N_RT_VIOLATIONS] = {"allocation", "lock", "sleep", "I/O"};
+static const uint32_t MAX_RT_REPORTS = 32; // Backtraces printed in log mode, the others are only counted
+
+static thread_local uint32_t rt_depth = 0; // Scopes open on this thread
+static thread_local bool rt_reporting = false; // The report itself may allocate
+static std::atomic<uint64_t> rt_counts[N_RT_VIOLATIONS];
+static std::atomic<uint32_t> rt_reports(0);
+static bool rt_log_only = false;
+
+static void rt_print(const char* text)
+{
+    fputs(text, stderr);
+    fflush(stderr);
+}
+
+static void rt_violation(RtViolation kind, const char* call)
+{
+    if(rt_depth == 0 || rt_reporting)
+        return;
+    rt_reporting = true;
+    rt_counts[kind]++;
+    if(!rt_log_only || rt_reports++ < MAX_RT_REPORTS)
+    {
+        char line[160];
+        snprintf(line, sizeof(line), "openpiano: %s() inside a real-time scope (%s)\n", call, RT_VIOLATION_NAMES[kind]);
+        rt_print(line);
+#ifdef RT_CHECK_INTERPOSE_LIBC
+        void* frames[32];
+        int n_frames = backtrace(frames, 32);
+        backtrace_symbols_fd(frames+1, n_frames-1, fileno(stderr));
+#endif
+    }
+    if(!rt_log_only)
+        abort();
+    rt_reporting = false;
+}
+
+void rt_check_enter()
+{
+    rt_depth++;
+}
+
+void rt_check_leave()
+{
+    rt_depth--;
+}
+
+uint64_t rt_check_violations()
+{
+    uint64_t total = 0;
+    for(uint32_t k = 0; k < N_RT_VIOLATIONS; k++)
+        total += rt_counts[k];
+    return total;
+}
+
+static void rt_summary()
+{
+    uint64_t total = rt_check_violations();
+    if(total == 0)
+        return;
+    char line[200];
+    snprintf(line, sizeof(line), "openpiano: %llu real-time violations (%llu allocations, %llu locks, %llu sleeps, %llu I/O)\n",
+             (unsigned long long)total, (unsigned long long)rt_counts[RT_ALLOCATION].load(),
+             (unsigned long long)rt_counts[RT_LOCK].load(), (unsigned long long)rt_counts[RT_SLEEP].load(),
+             (unsigned long long)rt_counts[RT_IO].load());
+    rt_print(line);
+}
+
+struct RtCheckInit
+{
+    RtCheckInit()
+    {
+        const char* mode = getenv("OPENPIANO_RT_CHECK");
+        rt_log_only = mode != nullptr && strcmp(mode, "log") == 0;
+#ifdef RT_CHECK_INTERPOSE_LIBC
+        // The first backtrace() loads the unwinder, which allocates: get it done outside of any scope
+        void* frames[4];
+        backtrace(frames, 4);
+#endif
+        atexit(rt_summary);
+    }
+};
+static RtCheckInit rt_check_init;
+
+/* ********************************************************************** *
+ * Interposed functions. The C library calls are defined here, in the     *
+ * executable, so they take precedence over the C library for the whole   *
+ * process; each one checks the scope and then forwards the call.         *
+ * ********************************************************************** */
+
+#ifdef RT_CHECK_INTERPOSE_LIBC
+
+extern "C"
+{
+
+void* __libc_malloc(size_t size);
+void* __libc_calloc(size_t count, size_t size);
+void* __libc_realloc(void* ptr, size_t size);
+void* __libc_memalign(size_t alignment, size_t size);
+void __libc_free(void* ptr);
+
+// Next definition of a function, resolved on first use (the race is harmless: every thread gets the same one)
+#define RT_NEXT(name) \
+    static decltype(&name) next_##name = nullptr; \
+    if(next_##name == nullptr) \
+        next_##name = (decltype(&name))dlsym(RTLD_NEXT, #name)
+
+void* malloc(size_t size)
+{
+    rt_violation(RT_ALLOCATION, "malloc");
+    return __libc_malloc(size);
+}
+
+void* calloc(size_t count, size_t size)
+{
+    rt_violation(RT_ALLOCATION, "calloc");
+    return __libc_calloc(count, size);
+}
+
+void* realloc(void* ptr, size_t size)
+{
+    rt_violation(RT_ALLOCATION, "realloc");
+    return __libc_realloc(ptr, size);
+}
+
+void free(void* ptr)
+{
+    if(ptr != nullptr)
+        rt_violation(RT_ALLOCATION, "free");
+    __libc_free(ptr);
+}
+
+int posix_memalign(void** ptr, size_t alignment, size_t size)
+{
+    rt_violation(RT_ALLOCATION, "posix_memalign");
+    if(alignment < sizeof(void*) || (alignment & (alignment-1)) != 0)
+        return EINVAL;
+    *ptr = __libc_memalign(alignment, size);
+    return *ptr == nullptr && size > 0 ? ENOMEM : 0;
+}
+
+void* aligned_alloc(size_t alignment, size_t size)
+{
+    rt_violation(RT_ALLOCATION, "aligned_alloc");
+    return __libc_memalign(alignment, size);
+}
+
+void* memalign(size_t alignment, size_t size)
+{
+    rt_violation(RT_ALLOCATION, "memalign");
+    return __libc_memalign(alignment, size);
+}
+
+int pthread_mutex_lock(pthread_mutex_t* mutex)
+{
+    rt_violation(RT_LOCK, "pthread_mutex_lock");
+    RT_NEXT(pthread_mutex_lock);
+    return next_pthread_mutex_lock(mutex);
+}
+
+int pthread_rwlock_rdlock(pthread_rwlock_t* lock)
+{
+    rt_violation(RT_LOCK, "pthread_rwlock_rdlock");
+    RT_NEXT(pthread_rwlock_rdlock);
+    return next_pthread_rwlock_rdlock(lock);
+}
+
+int pthread_rwlock_wrlock(pthread_rwlock_t* lock)
+{
+    rt_violation(RT_LOCK, "pthread_rwlock_wrlock");
+    RT_NEXT(pthread_rwlock_wrlock);
+    return next_pthread_rwlock_wrlock(lock);
+}
+
+int pthread_cond_wait(pthread_cond_t* cond, pthread_mutex_t* mutex)
+{
+    rt_violation(RT_LOCK, "pthread_cond_wait");
+    RT_NEXT(pthread_cond_wait);
+    return next_pthread_cond_wait(cond, mutex);
+}
+
+int pthread_cond_timedwait(pthread_cond_t* cond, pthread_mutex_t* mutex, const struct timespec* time)
+{
+    rt_violation(RT_LOCK, "pthread_cond_timedwait");
+    RT_NEXT(pthread_cond_timedwait);
+    return next_pthread_cond_timedwait(cond, mutex, time);
+}
+
+int nanosleep(const struct timespec* duration, struct timespec* remaining)
+{
+    rt_violation(RT_SLEEP, "nanosleep");
+    RT_NEXT(nanosleep);
+    return next_nanosleep(duration, remaining);
+}
+
+int clock_nanosleep(clockid_t clock, int flags, const struct timespec* time, struct timespec* remaining)
+{
+    rt_violation(RT_SLEEP, "clock_nanosleep");
+    RT_NEXT(clock_nanosleep);
+    return next_clock_nanosleep(clock, flags, time, remaining);
+}
+
+int usleep(useconds_t duration)
+{
+    rt_violation(RT_SLEEP, "usleep");
+    RT_NEXT(usleep);
+    return next_usleep(duration);
+}
+
+unsigned int sleep(unsigned int seconds)
+{
+    rt_violation(RT_SLEEP, "sleep");
+    RT_NEXT(sleep);
+    return next_sleep(seconds);
+}
+
+ssize_t read(int fd, void* buffer, size_t size)
+{
+    rt_violation(RT_IO, "read");
+    RT_NEXT(read);
+    return next_read(fd, buffer, size);
+}
+
+ssize_t write(int fd, const void* buffer, size_t size)
+{
+    rt_violation(RT_IO, "write");
+    RT_NEXT(write);
+    return next_write(fd, buffer, size);
+}
+
+FILE* fopen(const char* path, const char* mode)
+{
+    rt_violation(RT_IO, "fopen");
+    RT_NEXT(fopen);
+    return next_fopen(path, mode);
+}
+
+size_t fwrite(const void* buffer, size_t size, size_t count, FILE* file)
+{
+    rt_violation(RT_IO, "fwrite");
+    RT_NEXT(fwrite);
+    return next_fwrite(buffer, size, count, file);
+}
+
+} // extern "C"
+
+static void* rt_malloc(size_t size)
+{
+    return __libc_malloc(size);
+}
+static void rt_free(void* ptr)
+{
+    __libc_free(ptr);
+}
+
+#else
+
+static void* rt_malloc(size_t size)
+{
+    return malloc(size);
+}
+static void rt_free(void* ptr)
+{
+    free(ptr);
+}
+
+#endif // RT_CHECK_INTERPOSE_LIBC
+
+// operator new and delete are replaced on every platform
+
+static void* rt_new(size_t size, const char* call)
+{
+    rt_violation(RT_ALLOCATION, call);
+    return rt_malloc(size > 0 ? size : 1);
+}
+
+static void rt_delete(void* ptr, const char* call)
+{
+    if(ptr != nullptr)
+        rt_violation(RT_ALLOCATION, call);
+    rt_free(ptr);
+}
+
+void* operator new(size_t size)
+{
+    void* ptr = rt_new(size, "operator new");
+    if(ptr == nullptr)
+        throw std::bad_alloc();
+    return ptr;
+}
+
+void* operator new[](size_t size)
+{
+    void* ptr = rt_new(size, "operator new[]");
+    if(ptr == nullptr)
+        throw std::bad_alloc();
+    return ptr;
+}
+
+void* operator new(size_t size, const std::nothrow_t&) noexcept
+{
+    return rt_new(size, "operator new");
+}
+
+void* operator new[](size_t size, const std::nothrow_t&) noexcept
+{
+    return rt_new(size, "operator new[]");
+}
+
+void operator delete(void* ptr) noexcept
+{
+    rt_delete(ptr, "operator delete");
+}
+
+void operator delete[](void* ptr) noexcept
+{
+    rt_delete(ptr, "operator delete[]");
+}
+
+void operator delete(void* ptr, size_t) noexcept
+{
+    rt_delete(ptr, "operator delete");
+}
+
+void operator delete[](void* ptr, size_t) noexcept
+{
+    rt_delete(ptr, "operator delete[]");
+}
+
+#endif // OPENPIANO_RT_CHECK
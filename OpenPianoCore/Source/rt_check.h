@@ -0,0 +1,60 @@
+/*
+OpenPiano: an open source piano engine based on physical modeling
+Copyright (C) 2021-2022 Michele Perrone
+Github: https://github.com/michele-perrone/OpenPiano
+Author e-mail: perrone(dot)michele(at)outlook(dot)com
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Affero General Public License as published
+by the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Affero General Public License for more details.
+
+You should have received a copy of the GNU Affero General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef RT_CHECK_H
+#define RT_CHECK_H
+
+#include <inttypes.h>
+
+/* ********************************************************************** *
+ * Real-time safety checker, compiled in only with OPENPIANO_RT_CHECK     *
+ * (CMake option of the same name). The render threads and the host      *
+ * callback open an RtScope around their real-time work. While a scope    *
+ * is open on a thread, every allocation (malloc and its family,          *
+ * operator new and delete), lock (mutexes, condition variables) and      *
+ * blocking system call (sleeps, file I/O) made by that thread is a       *
+ * violation: "rt_check.cpp" interposes these functions and aborts with a *
+ * backtrace, or only logs it if OPENPIANO_RT_CHECK=log is set in the     *
+ * environment. Without OPENPIANO_RT_CHECK, RtScope is empty.             *
+ * ********************************************************************** */
+
+#ifdef OPENPIANO_RT_CHECK
+
+void rt_check_enter();
+void rt_check_leave();
+uint64_t rt_check_violations(); // Since the program started, on every thread
+
+struct RtScope
+{
+    RtScope() { rt_check_enter(); }
+    ~RtScope() { rt_check_leave(); }
+    RtScope(const RtScope&) = delete;
+    RtScope& operator=(const RtScope&) = delete;
+};
+
+#else
+
+struct RtScope
+{
+    RtScope() {}
+};
+
+#endif
+
+#endif // RT_CHECK_H
@@ -20,8 +20,6 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 #ifndef STRING_HAMMER_H
 #define STRING_HAMMER_H
 
-#endif // STRING_HAMMER_H
-
 /* *************************************************************** *
  * Implementation of the physical model for the string and hammer. *
  * It makes sense placing them inside the same source file because *
@@ -35,9 +33,13 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 #endif
 #include <math.h>
 #include <inttypes.h>
+#include <algorithm>
 
 #include "dr_wav.h"
 #include "array_helpers.h"
+#include "attack_cache.h"
+#include "piano_arena.h"
+#include <atomic>
 
 struct Hammer
 {
@@ -73,6 +75,8 @@ struct Hammer
     double* eta;
     double* Fh;
 
+    bool arrays_in_arena; // The arrays above are allocated by the string, possibly inside a PianoArena
+
     Hammer(int Fs, double Mh, double p, double bH, double K, double a, double g_meters)
     {
         this->Fs = Fs;
@@ -102,9 +106,12 @@ struct Hammer
         hammer_mask = nullptr;
         eta = nullptr;
         Fh = nullptr;
+        arrays_in_arena = false;
     }
     ~Hammer()
     {
+        if(arrays_in_arena)
+            return;
         free(hammer_win);
         free(hammer_mask);
         free(eta);
@@ -112,17 +119,178 @@ struct Hammer
     }
 };
 
-struct PianoString
+// Helpers for the binary snapshots of the simulation state (see PianoStringT::save_state())
+template <typename T>
+inline uint8_t* write_state(uint8_t* dest, const T* values, size_t count)
 {
-    // Hammer that hits this string
-    Hammer* h;
+    memcpy(dest, values, count*sizeof(T));
+    return dest + count*sizeof(T);
+}
+template <typename T>
+inline const uint8_t* read_state(const uint8_t* src, T* values, size_t count)
+{
+    memcpy(values, src, count*sizeof(T));
+    return src + count*sizeof(T);
+}
+
+/* ****************************************************************** *
+ * Boundary conditions and hammer models are policies of the string.  *
+ * Each combination compiles to its own kernel, so choosing one model *
+ * or the other doesn't cost a branch inside get_next_sample().       *
+ * ****************************************************************** */
+
+// Boundary conditions with perfect reflection (Chaigne, Eq. 23)
+struct PerfectReflection
+{
+    template <typename String>
+    static inline void apply(String& s)
+    {
+        uint32_t end = s.len_x_axis+1;
+        s.y[0][s.n_0] = -s.y[2][s.n_0]; // a) Left boundary
+        s.y[end][s.n_0] = -s.y[end-2][s.n_0]; // b) Bridge boundary
+    }
+};
+
+// Boundary conditions with agraffe and bridge impedances (Saitis, Eq. 4.18 and Eq. 4.20).
+// The end nodes are the first and the last ones of the string: y[1], which the PDE loop
+// never updates, and y[Xs_bridge], which the boundary computes instead of the PDE loop.
+// Past each end, a ghost node continues the string without bending it (zero second
+// derivative, the free-moment condition of a hinged end), so that the stencil of the
+// nodes next to the ends sees the motion of the ends.
+struct ImpedanceBoundary
+{
+    template <typename String>
+    static inline void apply(String& s)
+    {
+        double** y = s.y;
+        uint8_t n_0 = s.n_0, n_1 = s.n_1, n_2 = s.n_2;
+
+        // a) Left boundary (frame), Eq. 4.20
+        y[1][n_0] = s.b_L1*y[1][n_1] + s.b_L2*y[2][n_1] + s.b_L3*y[3][n_1]
+                + s.b_L4*y[1][n_2] + s.b_LF*s.Fh[n_1]*s.hammer_mask[1];
+        y[0][n_0] = 2*y[1][n_0] - y[2][n_0];
+
+        // b) Right boundary (bridge), Eq. 4.18
+        uint32_t end = s.Xs_bridge;
+        y[end][n_0] = s.b_R1*y[end][n_1] + s.b_R2*y[end-1][n_1]
+                + s.b_R3*y[end-2][n_1] + s.b_R4*y[end][n_2] + s.b_RF*s.Fh[n_1]*s.hammer_mask[end];
+        y[end+1][n_0] = 2*y[end][n_0] - y[end-1][n_0];
+    }
+};
+
+// The hammer displacement by taking into account its felt parameters (Saitis, Eq. 4.21)
+struct FeltHammer
+{
+    template <typename String>
+    static inline void update(String& s)
+    {
+        s.eta[s.n_0] = s.d1*s.eta[s.n_1] + s.d2*s.eta[s.n_2] + s.dF*s.Fh[s.n_1];
+    }
+};
+
+// (Simplified) The hammer displacement (Chaigne, Eq. 19)
+struct ChaigneHammer
+{
+    template <typename String>
+    static inline void update(String& s)
+    {
+        s.eta[s.n_0] = s.d1*s.eta[s.n_1] + s.d2*s.eta[s.n_2] - (s.Ts*s.Ts*s.Fh[s.n_1])/s.Mh;
+    }
+};
 
-    // String displacement over time and space
+/* ******************************************************************** *
+ * The string is split in two parts:                                    *
+ * - StringKernel holds everything touched by get_next_sample(), packed *
+ *   at the beginning of the string object and aligned to a cache line; *
+ * - StringPhysics holds the physical description of the string, which *
+ *   is used only to derive the coefficients of the kernel.             *
+ * ******************************************************************** */
+
+struct alignas(64) StringKernel
+{
+    // String displacement over time and space, and the hammer arrays (owned by the Hammer)
     double** y;
+    double* eta; // Hammer displacement over time
+    double* Fh; // Force imparted by the hammer on the string over time
+    double* hammer_mask; // Hammer contact window over the string
 
-    // Sampling frequency and period
+    // Buffer indices of the spatio-temporal simulation scheme
+    uint8_t n_0;
+    uint8_t n_1;
+    uint8_t n_2;
+    uint8_t n_3;
+
+    // These are used for optimization
+    bool is_active; // Whether the string displacement is negligible
+    uint64_t is_active_check_ctr; // Counter for triggering the "check_if_active()" function
+
+    // PDE Coefficients (Chaigne's article)
+    double a1;
+    double a2;
+    double a3;
+    double a4;
+    double a5;
+    double force_scale; // Ts*Ts*N, scales the hammer force before it's spread over the string
+    double Ms; // Total mass [kg]
+    double Ts; // Sampling period [s]
+
+    // Spatial samples
+    uint32_t len_x_axis;
+    uint32_t damper_left; // First spatial sample touched by the damper felt
+    uint32_t damper_right; // First spatial sample after the damper felt
+    uint32_t left_boundary; // First spatial sample of the sound pickup
+    uint32_t right_boundary; // Last spatial sample of the sound pickup
+    uint32_t Xs_contact; // Central contact point btw string and hammer [samples]
+
+    // Dashpot under the damper felt (see PianoStringT::compute_damper_coefficients())
+    double damper_g; // Weight of the undamped displacement under the damper: 1/(1+sigma)
+    double damper_s; // Weight of the displacement at n-2 under the damper: sigma/(1+sigma)
+
+    // Hammer (copied from the Hammer, see FeltHammer and ChaigneHammer)
+    double K; // Stiffness [N/m]
+    double p; // Stiffness nonlinear exponent
+    double d1;
+    double d2;
+    double dF;
+    double Mh; // Total mass [kg]
+
+    // Attack cache (see "attack_cache.h"). It can be published by another thread, hence the atomic.
+    std::atomic<AttackCache*> attack_cache; // nullptr -> always simulate the hammer contact
+    uint32_t attack_pos; // Current sample of the cached attack being played back
+    uint32_t attack_len; // Length of the cached attack being played back (0 -> none)
+    uint32_t attack_fade; // Length of the crossfade of the rest of the attack with the simulation (0 -> none)
+    float* attack_sound; // Sound being played back. The cache can be replaced in the meantime.
+
+    // Sympathetic resonance (see "sympathetic.h")
+    // The arrays are owned by the coupling stage and are nullptr when the coupling is disabled.
+    double* bridge_out; // Force exerted by this string on the bridge, summed over each coupling period
+    double* bridge_in; // Force injected by the other strings through the bridge, one value per coupling period
+    uint32_t bridge_capacity; // Number of coupling periods that fit inside an audio block
+    uint32_t coupling_period; // Length of a coupling period [samples]
+    uint32_t bridge_pos; // Current sample inside the audio block
+    uint32_t Xs_bridge; // Last simulated spatial sample: the bridge end of ImpedanceBoundary
+    double Te; // Tension [N]
+    double Xs; // Spatial step [m]
+
+    // Bridge boundary coefficients (case m=0, m=1), used only by ImpedanceBoundary
+    double b_R1;
+    double b_R2;
+    double b_R3;
+    double b_R4;
+    double b_RF;
+
+    // Left hand (hinged string end) boundary coefficients (case m;M-1, m=M), used only by ImpedanceBoundary
+    double b_L1;
+    double b_L2;
+    double b_L3;
+    double b_L4;
+    double b_LF;
+};
+
+struct StringPhysics
+{
+    // Sampling frequency
     int Fs;
-    double Ts;
 
     // These values are given
     double f0; // Fund. frequency [Hz]
@@ -132,11 +300,8 @@ struct PianoString
     double E; // Young's modulus [N/m^2]
     double b1; // First damping coefficient
     double b2; // Second damping coefficient
-    double _b1, _b2; // These two hold the original values of the damping coeffients
 
     // These values are calculated
-    double Ms; // Total mass [kg]
-    double Te; // Tension [N]
     double c; // Propagation velocity [m/s]
     double r_gyr; // Radius of gyration of the string [m]
     double eps; // Eq. 2, stiffness parameter
@@ -144,61 +309,48 @@ struct PianoString
     // Spatial sampling aliasing condition (number of maximum spatial steps)
     double gamma;
     uint32_t N;
-    uint32_t len_x_axis;
-    double* x_axis;
 
     // FD parameters
     double courant_num;
     double lambda;
     double mu;
-
-    // PDE Coefficients (Chaigne's article)
     double D;
     double r;
-    double a1;
-    double a2;
-    double a3;
-    double a4;
-    double a5;
 
     // Boundary parameters
     double zeta_b; // Normalized impedance of the bridge
     double zeta_l; // Normalized impedance of the left boundary
 
-    // Bridge boundary coefficients (case m=0, m=1)
-    double b_R1;
-    double b_R2;
-    double b_R3;
-    double b_R4;
-    double b_RF;
-
-    // Left hand (hinged string end) boundary coefficients (case m;M-1, m=M)
-    double b_L1;
-    double b_L2;
-    double b_L3;
-    double b_L4;
-    double b_LF;
-
     // Parameters for spatio-temporal simulation scheme
     uint32_t buffer_size; // 4 samples is the absolute minimum
-    uint64_t n; // Sample counter for the string simulation
-    uint8_t n_0;
-    uint8_t n_1;
-    uint8_t n_2;
-    uint8_t n_3;    
 
     // Parameters for the calculation of the sound
     uint32_t N_space_samples; // Must be even in order to be centered around something
     uint32_t Xs_sound;
-    uint32_t left_boundary;
-    uint32_t right_boundary;
+};
 
-    // These are used for optimization
-    bool is_active; // Whether the string displacement is negligible
-    uint64_t is_active_check_ctr; // Counter for triggering the "check_if_active()" function
+template <typename BoundaryPolicy, typename HammerPolicy>
+struct PianoStringT : StringKernel, StringPhysics
+{
+    // Hammer that hits this string
+    Hammer* h;
+
+    // Region that holds the arrays of the string and its hammer (nullptr -> malloc)
+    PianoArena* arena;
+
+    // Dampers
+    // The damper felt touches only a small portion of the string, where it acts as a dashpot
+    // (centered in time, which keeps the scheme stable for any damping). The damping under the
+    // fully engaged felt is computed once, when the string is created: moving the damper only
+    // interpolates the dashpot coefficients, once per audio block.
+    double damper_sigma; // Dashpot coefficient of the fully engaged damper
+    double damper_position; // 0 -> damper lifted, 1 -> damper resting on the string
+    double damper_target; // Position requested by the keys and the pedal
+    double damper_speed; // Maximum damper movement per sample
 
     // Methods
-    PianoString(int Fs, double f0, double L, double rho, double S, double E, double b1, double b2, Hammer * h)
+    PianoStringT(int Fs, double f0, double L, double rho, double S, double E, double b1, double b2, Hammer * h,
+                 PianoArena* arena = nullptr)
     {
         // Sampling frequency and period
         this->Fs = Fs;
@@ -206,6 +358,7 @@ struct PianoString
 
         // Hammer hitting this string
         this->h = h;
+        this->arena = arena;
 
         // Assign the parameters
         this->f0 = f0;
@@ -213,8 +366,8 @@ struct PianoString
         this->rho = rho;
         this->S = S;
         this->E = E;
-        this->_b1 = this->b1 = b1;
-        this->_b2 = this->b2 = b2;
+        this->b1 = b1;
+        this->b2 = b2;
 
         // Calculate the remaining physical parameters
         this->Ms = this->rho*this->L;
@@ -233,10 +386,17 @@ struct PianoString
         this->h->x_contact = this->h->a*this->L;
         this->h->Xs_contact = round(this->h->x_contact/this->h->Xs);
         this->h->g = ceil(this->h->g_meters*this->N/this->L); //hammer_length in samples
-        this->h->hammer_win = hanning(this->h->g);
-        this->h->hammer_mask = zeros1D(this->len_x_axis);
         this->h->i = floorf(this->h->Xs_contact-(this->h->g/2)) + 1;
-        memcpy(&this->h->hammer_mask[this->h->i], &this->h->hammer_win[0], this->h->g*sizeof(double*));
+
+        // The kernel keeps its own copy of what it needs from the hammer
+        this->Xs = this->h->Xs;
+        this->Xs_contact = this->h->Xs_contact;
+        this->K = this->h->K;
+        this->p = this->h->p;
+        this->d1 = this->h->d1;
+        this->d2 = this->h->d2;
+        this->dF = this->h->dF;
+        this->Mh = this->h->Mh;
 
         // FD parameters
         courant_num = c*Ts/this->h->Xs;
@@ -247,9 +407,22 @@ struct PianoString
         this->zeta_b = 1e03; // Normalized impedance of the bridge
         this->zeta_l = 1e20; // Normalized impedance of the left boundary
 
+        // Dampers: the felt sits across the striking point of the hammer and covers
+        // about a tenth of the string
+        uint32_t damper_half_width = std::max((uint32_t)2, N/20);
+        this->damper_left = std::max((uint32_t)2, this->h->Xs_contact-std::min(this->h->Xs_contact, damper_half_width));
+        this->damper_right = std::min(len_x_axis-3, this->h->Xs_contact+damper_half_width+1);
+        this->damper_sigma = 0.05; // Empirical: damps about as fast as the old global (b1, b2) = (0.2, 6.25e-6)
+        this->damper_speed = 1.0/(0.01*Fs); // The damper takes 10 ms to travel all the way
+
         // Compute the coefficients for the FD scheme
         compute_FD_coefficients();
 
+        // The dampers rest on the strings until a key or the pedal lifts them
+        this->damper_position = 1.0;
+        this->damper_target = 1.0;
+        compute_damper_coefficients();
+
         // Parameters for the spatio-temporal simulation scheme
         //this->n = -1; // [CONSIDER DEPRECATING] This counter will be incremented at every temporal step
         this->buffer_size = 4; // This is the length of the circular temporal buffer.
@@ -268,9 +441,7 @@ struct PianoString
         this->n_3 = 0; // Previous time instant n-3
 
         // Array definition
-        this->y = zeros2D(len_x_axis+2, buffer_size);
-        this->h->eta = zeros1D(buffer_size); // Hammer displacement over time
-        this->h->Fh = zeros1D(buffer_size); // Force imparted by the hammer on the string over time
+        allocate_arrays();
 
         // Parameters for extrapolating the sound of the string
         this->N_space_samples = std::min((uint32_t)13, ((N-1)|0x1)); // Must be even in order to be centered around something
@@ -281,14 +452,236 @@ struct PianoString
         // The string will become active when hit by the hammer
         this->is_active = false;
         this->is_active_check_ctr = 0;
+
+        // Sympathetic resonance is disabled until the piano enables the coupling stage
+        this->Xs_bridge = len_x_axis-4;
+        this->bridge_out = nullptr;
+        this->bridge_in = nullptr;
+        this->bridge_capacity = 0;
+        this->coupling_period = 1;
+        this->bridge_pos = 0;
+
+        // No attack cache until the piano builds one
+        this->attack_cache = nullptr;
+        this->attack_pos = 0;
+        this->attack_len = 0;
+        this->attack_fade = 0;
+        this->attack_sound = nullptr;
+    }
+    ~PianoStringT()
+    {
+        if(arena == nullptr)
+        {
+            for(uint32_t i = 0; i < len_x_axis+2; i++)
+            {
+                free(y[i]);
+            }
+            free(y);
+        }
+        delete attack_cache.load();
+    }
+    void allocate_arrays()
+    {
+        if(arena == nullptr)
+        {
+            this->h->hammer_win = hanning(this->h->g);
+            this->h->hammer_mask = zeros1D(this->len_x_axis);
+            this->y = zeros2D(len_x_axis+2, buffer_size);
+            this->h->eta = zeros1D(buffer_size); // Hammer displacement over time
+            this->h->Fh = zeros1D(buffer_size); // Force imparted by the hammer on the string over time
+        }
+        else
+        {
+            // The arrays that are touched at every sample come first, so that
+            // they share the cache lines right after the previous string.
+            // While the arena is measuring, every pointer is nullptr.
+            this->h->arrays_in_arena = true;
+            this->y = arena->allocate_array<double*>(len_x_axis+2);
+            double* y_data = arena->allocate_array<double>((size_t)(len_x_axis+2)*buffer_size);
+            this->h->eta = arena->allocate_array<double>(buffer_size);
+            this->h->Fh = arena->allocate_array<double>(buffer_size);
+            this->h->hammer_mask = arena->allocate_array<double>(this->len_x_axis);
+            this->h->hammer_win = arena->allocate_array<double>(this->h->g);
+            if(arena->measuring)
+                return;
+            for(uint32_t i = 0; i < len_x_axis+2; i++)
+                y[i] = &y_data[(size_t)i*buffer_size];
+            fill_hanning(this->h->hammer_win, this->h->g);
+        }
+        this->eta = this->h->eta;
+        this->Fh = this->h->Fh;
+        this->hammer_mask = this->h->hammer_mask;
+        memcpy(&this->h->hammer_mask[this->h->i], &this->h->hammer_win[0], this->h->g*sizeof(double*));
     }
-    ~PianoString()
+    void reset()
     {
+        // Bring the string and its hammer back at rest
         for(uint32_t i = 0; i < len_x_axis+2; i++)
+            for(uint32_t j = 0; j < buffer_size; j++)
+                y[i][j] = 0.0;
+        for(uint32_t j = 0; j < buffer_size; j++)
+        {
+            eta[j] = 0.0;
+            Fh[j] = 0.0;
+        }
+        n_0 = 3;
+        n_1 = 2;
+        n_2 = 1;
+        n_3 = 0;
+        is_active = false;
+        is_active_check_ctr = 0;
+        damper_position = damper_target = 1.0;
+        compute_damper_coefficients();
+        attack_pos = attack_len = 0;
+        attack_fade = 0;
+    }
+    size_t state_size() const
+    {
+        // Everything that changes while the string is played. The coefficients are
+        // derived from the physical parameters and are not part of the snapshot.
+        return sizeof(uint32_t) // Number of spatial samples (used for validation)
+                + 4*sizeof(uint8_t) // Buffer indices
+                + sizeof(uint8_t) + sizeof(uint64_t) // Active flag and its check counter
+                + 2*sizeof(double) // Damper position and target
+                + (size_t)(len_x_axis+2)*buffer_size*sizeof(double) // String displacement
+                + 2*buffer_size*sizeof(double) // Hammer displacement and force
+                + sizeof(uint32_t) + (size_t)bridge_capacity*sizeof(double) // Force coming from the bridge
+                + 2*sizeof(uint32_t) + (size_t)saved_attack_len()*sizeof(float); // Cached attack being played back
+    }
+    uint32_t saved_attack_len() const
+    {
+        // A crossfade in progress isn't saved: the restored string goes on with the simulation alone
+        return attack_fade > 0 ? 0 : attack_len;
+    }
+    uint8_t* save_state(uint8_t* dest) const
+    {
+        uint32_t n_nodes = len_x_axis+2;
+        uint8_t indices[4] = {n_0, n_1, n_2, n_3};
+        uint8_t active = is_active;
+        dest = write_state(dest, &n_nodes, 1);
+        dest = write_state(dest, indices, 4);
+        dest = write_state(dest, &active, 1);
+        dest = write_state(dest, &is_active_check_ctr, 1);
+        dest = write_state(dest, &damper_position, 1);
+        dest = write_state(dest, &damper_target, 1);
+        for(uint32_t i = 0; i < n_nodes; i++)
+            dest = write_state(dest, y[i], buffer_size);
+        dest = write_state(dest, eta, buffer_size);
+        dest = write_state(dest, Fh, buffer_size);
+        dest = write_state(dest, &bridge_capacity, 1);
+        if(bridge_capacity > 0)
+            dest = write_state(dest, bridge_in, bridge_capacity);
+        uint32_t len = saved_attack_len();
+        dest = write_state(dest, &attack_pos, 1);
+        dest = write_state(dest, &len, 1);
+        if(len > 0)
+            dest = write_state(dest, attack_sound, len);
+        return dest;
+    }
+    const uint8_t* check_state(const uint8_t* src, const uint8_t* end) const
+    {
+        // Returns the end of the snapshot of this string, or nullptr if the
+        // snapshot is truncated or doesn't belong to a string like this one.
+        uint32_t n_nodes, capacity, len;
+        if(end-src < (ptrdiff_t)sizeof(uint32_t))
+            return nullptr;
+        src = read_state(src, &n_nodes, 1);
+        size_t fixed_size = 4*sizeof(uint8_t) + sizeof(uint8_t) + sizeof(uint64_t) + 2*sizeof(double)
+                + (size_t)n_nodes*buffer_size*sizeof(double) + 2*buffer_size*sizeof(double);
+        if(n_nodes != len_x_axis+2 || end-src < (ptrdiff_t)(fixed_size+sizeof(uint32_t)))
+            return nullptr;
+        src = read_state(src+fixed_size, &capacity, 1);
+        if(end-src < (ptrdiff_t)((size_t)capacity*sizeof(double)+2*sizeof(uint32_t)))
+            return nullptr;
+        src += (size_t)capacity*sizeof(double) + sizeof(uint32_t);
+        src = read_state(src, &len, 1);
+        if(end-src < (ptrdiff_t)((size_t)len*sizeof(float)))
+            return nullptr;
+        return src + (size_t)len*sizeof(float);
+    }
+    const uint8_t* load_state(const uint8_t* src, const uint8_t* end)
+    {
+        // Nothing is allocated: the snapshot is copied into the existing arrays.
+        // Returns nullptr (and leaves the string untouched) if the snapshot is not valid.
+        uint32_t n_nodes, capacity, pos, len;
+        uint8_t indices[4], active;
+        if(check_state(src, end) == nullptr)
+            return nullptr;
+
+        src = read_state(src, &n_nodes, 1);
+        src = read_state(src, indices, 4);
+        src = read_state(src, &active, 1);
+        src = read_state(src, &is_active_check_ctr, 1);
+        src = read_state(src, &damper_position, 1);
+        src = read_state(src, &damper_target, 1);
+        for(uint32_t i = 0; i < n_nodes; i++)
+            src = read_state(src, y[i], buffer_size);
+        src = read_state(src, eta, buffer_size);
+        src = read_state(src, Fh, buffer_size);
+        n_0 = indices[0];
+        n_1 = indices[1];
+        n_2 = indices[2];
+        n_3 = indices[3];
+        is_active = active;
+        compute_damper_coefficients();
+
+        // The bridge forces are restored only if the coupling has the same configuration
+        src = read_state(src, &capacity, 1);
+        if(capacity == bridge_capacity && capacity > 0)
+            read_state(src, bridge_in, capacity);
+        src += (size_t)capacity*sizeof(double);
+
+        // The cached attack is restored only if this string has a cache that can hold it
+        src = read_state(src, &pos, 1);
+        src = read_state(src, &len, 1);
+        AttackCache* cache = attack_cache.load(std::memory_order_acquire);
+        if(len > 0 && cache != nullptr && cache->length == len)
         {
-            free(y[i]);
+            read_state(src, cache->playback, len);
+            attack_pos = pos;
+            attack_len = len;
+            attack_sound = cache->playback;
         }
-        free(y);
+        else
+        {
+            attack_pos = attack_len = 0;
+        }
+        attack_fade = 0;
+        src += (size_t)len*sizeof(float);
+
+        return src;
+    }
+    bool is_playable() const
+    {
+        // When f0 is high compared to the sample rate, the string has so few spatial samples
+        // that the hammer window (whose ends are zero) doesn't excite it, or the sound pickup
+        // doesn't fit on it. At 44.1 kHz this happens above C5#.
+        return this->h->g >= 3 && right_boundary <= len_x_axis+2;
+    }
+    bool carry_over_from(const PianoStringT& other)
+    {
+        // Continues the vibration of the same string in another model (e.g. after a preset change).
+        // Only possible if both strings have the same spatial grid and "other" isn't playing back
+        // a cached attack, whose sound belongs to the other model.
+        if(other.len_x_axis != len_x_axis || other.attack_pos < other.attack_len)
+            return false;
+
+        for(uint32_t i = 0; i < len_x_axis+2; i++)
+            memcpy(y[i], other.y[i], buffer_size*sizeof(double));
+        memcpy(eta, other.eta, buffer_size*sizeof(double));
+        memcpy(Fh, other.Fh, buffer_size*sizeof(double));
+        n_0 = other.n_0;
+        n_1 = other.n_1;
+        n_2 = other.n_2;
+        n_3 = other.n_3;
+        is_active = other.is_active;
+        is_active_check_ctr = other.is_active_check_ctr;
+        damper_position = other.damper_position;
+        damper_target = other.damper_target;
+        compute_damper_coefficients();
+        attack_pos = attack_len = 0;
+        attack_fade = 0;
+        return true;
     }
     void check_if_active()
     {
@@ -315,9 +708,30 @@ struct PianoString
     void hit(double V_h0)
     {
         // "Activate" the string
+        bool was_active = this->is_active;
         this->is_active = true;
         this->is_active_check_ctr = 0;
-        this->undamp();
+
+        // A cached attack still being played back: the simulation takes over from the cached state,
+        // where the hammer strikes again. The state is already at the end of the attack: the rest
+        // of the cached sound is crossfaded with the simulation, or the sound would jump.
+        if(was_active)
+            start_attack_fade();
+        else
+            attack_len = 0;
+
+        // The key lifts the damper before the hammer reaches the string
+        this->damper_target = 0.0;
+        this->damper_position = 0.0;
+        compute_damper_coefficients();
+
+        // A silent string doesn't need to simulate the hammer contact if it's in the cache
+        AttackCache* cache = attack_cache.load(std::memory_order_acquire);
+        if(!was_active && cache != nullptr && cache->covers(V_h0))
+        {
+            hit_from_cache(cache, V_h0);
+            return;
+        }
 
         // Hitting the string means:
         // 1. Re-initializing the previous hammer position to zero
@@ -335,32 +749,142 @@ struct PianoString
 
         // Since we've just decremented the indices, the n_0 below will also correspond
         // to the n_0 seen by get_next_sample() when it will be computing the string displacement
-        h->eta[n_3] = 0;
-        h->eta[n_2] = 0;
-        h->eta[n_1] = 0;
-        h->eta[n_0] = V_h0 * Ts;
+        eta[n_3] = 0;
+        eta[n_2] = 0;
+        eta[n_1] = 0;
+        eta[n_0] = V_h0 * Ts;
 
-        if (h->eta[n_0] < y[h->Xs_contact][n_0]) // (Chaigne, Eq. 21)
-            h->Fh[n_0] = 0.0f; // Hammer not in contact with string -> force is 0
+        if (eta[n_0] < y[Xs_contact][n_0]) // (Chaigne, Eq. 21)
+            Fh[n_0] = 0.0f; // Hammer not in contact with string -> force is 0
         else
-            h->Fh[n_0] = h->K*powf(h->eta[n_0]-y[h->Xs_contact][n_0], h->p); // (Chaigne, Eq. 20)
+            Fh[n_0] = K*powf(eta[n_0]-y[Xs_contact][n_0], p); // (Chaigne, Eq. 20)
     }
-    void undamp()
+    void hit_from_cache(AttackCache* cache, double V_h0)
     {
-        // Restore the original damping coeffients
-        this->b1 = this->_b1;
-        this->b2 = this->_b2;
+        // Interpolate the state of the two closest velocity buckets.
+        // Time level 0 of the cache is the current time instant n_0.
+        uint32_t b;
+        double w;
+        cache->find_buckets(V_h0, b, w);
+        uint32_t b_next = cache->n_buckets > 1 ? b+1 : b;
+
+        uint8_t levels[4] = {n_0, n_1, n_2, n_3};
+        const double* y_a = &cache->y[(size_t)b*cache->n_nodes*4];
+        const double* y_b = &cache->y[(size_t)b_next*cache->n_nodes*4];
+        for(uint32_t i = 0; i < cache->n_nodes; i++)
+            for(uint32_t l = 0; l < 4; l++)
+                y[i][levels[l]] = (1-w)*y_a[i*4+l] + w*y_b[i*4+l];
+        for(uint32_t l = 0; l < 4; l++)
+        {
+            eta[levels[l]] = (1-w)*cache->eta[b*4+l] + w*cache->eta[b_next*4+l];
+            Fh[levels[l]] = (1-w)*cache->Fh[b*4+l] + w*cache->Fh[b_next*4+l];
+        }
 
-        compute_FD_coefficients();
+        // Sound to be played back while the string "catches up" with the cached state
+        const float* sound_a = &cache->sound[(size_t)b*cache->length];
+        const float* sound_b = &cache->sound[(size_t)b_next*cache->length];
+        for(uint32_t k = 0; k < cache->length; k++)
+            cache->playback[k] = (1-w)*sound_a[k] + w*sound_b[k];
+        attack_pos = 0;
+        attack_len = cache->length;
+        attack_fade = 0;
+        attack_sound = cache->playback;
+    }
+    AttackCache* build_attack_cache(const double* velocities, uint32_t n_buckets, double max_duration = 0.02) const
+    {
+        // Simulates the attack of this string for each velocity bucket and stores the results in a new cache.
+        // The simulation runs on a private copy of the string, so it can be done in a background thread
+        // while the string itself is being played. The attack lasts until the hammer has left the string
+        // for every bucket (but no more than "max_duration" seconds).
+        const uint32_t release_samples = 32; // The hammer must stay away from the string for this long
+        uint32_t max_length = (uint32_t)(max_duration*Fs);
+
+        Hammer scratch_hammer(h->Fs, h->Mh, h->p, h->bH, h->K, h->a, h->g_meters);
+        PianoStringT scratch(Fs, f0, L, rho, S, E, b1, b2, &scratch_hammer);
+
+        // First pass: find out how long the hammer stays in contact with the string
+        uint32_t length = 1;
+        for(uint32_t b = 0; b < n_buckets; b++)
+        {
+            scratch.reset();
+            scratch.hit(velocities[b]);
+            uint32_t released_for = 0;
+            uint32_t k = 0;
+            for(; k < max_length && released_for < release_samples; k++)
+            {
+                scratch.get_next_sample();
+                released_for = scratch.Fh[scratch.n_0] == 0.0 ? released_for+1 : 0;
+            }
+            length = std::max(length, k);
+        }
+
+        // Second pass: simulate all the buckets for the same duration and store the results
+        AttackCache* cache = new AttackCache(velocities, n_buckets, length, len_x_axis+2);
+        for(uint32_t b = 0; b < n_buckets; b++)
+        {
+            scratch.reset();
+            scratch.hit(velocities[b]);
+            for(uint32_t k = 0; k < length; k++)
+            {
+                cache->sound[(size_t)b*length+k] = scratch.get_next_sample();
+            }
+
+            uint8_t levels[4] = {scratch.n_0, scratch.n_1, scratch.n_2, scratch.n_3};
+            double* y_b = &cache->y[(size_t)b*cache->n_nodes*4];
+            for(uint32_t i = 0; i < cache->n_nodes; i++)
+                for(uint32_t l = 0; l < 4; l++)
+                    y_b[i*4+l] = scratch.y[i][levels[l]];
+            for(uint32_t l = 0; l < 4; l++)
+            {
+                cache->eta[b*4+l] = scratch.eta[levels[l]];
+                cache->Fh[b*4+l] = scratch.Fh[levels[l]];
+            }
+        }
+
+        return cache;
+    }
+    void set_damper(double engagement)
+    {
+        // 0 -> damper lifted, 1 -> damper fully resting on the string.
+        // Intermediate values correspond to half-pedaling. The damper reaches
+        // the requested position gradually, see update_damper().
+        if(engagement < 0.0)
+            engagement = 0.0;
+        else if(engagement > 1.0)
+            engagement = 1.0;
+        this->damper_target = engagement;
+    }
+    void undamp()
+    {
+        set_damper(0.0);
     }
     void damp()
     {
-        // Crank up the damping coefficients
-        this->b1 = 0.2;
-        this->b2 = 6.25e-6;
+        set_damper(1.0);
+    }
+    void update_damper(uint32_t block_length)
+    {
+        // Called before computing each audio block: move the damper towards its
+        // target and interpolate the coefficients of the damped region.
+        if(damper_position == damper_target)
+            return;
 
-        compute_FD_coefficients();
-    }    
+        double max_step = damper_speed*block_length;
+        double step = damper_target-damper_position;
+        if(step > max_step)
+            step = max_step;
+        else if(step < -max_step)
+            step = -max_step;
+        damper_position += step;
+
+        compute_damper_coefficients();
+    }
+    void compute_damper_coefficients()
+    {
+        double sigma = damper_position*damper_sigma;
+        damper_g = 1.0/(1.0+sigma);
+        damper_s = sigma*damper_g;
+    }
     double get_next_sample()
     {
         // Save us a lot of time when the displacement is negligible.
@@ -376,6 +900,21 @@ struct PianoString
             return 0;
         }
 
+        // Play back the cached attack, if any. The string state already
+        // corresponds to the end of the attack.
+        if(attack_pos < attack_len && attack_fade == 0)
+        {
+            if(damper_s == 0.0) // Damper lifted
+            {
+                if(bridge_out != nullptr)
+                    bridge_pos++;
+                return attack_sound[attack_pos++];
+            }
+            // The damper reached the string before the end of the attack (a staccato note):
+            // the simulation takes over from the cached state, where the damper acts
+            start_attack_fade();
+        }
+
         // Compute:
 
         // 1. The new buffer indices
@@ -386,45 +925,53 @@ struct PianoString
 
         // 2. The string displacement  y(i,n)
         //   (spatial sampling loop, Chaigne, Eq. 10)
-        for (uint32_t i = 2; i< len_x_axis-3; i++)
+        //   The portion of string under the damper felt has its own coefficients
+        double hammer_force = force_scale*Fh[n_1];
+        compute_displacement(2, damper_left, hammer_force);
+        compute_displacement(damper_left, damper_right, hammer_force);
+        compute_displacement(damper_right, len_x_axis-3, hammer_force);
+
+        //   Under the damper felt: y(i,n) <- (y(i,n) + sigma*y(i,n-2))/(1+sigma)
+        for (uint32_t i = damper_left; i < damper_right; i++)
         {
-            y[i][n_0] = a1*y[i][n_1] + a2*y[i][n_2]
-                    + a3*(y[i+1][n_1] + y[i-1][n_1])
-                    + a4*(y[i+2][n_1] + y[i-2][n_1])
-                    + a5*(y[i+1][n_2] + y[i-1][n_2] + y[i][n_3])
-                    + (Ts*Ts*N*h->Fh[n_1]*h->hammer_mask[i])/Ms;
+            y[i][n_0] = damper_g*y[i][n_0] + damper_s*y[i][n_2];
         }
 
-        // 3. (Simplified) Boundary conditions with perfect reflection (Chaigne, Eq. 23)
-        uint32_t end = len_x_axis+1;
-        y[0][n_0] = -y[2][n_0]; // a) Left boundary
-        y[end][n_0] = -y[end-2][n_0]; // b) Bridge boundary
-
-        // 3. Boundary conditions with agraffe and bridge impedances (Saitis, Eq. 4.18 and Eq. 4.20)
-        //   a) left boundary (frame) // 4.20
-        //y[0][n] = b_L1*y[0][n-1] + b_L2*y[1][n-1] + b_L3*y[2][n-1]
-        //    + b_L4*y[0][n-2] + b_LF*h->Fh[n-1]*h->hammer_mask[i];
-        //   b) right boundary (bridge) // Eq. 4.18
-        //int end = len_x_axis;
-        //y[end][n] = b_R1*y[end][n-1] + b_R2*y[end-1][n-1]
-        //    + b_R3*y[end-2][n-1] + b_R4*y[end][n-2] + b_RF*h->Fh[n-1]*h->hammer_mask[i];        
+        // 3. Boundary conditions (see PerfectReflection and ImpedanceBoundary)
+        BoundaryPolicy::apply(*this);
 
-        // 4. The hammer displacement by taking into account its felt parameters (Saitis, Eq. 4.21)
-        h->eta[n_0] = h->d1*h->eta[n_1] + h->d2*h->eta[n_2] + h->dF*h->Fh[n_1];
+        // 3b. Sympathetic resonance: the other strings push the bridge end of this string,
+        //     and this string pushes back on the bridge with the transverse component of its tension.
+        //     After the boundary, which can compute the bridge end itself (see ImpedanceBoundary).
+        if(bridge_out != nullptr)
+        {
+            uint32_t k = bridge_pos/coupling_period;
+            if(k < bridge_capacity)
+            {
+                y[Xs_bridge][n_0] += (force_scale*bridge_in[k])/Ms;
+                bridge_out[k] += Te*(y[Xs_bridge][n_0]-y[Xs_bridge+1][n_0])/Xs;
+            }
+            bridge_pos++;
+        }
 
-        // 4. (Simplified) The hammer displacement (Chaigne, Eq. 19)
-        //h->eta[n_0] = h->d1*h->eta[n_1] + h->d2*h->eta[n_2] - (powf(Ts,2.0f)*h->Fh[n_1])/h->Mh;
+        // 4. The hammer displacement (see FeltHammer and ChaigneHammer)
+        HammerPolicy::update(*this);
 
         // 5. The hammer force Fh(n)
         // if the condition in (Chaigne, Eq. 21) is met, the force term is removed
-        if (h->eta[n_0] < y[h->Xs_contact][n_0]) // (Chaigne, Eq. 21)
-            h->Fh[n_0] = 0.0f; // Hammer not in contact with string -> force is 0
+        if (eta[n_0] < y[Xs_contact][n_0]) // (Chaigne, Eq. 21)
+            Fh[n_0] = 0.0f; // Hammer not in contact with string -> force is 0
         else
-            h->Fh[n_0] = h->K*powf(h->eta[n_0]-y[h->Xs_contact][n_0], h->p); // (Chaigne, Eq. 20)
+            Fh[n_0] = K*powf(eta[n_0]-y[Xs_contact][n_0], p); // (Chaigne, Eq. 20)
 
         // 6. The current sound sample as the mean of a portion of string with specular position
         //    with respect to the central striking point of the hammer
         double current_sample = mean(this->y, 1, n_0, left_boundary, right_boundary);
+        if(attack_pos < attack_len) // Crossfade with a cached attack cut short (see start_attack_fade())
+        {
+            double w = (double)(attack_len-attack_pos)/(attack_fade+1);
+            current_sample = w*attack_sound[attack_pos++] + (1.0-w)*current_sample;
+        }
 
         // 6. The current sound sample as a single point on the string
         //    This can be interesting for studying the different modes on different points of the string!
@@ -432,6 +979,28 @@ struct PianoString
 
         return current_sample;
     }
+    inline void start_attack_fade()
+    {
+        // Keeps at most ATTACK_DAMPER_FADE samples of the cached attack being played back,
+        // crossfaded with the simulation
+        if(attack_pos >= attack_len)
+            return;
+        if(attack_len-attack_pos > ATTACK_DAMPER_FADE)
+            attack_len = attack_pos+ATTACK_DAMPER_FADE;
+        if(attack_fade == 0)
+            attack_fade = attack_len-attack_pos;
+    }
+    inline void compute_displacement(uint32_t start, uint32_t stop, double hammer_force)
+    {
+        for (uint32_t i = start; i < stop; i++)
+        {
+            y[i][n_0] = a1*y[i][n_1] + a2*y[i][n_2]
+                    + a3*(y[i+1][n_1] + y[i-1][n_1])
+                    + a4*(y[i+2][n_1] + y[i-2][n_1])
+                    + a5*(y[i+1][n_2] + y[i-1][n_2] + y[i][n_3])
+                    + (hammer_force*hammer_mask[i])/Ms;
+        }
+    }
     void get_next_block(float* buffer, size_t length, float gain)
     {
         for(size_t i = 0; i < length; i++)
@@ -445,10 +1014,11 @@ struct PianoString
         double lambda_sqr, Ts_sqr;
 
         // PDE coefficients (Chaigne's article)
+        this->r = c*Ts/this->h->Xs; // Must be known before the coefficients are computed
+        this->force_scale = Ts*Ts*N;
         r_sqr = r*r;
         N_sqr = N*N;
         this->D = 1 + b1*this->h->Xs +2*b2/Ts;
-        this->r = c*Ts/this->h->Xs;
         this->a1 = (2 - 2*r_sqr + b2/Ts - 6*eps*N_sqr*r_sqr)/D;
         this->a2 = (-1 + b1*Ts + 2*b2/Ts)/D;
         this->a3 = (r_sqr * (1+4*eps*N_sqr))/D;
@@ -471,7 +1041,8 @@ struct PianoString
         this->b_L4 = (-1-b1*Ts+zeta_l*lambda)/(1+b1*Ts+zeta_l*lambda);
         this->b_LF = (Ts_sqr/rho)/(1+b1*Ts+zeta_l*lambda);
     }
-    static drwav_uint64 save_to_wav(char* filename, float* sound, uint64_t duration_samples, bool normalize_output, bool destroy)
+    static drwav_uint64 save_to_wav(char* filename, float* sound, uint64_t duration_samples, bool normalize_output, bool destroy,
+                                    uint32_t sample_rate = 48000)
     {
         if(normalize_output)
         {
@@ -483,7 +1054,7 @@ struct PianoString
         format.container = drwav_container_riff; // <-- drwav_container_riff = normal WAV files, drwav_container_w64 = Sony Wave64.
         format.format = DR_WAVE_FORMAT_IEEE_FLOAT; // <-- Any of the DR_WAVE_FORMAT_* codes.
         format.channels = 1;
-        format.sampleRate = 48000;
+        format.sampleRate = sample_rate;
         format.bitsPerSample = sizeof (float)*8;
         drwav_init_file_write(&wav, filename, &format, nullptr);
         drwav_uint64 framesWritten = drwav_write_pcm_frames(&wav, duration_samples, sound);
@@ -496,3 +1067,16 @@ struct PianoString
         return framesWritten;
     }
 };
+
+// The models used by the piano are chosen at compile time.
+// The defaults reproduce the original behaviour of the engine.
+#ifndef OPENPIANO_STRING_BOUNDARY
+#define OPENPIANO_STRING_BOUNDARY PerfectReflection
+#endif
+#ifndef OPENPIANO_HAMMER_MODEL
+#define OPENPIANO_HAMMER_MODEL FeltHammer
+#endif
+
+typedef PianoStringT<OPENPIANO_STRING_BOUNDARY, OPENPIANO_HAMMER_MODEL> PianoString;
+
+#endif // STRING_HAMMER_H
@@ -0,0 +1,211 @@
+/*
+OpenPiano: an open source piano engine based on physical modeling
+Copyright (C) 2021-2022 Michele Perrone
+Github: https://github.com/michele-perrone/OpenPiano
+Author e-mail: perrone(dot)michele(at)outlook(dot)com
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Affero General Public License as published
+by the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Affero General Public License for more details.
+
+You should have received a copy of the GNU Affero General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef SYMPATHETIC_H
+#define SYMPATHETIC_H
+
+#include "string_hammer.h"
+
+/* ******************************************************************** *
+ * Sympathetic resonance through the bridge.                            *
+ * While computing an audio block, every active string sums the force   *
+ * it exerts on the bridge over each "coupling period". Between two     *
+ * blocks, these forces are exchanged among the undamped strings with   *
+ * a sparse matrix of coupling weights, and injected back into the      *
+ * strings during the next block.                                       *
+ * The coupling is therefore not sample by sample: the force a string   *
+ * exerts reaches the other strings one render quantum later, whatever  *
+ * the period. Exchanging inside the quantum would need a barrier among *
+ * the threads at every period. The period only sets the time           *
+ * resolution of the exchanged force: 1 sample is the finest, longer    *
+ * periods are cheaper. Short quanta shorten the delay.                 *
+ * ******************************************************************** */
+
+struct SympatheticCoupling
+{
+    uint32_t n_strings;
+    uint32_t coupling_period; // Length of a coupling period [samples]
+    uint32_t capacity; // Number of coupling periods in the longest audio block
+    double wake_threshold; // Mean squared injected force [N^2] needed to wake up a dormant string
+
+    // Bridge forces, one row of "capacity" values for each string
+    double* forces_out;
+    double* forces_in;
+
+    // Sparse coupling weights in compressed row format: the sources that drive
+    // string "t" are src[row_start[t]] ... src[row_start[t+1]-1]
+    uint32_t* row_start;
+    uint32_t* src;
+    double* weight;
+    uint32_t n_weights;
+
+    SympatheticCoupling(PianoString** strings, uint32_t n_strings, uint32_t samples_per_block,
+                        uint32_t coupling_period, double coupling_gain, double wake_threshold)
+    {
+        this->n_strings = n_strings;
+        this->coupling_period = coupling_period < 1 ? 1 : coupling_period;
+        this->capacity = (samples_per_block + this->coupling_period - 1)/this->coupling_period;
+        this->wake_threshold = wake_threshold;
+
+        forces_out = zeros1D(n_strings*capacity);
+        forces_in = zeros1D(n_strings*capacity);
+
+        compute_weights(strings, coupling_gain);
+
+        // Hand the bridge buffers to the strings
+        for(uint32_t i = 0; i < n_strings; i++)
+        {
+            strings[i]->bridge_out = &forces_out[i*capacity];
+            strings[i]->bridge_in = &forces_in[i*capacity];
+            strings[i]->bridge_capacity = capacity;
+            strings[i]->coupling_period = this->coupling_period;
+            strings[i]->bridge_pos = 0;
+        }
+    }
+    ~SympatheticCoupling()
+    {
+        free(forces_out);
+        free(forces_in);
+        free(row_start);
+        free(src);
+        free(weight);
+    }
+    void detach(PianoString** strings)
+    {
+        for(uint32_t i = 0; i < n_strings; i++)
+        {
+            strings[i]->bridge_out = nullptr;
+            strings[i]->bridge_in = nullptr;
+            strings[i]->bridge_capacity = 0;
+        }
+    }
+    void compute_weights(PianoString** strings, double coupling_gain)
+    {
+        // Two strings are coupled when some of their partials coincide, i.e. when the
+        // ratio of their fundamental frequencies is close to p/q with small p and q.
+        // The weight decreases with the order of the coinciding partials.
+        const uint32_t max_partial = 6;
+        const double tolerance_cents = 15.0;
+
+        // First pass: count the weights, second pass: fill them
+        row_start = (uint32_t*)malloc((n_strings+1)*sizeof(uint32_t));
+        n_weights = 0;
+        for(int pass = 0; pass < 2; pass++)
+        {
+            uint32_t idx = 0;
+            for(uint32_t t = 0; t < n_strings; t++)
+            {
+                if(pass == 1)
+                    row_start[t] = idx;
+                for(uint32_t s = 0; s < n_strings; s++)
+                {
+                    if(s == t)
+                        continue;
+                    double ratio = strings[s]->f0/strings[t]->f0;
+                    double w = 0.0;
+                    for(uint32_t p = 1; p <= max_partial && w == 0.0; p++)
+                    {
+                        for(uint32_t q = 1; q <= max_partial; q++)
+                        {
+                            if(fabs(1200*log2(ratio*q/p)) < tolerance_cents)
+                            {
+                                w = coupling_gain/(p*q);
+                                break;
+                            }
+                        }
+                    }
+                    if(w == 0.0)
+                        continue;
+                    if(pass == 1)
+                    {
+                        src[idx] = s;
+                        weight[idx] = w;
+                    }
+                    idx++;
+                }
+            }
+            if(pass == 0)
+            {
+                n_weights = idx;
+                src = (uint32_t*)malloc((n_weights > 0 ? n_weights : 1)*sizeof(uint32_t));
+                weight = (double*)malloc((n_weights > 0 ? n_weights : 1)*sizeof(double));
+            }
+            else
+            {
+                row_start[n_strings] = idx;
+            }
+        }
+    }
+    void exchange(PianoString** strings, uint32_t block_length)
+    {
+        // Called between two audio blocks, when no thread is touching the strings
+        uint32_t n_periods = (block_length + coupling_period - 1)/coupling_period;
+        if(n_periods > capacity)
+            n_periods = capacity;
+
+        for(uint32_t t = 0; t < n_strings; t++)
+        {
+            double* in = &forces_in[t*capacity];
+            for(uint32_t k = 0; k < capacity; k++)
+                in[k] = 0.0;
+
+            // The damper absorbs whatever comes from the bridge,
+            // a half-engaged damper absorbs part of it
+            double openness = 1.0-strings[t]->damper_position;
+            if(openness <= 0.0)
+                continue;
+
+            for(uint32_t e = row_start[t]; e < row_start[t+1]; e++)
+            {
+                uint32_t s = src[e];
+                if(!strings[s]->is_active)
+                    continue;
+                double* out = &forces_out[s*capacity];
+                double w = openness*weight[e]/coupling_period; // The strings sum their force over the period
+                for(uint32_t k = 0; k < n_periods; k++)
+                    in[k] += w*out[k];
+            }
+
+            // Dormant strings are woken up only if they receive enough energy.
+            // This way, keeping the pedal down doesn't force every string to stay active.
+            if(!strings[t]->is_active)
+            {
+                double energy = 0.0;
+                for(uint32_t k = 0; k < n_periods; k++)
+                    energy += in[k]*in[k];
+                if(n_periods > 0 && energy/n_periods > wake_threshold)
+                {
+                    strings[t]->is_active = true;
+                    strings[t]->is_active_check_ctr = 0;
+                }
+            }
+        }
+
+        // Start collecting the forces of the next block
+        for(uint32_t i = 0; i < n_strings; i++)
+        {
+            double* out = &forces_out[i*capacity];
+            for(uint32_t k = 0; k < capacity; k++)
+                out[k] = 0.0;
+            strings[i]->bridge_pos = 0;
+        }
+    }
+};
+
+#endif // SYMPATHETIC_H
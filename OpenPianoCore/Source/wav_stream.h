@@ -0,0 +1,235 @@
+/*
+OpenPiano: an open source piano engine based on physical modeling
+Copyright (C) 2021-2022 Michele Perrone
+Github: https://github.com/michele-perrone/OpenPiano
+Author e-mail: perrone(dot)michele(at)outlook(dot)com
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Affero General Public License as published
+by the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Affero General Public License for more details.
+
+You should have received a copy of the GNU Affero General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef WAV_STREAM_H
+#define WAV_STREAM_H
+
+#include <stdlib.h>
+#include <inttypes.h>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include "dr_wav.h"
+#include "render_fifo.h"
+#include "mapped_file.h"
+#include "dither.h"
+
+/* ********************************************************************** *
+ * Streaming WAV writer. The renderer queues its blocks in a lock-free    *
+ * FIFO (see RenderFifo), and a background thread appends them to the     *
+ * file with drwav_write_pcm_frames(). The memory doesn't depend on the   *
+ * length of the render. RIFF files can't hold more than 4 GiB: longer    *
+ * renders need RF64 or Wave64 (see container_for()).                     *
+ * The absolute peak is tracked while writing: finalize() can then        *
+ * normalize the file in a second pass over its memory mapping, and       *
+ * convert it to 16 or 24-bit PCM with dither.                            *
+ * ********************************************************************** */
+
+struct WavStream
+{
+    static const uint32_t DEFAULT_CAPACITY = 1 << 18; // [samples], about 5 s at 48 kHz
+    static const uint32_t WRITE_CHUNK = 1 << 14; // Samples written by each call to drwav_write_pcm_frames()
+
+    drwav wav;
+    bool is_open;
+    uint32_t channels;
+    RenderFifo fifo; // Interleaved samples waiting to be written
+    float* fifo_data;
+    float* chunk; // Samples being written by the background thread
+    std::thread* writer; // Background thread
+    std::atomic<bool> closing; // No more samples will be queued
+    std::atomic<bool> failed; // The file couldn't be written
+    uint64_t frames_written; // Updated by the background thread, read it after close()
+    float peak; // Absolute peak of the samples written. Updated by the background thread, read it after close().
+
+    WavStream()
+    {
+        is_open = false;
+        channels = 0;
+        fifo_data = nullptr;
+        chunk = nullptr;
+        writer = nullptr;
+        closing = false;
+        failed = false;
+        frames_written = 0;
+        peak = 0.0f;
+    }
+    ~WavStream()
+    {
+        close();
+    }
+    static drwav_container container_for(uint64_t n_frames, uint32_t channels, uint32_t bits_per_sample)
+    {
+        // RIFF if the data fits in it (with some room for the headers), RF64 otherwise
+        uint64_t data_size = n_frames*channels*(bits_per_sample/8);
+        return data_size < 0xFFFFFFFFULL-1024 ? drwav_container_riff : drwav_container_rf64;
+    }
+    bool open(const char* path, uint32_t sample_rate, uint32_t channels = 1,
+              drwav_container container = drwav_container_riff, uint32_t capacity = DEFAULT_CAPACITY)
+    {
+        // The samples are written as 32-bit float
+        close();
+        drwav_data_format format;
+        format.container = container;
+        format.format = DR_WAVE_FORMAT_IEEE_FLOAT;
+        format.channels = channels;
+        format.sampleRate = sample_rate;
+        format.bitsPerSample = sizeof(float)*8;
+        if(!drwav_init_file_write(&wav, path, &format, nullptr))
+            return false;
+
+        this->channels = channels;
+        capacity = RenderFifo::capacity_for(capacity/2); // Power of two, at least "capacity"
+        fifo_data = (float*)malloc(capacity*sizeof(float));
+        fifo.init(fifo_data, capacity);
+        chunk = (float*)malloc(WRITE_CHUNK*channels*sizeof(float));
+        closing = false;
+        failed = false;
+        frames_written = 0;
+        peak = 0.0f;
+        is_open = true;
+        writer = new std::thread([this]() { writer_loop(); });
+        return true;
+    }
+    uint32_t write(const float* samples, uint32_t n_frames)
+    {
+        // Queues interleaved frames. When the FIFO is full, waits for the background thread.
+        // Returns the number of frames queued: less than "n_frames" only if the file can't be written.
+        uint32_t n_samples = n_frames*channels;
+        uint32_t n_queued = 0;
+        while(n_queued < n_samples && !failed)
+        {
+            n_queued += fifo.push(samples+n_queued, n_samples-n_queued);
+            if(n_queued < n_samples)
+                std::this_thread::sleep_for(std::chrono::microseconds(200));
+        }
+        return n_queued/channels;
+    }
+    bool close()
+    {
+        // Writes what's left and finalizes the header. Returns false if something couldn't be written.
+        if(!is_open)
+            return false;
+        closing = true;
+        writer->join();
+        delete writer;
+        writer = nullptr;
+        bool ok = drwav_uninit(&wav) == DRWAV_SUCCESS && !failed;
+        free(fifo_data);
+        free(chunk);
+        fifo_data = nullptr;
+        chunk = nullptr;
+        fifo.init(nullptr, 0);
+        is_open = false;
+        return ok;
+    }
+    void writer_loop()
+    {
+        while(true)
+        {
+            // "closing" is read before the FIFO, so nothing queued before close() is missed
+            bool last = closing.load(std::memory_order_acquire);
+            uint32_t n_available = fifo.available()/channels*channels;
+            if(n_available == 0)
+            {
+                if(last)
+                    return;
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+                continue;
+            }
+            uint32_t n_samples = fifo.pop(chunk, std::min(n_available, WRITE_CHUNK*channels), 1.0f);
+            for(uint32_t i = 0; i < n_samples; i++)
+                peak = std::max(peak, fabsf(chunk[i]));
+            uint64_t n_frames = n_samples/channels;
+            uint64_t n_written = drwav_write_pcm_frames(&wav, n_frames, chunk);
+            frames_written += n_written;
+            if(n_written != n_frames)
+            {
+                failed = true;
+                return;
+            }
+        }
+    }
+    static bool finalize(const char* float_path, const char* output_path, float gain,
+                         uint32_t bits_per_sample = 32, bool dither = true)
+    {
+        // Second pass over a float file written by WavStream (after close()). The file is mapped,
+        // so its length doesn't matter. With 32 bits, the gain is applied in place, and "output_path"
+        // is ignored. With 16 or 24 bits, the converted samples are written to "output_path", with
+        // the sample rate, the channels and the container of the float file, which is left as it is.
+        drwav source;
+        if(!drwav_init_file(&source, float_path, nullptr))
+            return false;
+        bool is_float = source.translatedFormatTag == DR_WAVE_FORMAT_IEEE_FLOAT && source.bitsPerSample == 32;
+        uint64_t data_pos = source.dataChunkDataPos;
+        uint64_t n_frames = source.totalPCMFrameCount;
+        uint32_t channels = source.channels;
+        drwav_data_format format;
+        format.container = source.container;
+        format.format = DR_WAVE_FORMAT_PCM;
+        format.channels = channels;
+        format.sampleRate = source.sampleRate;
+        format.bitsPerSample = bits_per_sample;
+        drwav_uninit(&source);
+        if(!is_float || (bits_per_sample != 16 && bits_per_sample != 24 && bits_per_sample != 32))
+            return false;
+
+        bool in_place = bits_per_sample == 32;
+        MappedFile file;
+        if(!file.open(float_path, in_place))
+            return false;
+        uint64_t n_samples = n_frames*channels;
+        if(data_pos % sizeof(float) != 0 || data_pos+n_samples*sizeof(float) > file.size)
+            return false; // The samples must be aligned to be read as floats
+        float* samples = (float*)(file.data+data_pos);
+        if(in_place)
+        {
+            for(uint64_t i = 0; i < n_samples; i++)
+                samples[i] *= gain;
+            return true;
+        }
+
+        drwav output;
+        if(!drwav_init_file_write(&output, output_path, &format, nullptr))
+            return false;
+        TpdfDither tpdf;
+        uint32_t bytes_per_sample = bits_per_sample/8;
+        int32_t* quantized = (int32_t*)malloc(WRITE_CHUNK*channels*sizeof(int32_t));
+        uint8_t* packed = (uint8_t*)malloc(WRITE_CHUNK*channels*bytes_per_sample);
+        bool ok = true;
+        for(uint64_t frame = 0; frame < n_frames && ok; frame += WRITE_CHUNK)
+        {
+            uint32_t chunk_frames = (uint32_t)std::min((uint64_t)WRITE_CHUNK, n_frames-frame);
+            uint32_t chunk_samples = chunk_frames*channels;
+            tpdf.quantize(samples+frame*channels, chunk_samples, gain, bits_per_sample, dither, quantized);
+            // Little-endian, as dr_wav expects the integer samples
+            for(uint32_t i = 0; i < chunk_samples; i++)
+            {
+                for(uint32_t b = 0; b < bytes_per_sample; b++)
+                    packed[i*bytes_per_sample+b] = (uint8_t)((uint32_t)quantized[i] >> (8*b));
+            }
+            ok = drwav_write_raw(&output, chunk_samples*bytes_per_sample, packed) == chunk_samples*bytes_per_sample;
+        }
+        free(quantized);
+        free(packed);
+        return drwav_uninit(&output) == DRWAV_SUCCESS && ok;
+    }
+};
+
+#endif // WAV_STREAM_H
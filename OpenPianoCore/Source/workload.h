@@ -0,0 +1,354 @@
+/*
+OpenPiano: an open source piano engine based on physical modeling
+Copyright (C) 2021-2022 Michele Perrone
+Github: https://github.com/michele-perrone/OpenPiano
+Author e-mail: perrone(dot)michele(at)outlook(dot)com
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Affero General Public License as published
+by the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Affero General Public License for more details.
+
+You should have received a copy of the GNU Affero General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef WORKLOAD_H
+#define WORKLOAD_H
+
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <math.h>
+#include <vector>
+#include <algorithm>
+#include "midi_file.h"
+#include "piano_description.h"
+
+/* ********************************************************************** *
+ * Seeded generator of synthetic performances, for the benchmarks and     *
+ * the renderer. Each pattern loads the engine in its own way:            *
+ * - melody: a random walk of single notes over a slow bass line;         *
+ * - chords: dense chords spread over the keyboard;                       *
+ * - repeated: fast repeated notes and trills;                            *
+ * - glissando: fast sweeps up and down the keyboard;                     *
+ * - pedal: long passages with the sustain pedal down, every string of    *
+ *   the arpeggios keeps ringing;                                         *
+ * - mixed: sections of all of the above.                                 *
+ * The velocities are normally distributed around a mean. The same        *
+ * options give the same events on any machine and with any compiler:     *
+ * the random numbers come from splitmix64, not from the distributions    *
+ * of the standard library (whose results depend on the implementation), *
+ * and the events lie on a grid of ticks at 120 BPM, so they survive the  *
+ * export to a Standard MIDI File (see MidiFile::save()) unchanged.       *
+ * ********************************************************************** */
+
+const uint16_t WORKLOAD_DIVISION = 960; // Ticks per quarter note
+const uint32_t WORKLOAD_TICKS_PER_SECOND = 2*WORKLOAD_DIVISION; // At 120 BPM, the default tempo of MIDI files
+
+const char* const WORKLOAD_PATTERNS[] = {"melody", "chords", "repeated", "glissando", "pedal", "mixed"};
+const uint32_t N_WORKLOAD_PATTERNS = sizeof(WORKLOAD_PATTERNS)/sizeof(const char*);
+
+struct WorkloadOptions
+{
+    uint64_t seed;
+    double duration; // [s]
+    uint8_t first_note; // MIDI note of the lowest key played (21 -> A0)
+    uint32_t n_keys; // Keys played, from "first_note" up
+    double velocity_mean; // MIDI velocity
+    double velocity_spread; // Standard deviation of the MIDI velocity
+
+    WorkloadOptions()
+    {
+        seed = 1;
+        duration = 30.0;
+        first_note = 21;
+        n_keys = DEFAULT_N_STRINGS;
+        velocity_mean = 80.0;
+        velocity_spread = 20.0;
+    }
+};
+
+struct WorkloadGenerator
+{
+    WorkloadOptions options;
+    uint64_t state; // splitmix64
+
+    WorkloadGenerator(const WorkloadOptions& options = WorkloadOptions())
+    {
+        this->options = options;
+        state = options.seed;
+        sequence = 0;
+    }
+    static bool is_pattern(const char* pattern)
+    {
+        for(uint32_t p = 0; p < N_WORKLOAD_PATTERNS; p++)
+        {
+            if(strcmp(pattern, WORKLOAD_PATTERNS[p]) == 0)
+                return true;
+        }
+        return false;
+    }
+    bool generate(const char* pattern, MidiFile& midi)
+    {
+        // Replaces the events of "midi" with "options.duration" seconds of the pattern.
+        // Every key and the pedal are released by the end. Returns false if the pattern is unknown.
+        options.n_keys = options.first_note < 128 ? std::min(options.n_keys, 128u-options.first_note) : 0;
+        if(!is_pattern(pattern) || options.n_keys == 0 || options.duration < 0)
+            return false;
+        state = options.seed;
+        sequence = 0;
+        events.clear();
+        uint64_t end = (uint64_t)llround(options.duration*WORKLOAD_TICKS_PER_SECOND);
+        play(pattern, 0, end);
+
+        // Same conversion as MidiFile::parse() at the default tempo, to the bit
+        std::stable_sort(events.begin(), events.end(),
+                         [](const TickEvent& a, const TickEvent& b) { return a.tick < b.tick || (a.tick == b.tick && a.sequence < b.sequence); });
+        const double seconds_per_tick = 0.5/WORKLOAD_DIVISION;
+        midi.events.clear();
+        midi.events.reserve(events.size());
+        for(const TickEvent& e : events)
+        {
+            MidiEvent event;
+            event.time = e.tick*seconds_per_tick;
+            event.status = e.status;
+            event.data1 = e.data1;
+            event.data2 = e.data2;
+            midi.events.push_back(event);
+        }
+        midi.duration = end*seconds_per_tick;
+        events.clear();
+        return true;
+    }
+
+private:
+    struct TickEvent
+    {
+        uint64_t tick;
+        uint32_t sequence; // Events of the same tick keep the order in which they were generated
+        uint8_t status;
+        uint8_t data1;
+        uint8_t data2;
+    };
+    std::vector<TickEvent> events;
+    uint32_t sequence;
+
+    void play(const char* pattern, uint64_t start, uint64_t end)
+    {
+        if(strcmp(pattern, "melody") == 0)
+            melody(start, end);
+        else if(strcmp(pattern, "chords") == 0)
+            chords(start, end);
+        else if(strcmp(pattern, "repeated") == 0)
+            repeated(start, end);
+        else if(strcmp(pattern, "glissando") == 0)
+            glissando(start, end);
+        else if(strcmp(pattern, "pedal") == 0)
+            pedal_passages(start, end);
+        else
+        {
+            // Sections of 4 to 8 s, each one of the other patterns
+            for(uint64_t t = start; t < end;)
+            {
+                uint64_t section_end = std::min(end, t + ms(between(4000, 8000)));
+                play(WORKLOAD_PATTERNS[below(N_WORKLOAD_PATTERNS-1)], t, section_end);
+                t = section_end;
+            }
+        }
+    }
+    void melody(uint64_t start, uint64_t end)
+    {
+        // A random walk of steps of at most a major third, reflected at the ends of the keyboard.
+        // Different keys are played legato, and a bass note is held for each bar.
+        const uint64_t beat = WORKLOAD_DIVISION;
+        const uint64_t lengths[] = {beat/4, beat/2, beat/2, beat};
+        int32_t key = (int32_t)(options.n_keys/4 + below(options.n_keys/2 + 1));
+        uint64_t next_bar = start;
+        for(uint64_t t = start; t < end;)
+        {
+            if(t >= next_bar)
+            {
+                note(next_bar, below(options.n_keys/3 + 1), velocity(options.velocity_mean-10.0), 4*beat - beat/8, end);
+                next_bar += 4*beat;
+            }
+            uint64_t length = lengths[below(4)];
+            int32_t step = between(-4, 4);
+            key = reflect(key + step);
+            note(t, key, velocity(options.velocity_mean), step != 0 ? length + beat/16 : length - beat/16, end);
+            t += length;
+        }
+    }
+    void chords(uint64_t start, uint64_t end)
+    {
+        // 4 to 10 notes, thirds and fourths stacked from a root in the lower half, slightly rolled.
+        // Each chord is held until the next one.
+        for(uint64_t t = start; t < end;)
+        {
+            uint64_t length = ms(between(250, 1000));
+            uint32_t n_notes = between(4, 10);
+            int32_t chord_velocity = velocity(options.velocity_mean);
+            bool used[128] = {};
+            uint32_t key = below(options.n_keys/2 + 1);
+            for(uint32_t i = 0; i < n_notes; i++)
+            {
+                uint32_t k = fold(key);
+                if(!used[k])
+                {
+                    used[k] = true;
+                    note(t + ms(below(15)), k, clamp_velocity(chord_velocity + between(-8, 8)), length - ms(20), end);
+                }
+                key += between(3, 5);
+            }
+            t += length;
+        }
+    }
+    void repeated(uint64_t start, uint64_t end)
+    {
+        // Bursts of 8 to 32 notes at 10 to 20 notes per second, on one key or trilled on two
+        for(uint64_t t = start; t < end;)
+        {
+            uint32_t key = below(options.n_keys);
+            uint32_t other = below(3) == 0 ? fold(key + between(1, 2)) : key;
+            uint64_t period = ms(between(50, 100));
+            uint32_t n_notes = between(8, 32);
+            for(uint32_t i = 0; i < n_notes && t < end; i++)
+            {
+                note(t, i%2 == 1 ? other : key, velocity(options.velocity_mean), period*3/4, end);
+                t += period;
+            }
+            t += ms(between(100, 400));
+        }
+    }
+    void glissando(uint64_t start, uint64_t end)
+    {
+        // Sweeps over half to all the keyboard, 20 to 40 keys per second, with a crescendo.
+        // Each key is held over the next one.
+        for(uint64_t t = start; t < end;)
+        {
+            bool up = below(2) == 0;
+            uint64_t step = ms(between(25, 50));
+            uint32_t span = options.n_keys/2 + below(options.n_keys - options.n_keys/2) + 1;
+            span = std::min(span, options.n_keys);
+            uint32_t lowest = below(options.n_keys - span + 1);
+            for(uint32_t i = 0; i < span && t < end; i++)
+            {
+                double mean = options.velocity_mean + options.velocity_spread*(2.0*i/span - 1.0);
+                note(t, up ? lowest+i : lowest+span-1-i, velocity(mean, 0.25), 2*step, end);
+                t += step;
+            }
+            t += ms(between(200, 600));
+        }
+    }
+    void pedal_passages(uint64_t start, uint64_t end)
+    {
+        // Passages of 4 to 10 s with the pedal down (sometimes half down), made of arpeggios
+        // of major and minor chords over three octaves. The pedal is lifted for 200 ms in between.
+        const int32_t major[] = {0, 4, 7};
+        const int32_t minor[] = {0, 3, 7};
+        for(uint64_t t = start; t < end;)
+        {
+            uint64_t passage_end = std::min(end, t + ms(between(4000, 10000)));
+            pedal(t, below(4) == 0 ? 80 : 127);
+            uint64_t u = t + ms(10);
+            while(u + ms(250) < passage_end)
+            {
+                const int32_t* chord = below(2) == 0 ? major : minor;
+                uint32_t root = below(options.n_keys/3 + 1);
+                for(uint32_t i = 0; i < 9 && u + ms(250) < passage_end; i++)
+                {
+                    note(u, fold(root + chord[i%3] + 12*(i/3)), velocity(options.velocity_mean), ms(150), passage_end);
+                    u += ms(between(60, 150));
+                }
+            }
+            pedal(passage_end, 0);
+            t = passage_end + ms(200);
+        }
+    }
+
+    void note(uint64_t tick, uint32_t key, uint8_t velocity, uint64_t length, uint64_t end)
+    {
+        // The key is released "length" ticks later, and by "end" at the latest
+        if(tick >= end)
+            return;
+        uint64_t release = std::min(tick + std::max(length, (uint64_t)1), end);
+        add(tick, 0x90, (uint8_t)(options.first_note + key), velocity);
+        add(release, 0x80, (uint8_t)(options.first_note + key), 64);
+    }
+    void pedal(uint64_t tick, uint8_t value)
+    {
+        add(tick, 0xB0, 64, value);
+    }
+    void add(uint64_t tick, uint8_t status, uint8_t data1, uint8_t data2)
+    {
+        TickEvent event;
+        event.tick = tick;
+        event.sequence = sequence++;
+        event.status = status;
+        event.data1 = data1;
+        event.data2 = data2;
+        events.push_back(event);
+    }
+    static uint64_t ms(uint32_t milliseconds)
+    {
+        return (uint64_t)milliseconds*WORKLOAD_TICKS_PER_SECOND/1000;
+    }
+    uint32_t fold(uint32_t key) const
+    {
+        // Down by octaves until the key is on the keyboard
+        while(key >= options.n_keys)
+            key = options.n_keys > 12 ? key-12 : key%options.n_keys;
+        return key;
+    }
+    int32_t reflect(int32_t key) const
+    {
+        int32_t last = (int32_t)options.n_keys-1;
+        if(key < 0)
+            key = -key;
+        if(key > last)
+            key = 2*last-key;
+        return std::max(0, std::min(key, last));
+    }
+
+    // Random numbers
+    uint64_t next()
+    {
+        uint64_t z = (state += 0x9E3779B97F4A7C15ULL);
+        z = (z ^ (z >> 30))*0xBF58476D1CE4E5B9ULL;
+        z = (z ^ (z >> 27))*0x94D049BB133111EBULL;
+        return z ^ (z >> 31);
+    }
+    uint32_t below(uint32_t n)
+    {
+        // Uniform in [0, n), for a small n
+        return n > 0 ? (uint32_t)(next() % n) : 0;
+    }
+    int32_t between(int32_t lowest, int32_t highest)
+    {
+        // Uniform in [lowest, highest]
+        return lowest + (int32_t)below((uint32_t)(highest-lowest+1));
+    }
+    double normal()
+    {
+        // Sum of 12 uniform numbers (Irwin-Hall): mean 0, variance 1, within [-6, 6].
+        // Only additions, so the result is the same everywhere, unlike the transcendental functions.
+        double sum = -6.0;
+        for(int i = 0; i < 12; i++)
+            sum += (next() >> 11)*(1.0/9007199254740992.0);
+        return sum;
+    }
+    uint8_t velocity(double mean, double spread_scale = 1.0)
+    {
+        return clamp_velocity((int32_t)llround(mean + spread_scale*options.velocity_spread*normal()));
+    }
+    static uint8_t clamp_velocity(int32_t velocity)
+    {
+        return (uint8_t)std::max(1, std::min(velocity, 127));
+    }
+};
+
+#endif // WORKLOAD_H
@@ -33,11 +33,13 @@ OpenPianoAudioProcessor::OpenPianoAudioProcessor()
                        )
 #endif
 {
-    pedal_down_current = false;
+    pedal_position = 0.0f;
+    piano = nullptr;
 }
 
 OpenPianoAudioProcessor::~OpenPianoAudioProcessor()
 {
+    delete piano;
 }
 
 //==============================================================================
@@ -108,15 +110,47 @@ void OpenPianoAudioProcessor::prepareToPlay (double sampleRate, int samplesPerBl
     // Use this method as the place to do any pre-playback
     // initialisation that you need..
 
-    // Initialize the piano and the output buffer
-    piano = new Piano(sampleRate, samplesPerBlock, std::thread::hardware_concurrency());
+    // The piano is created only once. Afterwards, a new sample rate or block size
+    // is prepared in the spare model, and the audio thread swaps it in.
+    // The render quantum follows the block size announced by the host: the host can
+    // still send shorter blocks, which are served from the output FIFO of the piano.
+    // A quantum shorter than the calibrated one would spend too much time waking the threads up:
+    // the host blocks are then served from the FIFO, with some latency.
+    if (piano != nullptr)
+    {
+        piano->reconfigure(sampleRate, std::max ((uint32_t) samplesPerBlock, piano->calibration.render_quantum));
+        setLatencySamples (piano->get_latency (samplesPerBlock));
+        return;
+    }
+
+    // Initialize the piano and the output buffer, with the threads and the quantum calibrated
+    // for this machine. The calibration is measured the first time only, then cached on disk.
+    // With OPENPIANO_CALIBRATION=off in the environment, or a pinned calibration file that
+    // doesn't choose them, the piano uses every core and the block size of the host.
+    PianoCalibration calibration = Piano::load_or_calibrate (sampleRate);
+    uint32_t quantum = std::max ((uint32_t) samplesPerBlock, calibration.render_quantum);
+    Piano* new_piano = new Piano(sampleRate, quantum, calibration.n_threads, nullptr, PianoDescription(), calibration);
+
+    // Recall the session, if the host restored it before the piano existed
+    if (pending_state.getSize() > 0)
+    {
+        new_piano->load_state(pending_state.getData(), pending_state.getSize());
+        pending_state.reset();
+    }
+
+    setLatencySamples (new_piano->get_latency (samplesPerBlock));
+
+    const juce::SpinLock::ScopedLockType lock (piano_lock);
+    delete piano;
+    piano = new_piano;
 }
 
 void OpenPianoAudioProcessor::releaseResources()
 {
     // When playback stops, you can use this as an opportunity to free up any
     // spare memory, etc.
-    delete piano;
+    // The piano is kept: the host will most likely call prepareToPlay() again,
+    // and rebuilding the threads and the models every time would be a waste.
 }
 
 #ifndef JucePlugin_PreferredChannelConfigurations
@@ -148,6 +182,7 @@ bool OpenPianoAudioProcessor::isBusesLayoutSupported (const BusesLayout& layouts
 void OpenPianoAudioProcessor::processBlock (juce::AudioBuffer<float>& buffer, juce::MidiBuffer& midiMessages)
 {
     juce::ScopedNoDenormals noDenormals;
+    RtScope rtScope; // With OPENPIANO_RT_CHECK, nothing below may allocate, lock or block (see "rt_check.h")
     auto totalNumInputChannels  = getTotalNumInputChannels();
     auto totalNumOutputChannels = getTotalNumOutputChannels();
 
@@ -160,6 +195,13 @@ void OpenPianoAudioProcessor::processBlock (juce::AudioBuffer<float>& buffer, ju
     for (auto i = totalNumInputChannels; i < totalNumOutputChannels; ++i)
         buffer.clear (i, 0, buffer.getNumSamples());
 
+    // If the piano is being replaced right now, or its state is being saved while the host wasn't processing, skip this block
+    const juce::SpinLock::ScopedTryLockType lock (piano_lock);
+    if (!lock.isLocked() || piano == nullptr)
+    {
+        buffer.clear();
+        return;
+    }
 
     // This is the place where you'd normally do the guts of your plugin's
     // audio processing...
@@ -169,54 +211,45 @@ void OpenPianoAudioProcessor::processBlock (juce::AudioBuffer<float>& buffer, ju
     // interleaved by keeping the same state.
     keyboardState.processNextMidiBuffer (midiMessages, 0, buffer.getNumSamples(), true);
 
+    // Swap in the model prepared by prepareToPlay(), if any, before the notes reach the strings
+    piano->apply_pending_model();
+
     for (const auto metadata : midiMessages)
     {
         juce::MidiMessage message = metadata.getMessage();
 
-        // To correctly deal with the pedal, we have to consider that some pedals send
-        // continuous messages. Right now, damping is implemented on a simple on/off
-        // basis, so we're only interested when the pedal goes up and down, nothing
-        // in between. To do so, we compare the current state of the pedal with the
-        // previous one. We damp the strings only when the pedal changes from down
-        // to up, otherwise we end up with a mess of messages to deal with.
-        if (message.isSustainPedalOn())
+        // The sustain pedal is continuous: half-pedaling lifts the dampers only partially.
+        // Moving the pedal doesn't recompute any coefficient, the strings just move their
+        // dampers towards the new position during the next blocks.
+        if (message.isControllerOfType(64))
         {
-            pedal_down_previous = pedal_down_current;
-            pedal_down_current = true;
-        }
-        else if (message.isSustainPedalOff())
-        {
-            pedal_down_previous = pedal_down_current;
-            pedal_down_current = false;
-            if(pedal_down_previous != pedal_down_current)
+            pedal_position = message.getControllerValue()/127.0f;
+            for (int i = 0; i < (int)piano->n_strings; i++)
             {
-                for (int i = 0; i < N_STRINGS; i++)
-                {
-                    // Damp only those strings which are not currently held down on the keyboard
-                    if(!keyboardState.isNoteOn(1, i+MIDI_NOTE_OFFSET))
-                        piano->strings[i]->damp();
-                }
+                // The dampers of the keys currently held down stay lifted
+                if(!keyboardState.isNoteOn(1, i+MIDI_NOTE_OFFSET))
+                    piano->strings[i]->set_damper(1.0-pedal_position.load());
             }
         }
         else if (message.isNoteOn() &&
                  message.getNoteNumber()-MIDI_NOTE_OFFSET >= 0 &&
-                 message.getNoteNumber()-MIDI_NOTE_OFFSET < N_STRINGS)
+                 message.getNoteNumber()-MIDI_NOTE_OFFSET < (int)piano->n_strings)
         {
             piano->strings[message.getNoteNumber()-MIDI_NOTE_OFFSET]->hit(message.getVelocity()/30.0);
         }
-        // Strings are damped only if pedal is not down
-        else if (message.isNoteOff() && !pedal_down_current &&
+        // When the key is released, the damper falls back as far as the pedal allows
+        else if (message.isNoteOff() &&
                  message.getNoteNumber()-MIDI_NOTE_OFFSET >= 0 &&
-                 message.getNoteNumber()-MIDI_NOTE_OFFSET < N_STRINGS)
+                 message.getNoteNumber()-MIDI_NOTE_OFFSET < (int)piano->n_strings)
         {
-            piano->strings[message.getNoteNumber()-MIDI_NOTE_OFFSET]->damp();
+            piano->strings[message.getNoteNumber()-MIDI_NOTE_OFFSET]->set_damper(1.0-pedal_position.load());
         }
     }
 
     int samplesPerBlock = buffer.getNumSamples();
     float* outputChannelData = buffer.getWritePointer(0);
     float gain = 150;
-    piano->get_next_block_multithreaded(outputChannelData, samplesPerBlock, gain);
+    piano->process(outputChannelData, samplesPerBlock, gain);
 }
 
 //==============================================================================
@@ -233,15 +266,47 @@ juce::AudioProcessorEditor* OpenPianoAudioProcessor::createEditor()
 //==============================================================================
 void OpenPianoAudioProcessor::getStateInformation (juce::MemoryBlock& destData)
 {
-    // You should use this method to store your parameters in the memory block.
-    // You could do that either as raw data, or use the XML or ValueTree classes
-    // as intermediaries to make it easy to save and load complex data.
+    // The state is the pedal position followed by a snapshot of the whole engine,
+    // so that the session is recalled exactly as it was, strings still ringing.
+    // The audio thread copies the snapshot between two quanta, so it keeps playing meanwhile.
+    float pedal = pedal_position.load();
+    destData.reset();
+    destData.append(&pedal, sizeof(float));
+    if (piano == nullptr)
+        return;
+    std::vector<uint8_t> state;
+    if (piano->capture_state(state, 200)) // A few quanta at most, unless the host isn't processing
+    {
+        destData.append(state.data(), state.size());
+        return;
+    }
+
+    // The host isn't processing: the state is taken here, and a block that starts meanwhile is skipped
+    const juce::SpinLock::ScopedLockType lock (piano_lock);
+    size_t offset = destData.getSize();
+    size_t state_size = piano->get_state_size();
+    destData.setSize(offset+state_size);
+    piano->save_state((uint8_t*)destData.getData()+offset, state_size);
 }
 
 void OpenPianoAudioProcessor::setStateInformation (const void* data, int sizeInBytes)
 {
     // You should use this method to restore your parameters from this memory block,
     // whose contents will have been created by the getStateInformation() call.
+    if (data == nullptr || sizeInBytes < (int)sizeof(float))
+        return;
+    const uint8_t* state = (const uint8_t*)data+sizeof(float);
+    size_t state_size = sizeInBytes-sizeof(float);
+
+    float pedal;
+    memcpy(&pedal, data, sizeof(float));
+    pedal_position = pedal;
+    // The snapshot is loaded into the spare model, which processBlock() swaps in.
+    // A snapshot taken at a different sample rate is ignored, and the strings go on ringing.
+    if (piano != nullptr)
+        piano->restore_state(state, state_size);
+    else
+        pending_state.replaceAll(state, state_size);
 }
 
 //==============================================================================
@@ -69,12 +69,14 @@ public:
 
     //==============================================================================
     juce::MidiKeyboardState keyboardState;
-    bool pedal_down_previous;
-    bool pedal_down_current;
+    std::atomic<float> pedal_position; // Sustain pedal (CC64): 0 -> up, 1 -> fully down. Also set by setStateInformation().
 
 private:
     //==============================================================================
     JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR (OpenPianoAudioProcessor)
 
     Piano* piano;
+    juce::SpinLock piano_lock; // Keeps the audio thread away from the piano while it's replaced, or while its
+                               // state is saved by the message thread because the audio thread isn't running
+    juce::MemoryBlock pending_state; // State restored before the piano was created, applied in prepareToPlay()
 };